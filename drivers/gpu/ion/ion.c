@@ -26,6 +26,7 @@
 #include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/rbtree.h>
+#include <linux/scatterlist.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/seq_file.h>
@@ -35,7 +36,7 @@
 #include "ion_priv.h"
 #define DEBUG
 
-/* this function should only be called while dev->lock is held */
+/* this function should only be called while dev->buffer_lock is held */
 static void ion_buffer_add(struct ion_device *dev,
 			   struct ion_buffer *buffer)
 {
@@ -61,7 +62,7 @@ static void ion_buffer_add(struct ion_device *dev,
 	rb_insert_color(&buffer->node, &dev->buffers);
 }
 
-/* this function should only be called while dev->lock is held */
+/* this function should only be called while heap->lock is held */
 static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     struct ion_device *dev,
 				     unsigned long len,
@@ -86,7 +87,9 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	buffer->dev = dev;
 	buffer->size = len;
 	mutex_init(&buffer->lock);
+	mutex_lock(&dev->buffer_lock);
 	ion_buffer_add(dev, buffer);
+	mutex_unlock(&dev->buffer_lock);
 	return buffer;
 }
 
@@ -96,9 +99,9 @@ static void ion_buffer_destroy(struct kref *kref)
 	struct ion_device *dev = buffer->dev;
 
 	buffer->heap->ops->free(buffer);
-	mutex_lock(&dev->lock);
+	mutex_lock(&dev->buffer_lock);
 	rb_erase(&buffer->node, &dev->buffers);
-	mutex_unlock(&dev->lock);
+	mutex_unlock(&dev->buffer_lock);
 	kfree(buffer);
 }
 
@@ -122,6 +125,7 @@ struct ion_handle *ion_handle_create(struct ion_client *client,
 		return ERR_PTR(-ENOMEM);
 	kref_init(&handle->ref);
 	rb_init_node(&handle->node);
+	rb_init_node(&handle->buffer_node);
 	handle->client = client;
 	ion_buffer_get(buffer);
 	handle->buffer = buffer;
@@ -135,11 +139,17 @@ static void ion_handle_destroy(struct kref *kref)
 	/* XXX Can a handle be destroyed while it's map count is non-zero?:
 	   if (handle->map_cnt) unmap
 	 */
-	ion_buffer_put(handle->buffer);
-	mutex_lock(&handle->client->lock);
-	if (!RB_EMPTY_NODE(&handle->node))
-		rb_erase(&handle->node, &handle->client->handles);
-	mutex_unlock(&handle->client->lock);
+	struct ion_client *client = handle->client;
+	struct ion_buffer *buffer = handle->buffer;
+
+	mutex_lock(&client->lock);
+	if (!RB_EMPTY_NODE(&handle->node)) {
+		rb_erase(&handle->node, &client->handles);
+		rb_erase(&handle->buffer_node, &client->buffer_handles);
+		client->heap_sizes[buffer->heap->type] -= buffer->size;
+	}
+	mutex_unlock(&client->lock);
+	ion_buffer_put(buffer);
 	kfree(handle);
 }
 
@@ -158,15 +168,23 @@ int ion_handle_put(struct ion_handle *handle)
 	return kref_put(&handle->ref, ion_handle_destroy);
 }
 
+/*
+ * Returns one of the client's handles to buffer, any one if it has several.
+ * this function should only be called while client->lock is held
+ */
 static struct ion_handle *ion_handle_lookup(struct ion_client *client,
 					    struct ion_buffer *buffer)
 {
-	struct rb_node *n;
+	struct rb_node *n = client->buffer_handles.rb_node;
 
-	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
+	while (n) {
 		struct ion_handle *handle = rb_entry(n, struct ion_handle,
-						     node);
-		if (handle->buffer == buffer)
+						     buffer_node);
+		if (buffer < handle->buffer)
+			n = n->rb_left;
+		else if (buffer > handle->buffer)
+			n = n->rb_right;
+		else
 			return handle;
 	}
 	return NULL;
@@ -211,6 +229,26 @@ void ion_handle_add(struct ion_client *client, struct ion_handle *handle)
 
 	rb_link_node(&handle->node, parent, p);
 	rb_insert_color(&handle->node, &client->handles);
+
+	/*
+	 * A client can hold more than one handle to a buffer, e.g. through
+	 * nvmap_duplicate_handle_id(), so equal keys go to the right.
+	 */
+	p = &client->buffer_handles.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ion_handle, buffer_node);
+
+		if (handle->buffer < entry->buffer)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	rb_link_node(&handle->buffer_node, parent, p);
+	rb_insert_color(&handle->buffer_node, &client->buffer_handles);
+	client->heap_sizes[handle->buffer->heap->type] += handle->buffer->size;
 }
 
 struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
@@ -227,7 +265,7 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 	 * request of the caller allocate from it.  Repeat until allocate has
 	 * succeeded or all heaps have been tried
 	 */
-	mutex_lock(&dev->lock);
+	down_read(&dev->lock);
 	for (n = rb_first(&dev->heaps); n != NULL; n = rb_next(n)) {
 		struct ion_heap *heap = rb_entry(n, struct ion_heap, node);
 		/* if the client doesn't support this heap type */
@@ -236,11 +274,13 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 		/* if the caller didn't specify this heap type */
 		if (!((1 << heap->id) & flags))
 			continue;
+		mutex_lock(&heap->lock);
 		buffer = ion_buffer_create(heap, dev, len, align, flags);
+		mutex_unlock(&heap->lock);
 		if (!IS_ERR_OR_NULL(buffer))
 			break;
 	}
-	mutex_unlock(&dev->lock);
+	up_read(&dev->lock);
 
 	if (IS_ERR_OR_NULL(buffer))
 		return ERR_PTR(PTR_ERR(buffer));
@@ -386,6 +426,12 @@ struct scatterlist *ion_map_dma(struct ion_client *client,
 	buffer = handle->buffer;
 	mutex_lock(&buffer->lock);
 
+	/* built at allocation, and stays until the buffer is freed */
+	if (buffer->sg_table) {
+		_ion_map(&buffer->dmap_cnt, &handle->dmap_cnt);
+		sglist = buffer->sg_table->sgl;
+		goto out;
+	}
 	if (!handle->buffer->heap->ops->map_dma) {
 		pr_err("map_kernel is not implemented by this heap.\n");
 		mutex_unlock(&buffer->lock);
@@ -400,6 +446,7 @@ struct scatterlist *ion_map_dma(struct ion_client *client,
 	} else {
 		sglist = buffer->sglist;
 	}
+out:
 	mutex_unlock(&buffer->lock);
 	mutex_unlock(&client->lock);
 	return sglist;
@@ -453,7 +500,8 @@ void ion_unmap_dma(struct ion_client *client, struct ion_handle *handle)
 	mutex_lock(&client->lock);
 	buffer = handle->buffer;
 	mutex_lock(&buffer->lock);
-	if (_ion_unmap(&buffer->dmap_cnt, &handle->dmap_cnt)) {
+	if (_ion_unmap(&buffer->dmap_cnt, &handle->dmap_cnt) &&
+	    !buffer->sg_table) {
 		buffer->heap->ops->unmap_dma(buffer->heap, buffer);
 		buffer->sglist = NULL;
 	}
@@ -532,8 +580,8 @@ static int ion_debug_client_show(struct seq_file *s, void *unused)
 {
 	struct ion_client *client = s->private;
 	struct rb_node *n;
-	size_t sizes[ION_NUM_HEAPS] = {0};
-	const char *names[ION_NUM_HEAPS] = {0};
+	size_t sizes[ION_MAX_HEAP_TYPES] = {0};
+	const char *names[ION_MAX_HEAP_TYPES] = {0};
 	int i;
 
 	mutex_lock(&client->lock);
@@ -549,7 +597,7 @@ static int ion_debug_client_show(struct seq_file *s, void *unused)
 	mutex_unlock(&client->lock);
 
 	seq_printf(s, "%16.16s: %16.16s\n", "heap_name", "size_in_bytes");
-	for (i = 0; i < ION_NUM_HEAPS; i++) {
+	for (i = 0; i < ION_MAX_HEAP_TYPES; i++) {
 		if (!names[i])
 			continue;
 		seq_printf(s, "%16.16s: %16u %d\n", names[i], sizes[i],
@@ -576,12 +624,12 @@ static struct ion_client *ion_client_lookup(struct ion_device *dev,
 	struct rb_node *n = dev->user_clients.rb_node;
 	struct ion_client *client;
 
-	mutex_lock(&dev->lock);
+	down_read(&dev->lock);
 	while (n) {
 		client = rb_entry(n, struct ion_client, node);
 		if (task == client->task) {
 			ion_client_get(client);
-			mutex_unlock(&dev->lock);
+			up_read(&dev->lock);
 			return client;
 		} else if (task < client->task) {
 			n = n->rb_left;
@@ -589,7 +637,7 @@ static struct ion_client *ion_client_lookup(struct ion_device *dev,
 			n = n->rb_right;
 		}
 	}
-	mutex_unlock(&dev->lock);
+	up_read(&dev->lock);
 	return NULL;
 }
 
@@ -636,6 +684,7 @@ struct ion_client *ion_client_create(struct ion_device *dev,
 
 	client->dev = dev;
 	client->handles = RB_ROOT;
+	client->buffer_handles = RB_ROOT;
 	mutex_init(&client->lock);
 	client->name = name;
 	client->heap_mask = heap_mask;
@@ -643,7 +692,7 @@ struct ion_client *ion_client_create(struct ion_device *dev,
 	client->pid = pid;
 	kref_init(&client->ref);
 
-	mutex_lock(&dev->lock);
+	down_write(&dev->lock);
 	if (task) {
 		p = &dev->user_clients.rb_node;
 		while (*p) {
@@ -676,7 +725,7 @@ struct ion_client *ion_client_create(struct ion_device *dev,
 	client->debug_root = debugfs_create_file(debug_name, 0664,
 						 dev->debug_root, client,
 						 &debug_client_fops);
-	mutex_unlock(&dev->lock);
+	up_write(&dev->lock);
 
 	return client;
 }
@@ -693,7 +742,7 @@ static void _ion_client_destroy(struct kref *kref)
 						     node);
 		ion_handle_destroy(&handle->ref);
 	}
-	mutex_lock(&dev->lock);
+	down_write(&dev->lock);
 	if (client->task) {
 		rb_erase(&client->node, &dev->user_clients);
 		put_task_struct(client->task);
@@ -701,7 +750,7 @@ static void _ion_client_destroy(struct kref *kref)
 		rb_erase(&client->node, &dev->kernel_clients);
 	}
 	debugfs_remove_recursive(client->debug_root);
-	mutex_unlock(&dev->lock);
+	up_write(&dev->lock);
 
 	kfree(client);
 }
@@ -780,9 +829,31 @@ static void ion_vma_close(struct vm_area_struct *vma)
 		 atomic_read(&buffer->ref.refcount));
 }
 
+/*
+ * Buffers with an sg_table but no map_user are mapped to userspace lazily,
+ * a page at a time, so mmap costs nothing up front and untouched parts of
+ * a buffer are never mapped at all.
+ */
+static int ion_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct ion_buffer *buffer = vma->vm_file->private_data;
+	unsigned long pfn;
+	int ret;
+
+	if (!buffer->pages || vmf->pgoff >= PAGE_ALIGN(buffer->size) >>
+					     PAGE_SHIFT)
+		return VM_FAULT_SIGBUS;
+	pfn = page_to_pfn(buffer->pages[vmf->pgoff]);
+	ret = vm_insert_pfn(vma, (unsigned long)vmf->virtual_address, pfn);
+	if (ret && ret != -EBUSY)
+		return VM_FAULT_SIGBUS;
+	return VM_FAULT_NOPAGE;
+}
+
 static struct vm_operations_struct ion_vm_ops = {
 	.open = ion_vma_open,
 	.close = ion_vma_close,
+	.fault = ion_vma_fault,
 };
 
 static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
@@ -821,6 +892,22 @@ static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
 	ion_buffer_get(buffer);
 
 	if (!handle->buffer->heap->ops->map_user) {
+		if (buffer->sg_table && buffer->pages) {
+			/*
+			 * pages are inserted by ion_vma_fault. A private
+			 * writable mapping would be a COW one, which a
+			 * VM_PFNMAP vma cannot be.
+			 */
+			if (!(vma->vm_flags & VM_SHARED) &&
+			    (vma->vm_flags & VM_MAYWRITE)) {
+				pr_err("%s: private mappings of this heap are "
+				       "not supported\n", __func__);
+				ret = -EINVAL;
+				goto err1;
+			}
+			vma->vm_flags |= VM_IO | VM_PFNMAP | VM_RESERVED;
+			goto mapped;
+		}
 		pr_err("this heap does not define a method for mapping "
 		       "to userspace\n");
 		ret = -EINVAL;
@@ -836,6 +923,8 @@ static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
 		goto err1;
 	}
 
+mapped:
+
 	vma->vm_ops = &ion_vm_ops;
 	/* move the handle into the vm_private_data so we can access it from
 	   vma_open/close */
@@ -1003,17 +1092,10 @@ static const struct file_operations ion_fops = {
 static size_t ion_debug_heap_total(struct ion_client *client,
 				   enum ion_heap_type type)
 {
-	size_t size = 0;
-	struct rb_node *n;
+	size_t size;
 
 	mutex_lock(&client->lock);
-	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
-		struct ion_handle *handle = rb_entry(n,
-						     struct ion_handle,
-						     node);
-		if (handle->buffer->heap->type == type)
-			size += handle->buffer->size;
-	}
+	size = client->heap_sizes[type];
 	mutex_unlock(&client->lock);
 	return size;
 }
@@ -1025,6 +1107,7 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 	struct rb_node *n;
 
 	seq_printf(s, "%16.s %16.s %16.s\n", "client", "pid", "size");
+	down_read(&dev->lock);
 	for (n = rb_first(&dev->user_clients); n; n = rb_next(n)) {
 		struct ion_client *client = rb_entry(n, struct ion_client,
 						     node);
@@ -1047,6 +1130,7 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 		seq_printf(s, "%16.s %16u %16u\n", client->name, client->pid,
 			   size);
 	}
+	up_read(&dev->lock);
 	return 0;
 }
 
@@ -1069,7 +1153,8 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 	struct ion_heap *entry;
 
 	heap->dev = dev;
-	mutex_lock(&dev->lock);
+	mutex_init(&heap->lock);
+	down_write(&dev->lock);
 	while (*p) {
 		parent = *p;
 		entry = rb_entry(parent, struct ion_heap, node);
@@ -1090,7 +1175,7 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 	debugfs_create_file(heap->name, 0664, dev->debug_root, heap,
 			    &debug_heap_fops);
 end:
-	mutex_unlock(&dev->lock);
+	up_write(&dev->lock);
 }
 
 struct ion_device *ion_device_create(long (*custom_ioctl)
@@ -1121,7 +1206,8 @@ struct ion_device *ion_device_create(long (*custom_ioctl)
 
 	idev->custom_ioctl = custom_ioctl;
 	idev->buffers = RB_ROOT;
-	mutex_init(&idev->lock);
+	mutex_init(&idev->buffer_lock);
+	init_rwsem(&idev->lock);
 	idev->heaps = RB_ROOT;
 	idev->user_clients = RB_ROOT;
 	idev->kernel_clients = RB_ROOT;
@@ -35,6 +35,9 @@ struct ion_heap *ion_heap_create(struct ion_platform_heap *heap_data)
 	case ION_HEAP_TYPE_IOMMU:
 		heap = ion_iommu_heap_create(heap_data);
 		break;
+	case ION_HEAP_TYPE_SYSTEM_SG:
+		heap = ion_system_sg_heap_create(heap_data);
+		break;
 	default:
 		pr_err("%s: Invalid heap type %d\n", __func__,
 		       heap_data->type);
@@ -71,6 +74,9 @@ void ion_heap_destroy(struct ion_heap *heap)
 	case ION_HEAP_TYPE_IOMMU:
 		ion_iommu_heap_destroy(heap);
 		break;
+	case ION_HEAP_TYPE_SYSTEM_SG:
+		ion_system_sg_heap_destroy(heap);
+		break;
 	default:
 		pr_err("%s: Invalid heap type %d\n", __func__,
 		       heap->type);
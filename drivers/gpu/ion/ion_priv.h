@@ -21,9 +21,13 @@
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/ion.h>
 #include <linux/miscdevice.h>
 
+/* Heap types, device specific ones included, are bits of 32 bit heap masks */
+#define ION_MAX_HEAP_TYPES	32
+
 struct ion_mapping;
 
 struct ion_dma_mapping {
@@ -40,14 +44,18 @@ struct ion_kernel_mapping {
  * struct ion_device - the metadata of the ion device node
  * @dev:		the actual misc device
  * @buffers:	an rb tree of all the existing buffers
- * @lock:		lock protecting the buffers & heaps trees
+ * @buffer_lock:	lock protecting the buffers tree
+ * @lock:		lock protecting the heaps & clients trees, taken for
+ *			reading to look them up, and held across allocations
+ *			so heaps can't go away under them
  * @heaps:		list of all the heaps in the system
  * @user_clients:	list of all the clients created from userspace
  */
 struct ion_device {
 	struct miscdevice dev;
 	struct rb_root buffers;
-	struct mutex lock;
+	struct mutex buffer_lock;
+	struct rw_semaphore lock;
 	struct rb_root heaps;
 	long (*custom_ioctl) (struct ion_client *client, unsigned int cmd,
 			      unsigned long arg);
@@ -62,8 +70,12 @@ struct ion_device {
  * @node:		node in the tree of all clients
  * @dev:		backpointer to ion device
  * @handles:		an rb tree of all the handles in this client
- * @lock:		lock protecting the tree of handles
+ * @buffer_handles:	the same handles, in an rb tree keyed by buffer, which
+ *			may hold several handles to one buffer
+ * @lock:		lock protecting the trees of handles
  * @heap_mask:		mask of all supported heaps
+ * @heap_sizes:		bytes of buffers this client has handles to, by
+ *			heap type, for debugfs
  * @name:		used for debugging
  * @task:		used for debugging
  *
@@ -76,8 +88,10 @@ struct ion_client {
 	struct rb_node node;
 	struct ion_device *dev;
 	struct rb_root handles;
+	struct rb_root buffer_handles;
 	struct mutex lock;
 	unsigned int heap_mask;
+	size_t heap_sizes[ION_MAX_HEAP_TYPES];
 	const char *name;
 	struct task_struct *task;
 	pid_t pid;
@@ -90,6 +104,7 @@ struct ion_client {
  * @client:		back pointer to the client the buffer resides in
  * @buffer:		pointer to the buffer
  * @node:		node in the client's handle rbtree
+ * @buffer_node:	node in the client's rbtree of handles by buffer
  * @kmap_cnt:		count of times this client has mapped to kernel
  * @dmap_cnt:		count of times this client has mapped for dma
  * @usermap_cnt:	count of times this client has mapped for userspace
@@ -102,6 +117,7 @@ struct ion_handle {
 	struct ion_client *client;
 	struct ion_buffer *buffer;
 	struct rb_node node;
+	struct rb_node buffer_node;
 	unsigned int kmap_cnt;
 	unsigned int dmap_cnt;
 	unsigned int usermap_cnt;
@@ -149,6 +165,10 @@ int ion_remap_dma(struct ion_client *client,
  * @dmap_cnt:		number of times the buffer is mapped for dma
  * @sglist:		the scatterlist for the buffer is dmap_cnt is not zero
  * @pages:		list for allocated pages for the buffer
+ * @sg_table:		if the heap sets this at allocation, ion_map_dma
+ *			returns its scatterlist without calling map_dma, and
+ *			if the heap has no map_user, user mappings are
+ *			faulted in one page at a time from @pages
  */
 struct ion_buffer {
 	struct kref ref;
@@ -167,6 +187,7 @@ struct ion_buffer {
 	int dmap_cnt;
 	struct scatterlist *sglist;
 	struct page **pages;
+	struct sg_table *sg_table;
 };
 
 /**
@@ -207,6 +228,9 @@ struct ion_heap_ops {
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @lock:		serializes allocations from this heap, so that
+ *			allocations from different heaps don't wait on
+ *			each other
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -220,6 +244,7 @@ struct ion_heap {
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	struct mutex lock;
 };
 
 /**
@@ -261,6 +286,9 @@ void ion_system_heap_destroy(struct ion_heap *);
 struct ion_heap *ion_system_contig_heap_create(struct ion_platform_heap *);
 void ion_system_contig_heap_destroy(struct ion_heap *);
 
+struct ion_heap *ion_system_sg_heap_create(struct ion_platform_heap *);
+void ion_system_sg_heap_destroy(struct ion_heap *);
+
 struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *);
 void ion_carveout_heap_destroy(struct ion_heap *);
 /**
@@ -284,6 +312,38 @@ static inline void ion_iommu_heap_destroy(struct ion_heap *)
 {
 }
 #endif
+/**
+ * struct ion_page_pool - pagepool struct
+ * @count:		number of items in the pool
+ * @items:		list of items, linked through page->lru
+ * @mutex:		lock protecting this struct and especially the count
+ *			item list
+ * @gfp_mask:		gfp_mask to use for allocations from the page
+ *			allocator when the pool is empty
+ * @order:		order of pages in the pool
+ *
+ * Allows you to keep a pool of pre-zeroed pages of one order around so
+ * that buffers don't pay for the page allocator and zeroing each time.
+ * Pages are zeroed before being returned to the pool with
+ * ion_page_pool_free, and ion_page_pool_alloc falls back to the page
+ * allocator, with __GFP_ZERO, when the pool is empty.
+ * ion_page_pool_shrink gives pages back to the system.
+ */
+struct ion_page_pool {
+	int count;
+	struct list_head items;
+	struct mutex mutex;
+	gfp_t gfp_mask;
+	unsigned int order;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+/* returns the number of pages freed, at most nr_to_scan */
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan);
+
 /**
  * The carveout heap returns physical addresses, since 0 may be a valid
  * physical address, this is used to indicate allocation failed
@@ -15,55 +15,272 @@
  */
 
 #include <linux/err.h>
+#include <linux/freezer.h>
+#include <linux/highmem.h>
 #include <linux/ion.h>
+#include <linux/kthread.h>
 #include <linux/mm.h>
 #include <linux/scatterlist.h>
+#include <linux/shrinker.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
 #include "ion_priv.h"
 
+/*
+ * The system heap builds buffers out of the largest of these orders that
+ * fit, so that big buffers take fewer, larger pages; pages are taken from,
+ * and given back to, a pool per order.  High orders are only tried
+ * opportunistically, without reclaim, falling back to smaller ones.
+ */
+static unsigned int orders[] = {8, 4, 0};
+static const int num_orders = ARRAY_SIZE(orders);
+
+static gfp_t high_order_gfp_flags = (GFP_HIGHUSER | __GFP_NOWARN |
+				     __GFP_NORETRY) & ~__GFP_WAIT;
+static gfp_t low_order_gfp_flags = GFP_HIGHUSER | __GFP_NOWARN;
+
+/**
+ * struct ion_system_heap - the system heap
+ * @heap:		the generic heap, must be first
+ * @pools:		one page pool per entry in orders[]
+ * @free_list:		buffers freed but not yet zeroed and returned to
+ *			the pools
+ * @free_lock:		protects free_list
+ * @waitqueue:		where the deferred free thread waits for work
+ * @task:		the deferred free thread
+ * @shrinker:		gives pooled and pending pages back to the system
+ *
+ * Freed buffers are handed to a kthread which zeroes their pages and puts
+ * them back into the pools, so neither ion_free nor the next allocation
+ * that reuses the pages pays for clearing them.
+ */
+struct ion_system_heap {
+	struct ion_heap heap;
+	struct ion_page_pool *pools[ARRAY_SIZE(orders)];
+	struct list_head free_list;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	struct shrinker shrinker;
+};
+
+struct page_info {
+	struct page *page;
+	unsigned int order;
+	struct list_head list;
+};
+
+/* hangs off buffer->priv_virt, and outlives the buffer if freed deferred */
+struct ion_system_buffer_info {
+	struct list_head pages;		/* of page_info, largest first */
+	struct list_head list;		/* on the heap's free_list */
+};
+
+static int order_to_index(unsigned int order)
+{
+	int i;
+
+	for (i = 0; i < num_orders; i++)
+		if (order == orders[i])
+			return i;
+	BUG();
+	return -1;
+}
+
+static struct page_info *alloc_largest_available(struct ion_system_heap *heap,
+						 unsigned long size,
+						 unsigned int max_order)
+{
+	struct page_info *info;
+	struct page *page;
+	int i;
+
+	info = kmalloc(sizeof(struct page_info), GFP_KERNEL);
+	if (!info)
+		return NULL;
+
+	for (i = 0; i < num_orders; i++) {
+		if (size < (PAGE_SIZE << orders[i]))
+			continue;
+		if (max_order < orders[i])
+			continue;
+		page = ion_page_pool_alloc(heap->pools[i]);
+		if (!page)
+			continue;
+		info->page = page;
+		info->order = orders[i];
+		return info;
+	}
+	kfree(info);
+	return NULL;
+}
+
+static void free_buffer_pages(struct ion_system_heap *heap,
+			      struct ion_system_buffer_info *buf, bool pool)
+{
+	struct page_info *info, *tmp;
+	int i;
+
+	list_for_each_entry_safe(info, tmp, &buf->pages, list) {
+		if (pool) {
+			for (i = 0; i < (1 << info->order); i++)
+				clear_highpage(info->page + i);
+			ion_page_pool_free(heap->pools[order_to_index(
+							info->order)],
+					   info->page);
+		} else {
+			__free_pages(info->page, info->order);
+		}
+		list_del(&info->list);
+		kfree(info);
+	}
+	kfree(buf);
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				     struct ion_buffer *buffer,
 				     unsigned long size, unsigned long align,
 				     unsigned long flags)
 {
-	buffer->priv_virt = vmalloc_user(size);
-	if (!buffer->priv_virt)
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer_info *buf;
+	struct page_info *info;
+	long size_remaining = PAGE_ALIGN(size);
+	unsigned int max_order = orders[0];
+
+	buf = kmalloc(sizeof(struct ion_system_buffer_info), GFP_KERNEL);
+	if (!buf)
 		return -ENOMEM;
+	INIT_LIST_HEAD(&buf->pages);
+	while (size_remaining > 0) {
+		info = alloc_largest_available(sys_heap, size_remaining,
+					       max_order);
+		if (!info)
+			goto err;
+		list_add_tail(&info->list, &buf->pages);
+		size_remaining -= PAGE_SIZE << info->order;
+		max_order = info->order;
+	}
+	buffer->priv_virt = buf;
 	return 0;
+err:
+	/* nothing was written to these, so they are still zeroed */
+	free_buffer_pages(sys_heap, buf, false);
+	return -ENOMEM;
 }
 
 void ion_system_heap_free(struct ion_buffer *buffer)
 {
-	vfree(buffer->priv_virt);
+	struct ion_system_heap *sys_heap = container_of(buffer->heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer_info *buf = buffer->priv_virt;
+
+	/* the pages must not go back to the pools with a kernel alias */
+	if (buffer->vaddr) {
+		vunmap(buffer->vaddr);
+		buffer->vaddr = NULL;
+	}
+	if (!sys_heap->task) {
+		free_buffer_pages(sys_heap, buf, true);
+		return;
+	}
+	spin_lock(&sys_heap->free_lock);
+	list_add_tail(&buf->list, &sys_heap->free_list);
+	spin_unlock(&sys_heap->free_lock);
+	wake_up(&sys_heap->waitqueue);
+}
+
+static struct ion_system_buffer_info *
+ion_system_heap_next_free(struct ion_system_heap *sys_heap)
+{
+	struct ion_system_buffer_info *buf = NULL;
+
+	spin_lock(&sys_heap->free_lock);
+	if (!list_empty(&sys_heap->free_list)) {
+		buf = list_first_entry(&sys_heap->free_list,
+				       struct ion_system_buffer_info, list);
+		list_del(&buf->list);
+	}
+	spin_unlock(&sys_heap->free_lock);
+	return buf;
+}
+
+static int ion_system_heap_deferred_free(void *data)
+{
+	struct ion_system_heap *sys_heap = data;
+	struct ion_system_buffer_info *buf;
+
+	set_freezable();
+	while (!kthread_should_stop()) {
+		wait_event_freezable(sys_heap->waitqueue,
+				     !list_empty(&sys_heap->free_list) ||
+				     kthread_should_stop());
+		while ((buf = ion_system_heap_next_free(sys_heap)))
+			free_buffer_pages(sys_heap, buf, true);
+	}
+	return 0;
+}
+
+static int ion_system_heap_shrink(struct shrinker *shrinker,
+				  struct shrink_control *sc)
+{
+	struct ion_system_heap *sys_heap = container_of(shrinker,
+							struct ion_system_heap,
+							shrinker);
+	struct ion_system_buffer_info *buf;
+	long nr_to_scan = sc->nr_to_scan;
+	int i, nr, total = 0;
+
+	if (nr_to_scan) {
+		/* pages still waiting to be zeroed aren't worth zeroing now */
+		while (nr_to_scan > 0 &&
+		       (buf = ion_system_heap_next_free(sys_heap))) {
+			struct page_info *info;
+
+			list_for_each_entry(info, &buf->pages, list)
+				nr_to_scan -= 1 << info->order;
+			free_buffer_pages(sys_heap, buf, false);
+		}
+		/* then the pools, the most fragmenting high orders first */
+		for (i = 0; i < num_orders && nr_to_scan > 0; i++) {
+			nr = DIV_ROUND_UP(nr_to_scan, 1 << orders[i]);
+			nr = ion_page_pool_shrink(sys_heap->pools[i], nr);
+			nr_to_scan -= nr << orders[i];
+		}
+	}
+
+	for (i = 0; i < num_orders; i++)
+		total += sys_heap->pools[i]->count << orders[i];
+	return total;
 }
 
 struct scatterlist *ion_system_heap_map_dma(struct ion_heap *heap,
 					    struct ion_buffer *buffer)
 {
-	struct scatterlist *sglist;
-	struct page *page;
-	int i;
-	int npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	void *vaddr = buffer->priv_virt;
+	struct ion_system_buffer_info *buf = buffer->priv_virt;
+	struct scatterlist *sglist, *sg;
+	struct page_info *info;
+	int nents = 0;
 
-	sglist = vmalloc(npages * sizeof(struct scatterlist));
+	list_for_each_entry(info, &buf->pages, list)
+		nents++;
+	sglist = vmalloc(nents * sizeof(struct scatterlist));
 	if (!sglist)
 		return ERR_PTR(-ENOMEM);
-	memset(sglist, 0, npages * sizeof(struct scatterlist));
-	sg_init_table(sglist, npages);
-	for (i = 0; i < npages; i++) {
-		page = vmalloc_to_page(vaddr);
-		if (!page)
-			goto end;
-		sg_set_page(&sglist[i], page, PAGE_SIZE, 0);
-		vaddr += PAGE_SIZE;
+	memset(sglist, 0, nents * sizeof(struct scatterlist));
+	sg_init_table(sglist, nents);
+	sg = sglist;
+	list_for_each_entry(info, &buf->pages, list) {
+		sg_set_page(sg, info->page, PAGE_SIZE << info->order, 0);
+		sg = sg_next(sg);
 	}
 	/* XXX do cache maintenance for dma? */
 	return sglist;
-end:
-	vfree(sglist);
-	return NULL;
 }
 
 void ion_system_heap_unmap_dma(struct ion_heap *heap,
@@ -77,18 +294,71 @@ void ion_system_heap_unmap_dma(struct ion_heap *heap,
 void *ion_system_heap_map_kernel(struct ion_heap *heap,
 				 struct ion_buffer *buffer)
 {
-	return buffer->priv_virt;
+	struct ion_system_buffer_info *buf = buffer->priv_virt;
+	int npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+	struct page **pages, **tmp;
+	struct page_info *info;
+	void *vaddr;
+	int i;
+
+	pages = vmalloc(sizeof(struct page *) * npages);
+	if (!pages)
+		return ERR_PTR(-ENOMEM);
+	tmp = pages;
+	list_for_each_entry(info, &buf->pages, list)
+		for (i = 0; i < (1 << info->order); i++)
+			*(tmp++) = info->page + i;
+	vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	vfree(pages);
+	if (!vaddr)
+		return ERR_PTR(-ENOMEM);
+	return vaddr;
 }
 
 void ion_system_heap_unmap_kernel(struct ion_heap *heap,
 				  struct ion_buffer *buffer)
 {
+	vunmap(buffer->vaddr);
 }
 
 int ion_system_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 			     struct vm_area_struct *vma)
 {
-	return remap_vmalloc_range(vma, buffer->priv_virt, vma->vm_pgoff);
+	struct ion_system_buffer_info *buf = buffer->priv_virt;
+	unsigned long addr = vma->vm_start;
+	unsigned long offset = vma->vm_pgoff * PAGE_SIZE;
+	struct page_info *info;
+	unsigned long len;
+	int ret;
+
+	list_for_each_entry(info, &buf->pages, list) {
+		len = PAGE_SIZE << info->order;
+		if (offset >= len) {
+			offset -= len;
+			continue;
+		}
+		len = min(len - offset, vma->vm_end - addr);
+		/*
+		 * remap_pfn_range() maps a private writable (COW) mapping
+		 * only in one go, so such a mapping must fit in one chunk.
+		 */
+		if ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) ==
+		    VM_MAYWRITE && len < vma->vm_end - vma->vm_start) {
+			pr_err("%s: private writable mappings of more than "
+			       "one chunk are not supported\n", __func__);
+			return -EINVAL;
+		}
+		ret = remap_pfn_range(vma, addr, page_to_pfn(info->page) +
+				      offset / PAGE_SIZE, len,
+				      vma->vm_page_prot);
+		if (ret)
+			return ret;
+		offset = 0;
+		addr += len;
+		if (addr >= vma->vm_end)
+			break;
+	}
+	return 0;
 }
 
 static struct ion_heap_ops vmalloc_ops = {
@@ -101,21 +371,163 @@ static struct ion_heap_ops vmalloc_ops = {
 	.map_user = ion_system_heap_map_user,
 };
 
-struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
+/*
+ * The scatter-gather system heap allocates like the system heap, but also
+ * builds the buffer's sg_table and array of pages at allocation.  The ion
+ * core then hands out the sg_table on every ion_map_dma without calling
+ * back into the heap, and faults user mappings in from the page array.
+ */
+static int ion_system_sg_heap_allocate(struct ion_heap *heap,
+				       struct ion_buffer *buffer,
+				       unsigned long size, unsigned long align,
+				       unsigned long flags)
 {
-	struct ion_heap *heap;
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer_info *buf;
+	struct sg_table *table;
+	struct scatterlist *sg;
+	struct page_info *info;
+	struct page **pages, **tmp;
+	int npages = PAGE_ALIGN(size) / PAGE_SIZE;
+	int nents = 0, i, ret;
 
-	heap = kzalloc(sizeof(struct ion_heap), GFP_KERNEL);
+	ret = ion_system_heap_allocate(heap, buffer, size, align, flags);
+	if (ret)
+		return ret;
+	buf = buffer->priv_virt;
+	list_for_each_entry(info, &buf->pages, list)
+		nents++;
+
+	table = kmalloc(sizeof(struct sg_table), GFP_KERNEL);
+	if (!table)
+		goto err;
+	if (sg_alloc_table(table, nents, GFP_KERNEL))
+		goto err_table;
+	pages = vmalloc(sizeof(struct page *) * npages);
+	if (!pages)
+		goto err_sg;
+
+	sg = table->sgl;
+	tmp = pages;
+	list_for_each_entry(info, &buf->pages, list) {
+		sg_set_page(sg, info->page, PAGE_SIZE << info->order, 0);
+		sg = sg_next(sg);
+		for (i = 0; i < (1 << info->order); i++)
+			*(tmp++) = info->page + i;
+	}
+	buffer->sg_table = table;
+	buffer->pages = pages;
+	return 0;
+
+err_sg:
+	sg_free_table(table);
+err_table:
+	kfree(table);
+err:
+	free_buffer_pages(sys_heap, buf, false);
+	return -ENOMEM;
+}
+
+static void ion_system_sg_heap_free(struct ion_buffer *buffer)
+{
+	sg_free_table(buffer->sg_table);
+	kfree(buffer->sg_table);
+	vfree(buffer->pages);
+	ion_system_heap_free(buffer);
+}
+
+static void *ion_system_sg_heap_map_kernel(struct ion_heap *heap,
+					   struct ion_buffer *buffer)
+{
+	void *vaddr = vmap(buffer->pages, PAGE_ALIGN(buffer->size) / PAGE_SIZE,
+			   VM_MAP, PAGE_KERNEL);
+
+	if (!vaddr)
+		return ERR_PTR(-ENOMEM);
+	return vaddr;
+}
+
+static struct ion_heap_ops sg_ops = {
+	.allocate = ion_system_sg_heap_allocate,
+	.free = ion_system_sg_heap_free,
+	.map_kernel = ion_system_sg_heap_map_kernel,
+	.unmap_kernel = ion_system_heap_unmap_kernel,
+};
+
+static struct ion_heap *__ion_system_heap_create(struct ion_heap_ops *ops,
+						 enum ion_heap_type type)
+{
+	struct ion_system_heap *heap;
+	gfp_t gfp_flags;
+	int i;
+
+	heap = kzalloc(sizeof(struct ion_system_heap), GFP_KERNEL);
 	if (!heap)
 		return ERR_PTR(-ENOMEM);
-	heap->ops = &vmalloc_ops;
-	heap->type = ION_HEAP_TYPE_SYSTEM;
-	return heap;
+	heap->heap.ops = ops;
+	heap->heap.type = type;
+	for (i = 0; i < num_orders; i++) {
+		gfp_flags = orders[i] ? high_order_gfp_flags :
+					low_order_gfp_flags;
+		heap->pools[i] = ion_page_pool_create(gfp_flags, orders[i]);
+		if (!heap->pools[i])
+			goto err;
+	}
+	INIT_LIST_HEAD(&heap->free_list);
+	spin_lock_init(&heap->free_lock);
+	init_waitqueue_head(&heap->waitqueue);
+	heap->task = kthread_run(ion_system_heap_deferred_free, heap,
+				 "ion_system_heap");
+	if (IS_ERR(heap->task)) {
+		pr_err("%s: creating thread for deferred free failed\n",
+		       __func__);
+		/* buffers will be freed synchronously */
+		heap->task = NULL;
+	}
+	heap->shrinker.shrink = ion_system_heap_shrink;
+	heap->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&heap->shrinker);
+	return &heap->heap;
+err:
+	while (--i >= 0)
+		ion_page_pool_destroy(heap->pools[i]);
+	kfree(heap);
+	return ERR_PTR(-ENOMEM);
+}
+
+struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
+{
+	return __ion_system_heap_create(&vmalloc_ops, ION_HEAP_TYPE_SYSTEM);
+}
+
+struct ion_heap *ion_system_sg_heap_create(struct ion_platform_heap *unused)
+{
+	return __ion_system_heap_create(&sg_ops, ION_HEAP_TYPE_SYSTEM_SG);
 }
 
 void ion_system_heap_destroy(struct ion_heap *heap)
 {
-	kfree(heap);
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer_info *buf;
+	int i;
+
+	unregister_shrinker(&sys_heap->shrinker);
+	if (sys_heap->task)
+		kthread_stop(sys_heap->task);
+	while ((buf = ion_system_heap_next_free(sys_heap)))
+		free_buffer_pages(sys_heap, buf, false);
+	for (i = 0; i < num_orders; i++)
+		ion_page_pool_destroy(sys_heap->pools[i]);
+	kfree(sys_heap);
+}
+
+void ion_system_sg_heap_destroy(struct ion_heap *heap)
+{
+	ion_system_heap_destroy(heap);
 }
 
 static int ion_system_contig_heap_allocate(struct ion_heap *heap,
@@ -168,14 +580,25 @@ int ion_system_contig_heap_map_user(struct ion_heap *heap,
 
 }
 
+void *ion_system_contig_heap_map_kernel(struct ion_heap *heap,
+					struct ion_buffer *buffer)
+{
+	return buffer->priv_virt;
+}
+
+void ion_system_contig_heap_unmap_kernel(struct ion_heap *heap,
+					 struct ion_buffer *buffer)
+{
+}
+
 static struct ion_heap_ops kmalloc_ops = {
 	.allocate = ion_system_contig_heap_allocate,
 	.free = ion_system_contig_heap_free,
 	.phys = ion_system_contig_heap_phys,
 	.map_dma = ion_system_contig_heap_map_dma,
 	.unmap_dma = ion_system_heap_unmap_dma,
-	.map_kernel = ion_system_heap_map_kernel,
-	.unmap_kernel = ion_system_heap_unmap_kernel,
+	.map_kernel = ion_system_contig_heap_map_kernel,
+	.unmap_kernel = ion_system_contig_heap_unmap_kernel,
 	.map_user = ion_system_contig_heap_map_user,
 };
 
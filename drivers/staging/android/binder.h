@@ -32,11 +32,13 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	FLAT_BINDER_FLAG_ACCEPTS_ZERO_COPY = 0x200,
 };
 
 /*
@@ -61,6 +63,20 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+/*
+ * A BINDER_TYPE_PTR object describes a buffer outside of the data that
+ * is gathered into the target's binder buffer by BC_TRANSACTION_SG and
+ * BC_REPLY_SG.  The driver rewrites 'buffer' to where the receiver
+ * finds it.  It has the size of a flat_binder_object so that both can
+ * be listed in the same offsets array.
+ */
+struct binder_buffer_object {
+	unsigned long		type;
+	unsigned long		flags;
+	void			*buffer;
+	size_t			length;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -88,6 +104,7 @@ struct binder_version {
 #define	BINDER_SET_IDLE_TIMEOUT		_IOW('b', 3, int64_t)
 #define	BINDER_SET_MAX_THREADS		_IOW('b', 5, size_t)
 #define	BINDER_SET_IDLE_PRIORITY	_IOW('b', 6, int)
+/* the argument is 0, or FLAT_BINDER_FLAG_ACCEPTS_ZERO_COPY */
 #define	BINDER_SET_CONTEXT_MGR		_IOW('b', 7, int)
 #define	BINDER_THREAD_EXIT		_IOW('b', 8, int)
 #define BINDER_VERSION			_IOWR('b', 9, struct binder_version)
@@ -112,6 +129,8 @@ enum transaction_flags {
 	TF_ROOT_OBJECT	= 0x04,	/* contents are the component's root object */
 	TF_STATUS_CODE	= 0x08,	/* contents are a 32-bit status code */
 	TF_ACCEPT_FDS	= 0x10,	/* allow replies with file descriptors */
+	TF_ZERO_COPY	= 0x20,	/* map page aligned sg buffers, don't copy */
+	TF_ACCEPT_ZERO_COPY = 0x40, /* allow replies with mapped sg buffers */
 };
 
 struct binder_transaction_data {
@@ -147,6 +166,16 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * Payload of BC_TRANSACTION_SG and BC_REPLY_SG: buffers_size is the room
+ * to reserve after the offsets for the BINDER_TYPE_PTR buffers, each
+ * aligned to a pointer or, with TF_ZERO_COPY, to a page.
+ */
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	size_t		buffers_size;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +353,19 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with the contents
+	 * of its BINDER_TYPE_PTR objects gathered after the offsets.
+	 * With TF_ZERO_COPY set, whole pages of page aligned buffers that
+	 * are backed by shared memory are mapped into the target instead
+	 * of being copied; anything else is copied.  Since the sender can
+	 * still write to mapped pages, this is only done for targets that
+	 * ask for it: nodes with FLAT_BINDER_FLAG_ACCEPTS_ZERO_COPY, and
+	 * replies to transactions sent with TF_ACCEPT_ZERO_COPY.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
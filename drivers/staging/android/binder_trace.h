@@ -0,0 +1,145 @@
+/* binder_trace.h
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Only included by binder.c, after the definitions of the structures
+ * these events look into.
+ */
+
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(struct binder_transaction *t, struct binder_node *target_node),
+	TP_ARGS(t, target_node),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, target_node)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->target_node = target_node->debug_id;
+		__entry->to_proc = t->to_proc->pid;
+		__entry->to_thread = t->to_thread ? t->to_thread->pid : 0;
+		__entry->code = t->code;
+		__entry->flags = t->flags;
+	),
+
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->target_node, __entry->to_proc,
+		  __entry->to_thread, __entry->flags, __entry->code)
+);
+
+TRACE_EVENT(binder_reply,
+	TP_PROTO(struct binder_transaction *t,
+		 struct binder_transaction *in_reply_to),
+	TP_ARGS(t, in_reply_to),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, reply_to)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(unsigned int, flags)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->reply_to = in_reply_to->debug_id;
+		__entry->to_proc = t->to_proc->pid;
+		__entry->to_thread = t->to_thread->pid;
+		__entry->flags = t->flags;
+	),
+
+	TP_printk("transaction=%d reply_to=%d dest_proc=%d dest_thread=%d "
+		  "flags=0x%x",
+		  __entry->debug_id, __entry->reply_to, __entry->to_proc,
+		  __entry->to_thread, __entry->flags)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(struct binder_transaction *t, u64 latency_ns),
+	TP_ARGS(t, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(bool, reply)
+		__field(u64, latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->reply = t->buffer->target_node == NULL;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("transaction=%d%s latency=%lluns",
+		  __entry->debug_id, __entry->reply ? " reply" : "",
+		  (unsigned long long)__entry->latency_ns)
+);
+
+DECLARE_EVENT_CLASS(binder_buffer_class,
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf),
+	TP_ARGS(proc, buf),
+
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, debug_id)
+		__field(size_t, data_size)
+		__field(size_t, offsets_size)
+		__field(size_t, extra_buffers_size)
+	),
+
+	TP_fast_assign(
+		__entry->proc = proc->pid;
+		__entry->debug_id = buf->debug_id;
+		__entry->data_size = buf->data_size;
+		__entry->offsets_size = buf->offsets_size;
+		__entry->extra_buffers_size = buf->extra_buffers_size;
+	),
+
+	TP_printk("proc=%d transaction=%d data_size=%zd offsets_size=%zd "
+		  "extra_buffers_size=%zd",
+		  __entry->proc, __entry->debug_id, __entry->data_size,
+		  __entry->offsets_size, __entry->extra_buffers_size)
+);
+
+DEFINE_EVENT(binder_buffer_class, binder_alloc_buf,
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf),
+	TP_ARGS(proc, buf));
+
+DEFINE_EVENT(binder_buffer_class, binder_free_buf,
+	TP_PROTO(struct binder_proc *proc, struct binder_buffer *buf),
+	TP_ARGS(proc, buf));
+
+#endif /* _BINDER_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
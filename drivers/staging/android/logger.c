@@ -25,16 +25,66 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * struct logger_stage - a per-cpu staging buffer of a log
+ *
+ * Writers do not take log->mutex.  They reserve room for their entry here
+ * under 'lock', which is only contended by writers that migrated and by
+ * logger_flush(), and copy the payload in with the lock dropped.
+ * logger_flush() later moves finished entries into the log in batches.
+ * Staged entries lie between 'head' and 'tail'; only the flusher moves
+ * 'head', and both go back to zero whenever the buffer drains.
+ */
+struct logger_stage {
+	spinlock_t		lock;	/* protects head, tail and states */
+	unsigned char		*buffer; /* LOGGER_STAGE_SIZE bytes */
+	size_t			head;	/* oldest staged entry */
+	size_t			tail;	/* writers reserve here */
+	size_t			flush_pos; /* logger_flush() cursor */
+	size_t			flush_end;
+};
+
+/*
+ * struct logger_staged - an entry in a staging buffer
+ *
+ * 'seq' is taken from log->seq right after the entry's timestamp when the
+ * entry is reserved, and entries reach the log in 'seq' order.  Writers on
+ * different cpus stamp under different locks, so two entries reserved at
+ * about the same time can still be in the log in the opposite order of
+ * their timestamps.
+ */
+struct logger_staged {
+	unsigned int		seq;	/* commit order */
+	unsigned short		size;	/* bytes used in the staging buffer */
+	unsigned short		state;	/* LOGGER_STAGED_* */
+	struct logger_entry	entry;	/* as it goes into the log */
+};
+
+enum {
+	LOGGER_STAGED_BUSY,	/* payload still being copied */
+	LOGGER_STAGED_READY,
+	LOGGER_STAGED_FAILED,	/* copy faulted, the entry is dropped */
+};
+
+/* must hold a maximal entry, flush right away past LOGGER_STAGE_FLUSH */
+#define LOGGER_STAGE_SIZE	(2 * LOGGER_ENTRY_MAX_LEN)
+#define LOGGER_STAGE_FLUSH	LOGGER_ENTRY_MAX_LEN
+/* otherwise staged entries reach the log within this many jiffies */
+#define LOGGER_FLUSH_DELAY	1
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The ring buffer and the readers
+ * are protected by the mutex 'mutex'; writers only touch their staging
+ * buffer and 'seq'.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
@@ -45,6 +95,10 @@ struct logger_log {
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_stage __percpu *stage; /* per-cpu staging buffers */
+	wait_queue_head_t	stage_wq; /* writers waiting for a stage */
+	atomic_t		seq;	/* sequence of the next entry */
+	struct delayed_work	flush_work; /* flushes what writers staged */
 };
 
 /*
@@ -57,6 +111,11 @@ struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	int			batch;	/* read() returns as many as fit */
+	size_t			wake_bytes; /* see struct logger_wakeup */
+	unsigned long		wake_timeout; /* in jiffies */
+	struct timer_list	timer;	/* runs out wake_timeout */
+	int			timed_out; /* set by timer */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -142,17 +201,41 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	return count;
 }
 
+/*
+ * reader_ready - is there enough in the log to wake up 'reader'?
+ *
+ * Caller needs to hold log->mutex.
+ */
+static int reader_ready(struct logger_log *log, struct logger_reader *reader)
+{
+	size_t avail = logger_offset(log->w_off - reader->r_off);
+
+	return avail && (avail >= reader->wake_bytes || reader->timed_out);
+}
+
+static void logger_reader_timeout(unsigned long data)
+{
+	struct logger_reader *reader = (struct logger_reader *) data;
+
+	reader->timed_out = 1;
+	wake_up_interruptible(&reader->log->wq);
+}
+
+static void logger_flush(struct logger_log *log);
+
 /*
  * logger_read - our log's read() method
  *
  * Behavior:
  *
  * 	- O_NONBLOCK works
- * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- If there are no log entries to read, blocks until log is written to,
+ * 	  or until the reader's LOGGER_SET_WAKEUP watermark is reached
+ * 	- Atomically reads exactly one log entry, or with LOGGER_SET_BATCH_READ
+ * 	  as many whole entries as fit in 'buf'
  *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN, or larger in batch mode. Will set
+ * errno to EINVAL if read buffer is insufficient to hold next entry.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
@@ -160,6 +243,7 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
 	ssize_t ret;
+	size_t copied;
 	DEFINE_WAIT(wait);
 
 start:
@@ -167,7 +251,11 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		logger_flush(log);
+		if (file->f_flags & O_NONBLOCK)
+			ret = (log->w_off == reader->r_off);
+		else
+			ret = !reader_ready(log, reader);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -204,8 +292,25 @@ start:
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	/* get exactly one entry from the log, or as many as fit */
+	copied = 0;
+	do {
+		ret = do_read_log_to_user(log, reader, buf + copied, ret);
+		if (ret < 0)
+			break;
+		copied += ret;
+		if (!reader->batch || log->w_off == reader->r_off)
+			break;
+		ret = get_entry_len(log, reader->r_off);
+	} while (ret <= count - copied);
+	if (copied)
+		ret = copied;
+
+	/* the next batch starts its own clock */
+	if (reader->wake_timeout) {
+		del_timer_sync(&reader->timer);
+		reader->timed_out = 0;
+	}
 
 out:
 	mutex_unlock(&log->mutex);
@@ -290,97 +395,245 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 
 }
 
+static inline int seq_before(unsigned int a, unsigned int b)
+{
+	return (int)(a - b) < 0;
+}
+
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * logger_flush - moves the finished entries of all staging buffers into the
+ * log in 'seq' order, and wakes up the readers once if anything was
+ * written.  An entry that is still being copied holds back every entry
+ * reserved after it, on any cpu.
  *
  * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static void logger_flush(struct logger_log *log)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	struct logger_stage *stage, *next;
+	struct logger_staged *staged, *first;
+	unsigned int limit, horizon;
+	struct logger_reader *reader;
+	int cpu, written = 0, wake = 0;
+
+	/* entries reserved from here on wait for the next flush */
+	limit = atomic_read(&log->seq);
+	horizon = limit;
+	for_each_possible_cpu(cpu) {
+		size_t off;
+
+		stage = per_cpu_ptr(log->stage, cpu);
+		spin_lock(&stage->lock);
+		for (off = stage->head; off < stage->tail; off += staged->size) {
+			staged = (void *)stage->buffer + off;
+			if (!seq_before(staged->seq, limit))
+				break;
+			if (staged->state == LOGGER_STAGED_BUSY) {
+				if (seq_before(staged->seq, horizon))
+					horizon = staged->seq;
+				break;
+			}
+		}
+		stage->flush_pos = stage->head;
+		stage->flush_end = off;
+		spin_unlock(&stage->lock);
+	}
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	/*
+	 * Entries up to flush_end are final, so they can be read without
+	 * the stage lock.  Each stage is in 'seq' order, merge them.
+	 */
+	for (;;) {
+		size_t len;
 
+		next = NULL;
+		first = NULL;
+		for_each_possible_cpu(cpu) {
+			stage = per_cpu_ptr(log->stage, cpu);
+			if (stage->flush_pos == stage->flush_end)
+				continue;
+			staged = (void *)stage->buffer + stage->flush_pos;
+			if (!seq_before(staged->seq, horizon)) {
+				stage->flush_end = stage->flush_pos;
+				continue;
+			}
+			if (!first || seq_before(staged->seq, first->seq)) {
+				first = staged;
+				next = stage;
+			}
+		}
+		if (!next)
+			break;
+		next->flush_pos += first->size;
+		if (first->state != LOGGER_STAGED_READY)
+			continue;
+
+		len = sizeof(struct logger_entry) + first->entry.len;
+		/*
+		 * Fix up any readers, pulling them forward to the first
+		 * readable entry after (what will be) the new write offset.
+		 */
+		fix_up_readers(log, len);
+		do_write_log(log, &first->entry, len);
 #ifdef CONFIG_ANDROID_LOGGER_TO_KMSG
-	pr_info("[log] %.*s%.*s\n", len, log->buffer + log->w_off, count - len, log->buffer );
+		pr_info("[log] %.*s\n", first->entry.len, first->entry.msg);
 #endif
+		written = 1;
+	}
 
-	log->w_off = logger_offset(log->w_off + count);
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stage, cpu);
+		spin_lock(&stage->lock);
+		stage->head = stage->flush_pos;
+		if (stage->head == stage->tail)
+			stage->head = stage->tail = 0;
+		spin_unlock(&stage->lock);
+	}
+	wake_up(&log->stage_wq);
 
-	return count;
+	/*
+	 * Wake up any blocked readers, but only once one of them has enough
+	 * to read.  Start the clock of readers that have to wait for more.
+	 */
+	list_for_each_entry(reader, &log->readers, list) {
+		if (reader_ready(log, reader))
+			wake = written;
+		else if (reader->wake_timeout && log->w_off != reader->r_off &&
+			 !timer_pending(&reader->timer))
+			mod_timer(&reader->timer,
+				  jiffies + reader->wake_timeout);
+	}
+	if (wake)
+		wake_up_interruptible(&log->wq);
+}
+
+static void logger_flush_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      flush_work.work);
+
+	mutex_lock(&log->mutex);
+	logger_flush(log);
+	mutex_unlock(&log->mutex);
+}
+
+static int logger_stage_room(struct logger_stage *stage, size_t size)
+{
+	return LOGGER_STAGE_SIZE - ACCESS_ONCE(stage->tail) >= size;
+}
+
+/*
+ * logger_stage_reserve - reserves 'size' bytes for a new entry of 'len'
+ * payload bytes in a staging buffer and fills in its header.  If the buffer
+ * is full we flush, and if writers ahead of us still hold the buffer up we
+ * sleep until one of them commits its entry.
+ */
+static struct logger_staged *logger_stage_reserve(struct logger_log *log,
+						  size_t size, size_t len,
+						  struct logger_stage **stagep)
+{
+	struct logger_stage *stage;
+	struct logger_staged *staged;
+	struct timespec now;
+
+	for (;;) {
+		/* any stage would do, this cpu's is the cheapest one */
+		stage = __this_cpu_ptr(log->stage);
+		spin_lock(&stage->lock);
+		if (LOGGER_STAGE_SIZE - stage->tail >= size)
+			break;
+		spin_unlock(&stage->lock);
+
+		mutex_lock(&log->mutex);
+		logger_flush(log);
+		mutex_unlock(&log->mutex);
+		wait_event(log->stage_wq, logger_stage_room(stage, size));
+	}
+
+	staged = (void *)stage->buffer + stage->tail;
+	stage->tail += size;
+	staged->size = size;
+	staged->state = LOGGER_STAGED_BUSY;
+	now = current_kernel_time();
+	staged->seq = atomic_inc_return(&log->seq) - 1;
+	spin_unlock(&stage->lock);
+
+	staged->entry.len = len;
+	staged->entry.__pad = 0;
+	staged->entry.pid = current->tgid;
+	staged->entry.tid = current->pid;
+	staged->entry.sec = now.tv_sec;
+	staged->entry.nsec = now.tv_nsec;
+
+	*stagep = stage;
+	return staged;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is built in a staging buffer without taking log->mutex and is
+ * committed to the log by a later logger_flush(), which this write either
+ * runs itself, once enough has been staged, or schedules.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
-	struct timespec now;
+	struct logger_stage *stage;
+	struct logger_staged *staged;
+	size_t len, staged_bytes;
 	ssize_t ret = 0;
 
-	now = current_kernel_time();
-
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	staged = logger_stage_reserve(log, ALIGN(sizeof(struct logger_staged) +
+					len, sizeof(int)), len, &stage);
 
 	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+		size_t seg;
 
 		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+		seg = min_t(size_t, iov->iov_len, len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		if (seg && copy_from_user(staged->entry.msg + ret,
+					  iov->iov_base, seg)) {
+			ret = -EFAULT;
+			break;
 		}
 
 		iov++;
-		ret += nr;
+		ret += seg;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_lock(&stage->lock);
+	staged->state = ret < 0 ? LOGGER_STAGED_FAILED : LOGGER_STAGED_READY;
+	staged_bytes = stage->tail - stage->head;
+	spin_unlock(&stage->lock);
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	/*
+	 * Writers waiting for room may be waiting on this entry, flush for
+	 * them right away; the flush wakes them.  Every way out of here
+	 * flushes, so one that only starts to wait now is woken as well.
+	 */
+	smp_mb();
+	if (waitqueue_active(&log->stage_wq)) {
+		mutex_lock(&log->mutex);
+		logger_flush(log);
+		mutex_unlock(&log->mutex);
+	} else if (staged_bytes >= LOGGER_STAGE_FLUSH &&
+		   mutex_trylock(&log->mutex)) {
+		logger_flush(log);
+		mutex_unlock(&log->mutex);
+	} else if (!delayed_work_pending(&log->flush_work))
+		schedule_delayed_work(&log->flush_work, LOGGER_FLUSH_DELAY);
 
 	return ret;
 }
@@ -414,6 +667,12 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		INIT_LIST_HEAD(&reader->list);
+		reader->batch = 0;
+		reader->wake_bytes = 0;
+		reader->wake_timeout = 0;
+		reader->timed_out = 0;
+		setup_timer(&reader->timer, logger_reader_timeout,
+			    (unsigned long) reader);
 
 		mutex_lock(&log->mutex);
 		reader->r_off = log->head;
@@ -436,7 +695,13 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		/* logger_flush() may arm our timer until we are off the list */
+		mutex_lock(&log->mutex);
 		list_del(&reader->list);
+		mutex_unlock(&log->mutex);
+		del_timer_sync(&reader->timer);
 		kfree(reader);
 	}
 
@@ -447,6 +712,7 @@ static int logger_release(struct inode *ignored, struct file *file)
  * logger_poll - the log's poll file operation, for poll/select/epoll
  *
  * Note we always return POLLOUT, because you can always write() to the log.
+ * POLLIN honors the reader's LOGGER_SET_WAKEUP watermark.
  * Note also that, strictly speaking, a return value of POLLIN does not
  * guarantee that the log is readable without blocking, as there is a small
  * chance that the writer can lap the reader in the interim between poll()
@@ -467,7 +733,8 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	logger_flush(log);
+	if (reader_ready(log, reader))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -481,6 +748,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	long ret = -ENOTTY;
 
 	mutex_lock(&log->mutex);
+	logger_flush(log);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -518,6 +786,36 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		log->head = log->w_off;
 		ret = 0;
 		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
+		ret = 0;
+		break;
+	case LOGGER_SET_WAKEUP: {
+		struct logger_wakeup wakeup;
+
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		if (copy_from_user(&wakeup, (void __user *) arg,
+				   sizeof(wakeup))) {
+			ret = -EFAULT;
+			break;
+		}
+		reader = file->private_data;
+		/* more than half the log could be overwritten before we wake */
+		reader->wake_bytes = min_t(size_t, wakeup.bytes, log->size / 2);
+		reader->wake_timeout = msecs_to_jiffies(wakeup.msecs);
+		del_timer_sync(&reader->timer);
+		reader->timed_out = 0;
+		ret = 0;
+		break;
+	}
 	}
 
 	mutex_unlock(&log->mutex);
@@ -552,11 +850,15 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.stage_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .stage_wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.seq = ATOMIC_INIT(0), \
+	.flush_work = __DELAYED_WORK_INITIALIZER(VAR .flush_work, \
+						 logger_flush_work), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024)
@@ -577,14 +879,39 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+static void free_log_stages(struct logger_log *log)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(log->stage, cpu)->buffer);
+	free_percpu(log->stage);
+	log->stage = NULL;
+}
+
 static int __init init_log(struct logger_log *log)
 {
-	int ret;
+	int ret, cpu;
+
+	log->stage = alloc_percpu(struct logger_stage);
+	if (unlikely(!log->stage))
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct logger_stage *stage = per_cpu_ptr(log->stage, cpu);
+
+		spin_lock_init(&stage->lock);
+		stage->buffer = kmalloc(LOGGER_STAGE_SIZE, GFP_KERNEL);
+		if (unlikely(!stage->buffer)) {
+			free_log_stages(log);
+			return -ENOMEM;
+		}
+	}
 
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		free_log_stages(log);
 		return ret;
 	}
 
@@ -39,11 +39,26 @@ struct logger_entry {
 #define LOGGER_ENTRY_MAX_PAYLOAD	\
 	(LOGGER_ENTRY_MAX_LEN - sizeof(struct logger_entry))
 
+/*
+ * struct logger_wakeup - argument of LOGGER_SET_WAKEUP
+ *
+ * A blocked reader is only woken, and poll() only reports the log readable,
+ * once 'bytes' bytes are waiting or the oldest unread entry has waited
+ * 'msecs' milliseconds.  Zero disables either condition; both zero, the
+ * default, wakes the reader for every entry.
+ */
+struct logger_wakeup {
+	__u32		bytes;	/* wake up once this much is unread */
+	__u32		msecs;	/* or once data waited this long */
+};
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 5) /* read many entries */
+#define LOGGER_SET_WAKEUP		_IOW(__LOGGERIO, 6, struct logger_wakeup)
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,15 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept in an index bucketed by oom_adj, so picking a victim
+ * only looks at the processes that may be killed at the current level.
+ * /sys/module/lowmemorykiller/parameters/stats shows how often the shrinker
+ * ran, walked the index and killed, and the time it spent doing so.
+ *
+ * /dev/lowmemorykiller reports pressure before the kills begin, see struct
+ * lowmem_event.  Each minfree threshold raises the pressure level once free
+ * memory comes within notify_margin percent of it.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +44,12 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+#include "lowmemorykiller.h"
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,6 +70,30 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Thread group leaders by oom_adj.  Maintained from fork, exit and exec and
+ * from the oom_adj writes in /proc.  lowmem_index_lock nests inside
+ * tasklist_lock and the siglock of a forking task, and outside task_lock.
+ * It also protects lowmem_deathpending.
+ */
+static struct hlist_head lowmem_index[OOM_ADJUST_MAX - OOM_DISABLE + 1];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+
+static unsigned int lowmem_notify_margin = 25;		/* percent */
+static unsigned int lowmem_notify_interval_ms = 100;
+static bool lowmem_notify_enabled;	/* the event device is registered */
+static struct lowmem_event lowmem_event;
+static unsigned long lowmem_notify_next;	/* jiffies */
+static DEFINE_SPINLOCK(lowmem_event_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_event_wait);
+
+static struct {
+	atomic_long_t calls;	/* of lowmem_shrink() */
+	atomic_long_t scans;	/* walks of the index */
+	atomic_long_t kills;
+	atomic64_t time_ns;	/* spent in lowmem_shrink() */
+} lowmem_stats;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -79,21 +118,181 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+static struct hlist_head *lowmem_bucket(int oom_adj)
+{
+	return &lowmem_index[clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX) -
+			     OOM_DISABLE];
+}
+
+/* called with tasklist_lock held for writing */
+void lowmem_index_add(struct task_struct *p)
+{
+	spin_lock(&lowmem_index_lock);
+	hlist_add_head(&p->lowmem_node, lowmem_bucket(p->signal->oom_adj));
+	spin_unlock(&lowmem_index_lock);
+}
+
+/* called with tasklist_lock held for writing */
+void lowmem_index_del(struct task_struct *p)
+{
+	spin_lock(&lowmem_index_lock);
+	hlist_del_init(&p->lowmem_node);
+	/* the victim is gone, no need to wait for the task to be freed */
+	if (p == lowmem_deathpending)
+		lowmem_deathpending = NULL;
+	spin_unlock(&lowmem_index_lock);
+}
+
+/* exec made 'new' the group leader, called with tasklist_lock held */
+void lowmem_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	spin_lock(&lowmem_index_lock);
+	if (!hlist_unhashed(&old->lowmem_node)) {
+		hlist_del_init(&old->lowmem_node);
+		hlist_add_head(&new->lowmem_node,
+			       lowmem_bucket(new->signal->oom_adj));
+	}
+	if (old == lowmem_deathpending)
+		lowmem_deathpending = new;
+	spin_unlock(&lowmem_index_lock);
+}
+
+/* the oom_adj of 'p' changed, called without task_lock */
+void lowmem_index_update(struct task_struct *p)
+{
+	read_lock(&tasklist_lock);
+	if (pid_alive(p)) {
+		p = p->group_leader;
+		spin_lock(&lowmem_index_lock);
+		if (!hlist_unhashed(&p->lowmem_node)) {
+			hlist_del(&p->lowmem_node);
+			hlist_add_head(&p->lowmem_node,
+				       lowmem_bucket(p->signal->oom_adj));
+		}
+		spin_unlock(&lowmem_index_lock);
+	}
+	read_unlock(&tasklist_lock);
+}
+
+static int lowmem_stats_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "calls %ld\nscans %ld\nkills %ld\n"
+		       "time_ns %lld",
+		       atomic_long_read(&lowmem_stats.calls),
+		       atomic_long_read(&lowmem_stats.scans),
+		       atomic_long_read(&lowmem_stats.kills),
+		       (long long)atomic64_read(&lowmem_stats.time_ns));
+}
+
+static struct kernel_param_ops lowmem_stats_ops = {
+	.get = lowmem_stats_get,
+};
+
+/*
+ * lowmem_notify - grades the pressure that lowmem_shrink() sees against the
+ * minfree thresholds, and posts a new event if it changed.
+ */
+static void lowmem_notify_recheck(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_notify_work, lowmem_notify_recheck);
+
+static void lowmem_notify(int other_free, int other_file, int array_size)
+{
+	int i, level = 0, adj = OOM_ADJUST_MAX + 1, killing = 0;
+	unsigned long flags;
+
+	if (!lowmem_notify_enabled)
+		return;
+
+	/* the level comes from the first threshold within its margin */
+	for (i = 0; i < array_size; i++) {
+		size_t minfree = lowmem_minfree[i];
+		size_t warn = minfree + minfree * lowmem_notify_margin / 100;
+
+		if (other_free < warn && other_file < warn) {
+			level = array_size - i;
+			adj = lowmem_adj[i];
+			break;
+		}
+	}
+	/*
+	 * and what gets killed from the first one actually crossed, the
+	 * same one lowmem_shrink() picks, which can be a later one
+	 */
+	for (; level && i < array_size; i++) {
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i]) {
+			adj = lowmem_adj[i];
+			killing = 1;
+			break;
+		}
+	}
+
+	if (level != lowmem_event.level || killing != lowmem_event.killing) {
+		spin_lock_irqsave(&lowmem_event_lock, flags);
+		if ((level != lowmem_event.level ||
+		     killing != lowmem_event.killing) &&
+		    time_after_eq(jiffies, lowmem_notify_next)) {
+			lowmem_event.seq++;
+			lowmem_event.level = level;
+			lowmem_event.adj = adj;
+			lowmem_event.killing = killing;
+			lowmem_event.free_pages = other_free;
+			lowmem_event.file_pages = other_file;
+			lowmem_notify_next = jiffies +
+				msecs_to_jiffies(lowmem_notify_interval_ms);
+			lowmem_print(3, "lowmem_notify level %d, adj %d%s\n",
+				     level, adj, killing ? ", killing" : "");
+			wake_up_interruptible(&lowmem_event_wait);
+		}
+		spin_unlock_irqrestore(&lowmem_event_lock, flags);
+	}
+
+	/*
+	 * Reclaim stops calling us once pressure eases, and a rate limited
+	 * change is still due, so look again until things are back to
+	 * normal and reported as such.
+	 */
+	if (level || lowmem_event.level)
+		schedule_delayed_work(&lowmem_notify_work,
+			max(1UL, msecs_to_jiffies(lowmem_notify_interval_ms)));
+}
+
+static void lowmem_notify_recheck(struct work_struct *work)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	lowmem_notify(global_page_state(NR_FREE_PAGES),
+		      global_page_state(NR_FILE_PAGES) -
+		      global_page_state(NR_SHMEM), array_size);
+}
+
+static int __lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
 	struct task_struct *p;
+	struct hlist_node *node;
 	struct task_struct *selected = NULL;
 	int rem = 0;
 	int tasksize;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
+	int oom_adj;
 	int selected_tasksize = 0;
-	int selected_oom_adj;
+	int selected_oom_adj = 0;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
 
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	lowmem_notify(other_free, other_file, array_size);
+
 	/*
 	 * If we already have a death outstanding, then
 	 * bail out right away; indicating to vmscan
@@ -105,10 +304,6 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	    time_before_eq(jiffies, lowmem_deathpending_timeout))
 		return 0;
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
@@ -129,50 +324,62 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
+	/*
+	 * tasklist_lock keeps the victim hashed, and its sighand around,
+	 * until force_sig() is done with it.
+	 */
 	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
+	spin_lock(&lowmem_index_lock);
+
+	/* another shrinker may have picked a victim meanwhile */
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		spin_unlock(&lowmem_index_lock);
+		read_unlock(&tasklist_lock);
+		return 0;
+	}
+
+	/* the largest process of the highest non-empty bucket */
+	atomic_long_inc(&lowmem_stats.scans);
+	for (oom_adj = OOM_ADJUST_MAX; oom_adj >= min_adj && !selected;
+	     oom_adj--) {
+		hlist_for_each_entry(p, node, lowmem_bucket(oom_adj),
+				     lowmem_node) {
+			struct mm_struct *mm;
+
+			task_lock(p);
+			mm = p->mm;
+			if (!mm) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
 			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+			if (tasksize <= 0)
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			if (selected && tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", p->pid, p->comm, oom_adj,
+				     tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
+	if (selected) {
+		lowmem_deathpending = selected;
+		lowmem_deathpending_timeout = jiffies + HZ;
+	}
+	spin_unlock(&lowmem_index_lock);
+
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
 		force_sig(SIGKILL, selected);
+		atomic_long_inc(&lowmem_stats.kills);
 		rem -= selected_tasksize;
 	}
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
@@ -181,13 +388,95 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	return rem;
 }
 
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	u64 start = local_clock();
+	int rem;
+
+	rem = __lowmem_shrink(s, sc);
+	atomic_long_inc(&lowmem_stats.calls);
+	atomic64_add(local_clock() - start, &lowmem_stats.time_ns);
+	return rem;
+}
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+/* a reader's private_data is the seq of the last event it read */
+static int lowmem_event_open(struct inode *inode, struct file *file)
+{
+	nonseekable_open(inode, file);
+	file->private_data = (void *)(unsigned long)(lowmem_event.seq - 1);
+	return 0;
+}
+
+static int lowmem_event_pending(struct file *file)
+{
+	return (unsigned long)file->private_data !=
+		ACCESS_ONCE(lowmem_event.seq);
+}
+
+static ssize_t lowmem_event_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *pos)
+{
+	struct lowmem_event event;
+	unsigned long flags;
+	int ret;
+
+	if (count < sizeof(event))
+		return -EINVAL;
+
+	if (!lowmem_event_pending(file)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(lowmem_event_wait,
+					       lowmem_event_pending(file));
+		if (ret)
+			return ret;
+	}
+
+	spin_lock_irqsave(&lowmem_event_lock, flags);
+	event = lowmem_event;
+	spin_unlock_irqrestore(&lowmem_event_lock, flags);
+
+	if (copy_to_user(buf, &event, sizeof(event)))
+		return -EFAULT;
+	file->private_data = (void *)(unsigned long)event.seq;
+	return sizeof(event);
+}
+
+static unsigned int lowmem_event_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_event_wait, wait);
+	return lowmem_event_pending(file) ? POLLIN | POLLRDNORM : 0;
+}
+
+static const struct file_operations lowmem_event_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_event_open,
+	.read = lowmem_event_read,
+	.poll = lowmem_event_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_event_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmemorykiller",
+	.fops = &lowmem_event_fops,
+};
+
 static int __init lowmem_init(void)
 {
+	int ret;
+
+	ret = misc_register(&lowmem_event_dev);
+	if (ret)
+		printk(KERN_ERR "lowmemorykiller: failed to register "
+		       "misc device, no pressure events\n");
+	else
+		lowmem_notify_enabled = true;
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
@@ -197,6 +486,9 @@ static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
+	cancel_delayed_work_sync(&lowmem_notify_work);
+	if (lowmem_notify_enabled)
+		misc_deregister(&lowmem_event_dev);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -205,6 +497,11 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_cb(stats, &lowmem_stats_ops, NULL, S_IRUGO);
+module_param_named(notify_margin, lowmem_notify_margin, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(notify_interval_ms, lowmem_notify_interval_ms, uint,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
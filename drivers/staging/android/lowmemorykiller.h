@@ -0,0 +1,41 @@
+/* drivers/staging/android/lowmemorykiller.h
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef _LINUX_LOWMEMORYKILLER_H
+#define _LINUX_LOWMEMORYKILLER_H
+
+#include <linux/types.h>
+
+/*
+ * struct lowmem_event - what a read() of /dev/lowmemorykiller returns
+ *
+ * 'level' counts the minfree thresholds that free memory has come within
+ * notify_margin percent of, 0 meaning no pressure and the number of
+ * thresholds the worst.  Processes at 'adj' and above are killed once
+ * free memory drops below that threshold itself, and 'killing' says it
+ * already has.  A read blocks until the level changes; poll() reports
+ * POLLIN when it has.  Changes are reported at most every
+ * notify_interval_ms milliseconds.
+ */
+struct lowmem_event {
+	__u32		seq;		/* bumped for every change */
+	__u32		level;		/* of pressure, 0 = none */
+	__s32		adj;		/* lowest oom_adj at risk */
+	__u32		killing;	/* kills at 'adj' have begun */
+	__u32		free_pages;	/* as lowmemorykiller counts them */
+	__u32		file_pages;
+};
+
+#endif /* _LINUX_LOWMEMORYKILLER_H */
@@ -6,10 +6,11 @@
  *
  * Zcache provides an in-kernel "host implementation" for transcendent memory
  * and, thus indirectly, for cleancache and frontswap.  Zcache includes two
- * page-accessible memory [1] interfaces, both utilizing lzo1x compression:
+ * page-accessible memory [1] interfaces, both utilizing compression through
+ * the crypto API (lzo1x unless another compressor is selected):
  * 1) "compression buddies" ("zbud") is used for ephemeral pages
- * 2) xvmalloc is used for persistent pages.
- * Xvmalloc (based on the TLSF allocator) has very low fragmentation
+ * 2) zsmalloc is used for persistent pages.
+ * Zsmalloc packs objects of similar size densely into small groups of pages
  * so maximizes space efficiency, while zbud allows pairs (and potentially,
  * in the future, more than a pair of) compressed pages to be closely linked
  * so that reclaiming can be done via the kernel's physical-page-oriented
@@ -23,7 +24,9 @@
 #include <linux/cpu.h>
 #include <linux/highmem.h>
 #include <linux/list.h>
-#include <linux/lzo.h>
+#include <linux/crypto.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
@@ -31,7 +34,7 @@
 #include <linux/math64.h>
 #include "tmem.h"
 
-#include "../zram/xvmalloc.h" /* if built in drivers/staging */
+#include "../zsmalloc/zsmalloc.h" /* if built in drivers/staging */
 
 #if (!defined(CONFIG_CLEANCACHE) && !defined(CONFIG_FRONTSWAP))
 #error "zcache is useless without CONFIG_CLEANCACHE or CONFIG_FRONTSWAP"
@@ -60,7 +63,7 @@ MODULE_LICENSE("GPL");
 
 struct zcache_client {
 	struct tmem_pool *tmem_pools[MAX_POOLS_PER_CLIENT];
-	struct xv_pool *xvpool;
+	struct zs_pool *zspool;
 	bool allocated;
 	atomic_t refcount;
 };
@@ -81,6 +84,37 @@ static inline bool is_local_client(struct zcache_client *cli)
 	return cli == &zcache_host;
 }
 
+/*
+ * Compressors: the crypto API compression algorithm for new pages can be
+ * changed at runtime through sysfs.  Each stored page records the index
+ * of the one that compressed it, and a compressor, once added, is never
+ * removed, so pages stored under a previous choice remain readable.
+ */
+
+#define ZCACHE_MAX_COMPS 8
+
+struct zcache_comp_stats {
+	u64 compress;		/* pages compressed */
+	u64 compress_ns;
+	u64 zbytes;		/* compressed size of those pages */
+	u64 decompress;		/* pages decompressed */
+	u64 decompress_ns;
+};
+
+struct zcache_comp {
+	char name[CRYPTO_MAX_ALG_NAME];
+	struct crypto_comp * __percpu *tfm;
+	struct zcache_comp_stats __percpu *stats;
+};
+
+static struct zcache_comp zcache_comps[ZCACHE_MAX_COMPS];
+static unsigned int zcache_nr_comps;
+static unsigned int zcache_comp_cur;	/* for new pages */
+static DEFINE_MUTEX(zcache_comp_mutex);	/* serializes changes */
+
+static void zcache_decompress(unsigned int comp, char *from_va,
+			      unsigned size, struct page *page);
+
 /**********
  * Compression buddies ("zbud") provides for packing two (or, possibly
  * in the future, more) compressed ephemeral pages into a single "raw"
@@ -109,12 +143,14 @@ struct zbud_hdr {
 	struct tmem_oid oid;
 	uint32_t index;
 	uint16_t size; /* compressed size in bytes, zero means unused */
+	uint16_t comp; /* index in zcache_comps[] of the compressor */
 	DECL_SENTINEL
 };
 
 struct zbud_page {
 	struct list_head bud_list;
 	spinlock_t lock;
+	uint16_t shard; /* index in zbud_shards[] of the lists it is on */
 	struct zbud_hdr buddy[ZBUD_MAX_BUDS];
 	DECL_SENTINEL
 	/* followed by NUM_CHUNK aligned CHUNK_SIZE-byte chunks */
@@ -127,25 +163,56 @@ struct zbud_page {
 				CHUNK_MASK) >> CHUNK_SHIFT)
 #define MAX_CHUNK	(NCHUNKS-1)
 
-static struct {
-	struct list_head list;
-	unsigned count;
-} zbud_unbuddied[NCHUNKS];
-/* list N contains pages with N chunks USED and NCHUNKS-N unused */
-/* element 0 is never used but optimizing that isn't worth it */
+/*
+ * The buddied and unbuddied lists are split into shards, each with its
+ * own lock, so that cpus putting and flushing pages concurrently don't
+ * all serialize on one lock.  A cpu adds new zbpgs to the shard it maps
+ * to and looks for a buddy there first; a zbpg stays on its shard's
+ * lists until it is freed.  Eviction walks all shards in turn.
+ */
+#define ZBUD_NR_SHARDS	8
+
+struct zbud_shard {
+	spinlock_t lock;	/* protects the lists and counts below */
+	struct list_head buddied_list;
+	unsigned long buddied_count;
+	struct {
+		struct list_head list;
+		unsigned long count;
+	} unbuddied[NCHUNKS];
+	/* list N contains pages with N chunks USED and NCHUNKS-N unused */
+	/* element 0 is never used but optimizing that isn't worth it */
+	unsigned long acquired;		/* times the lock was taken */
+	unsigned long contended;	/* ... of which it was already held */
+} ____cacheline_aligned_in_smp;
+
+static struct zbud_shard zbud_shards[ZBUD_NR_SHARDS];
+static atomic_t zbud_evict_shard;	/* where the next eviction starts */
+
 static unsigned long zbud_cumul_chunk_counts[NCHUNKS];
 
-struct list_head zbud_buddied_list;
-static unsigned long zcache_zbud_buddied_count;
+/*
+ * Pages with no zbuds are kept in a small per-cpu cache, so that a cpu
+ * which just freed a zbpg can reuse it without taking any shared lock;
+ * the caches overflow into, and refill from, the global unused list.
+ * The per-cpu locks are only ever contended by eviction.
+ */
+#define ZBUD_UNUSED_CACHE_MAX	8
 
-/* protects the buddied list and all unbuddied lists */
-static DEFINE_SPINLOCK(zbud_budlists_spinlock);
+struct zbud_unused_list {
+	spinlock_t lock;
+	struct list_head list;
+	unsigned count;
+};
 
-static LIST_HEAD(zbpg_unused_list);
-static unsigned long zcache_zbpg_unused_list_count;
+static struct zbud_unused_list zbpg_unused = {
+	.lock = __SPIN_LOCK_UNLOCKED(zbpg_unused.lock),
+	.list = LIST_HEAD_INIT(zbpg_unused.list),
+};
+static DEFINE_PER_CPU(struct zbud_unused_list, zbpg_unused_caches);
 
-/* protects the unused page list */
-static DEFINE_SPINLOCK(zbpg_unused_list_spinlock);
+/* pages on the unused list and in all per-cpu caches */
+static atomic_t zcache_zbpg_unused_list_count;
 
 static atomic_t zcache_zbud_curr_raw_pages;
 static atomic_t zcache_zbud_curr_zpages;
@@ -214,23 +281,52 @@ static char *zbud_data(struct zbud_hdr *zh, unsigned size)
  * zbud raw page management
  */
 
-static struct zbud_page *zbud_alloc_raw_page(void)
+static inline struct zbud_shard *zbud_local_shard(void)
+{
+	return &zbud_shards[smp_processor_id() & (ZBUD_NR_SHARDS - 1)];
+}
+
+static inline void zbud_shard_lock(struct zbud_shard *shard)
+{
+	if (!spin_trylock(&shard->lock)) {
+		spin_lock(&shard->lock);
+		shard->contended++;
+	}
+	shard->acquired++;
+}
+
+/*
+ * zbud raw page management
+ */
+
+static struct zbud_page *zbud_unused_get(struct zbud_unused_list *ul)
 {
 	struct zbud_page *zbpg = NULL;
-	struct zbud_hdr *zh0, *zh1;
-	bool recycled = 0;
 
-	/* if any pages on the zbpg list, use one */
-	spin_lock(&zbpg_unused_list_spinlock);
-	if (!list_empty(&zbpg_unused_list)) {
-		zbpg = list_first_entry(&zbpg_unused_list,
-				struct zbud_page, bud_list);
+	spin_lock(&ul->lock);
+	if (!list_empty(&ul->list)) {
+		zbpg = list_first_entry(&ul->list, struct zbud_page, bud_list);
 		list_del_init(&zbpg->bud_list);
-		zcache_zbpg_unused_list_count--;
-		recycled = 1;
+		ul->count--;
 	}
-	spin_unlock(&zbpg_unused_list_spinlock);
+	spin_unlock(&ul->lock);
+	return zbpg;
+}
+
+static struct zbud_page *zbud_alloc_raw_page(void)
+{
+	struct zbud_page *zbpg;
+	struct zbud_hdr *zh0, *zh1;
+	bool recycled = 0;
+
+	/* if any pages in this cpu's cache or on the zbpg list, use one */
+	zbpg = zbud_unused_get(&__get_cpu_var(zbpg_unused_caches));
 	if (zbpg == NULL)
+		zbpg = zbud_unused_get(&zbpg_unused);
+	if (zbpg != NULL) {
+		atomic_dec(&zcache_zbpg_unused_list_count);
+		recycled = 1;
+	} else
 		/* none on zbpg list, try to get a kernel page */
 		zbpg = zcache_get_free_page();
 	if (likely(zbpg != NULL)) {
@@ -257,6 +353,7 @@ static struct zbud_page *zbud_alloc_raw_page(void)
 static void zbud_free_raw_page(struct zbud_page *zbpg)
 {
 	struct zbud_hdr *zh0 = &zbpg->buddy[0], *zh1 = &zbpg->buddy[1];
+	struct zbud_unused_list *ul = &__get_cpu_var(zbpg_unused_caches);
 
 	ASSERT_SENTINEL(zbpg, ZBPG);
 	BUG_ON(!list_empty(&zbpg->bud_list));
@@ -265,10 +362,19 @@ static void zbud_free_raw_page(struct zbud_page *zbpg)
 	BUG_ON(zh1->size != 0 || tmem_oid_valid(&zh1->oid));
 	INVERT_SENTINEL(zbpg, ZBPG);
 	spin_unlock(&zbpg->lock);
-	spin_lock(&zbpg_unused_list_spinlock);
-	list_add(&zbpg->bud_list, &zbpg_unused_list);
-	zcache_zbpg_unused_list_count++;
-	spin_unlock(&zbpg_unused_list_spinlock);
+	atomic_inc(&zcache_zbpg_unused_list_count);
+	spin_lock(&ul->lock);
+	if (ul->count < ZBUD_UNUSED_CACHE_MAX) {
+		list_add(&zbpg->bud_list, &ul->list);
+		ul->count++;
+		spin_unlock(&ul->lock);
+		return;
+	}
+	spin_unlock(&ul->lock);
+	spin_lock(&zbpg_unused.lock);
+	list_add(&zbpg->bud_list, &zbpg_unused.list);
+	zbpg_unused.count++;
+	spin_unlock(&zbpg_unused.lock);
 }
 
 /*
@@ -298,6 +404,7 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 	unsigned budnum = zbud_budnum(zh), size;
 	struct zbud_page *zbpg =
 		container_of(zh, struct zbud_page, buddy[budnum]);
+	struct zbud_shard *shard;
 
 	spin_lock(&zbpg->lock);
 	if (list_empty(&zbpg->bud_list)) {
@@ -307,23 +414,24 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 	}
 	size = zbud_free(zh);
 	ASSERT_SPINLOCK(&zbpg->lock);
+	shard = &zbud_shards[zbpg->shard];
 	zh_other = &zbpg->buddy[(budnum == 0) ? 1 : 0];
 	if (zh_other->size == 0) { /* was unbuddied: unlist and free */
 		chunks = zbud_size_to_chunks(size) ;
-		spin_lock(&zbud_budlists_spinlock);
-		BUG_ON(list_empty(&zbud_unbuddied[chunks].list));
+		zbud_shard_lock(shard);
+		BUG_ON(list_empty(&shard->unbuddied[chunks].list));
 		list_del_init(&zbpg->bud_list);
-		zbud_unbuddied[chunks].count--;
-		spin_unlock(&zbud_budlists_spinlock);
+		shard->unbuddied[chunks].count--;
+		spin_unlock(&shard->lock);
 		zbud_free_raw_page(zbpg);
 	} else { /* was buddied: move remaining buddy to unbuddied list */
 		chunks = zbud_size_to_chunks(zh_other->size) ;
-		spin_lock(&zbud_budlists_spinlock);
+		zbud_shard_lock(shard);
 		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
-		list_add_tail(&zbpg->bud_list, &zbud_unbuddied[chunks].list);
-		zbud_unbuddied[chunks].count++;
-		spin_unlock(&zbud_budlists_spinlock);
+		shard->buddied_count--;
+		list_add_tail(&zbpg->bud_list, &shard->unbuddied[chunks].list);
+		shard->unbuddied[chunks].count++;
+		spin_unlock(&shard->lock);
 		spin_unlock(&zbpg->lock);
 	}
 }
@@ -331,37 +439,38 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 static struct zbud_hdr *zbud_create(uint16_t client_id, uint16_t pool_id,
 					struct tmem_oid *oid,
 					uint32_t index, struct page *page,
-					void *cdata, unsigned size)
+					void *cdata, unsigned size,
+					unsigned int comp)
 {
 	struct zbud_hdr *zh0, *zh1, *zh = NULL;
-	struct zbud_page *zbpg = NULL, *ztmp;
+	struct zbud_page *zbpg = NULL;
+	struct zbud_shard *shard = zbud_local_shard();
 	unsigned nchunks;
 	char *to;
 	int i, found_good_buddy = 0;
 
 	nchunks = zbud_size_to_chunks(size) ;
+	/* only the local shard is searched, to keep its lock cpu-local */
+	zbud_shard_lock(shard);
 	for (i = MAX_CHUNK - nchunks + 1; i > 0; i--) {
-		spin_lock(&zbud_budlists_spinlock);
-		if (!list_empty(&zbud_unbuddied[i].list)) {
-			list_for_each_entry_safe(zbpg, ztmp,
-				    &zbud_unbuddied[i].list, bud_list) {
-				if (spin_trylock(&zbpg->lock)) {
-					found_good_buddy = i;
-					goto found_unbuddied;
-				}
+		list_for_each_entry(zbpg, &shard->unbuddied[i].list, bud_list) {
+			if (spin_trylock(&zbpg->lock)) {
+				found_good_buddy = i;
+				goto found_unbuddied;
 			}
 		}
-		spin_unlock(&zbud_budlists_spinlock);
 	}
+	spin_unlock(&shard->lock);
 	/* didn't find a good buddy, try allocating a new page */
 	zbpg = zbud_alloc_raw_page();
 	if (unlikely(zbpg == NULL))
 		goto out;
 	/* ok, have a page, now compress the data before taking locks */
 	spin_lock(&zbpg->lock);
-	spin_lock(&zbud_budlists_spinlock);
-	list_add_tail(&zbpg->bud_list, &zbud_unbuddied[nchunks].list);
-	zbud_unbuddied[nchunks].count++;
+	zbud_shard_lock(shard);
+	zbpg->shard = shard - zbud_shards;
+	list_add_tail(&zbpg->bud_list, &shard->unbuddied[nchunks].list);
+	shard->unbuddied[nchunks].count++;
 	zh = &zbpg->buddy[0];
 	goto init_zh;
 
@@ -378,19 +487,20 @@ found_unbuddied:
 	} else
 		BUG();
 	list_del_init(&zbpg->bud_list);
-	zbud_unbuddied[found_good_buddy].count--;
-	list_add_tail(&zbpg->bud_list, &zbud_buddied_list);
-	zcache_zbud_buddied_count++;
+	shard->unbuddied[found_good_buddy].count--;
+	list_add_tail(&zbpg->bud_list, &shard->buddied_list);
+	shard->buddied_count++;
 
 init_zh:
 	SET_SENTINEL(zh, ZBH);
 	zh->size = size;
+	zh->comp = comp;
 	zh->index = index;
 	zh->oid = *oid;
 	zh->pool_id = pool_id;
 	zh->client_id = client_id;
 	/* can wait to copy the data until the list locks are dropped */
-	spin_unlock(&zbud_budlists_spinlock);
+	spin_unlock(&shard->lock);
 
 	to = zbud_data(zh, size);
 	memcpy(to, cdata, size);
@@ -408,8 +518,7 @@ static int zbud_decompress(struct page *page, struct zbud_hdr *zh)
 {
 	struct zbud_page *zbpg;
 	unsigned budnum = zbud_budnum(zh);
-	size_t out_len = PAGE_SIZE;
-	char *to_va, *from_va;
+	char *from_va;
 	unsigned size;
 	int ret = 0;
 
@@ -422,13 +531,9 @@ static int zbud_decompress(struct page *page, struct zbud_hdr *zh)
 	}
 	ASSERT_SENTINEL(zh, ZBH);
 	BUG_ON(zh->size == 0 || zh->size > zbud_max_buddy_size());
-	to_va = kmap_atomic(page, KM_USER0);
 	size = zh->size;
 	from_va = zbud_data(zh, size);
-	ret = lzo1x_decompress_safe(from_va, size, to_va, &out_len);
-	BUG_ON(ret != LZO_E_OK);
-	BUG_ON(out_len != PAGE_SIZE);
-	kunmap_atomic(to_va, KM_USER0);
+	zcache_decompress(zh->comp, from_va, size, page);
 out:
 	spin_unlock(&zbpg->lock);
 	return ret;
@@ -481,102 +586,157 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
 		}
 	}
 	ASSERT_SENTINEL(zbpg, ZBPG);
+	/* wait out anyone who found the zombie before giving it back */
 	spin_lock(&zbpg->lock);
-	zbud_free_raw_page(zbpg);
+	INVERT_SENTINEL(zbpg, ZBPG);
+	spin_unlock(&zbpg->lock);
+	atomic_dec(&zcache_zbud_curr_raw_pages);
+	zcache_free_page(zbpg);
 }
 
 /*
- * Free nr pages.  This code is funky because we want to hold the locks
- * protecting various lists for as short a time as possible, and in some
- * circumstances the list may change asynchronously when the list lock is
- * not held.  In some cases we also trylock not only to avoid waiting on a
- * page in use by another cpu, but also to avoid potential deadlock due to
- * lock inversion.
+ * Free up to nr pages from an unused list, returning how many were freed.
+ * The list is not walked, since it may change whenever it is unlocked.
  */
-static void zbud_evict_pages(int nr)
+static int zbud_free_unused(struct zbud_unused_list *ul, int nr)
 {
 	struct zbud_page *zbpg;
-	int i;
+	int freed = 0;
 
-	/* first try freeing any pages on unused list */
-retry_unused_list:
-	spin_lock_bh(&zbpg_unused_list_spinlock);
-	if (!list_empty(&zbpg_unused_list)) {
-		/* can't walk list here, since it may change when unlocked */
-		zbpg = list_first_entry(&zbpg_unused_list,
-				struct zbud_page, bud_list);
+	while (freed < nr) {
+		spin_lock_bh(&ul->lock);
+		if (list_empty(&ul->list)) {
+			spin_unlock_bh(&ul->lock);
+			break;
+		}
+		zbpg = list_first_entry(&ul->list, struct zbud_page, bud_list);
 		list_del_init(&zbpg->bud_list);
-		zcache_zbpg_unused_list_count--;
+		ul->count--;
+		spin_unlock_bh(&ul->lock);
+		atomic_dec(&zcache_zbpg_unused_list_count);
 		atomic_dec(&zcache_zbud_curr_raw_pages);
-		spin_unlock_bh(&zbpg_unused_list_spinlock);
 		zcache_free_page(zbpg);
 		zcache_evicted_raw_pages++;
-		if (--nr <= 0)
-			goto out;
-		goto retry_unused_list;
+		freed++;
 	}
-	spin_unlock_bh(&zbpg_unused_list_spinlock);
+	return freed;
+}
 
-	/* now try freeing unbuddied pages, starting with least space avail */
-	for (i = 0; i < MAX_CHUNK; i++) {
-retry_unbud_list_i:
-		spin_lock_bh(&zbud_budlists_spinlock);
-		if (list_empty(&zbud_unbuddied[i].list)) {
-			spin_unlock_bh(&zbud_budlists_spinlock);
-			continue;
-		}
-		list_for_each_entry(zbpg, &zbud_unbuddied[i].list, bud_list) {
+#define ZBUD_EVICT_BATCH	16
+
+/*
+ * Evict up to nr zbpgs from one of a shard's lists, a batch at a time:
+ * each batch is taken off the list under the shard lock, which is then
+ * dropped while the zbuds are flushed from tmem, so that puts and flushes
+ * on the shard only ever wait for one list walk.  A zbpg that is off its
+ * list but not yet freed is a "zombie", which all other paths ignore.
+ * Returns the number of zbpgs evicted.
+ */
+static int zbud_evict_list(struct zbud_shard *shard, struct list_head *list,
+			   unsigned long *count, int nr)
+{
+	struct zbud_page *zbpg, *ztmp, *batch[ZBUD_EVICT_BATCH];
+	int i, n, evicted = 0;
+
+	do {
+		n = 0;
+		local_bh_disable();
+		zbud_shard_lock(shard);
+		list_for_each_entry_safe(zbpg, ztmp, list, bud_list) {
+			/* trylock, as the zbpg lock nests outside the shard's */
 			if (unlikely(!spin_trylock(&zbpg->lock)))
 				continue;
 			list_del_init(&zbpg->bud_list);
-			zbud_unbuddied[i].count--;
-			spin_unlock(&zbud_budlists_spinlock);
-			zcache_evicted_unbuddied_pages++;
-			/* want budlists unlocked when doing zbpg eviction */
-			zbud_evict_zbpg(zbpg);
-			local_bh_enable();
-			if (--nr <= 0)
+			(*count)--;
+			spin_unlock(&zbpg->lock);
+			batch[n++] = zbpg;
+			if (n == ZBUD_EVICT_BATCH || evicted + n >= nr)
+				break;
+		}
+		spin_unlock(&shard->lock);
+		/* want the shard unlocked when doing zbpg eviction */
+		for (i = 0; i < n; i++) {
+			spin_lock(&batch[i]->lock);
+			zbud_evict_zbpg(batch[i]);
+		}
+		local_bh_enable();
+		evicted += n;
+	} while (n == ZBUD_EVICT_BATCH && evicted < nr);
+	return evicted;
+}
+
+/*
+ * Free nr pages: first unused ones, then unbuddied ones starting with the
+ * least space used, then buddied ones.  Each list is drained across all
+ * shards before moving on to the next, starting from a different shard
+ * each time so that no shard is always evicted first.
+ */
+static void zbud_evict_pages(int nr)
+{
+	struct zbud_shard *shard;
+	int cpu, i, n, start, evicted;
+
+	/* first try freeing any pages on unused list or per-cpu caches */
+	nr -= zbud_free_unused(&zbpg_unused, nr);
+	for_each_possible_cpu(cpu) {
+		if (nr <= 0)
+			goto out;
+		nr -= zbud_free_unused(&per_cpu(zbpg_unused_caches, cpu), nr);
+	}
+
+	start = atomic_inc_return(&zbud_evict_shard);
+
+	/* now try freeing unbuddied pages, starting with least space avail */
+	for (i = 0; i < MAX_CHUNK; i++) {
+		for (n = 0; n < ZBUD_NR_SHARDS; n++) {
+			if (nr <= 0)
 				goto out;
-			goto retry_unbud_list_i;
+			shard = &zbud_shards[(start + n) & (ZBUD_NR_SHARDS - 1)];
+			if (list_empty(&shard->unbuddied[i].list))
+				continue;
+			evicted = zbud_evict_list(shard,
+					&shard->unbuddied[i].list,
+					&shard->unbuddied[i].count, nr);
+			zcache_evicted_unbuddied_pages += evicted;
+			nr -= evicted;
 		}
-		spin_unlock_bh(&zbud_budlists_spinlock);
 	}
 
 	/* as a last resort, free buddied pages */
-retry_bud_list:
-	spin_lock_bh(&zbud_budlists_spinlock);
-	if (list_empty(&zbud_buddied_list)) {
-		spin_unlock_bh(&zbud_budlists_spinlock);
-		goto out;
-	}
-	list_for_each_entry(zbpg, &zbud_buddied_list, bud_list) {
-		if (unlikely(!spin_trylock(&zbpg->lock)))
-			continue;
-		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
-		spin_unlock(&zbud_budlists_spinlock);
-		zcache_evicted_buddied_pages++;
-		/* want budlists unlocked when doing zbpg eviction */
-		zbud_evict_zbpg(zbpg);
-		local_bh_enable();
-		if (--nr <= 0)
+	for (n = 0; n < ZBUD_NR_SHARDS; n++) {
+		if (nr <= 0)
 			goto out;
-		goto retry_bud_list;
+		shard = &zbud_shards[(start + n) & (ZBUD_NR_SHARDS - 1)];
+		evicted = zbud_evict_list(shard, &shard->buddied_list,
+					  &shard->buddied_count, nr);
+		zcache_evicted_buddied_pages += evicted;
+		nr -= evicted;
 	}
-	spin_unlock_bh(&zbud_budlists_spinlock);
 out:
 	return;
 }
 
 static void zbud_init(void)
 {
-	int i;
-
-	INIT_LIST_HEAD(&zbud_buddied_list);
-	zcache_zbud_buddied_count = 0;
-	for (i = 0; i < NCHUNKS; i++) {
-		INIT_LIST_HEAD(&zbud_unbuddied[i].list);
-		zbud_unbuddied[i].count = 0;
+	struct zbud_shard *shard;
+	struct zbud_unused_list *ul;
+	int cpu, i, n;
+
+	for (n = 0; n < ZBUD_NR_SHARDS; n++) {
+		shard = &zbud_shards[n];
+		spin_lock_init(&shard->lock);
+		INIT_LIST_HEAD(&shard->buddied_list);
+		shard->buddied_count = 0;
+		for (i = 0; i < NCHUNKS; i++) {
+			INIT_LIST_HEAD(&shard->unbuddied[i].list);
+			shard->unbuddied[i].count = 0;
+		}
+	}
+	for_each_possible_cpu(cpu) {
+		ul = &per_cpu(zbpg_unused_caches, cpu);
+		spin_lock_init(&ul->lock);
+		INIT_LIST_HEAD(&ul->list);
+		ul->count = 0;
 	}
 }
 
@@ -588,11 +748,48 @@ static void zbud_init(void)
  */
 static int zbud_show_unbuddied_list_counts(char *buf)
 {
-	int i;
+	unsigned long count;
+	int i, n;
 	char *p = buf;
 
-	for (i = 0; i < NCHUNKS; i++)
-		p += sprintf(p, "%u ", zbud_unbuddied[i].count);
+	for (i = 0; i < NCHUNKS; i++) {
+		for (count = 0, n = 0; n < ZBUD_NR_SHARDS; n++)
+			count += zbud_shards[n].unbuddied[i].count;
+		p += sprintf(p, "%lu ", count);
+	}
+	return p - buf;
+}
+
+static int zbud_show_buddied_count(char *buf)
+{
+	unsigned long count = 0;
+	int n;
+
+	for (n = 0; n < ZBUD_NR_SHARDS; n++)
+		count += zbud_shards[n].buddied_count;
+	return sprintf(buf, "%lu\n", count);
+}
+
+/*
+ * One line per shard: its buddied and unbuddied page counts, how often
+ * its lock was taken, and how often that found the lock already held.
+ */
+static int zbud_show_shard_stats(char *buf)
+{
+	struct zbud_shard *shard;
+	unsigned long unbuddied;
+	int i, n;
+	char *p = buf;
+
+	for (n = 0; n < ZBUD_NR_SHARDS; n++) {
+		shard = &zbud_shards[n];
+		for (unbuddied = 0, i = 0; i < NCHUNKS; i++)
+			unbuddied += shard->unbuddied[i].count;
+		p += sprintf(p, "%d: buddied %lu unbuddied %lu "
+			     "acquired %lu contended %lu\n", n,
+			     shard->buddied_count, unbuddied,
+			     shard->acquired, shard->contended);
+	}
 	return p - buf;
 }
 
@@ -623,12 +820,13 @@ static int zbud_show_cumul_chunk_counts(char *buf)
 #endif
 
 /**********
- * This "zv" PAM implementation combines the TLSF-based xvMalloc
- * with lzo1x compression to maximize the amount of data that can
+ * This "zv" PAM implementation combines the zsmalloc allocator
+ * with compression to maximize the amount of data that can
  * be packed into a physical page.
  *
  * Zv represents a PAM page with the index and object (plus a "size" value
  * necessary for decompression) immediately preceding the compressed data.
+ * The pampd is the zsmalloc handle of the object, not a pointer to it.
  */
 
 #define ZVH_SENTINEL  0x43214321
@@ -637,6 +835,8 @@ struct zv_hdr {
 	uint32_t pool_id;
 	struct tmem_oid oid;
 	uint32_t index;
+	uint16_t size; /* of the compressed data */
+	uint16_t comp; /* index in zcache_comps[] of the compressor */
 	DECL_SENTINEL
 };
 
@@ -658,73 +858,67 @@ static unsigned int zv_max_mean_zsize = (PAGE_SIZE / 8) * 5;
 static unsigned long zv_curr_dist_counts[NCHUNKS];
 static unsigned long zv_cumul_dist_counts[NCHUNKS];
 
-static struct zv_hdr *zv_create(struct xv_pool *xvpool, uint32_t pool_id,
+static unsigned long zv_create(struct zs_pool *zspool, uint32_t pool_id,
 				struct tmem_oid *oid, uint32_t index,
-				void *cdata, unsigned clen)
+				void *cdata, unsigned clen, unsigned int comp)
 {
-	struct page *page;
-	struct zv_hdr *zv = NULL;
-	uint32_t offset;
+	struct zv_hdr *zv;
 	int alloc_size = clen + sizeof(struct zv_hdr);
 	int chunks = (alloc_size + (CHUNK_SIZE - 1)) >> CHUNK_SHIFT;
-	int ret;
+	unsigned long handle;
 
 	BUG_ON(!irqs_disabled());
 	BUG_ON(chunks >= NCHUNKS);
-	ret = xv_malloc(xvpool, alloc_size,
-			&page, &offset, ZCACHE_GFP_MASK);
-	if (unlikely(ret))
+	handle = zs_malloc(zspool, alloc_size, ZCACHE_GFP_MASK);
+	if (unlikely(!handle))
 		goto out;
 	zv_curr_dist_counts[chunks]++;
 	zv_cumul_dist_counts[chunks]++;
-	zv = kmap_atomic(page, KM_USER0) + offset;
+	zv = zs_map_object(zspool, handle);
 	zv->index = index;
 	zv->oid = *oid;
 	zv->pool_id = pool_id;
+	zv->size = clen;
+	zv->comp = comp;
 	SET_SENTINEL(zv, ZVH);
 	memcpy((char *)zv + sizeof(struct zv_hdr), cdata, clen);
-	kunmap_atomic(zv, KM_USER0);
+	zs_unmap_object(zspool, handle);
 out:
-	return zv;
+	return handle;
 }
 
-static void zv_free(struct xv_pool *xvpool, struct zv_hdr *zv)
+static void zv_free(struct zs_pool *zspool, unsigned long handle)
 {
 	unsigned long flags;
-	struct page *page;
-	uint32_t offset;
-	uint16_t size = xv_get_object_size(zv);
-	int chunks = (size + (CHUNK_SIZE - 1)) >> CHUNK_SHIFT;
+	struct zv_hdr *zv;
+	uint16_t size;
+	int chunks;
 
+	zv = zs_map_object(zspool, handle);
 	ASSERT_SENTINEL(zv, ZVH);
+	BUG_ON(zv->size == 0);
+	size = zv->size + sizeof(struct zv_hdr);
+	INVERT_SENTINEL(zv, ZVH);
+	zs_unmap_object(zspool, handle);
+
+	chunks = (size + (CHUNK_SIZE - 1)) >> CHUNK_SHIFT;
 	BUG_ON(chunks >= NCHUNKS);
 	zv_curr_dist_counts[chunks]--;
-	size -= sizeof(*zv);
-	BUG_ON(size == 0);
-	INVERT_SENTINEL(zv, ZVH);
-	page = virt_to_page(zv);
-	offset = (unsigned long)zv & ~PAGE_MASK;
 	local_irq_save(flags);
-	xv_free(xvpool, page, offset);
+	zs_free(zspool, handle);
 	local_irq_restore(flags);
 }
 
-static void zv_decompress(struct page *page, struct zv_hdr *zv)
+static void zv_decompress(struct zs_pool *zspool, struct page *page,
+			  unsigned long handle)
 {
-	size_t clen = PAGE_SIZE;
-	char *to_va;
-	unsigned size;
-	int ret;
+	struct zv_hdr *zv;
 
+	zv = zs_map_object(zspool, handle);
 	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
-	BUG_ON(size == 0);
-	to_va = kmap_atomic(page, KM_USER0);
-	ret = lzo1x_decompress_safe((char *)zv + sizeof(*zv),
-					size, to_va, &clen);
-	kunmap_atomic(to_va, KM_USER0);
-	BUG_ON(ret != LZO_E_OK);
-	BUG_ON(clen != PAGE_SIZE);
+	BUG_ON(zv->size == 0);
+	zcache_decompress(zv->comp, (char *)zv + sizeof(*zv), zv->size, page);
+	zs_unmap_object(zspool, handle);
 }
 
 #ifdef CONFIG_SYSFS
@@ -937,6 +1131,9 @@ static void zcache_put_pool(struct tmem_pool *pool)
 int zcache_new_client(uint16_t cli_id)
 {
 	struct zcache_client *cli = NULL;
+#ifdef CONFIG_FRONTSWAP
+	char name[16];
+#endif
 	int ret = -1;
 
 	if (cli_id == LOCAL_CLIENT)
@@ -949,8 +1146,12 @@ int zcache_new_client(uint16_t cli_id)
 		goto out;
 	cli->allocated = 1;
 #ifdef CONFIG_FRONTSWAP
-	cli->xvpool = xv_create_pool();
-	if (cli->xvpool == NULL)
+	if (cli_id == LOCAL_CLIENT)
+		strcpy(name, "zcache");
+	else
+		sprintf(name, "zcache%u", cli_id);
+	cli->zspool = zs_create_pool(name);
+	if (cli->zspool == NULL)
 		goto out;
 #endif
 	ret = 0;
@@ -962,15 +1163,16 @@ out:
 static unsigned long zcache_failed_get_free_pages;
 static unsigned long zcache_failed_alloc;
 static unsigned long zcache_put_to_flush;
-static unsigned long zcache_aborted_preload;
 static unsigned long zcache_aborted_shrink;
 
 /*
  * Ensure that memory allocation requests in zcache don't result
  * in direct reclaim requests via the shrinker, which would cause
- * an infinite loop.  Maybe a GFP flag would be better?
+ * an infinite loop.  Maybe a GFP flag would be better?  Preloads run
+ * with irqs disabled, so a shrinker called from one runs on the same
+ * cpu; a per-cpu flag avoids serializing all puts on a global lock.
  */
-static DEFINE_SPINLOCK(zcache_direct_reclaim_lock);
+static DEFINE_PER_CPU(bool, zcache_in_preload);
 
 /*
  * for now, used named slabs so can easily track usage; later can
@@ -1009,10 +1211,7 @@ static int zcache_do_preload(struct tmem_pool *pool)
 		goto out;
 	if (unlikely(zcache_obj_cache == NULL))
 		goto out;
-	if (!spin_trylock(&zcache_direct_reclaim_lock)) {
-		zcache_aborted_preload++;
-		goto out;
-	}
+	__this_cpu_write(zcache_in_preload, true);
 	preempt_disable();
 	kp = &__get_cpu_var(zcache_preloads);
 	while (kp->nr < ARRAY_SIZE(kp->objnodes)) {
@@ -1054,7 +1253,7 @@ static int zcache_do_preload(struct tmem_pool *pool)
 		free_page((unsigned long)page);
 	ret = 0;
 unlock_out:
-	spin_unlock(&zcache_direct_reclaim_lock);
+	__this_cpu_write(zcache_in_preload, false);
 out:
 	return ret;
 }
@@ -1148,7 +1347,8 @@ static atomic_t zcache_curr_pers_pampd_count = ATOMIC_INIT(0);
 static unsigned long zcache_curr_pers_pampd_count_max;
 
 /* forward reference */
-static int zcache_compress(struct page *from, void **out_va, size_t *out_len);
+static int zcache_compress(struct page *from, void **out_va, size_t *out_len,
+			   unsigned int *comp);
 
 static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 				struct tmem_pool *pool, struct tmem_oid *oid,
@@ -1156,6 +1356,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 {
 	void *pampd = NULL, *cdata;
 	size_t clen;
+	unsigned int comp;
 	int ret;
 	unsigned long count;
 	struct page *page = (struct page *)(data);
@@ -1166,7 +1367,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 	u64 total_zsize;
 
 	if (eph) {
-		ret = zcache_compress(page, &cdata, &clen);
+		ret = zcache_compress(page, &cdata, &clen, &comp);
 		if (ret == 0)
 			goto out;
 		if (clen == 0 || clen > zbud_max_buddy_size()) {
@@ -1174,7 +1375,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 			goto out;
 		}
 		pampd = (void *)zbud_create(client_id, pool->pool_id, oid,
-						index, page, cdata, clen);
+						index, page, cdata, clen, comp);
 		if (pampd != NULL) {
 			count = atomic_inc_return(&zcache_curr_eph_pampd_count);
 			if (count > zcache_curr_eph_pampd_count_max)
@@ -1186,7 +1387,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 		if (curr_pers_pampd_count >
 		    (zv_page_count_policy_percent * totalram_pages) / 100)
 			goto out;
-		ret = zcache_compress(page, &cdata, &clen);
+		ret = zcache_compress(page, &cdata, &clen, &comp);
 		if (ret == 0)
 			goto out;
 		/* reject if compression is too poor */
@@ -1196,7 +1397,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 		}
 		/* reject if mean compression is too poor */
 		if ((clen > zv_max_mean_zsize) && (curr_pers_pampd_count > 0)) {
-			total_zsize = xv_get_total_size_bytes(cli->xvpool);
+			total_zsize = zs_get_total_size_bytes(cli->zspool);
 			zv_mean_zsize = div_u64(total_zsize,
 						curr_pers_pampd_count);
 			if (zv_mean_zsize > zv_max_mean_zsize) {
@@ -1204,8 +1405,8 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 				goto out;
 			}
 		}
-		pampd = (void *)zv_create(cli->xvpool, pool->pool_id,
-						oid, index, cdata, clen);
+		pampd = (void *)zv_create(cli->zspool, pool->pool_id,
+						oid, index, cdata, clen, comp);
 		if (pampd == NULL)
 			goto out;
 		count = atomic_inc_return(&zcache_curr_pers_pampd_count);
@@ -1224,10 +1425,12 @@ static int zcache_pampd_get_data(char *data, size_t *bufsize, bool raw,
 					void *pampd, struct tmem_pool *pool,
 					struct tmem_oid *oid, uint32_t index)
 {
+	struct zcache_client *cli = pool->client;
 	int ret = 0;
 
 	BUG_ON(is_ephemeral(pool));
-	zv_decompress((struct page *)(data), pampd);
+	zv_decompress(cli->zspool, (struct page *)(data),
+		      (unsigned long)pampd);
 	return ret;
 }
 
@@ -1262,7 +1465,7 @@ static void zcache_pampd_free(void *pampd, struct tmem_pool *pool,
 		atomic_dec(&zcache_curr_eph_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_eph_pampd_count) < 0);
 	} else {
-		zv_free(cli->xvpool, (struct zv_hdr *)pampd);
+		zv_free(cli->zspool, (unsigned long)pampd);
 		atomic_dec(&zcache_curr_pers_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_pers_pampd_count) < 0);
 	}
@@ -1301,32 +1504,211 @@ static struct tmem_pamops zcache_pamops = {
  * zcache compression/decompression and related per-cpu stuff
  */
 
-#define LZO_WORKMEM_BYTES LZO1X_1_MEM_COMPRESS
-#define LZO_DSTMEM_PAGE_ORDER 1
-static DEFINE_PER_CPU(unsigned char *, zcache_workmem);
+#define ZCACHE_DSTMEM_PAGE_ORDER 1
 static DEFINE_PER_CPU(unsigned char *, zcache_dstmem);
 
-static int zcache_compress(struct page *from, void **out_va, size_t *out_len)
+/*
+ * Makes @name the compressor for new pages, first adding it to
+ * zcache_comps[] with a transform for every possible cpu if needed.
+ */
+static int zcache_comp_select(const char *name)
+{
+	struct zcache_comp *zc;
+	struct crypto_comp *tfm;
+	unsigned int i;
+	int cpu, ret = 0;
+
+	mutex_lock(&zcache_comp_mutex);
+	for (i = 0; i < zcache_nr_comps; i++)
+		if (!strcmp(zcache_comps[i].name, name))
+			goto found;
+
+	ret = -ENOSPC;
+	if (zcache_nr_comps == ZCACHE_MAX_COMPS)
+		goto out;
+	ret = -ENOENT;
+	if (!crypto_has_comp(name, 0, 0))
+		goto out;
+
+	zc = &zcache_comps[i];
+	strlcpy(zc->name, name, sizeof(zc->name));
+	ret = -ENOMEM;
+	zc->tfm = alloc_percpu(struct crypto_comp *);
+	zc->stats = alloc_percpu(struct zcache_comp_stats);
+	if (!zc->tfm || !zc->stats)
+		goto out_free;
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(name, 0, 0);
+		if (IS_ERR(tfm)) {
+			ret = PTR_ERR(tfm);
+			goto out_free;
+		}
+		*per_cpu_ptr(zc->tfm, cpu) = tfm;
+	}
+	/* publish the new compressor before pages can refer to it */
+	smp_wmb();
+	zcache_nr_comps++;
+found:
+	zcache_comp_cur = i;
+	ret = 0;
+out:
+	mutex_unlock(&zcache_comp_mutex);
+	return ret;
+
+out_free:
+	if (zc->tfm) {
+		for_each_possible_cpu(cpu) {
+			tfm = *per_cpu_ptr(zc->tfm, cpu);
+			if (tfm)
+				crypto_free_comp(tfm);
+		}
+		free_percpu(zc->tfm);
+	}
+	free_percpu(zc->stats);
+	memset(zc, 0, sizeof(*zc));
+	goto out;
+}
+
+static int zcache_compress(struct page *from, void **out_va, size_t *out_len,
+			   unsigned int *comp)
 {
 	int ret = 0;
 	unsigned char *dmem = __get_cpu_var(zcache_dstmem);
-	unsigned char *wmem = __get_cpu_var(zcache_workmem);
+	unsigned int clen = PAGE_SIZE << ZCACHE_DSTMEM_PAGE_ORDER;
+	struct zcache_comp_stats *stats;
+	struct zcache_comp *zc;
 	char *from_va;
+	u64 start;
 
 	BUG_ON(!irqs_disabled());
-	if (unlikely(dmem == NULL || wmem == NULL))
+	if (unlikely(dmem == NULL))
 		goto out;  /* no buffer, so can't compress */
+	*comp = ACCESS_ONCE(zcache_comp_cur);
+	smp_rmb();
+	zc = &zcache_comps[*comp];
 	from_va = kmap_atomic(from, KM_USER0);
 	mb();
-	ret = lzo1x_1_compress(from_va, PAGE_SIZE, dmem, out_len, wmem);
-	BUG_ON(ret != LZO_E_OK);
-	*out_va = dmem;
+	start = local_clock();
+	ret = crypto_comp_compress(*__this_cpu_ptr(zc->tfm), from_va,
+				   PAGE_SIZE, dmem, &clen);
 	kunmap_atomic(from_va, KM_USER0);
+	if (unlikely(ret)) {
+		ret = 0;  /* output did not fit, so can't compress */
+		goto out;
+	}
+	stats = __this_cpu_ptr(zc->stats);
+	stats->compress++;
+	stats->compress_ns += local_clock() - start;
+	stats->zbytes += clen;
+	*out_va = dmem;
+	*out_len = clen;
 	ret = 1;
 out:
 	return ret;
 }
 
+static void zcache_decompress(unsigned int comp, char *from_va,
+			      unsigned size, struct page *page)
+{
+	struct zcache_comp *zc = &zcache_comps[comp];
+	struct zcache_comp_stats *stats;
+	unsigned int out_len = PAGE_SIZE;
+	char *to_va;
+	u64 start;
+	int ret;
+
+	BUG_ON(!irqs_disabled());
+	BUG_ON(comp >= zcache_nr_comps);
+	to_va = kmap_atomic(page, KM_USER0);
+	start = local_clock();
+	ret = crypto_comp_decompress(*__this_cpu_ptr(zc->tfm), from_va, size,
+				     to_va, &out_len);
+	kunmap_atomic(to_va, KM_USER0);
+	BUG_ON(ret);
+	BUG_ON(out_len != PAGE_SIZE);
+	stats = __this_cpu_ptr(zc->stats);
+	stats->decompress++;
+	stats->decompress_ns += local_clock() - start;
+}
+
+#ifdef CONFIG_SYSFS
+/*
+ * show the compressor for new pages, and any other available common one
+ */
+static ssize_t zcache_compressor_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	static const char * const common[] = { "lzo", "lz4", "deflate" };
+	const char *cur;
+	char *p = buf;
+	int i;
+
+	mutex_lock(&zcache_comp_mutex);
+	cur = zcache_comps[zcache_comp_cur].name;
+	p += sprintf(p, "[%s]", cur);
+	for (i = 0; i < ARRAY_SIZE(common); i++)
+		if (strcmp(common[i], cur) && crypto_has_comp(common[i], 0, 0))
+			p += sprintf(p, " %s", common[i]);
+	mutex_unlock(&zcache_comp_mutex);
+	p += sprintf(p, "\n");
+	return p - buf;
+}
+
+static ssize_t zcache_compressor_store(struct kobject *kobj,
+				       struct kobj_attribute *attr,
+				       const char *buf, size_t count)
+{
+	char name[CRYPTO_MAX_ALG_NAME];
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	strlcpy(name, buf, sizeof(name));
+	name[strcspn(name, "\n")] = '\0';
+	err = zcache_comp_select(name);
+	if (err)
+		return err == -ENOENT ? -EINVAL : err;
+	return count;
+}
+
+/*
+ * show, for every compressor used so far, how many pages it compressed
+ * and decompressed, the time that took and the compressed size
+ */
+static int zcache_show_comp_stats(char *buf)
+{
+	struct zcache_comp_stats sum, *stats;
+	char *p = buf;
+	unsigned int i;
+	int cpu;
+
+	for (i = 0; i < ACCESS_ONCE(zcache_nr_comps); i++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			stats = per_cpu_ptr(zcache_comps[i].stats, cpu);
+			sum.compress += stats->compress;
+			sum.compress_ns += stats->compress_ns;
+			sum.zbytes += stats->zbytes;
+			sum.decompress += stats->decompress;
+			sum.decompress_ns += stats->decompress_ns;
+		}
+		p += sprintf(p, "%s compress:%llu compress_ns:%llu zbytes:%llu "
+			     "decompress:%llu decompress_ns:%llu\n",
+			     zcache_comps[i].name, sum.compress,
+			     sum.compress_ns, sum.zbytes, sum.decompress,
+			     sum.decompress_ns);
+	}
+	return p - buf;
+}
+
+static struct kobj_attribute zcache_compressor_attr = {
+		.attr = { .name = "compressor", .mode = 0644 },
+		.show = zcache_compressor_show,
+		.store = zcache_compressor_store,
+};
+#endif
+
 
 static int zcache_cpu_notifier(struct notifier_block *nb,
 				unsigned long action, void *pcpu)
@@ -1338,18 +1720,13 @@ static int zcache_cpu_notifier(struct notifier_block *nb,
 	case CPU_UP_PREPARE:
 		per_cpu(zcache_dstmem, cpu) = (void *)__get_free_pages(
 			GFP_KERNEL | __GFP_REPEAT,
-			LZO_DSTMEM_PAGE_ORDER),
-		per_cpu(zcache_workmem, cpu) =
-			kzalloc(LZO1X_MEM_COMPRESS,
-				GFP_KERNEL | __GFP_REPEAT);
+			ZCACHE_DSTMEM_PAGE_ORDER);
 		break;
 	case CPU_DEAD:
 	case CPU_UP_CANCELED:
 		free_pages((unsigned long)per_cpu(zcache_dstmem, cpu),
-				LZO_DSTMEM_PAGE_ORDER);
+				ZCACHE_DSTMEM_PAGE_ORDER);
 		per_cpu(zcache_dstmem, cpu) = NULL;
-		kfree(per_cpu(zcache_workmem, cpu));
-		per_cpu(zcache_workmem, cpu) = NULL;
 		kp = &per_cpu(zcache_preloads, cpu);
 		while (kp->nr) {
 			kmem_cache_free(zcache_objnode_cache,
@@ -1415,15 +1792,12 @@ ZCACHE_SYSFS_RO(failed_pers_puts);
 ZCACHE_SYSFS_RO(zbud_curr_zbytes);
 ZCACHE_SYSFS_RO(zbud_cumul_zpages);
 ZCACHE_SYSFS_RO(zbud_cumul_zbytes);
-ZCACHE_SYSFS_RO(zbud_buddied_count);
-ZCACHE_SYSFS_RO(zbpg_unused_list_count);
 ZCACHE_SYSFS_RO(evicted_raw_pages);
 ZCACHE_SYSFS_RO(evicted_unbuddied_pages);
 ZCACHE_SYSFS_RO(evicted_buddied_pages);
 ZCACHE_SYSFS_RO(failed_get_free_pages);
 ZCACHE_SYSFS_RO(failed_alloc);
 ZCACHE_SYSFS_RO(put_to_flush);
-ZCACHE_SYSFS_RO(aborted_preload);
 ZCACHE_SYSFS_RO(aborted_shrink);
 ZCACHE_SYSFS_RO(compress_poor);
 ZCACHE_SYSFS_RO(mean_compress_poor);
@@ -1431,6 +1805,11 @@ ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_raw_pages);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_zpages);
 ZCACHE_SYSFS_RO_ATOMIC(curr_obj_count);
 ZCACHE_SYSFS_RO_ATOMIC(curr_objnode_count);
+ZCACHE_SYSFS_RO_ATOMIC(zbpg_unused_list_count);
+ZCACHE_SYSFS_RO_CUSTOM(zbud_buddied_count,
+			zbud_show_buddied_count);
+ZCACHE_SYSFS_RO_CUSTOM(zbud_shard_stats,
+			zbud_show_shard_stats);
 ZCACHE_SYSFS_RO_CUSTOM(zbud_unbuddied_list_counts,
 			zbud_show_unbuddied_list_counts);
 ZCACHE_SYSFS_RO_CUSTOM(zbud_cumul_chunk_counts,
@@ -1439,6 +1818,8 @@ ZCACHE_SYSFS_RO_CUSTOM(zv_curr_dist_counts,
 			zv_curr_dist_counts_show);
 ZCACHE_SYSFS_RO_CUSTOM(zv_cumul_dist_counts,
 			zv_cumul_dist_counts_show);
+ZCACHE_SYSFS_RO_CUSTOM(comp_stats,
+			zcache_show_comp_stats);
 
 static struct attribute *zcache_attrs[] = {
 	&zcache_curr_obj_count_attr.attr,
@@ -1466,15 +1847,17 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_failed_get_free_pages_attr.attr,
 	&zcache_failed_alloc_attr.attr,
 	&zcache_put_to_flush_attr.attr,
-	&zcache_aborted_preload_attr.attr,
 	&zcache_aborted_shrink_attr.attr,
 	&zcache_zbud_unbuddied_list_counts_attr.attr,
 	&zcache_zbud_cumul_chunk_counts_attr.attr,
+	&zcache_zbud_shard_stats_attr.attr,
 	&zcache_zv_curr_dist_counts_attr.attr,
 	&zcache_zv_cumul_dist_counts_attr.attr,
 	&zcache_zv_max_zsize_attr.attr,
 	&zcache_zv_max_mean_zsize_attr.attr,
 	&zcache_zv_page_count_policy_percent_attr.attr,
+	&zcache_compressor_attr.attr,
+	&zcache_comp_stats_attr.attr,
 	NULL,
 };
 
@@ -1507,10 +1890,9 @@ static int shrink_zcache_memory(struct shrinker *shrink,
 		if (!(gfp_mask & __GFP_FS))
 			/* does this case really need to be skipped? */
 			goto out;
-		if (spin_trylock(&zcache_direct_reclaim_lock)) {
+		if (!this_cpu_read(zcache_in_preload))
 			zbud_evict_pages(nr);
-			spin_unlock(&zcache_direct_reclaim_lock);
-		} else
+		else
 			zcache_aborted_shrink++;
 	}
 	ret = (int)atomic_read(&zcache_zbud_curr_raw_pages);
@@ -1949,6 +2331,11 @@ static int __init zcache_init(void)
 	if (zcache_enabled) {
 		unsigned int cpu;
 
+		ret = zcache_comp_select("lzo");
+		if (ret) {
+			pr_err("zcache: can't allocate lzo compressor\n");
+			goto out;
+		}
 		tmem_register_hostops(&zcache_hostops);
 		tmem_register_pamops(&zcache_pamops);
 		ret = register_cpu_notifier(&zcache_cpu_notifier_block);
@@ -1991,7 +2378,7 @@ static int __init zcache_init(void)
 
 		old_ops = zcache_frontswap_register_ops();
 		pr_info("zcache: frontswap enabled using kernel "
-			"transcendent memory and xvmalloc\n");
+			"transcendent memory and zsmalloc\n");
 		if (old_ops.init != NULL)
 			pr_warning("ktmem: frontswap_ops overridden");
 	}
@@ -23,13 +23,15 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -37,19 +39,21 @@
 
 /* Globals */
 static int zram_major;
+static struct kmem_cache *zram_entry_cache;
+static struct workqueue_struct *zram_wb_wq;
 struct zram *devices;
 
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -71,6 +75,145 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+/* Account one (de)compression that started at local_clock() @start */
+static void zram_stat64_time(struct zram *zram, u64 *num, u64 *time,
+			     u64 start)
+{
+	s64 delta = local_clock() - start;
+
+	spin_lock(&zram->stat64_lock);
+	*num = *num + 1;
+	/* local_clock() can go back a little between cpus */
+	if (delta > 0)
+		*time = *time + delta;
+	spin_unlock(&zram->stat64_lock);
+}
+
+/*
+ * Table entries, and what they point to, are protected by a bit lock each.
+ * It is only held to look up or swap an entry, never across an allocation.
+ */
+static void zram_lock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_lock(index, zram->slot_lock);
+}
+
+static void zram_unlock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(index, zram->slot_lock);
+}
+
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *zstrm;
+
+	spin_lock(&zram->stream_lock);
+	while (list_empty(&zram->idle_streams)) {
+		spin_unlock(&zram->stream_lock);
+		wait_event(zram->stream_wait,
+			   !list_empty(&zram->idle_streams));
+		spin_lock(&zram->stream_lock);
+	}
+	zstrm = list_first_entry(&zram->idle_streams, struct zram_stream,
+				 list);
+	list_del(&zstrm->list);
+	spin_unlock(&zram->stream_lock);
+
+	return zstrm;
+}
+
+static void zram_stream_put(struct zram *zram, struct zram_stream *zstrm)
+{
+	spin_lock(&zram->stream_lock);
+	list_add(&zstrm->list, &zram->idle_streams);
+	spin_unlock(&zram->stream_lock);
+	wake_up(&zram->stream_wait);
+}
+
+static void zram_stream_destroy(struct zram_stream *zstrm)
+{
+	if (zstrm->tfm)
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, ZRAM_STREAM_BUFFER_ORDER);
+}
+
+static int zram_stream_init(struct zram *zram, struct zram_stream *zstrm)
+{
+	zstrm->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+	if (IS_ERR(zstrm->tfm)) {
+		int err = PTR_ERR(zstrm->tfm);
+
+		pr_err("Error allocating %s compressor: %d\n",
+		       zram->compressor, err);
+		zstrm->tfm = NULL;
+		return err;
+	}
+
+	zstrm->buffer = (void *)__get_free_pages(__GFP_ZERO,
+						 ZRAM_STREAM_BUFFER_ORDER);
+	if (!zstrm->buffer) {
+		pr_err("Error allocating compressor buffer space\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void zram_free_streams(struct zram *zram)
+{
+	struct zram_stream *zstrm, *next;
+	int cpu;
+
+	list_for_each_entry_safe(zstrm, next, &zram->idle_streams, list) {
+		list_del(&zstrm->list);
+		zram_stream_destroy(zstrm);
+		kfree(zstrm);
+	}
+
+	if (!zram->read_streams)
+		return;
+	for_each_possible_cpu(cpu)
+		zram_stream_destroy(per_cpu_ptr(zram->read_streams, cpu));
+	free_percpu(zram->read_streams);
+	zram->read_streams = NULL;
+}
+
+/* Allocates @num streams for writers, and one per possible cpu for reads */
+static int zram_alloc_streams(struct zram *zram, int num)
+{
+	struct zram_stream *zstrm;
+	int cpu, ret;
+
+	while (num--) {
+		zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+		if (!zstrm)
+			return -ENOMEM;
+		list_add(&zstrm->list, &zram->idle_streams);
+
+		ret = zram_stream_init(zram, zstrm);
+		if (ret)
+			return ret;
+	}
+
+	zram->read_streams = alloc_percpu(struct zram_stream);
+	if (!zram->read_streams)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		ret = zram_stream_init(zram,
+				       per_cpu_ptr(zram->read_streams, cpu));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Now, in the units of table[].ac_time */
+static inline u16 zram_age_now(void)
+{
+	return get_seconds() >> ZRAM_AGE_SHIFT;
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
@@ -89,21 +232,108 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Checks if the page is one word repeated, four words at a time. Pages
+ * that are not usually differ in the first or the last word, so the
+ * last one is looked at first.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
-	unsigned long *page;
+	unsigned long *page = ptr;
+	unsigned long val = page[0];
 
-	page = (unsigned long *)ptr;
+	if (val != page[PAGE_SIZE / sizeof(*page) - 1])
+		return 0;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 0; pos < PAGE_SIZE / sizeof(*page); pos += 4) {
+		if ((page[pos] ^ val) | (page[pos + 1] ^ val) |
+		    (page[pos + 2] ^ val) | (page[pos + 3] ^ val))
 			return 0;
 	}
 
+	*element = val;
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned int len, unsigned long value)
+{
+	unsigned int pos;
+	unsigned long *page = ptr;
+
+	if (!value) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	for (pos = 0; pos < len / sizeof(*page); pos++)
+		page[pos] = value;
+}
+
+static struct zram_entry *zram_entry_alloc(unsigned long handle,
+					   unsigned int len, u32 checksum)
+{
+	struct zram_entry *entry;
+
+	entry = kmem_cache_alloc(zram_entry_cache, GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	RB_CLEAR_NODE(&entry->rb_node);
+	entry->checksum = checksum;
+	entry->refcount = 1;
+	entry->handle = handle;
+	entry->len = len;
+
+	return entry;
+}
+
+static u32 zram_checksum(void *mem)
+{
+	return jhash2(mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static void zram_dedup_insert(struct zram *zram, struct zram_entry *new)
+{
+	struct rb_node **rb_node, *parent = NULL;
+	struct zram_entry *entry;
+
+	spin_lock(&zram->dedup_lock);
+	rb_node = &zram->dedup_tree.rb_node;
+	while (*rb_node) {
+		parent = *rb_node;
+		entry = rb_entry(parent, struct zram_entry, rb_node);
+		if (new->checksum < entry->checksum)
+			rb_node = &parent->rb_left;
+		else
+			rb_node = &parent->rb_right;
+	}
+
+	rb_link_node(&new->rb_node, parent, rb_node);
+	rb_insert_color(&new->rb_node, &zram->dedup_tree);
+	spin_unlock(&zram->dedup_lock);
+}
+
+/*
+ * Drops a reference to @entry, and frees it with its object if that was
+ * the last one. Returns true in that case.
+ */
+static bool zram_entry_put(struct zram *zram, struct zram_entry *entry)
+{
+	spin_lock(&zram->dedup_lock);
+	if (--entry->refcount) {
+		spin_unlock(&zram->dedup_lock);
+		return false;
+	}
+	if (!RB_EMPTY_NODE(&entry->rb_node))
+		rb_erase(&entry->rb_node, &zram->dedup_tree);
+	spin_unlock(&zram->dedup_lock);
+
+	zs_free(zram->mem_pool, entry->handle);
+	kmem_cache_free(zram_entry_cache, entry);
+	return true;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -136,54 +366,69 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
-
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	struct zram_entry *entry = zram->table[index].entry;
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram_stat_dec(&zram->stats.pages_same);
+		if (!zram->table[index].element)
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram->table[index].element = 0;
+		return;
+	}
+
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		spin_lock(&zram->wb_bitmap_lock);
+		clear_bit(zram->table[index].element, zram->wb_bitmap);
+		spin_unlock(&zram->wb_bitmap_lock);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram_stat_dec(&zram->stats.pages_stored);
+		zram->table[index].element = 0;
 		return;
 	}
 
+	if (unlikely(!entry))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = entry->len;
+	if (!zram_entry_put(zram, entry)) {
+		/* another page still refers to the object */
+		zram_stat_dec(&zram->stats.pages_dup);
+		zram_stat64_sub(zram, &zram->stats.dup_data_size, clen);
+		zram_stat_dec(&zram->stats.pages_stored);
+		goto clear;
+	}
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
 out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
-
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+clear:
+	zram->table[index].entry = NULL;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -210,108 +455,308 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Reads or writes @nr pages from block @blk of the backing device on, in
+ * one bio, and waits for it. Returns the number of pages transferred,
+ * which can be fewer than @nr if the queue does not take them all, or a
+ * negative error.
+ */
+static int zram_bdev_rw(struct zram *zram, int rw, struct page **pages,
+			int nr, unsigned long blk)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int i, ret;
+
+	bio = bio_alloc(GFP_NOIO, nr);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+	for (i = 0; i < nr; i++)
+		if (bio_add_page(bio, pages[i], PAGE_SIZE, 0) != PAGE_SIZE)
+			break;
+	if (!i) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? i : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+/*
+ * Reads block @blk of the backing device into @page. Called holding
+ * zram->wb_sem for read.
+ */
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+			       unsigned long blk)
+{
+	int ret;
+	u64 start;
+
+	start = local_clock();
+	ret = zram_bdev_rw(zram, READ, &page, 1, blk);
+	zram_stat64_time(zram, &zram->stats.num_wb_reads,
+			 &zram->stats.wb_read_time, start);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* Like zram_read_from_bdev(), into @len bytes at @mem from @offset on */
+static int zram_read_from_bdev_to(struct zram *zram, unsigned char *mem,
+				  unsigned long blk, int offset, int len)
+{
+	int ret;
+	struct page *page;
+	unsigned char *src;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_read_from_bdev(zram, page, blk);
+	if (!ret) {
+		src = kmap_atomic(page, KM_USER1);
+		memcpy(mem, src + offset, len);
+		kunmap_atomic(src, KM_USER1);
+	}
+	__free_page(page);
+
+	return ret;
+}
+
+static int handle_wb_page(struct zram *zram, struct bio_vec *bvec,
+			  unsigned long blk, int offset)
+{
+	int ret;
+	struct page *page = bvec->bv_page;
+	unsigned char *user_mem;
+
+	if (!is_partial_io(bvec)) {
+		ret = zram_read_from_bdev(zram, page, blk);
+	} else {
+		user_mem = kmap(page);
+		ret = zram_read_from_bdev_to(zram, user_mem + bvec->bv_offset,
+					     blk, offset, bvec->bv_len);
+		kunmap(page);
+	}
+
+	if (!ret)
+		flush_dcache_page(page);
+	return ret;
+}
+
+/*
+ * Decompresses @entry into @mem. Called with a table entry that refers to
+ * it locked, or holding a reference.
+ */
+static int zram_decompress_page(struct zram *zram, struct zram_stream *zstrm,
+				unsigned char *mem, struct zram_entry *entry)
+{
+	int ret;
+	u64 start;
+	unsigned int clen = PAGE_SIZE;
+	unsigned char *cmem;
+
+	start = local_clock();
+	cmem = zs_map_object(zram->mem_pool, entry->handle);
+
+	ret = crypto_comp_decompress(zstrm->tfm, cmem, entry->len, mem, &clen);
+
+	zs_unmap_object(zram->mem_pool, entry->handle);
+	if (!ret && clen != PAGE_SIZE)
+		ret = -EINVAL;
+
+	zram_stat64_time(zram, &zram->stats.num_decompress,
+			 &zram->stats.decompr_time, start);
+	return ret;
+}
+
+/*
+ * Looks for a stored object with the same contents as the page at @mem,
+ * and returns it with a reference taken. Only the first object with the
+ * same checksum is compared; it is decompressed into the stream's buffer.
+ */
+static struct zram_entry *zram_dedup_find(struct zram *zram,
+					  struct zram_stream *zstrm,
+					  unsigned char *mem, u32 checksum)
+{
+	struct rb_node *rb_node;
+	struct zram_entry *entry = NULL;
+
+	spin_lock(&zram->dedup_lock);
+	rb_node = zram->dedup_tree.rb_node;
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (checksum == entry->checksum)
+			break;
+		if (checksum < entry->checksum)
+			rb_node = rb_node->rb_left;
+		else
+			rb_node = rb_node->rb_right;
+	}
+	if (!rb_node) {
+		spin_unlock(&zram->dedup_lock);
+		return NULL;
+	}
+	entry->refcount++;
+	spin_unlock(&zram->dedup_lock);
+
+	if (!zram_decompress_page(zram, zstrm, zstrm->buffer, entry) &&
+	    !memcmp(mem, zstrm->buffer, PAGE_SIZE))
+		return entry;
+
+	zram_entry_put(zram, entry);
+	return NULL;
+}
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
-	int ret;
-	size_t clen;
+	int ret = 0;
+	unsigned long blk;
 	struct page *page;
-	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	struct zram_stream *zstrm;
+	unsigned char *user_mem, *uncmem;
 
 	page = bvec->bv_page;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
-		return 0;
+	if (zram->bdev)
+		down_read(&zram->wb_sem);
+	zram_lock_slot(zram, index);
+	zram->table[index].ac_time = zram_age_now();
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		blk = zram->table[index].element;
+		zram_unlock_slot(zram, index);
+
+		ret = handle_wb_page(zram, bvec, blk, offset);
+		up_read(&zram->wb_sem);
+		if (unlikely(ret)) {
+			pr_err("Backing device read failed! err=%d, page=%u\n",
+			       ret, index);
+			zram_stat64_inc(zram, &zram->stats.failed_reads);
+		}
+		return ret;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		handle_same_page(bvec, zram->table[index].element);
+		goto out;
 	}
 
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
+	if (unlikely(!zram->table[index].entry)) {
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
-		return 0;
+		handle_same_page(bvec, 0);
+		goto out;
 	}
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		handle_uncompressed_page(zram, bvec, index, offset);
-		return 0;
-	}
-
-	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			return -ENOMEM;
-		}
+		goto out;
 	}
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	if (!is_partial_io(bvec))
-		uncmem = user_mem;
-	clen = PAGE_SIZE;
+	/* the slot lock already keeps us on this cpu */
+	zstrm = get_cpu_ptr(zram->read_streams);
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	/* Partial pages are decompressed into the stream's buffer */
+	if (is_partial_io(bvec))
+		uncmem = zstrm->buffer;
+	else
+		uncmem = user_mem;
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    uncmem, &clen);
+	ret = zram_decompress_page(zram, zstrm, uncmem,
+				   zram->table[index].entry);
 
-	if (is_partial_io(bvec)) {
+	if (is_partial_io(bvec))
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
 		       bvec->bv_len);
-		kfree(uncmem);
-	}
 
-	kunmap_atomic(cmem, KM_USER1);
+	put_cpu_ptr(zram->read_streams);
 	kunmap_atomic(user_mem, KM_USER0);
 
+	if (likely(!ret))
+		flush_dcache_page(page);
+out:
+	zram_unlock_slot(zram, index);
+	if (zram->bdev)
+		up_read(&zram->wb_sem);
+
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
 	}
 
-	flush_dcache_page(page);
-
 	return 0;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
+/* Called holding zram->wb_sem for read if there is a backing device */
+static int zram_read_before_write(struct zram *zram, struct zram_stream *zstrm,
+				  char *mem, u32 index)
 {
 	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
+	unsigned long blk;
 	unsigned char *cmem;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
-		memset(mem, 0, PAGE_SIZE);
+	zram_lock_slot(zram, index);
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		blk = zram->table[index].element;
+		zram_unlock_slot(zram, index);
+
+		ret = zram_read_from_bdev_to(zram, mem, blk, 0, PAGE_SIZE);
+		if (unlikely(ret)) {
+			pr_err("Backing device read failed! err=%d, page=%u\n",
+			       ret, index);
+			zram_stat64_inc(zram, &zram->stats.failed_reads);
+		}
+		return ret;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_fill_page(mem, PAGE_SIZE, zram->table[index].element);
+		zram_unlock_slot(zram, index);
 		return 0;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
+	if (!zram->table[index].entry) {
+		zram_unlock_slot(zram, index);
+		memset(mem, 0, PAGE_SIZE);
+		return 0;
+	}
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(zram->table[index].page, KM_USER0);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem, KM_USER0);
+		zram_unlock_slot(zram, index);
 		return 0;
 	}
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
+	ret = zram_decompress_page(zram, zstrm, mem, zram->table[index].entry);
+	zram_unlock_slot(zram, index);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
@@ -320,18 +765,27 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
+/*
+ * Pages are compressed with one of the device's streams and stored in newly
+ * allocated memory before the table entry is locked; the entry then only
+ * has to be swapped for the new one. With dedup, a page that is already
+ * stored just takes another reference to its object.
+ */
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
-	size_t clen;
-	struct zobj_header *zheader;
+	u64 start;
+	u32 checksum = 0;
+	unsigned long handle, element;
+	unsigned int clen;
+	int uncompressed = 0, new_object = 0;
+	struct zram_entry *entry = NULL;
+	struct zram_stream *zstrm;
 	struct page *page, *page_store;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -344,20 +798,20 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
-			goto out;
-		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
+	/* wb_sem is taken before a stream, as on the read side */
+	if (is_partial_io(bvec) && zram->bdev)
+		down_read(&zram->wb_sem);
+	zstrm = zram_stream_get(zram);
+
+	if (is_partial_io(bvec)) {
+		ret = zram_read_before_write(zram, zstrm, uncmem, index);
+		if (zram->bdev)
+			up_read(&zram->wb_sem);
+		if (ret)
+			goto out_put;
+	}
 
 	user_mem = kmap_atomic(page, KM_USER0);
 
@@ -367,26 +821,50 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	else
 		uncmem = user_mem;
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
 		if (is_partial_io(bvec))
 			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
-		ret = 0;
-		goto out;
+		zram_stream_put(zram, zstrm);
+
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_lock_slot(zram, index);
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram->table[index].element = element;
+		zram->table[index].ac_time = zram_age_now();
+		zram_unlock_slot(zram, index);
+		zram_stat_inc(&zram->stats.pages_same);
+		if (!element)
+			zram_stat_inc(&zram->stats.pages_zero);
+		return 0;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	if (zram->use_dedup) {
+		checksum = zram_checksum(uncmem);
+		entry = zram_dedup_find(zram, zstrm, uncmem, checksum);
+		if (entry) {
+			kunmap_atomic(user_mem, KM_USER0);
+			clen = entry->len;
+			goto stored;
+		}
+	}
+
+	start = local_clock();
+	clen = ZRAM_STREAM_BUFFER_SIZE;
+	ret = crypto_comp_compress(zstrm->tfm, uncmem, PAGE_SIZE,
+				   zstrm->buffer, &clen);
 
 	kunmap_atomic(user_mem, KM_USER0);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	zram_stat64_time(zram, &zram->stats.num_compress,
+			 &zram->stats.compr_time, start);
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
-		goto out;
+		goto out_put;
 	}
 
 	/*
@@ -401,55 +879,81 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			pr_info("Error allocating memory for "
 				"incompressible page: %u\n", index);
 			ret = -ENOMEM;
-			goto out;
+			goto out_put;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
-		zram->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
+		uncompressed = 1;
+		if (is_partial_io(bvec))
+			src = uncmem;
+		else
+			src = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		if (!is_partial_io(bvec))
+			kunmap_atomic(src, KM_USER0);
+		goto stored;
 	}
 
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
+	handle = zs_malloc(zram->mem_pool, clen, GFP_NOIO | __GFP_HIGHMEM);
+	if (handle)
+		entry = zram_entry_alloc(handle, clen, checksum);
+	if (!entry) {
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
+		zs_free(zram->mem_pool, handle);
 		ret = -ENOMEM;
-		goto out;
-	}
-
-memstore:
-	zram->table[index].offset = store_offset;
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
-
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
+		goto out_put;
 	}
-#endif
+	cmem = zs_map_object(zram->mem_pool, handle);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(zram->mem_pool, handle);
+	if (zram->use_dedup)
+		zram_dedup_insert(zram, entry);
+	new_object = 1;
+
+stored:
+	zram_stream_put(zram, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 
-	memcpy(cmem, src, clen);
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	zram_lock_slot(zram, index);
+	zram_free_page(zram, index);
+	if (unlikely(uncompressed)) {
+		zram->table[index].page = page_store;
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	} else
+		zram->table[index].entry = entry;
+	zram->table[index].ac_time = zram_age_now();
+	zram_unlock_slot(zram, index);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	/* incompressible pages are the first to go to the backing device */
+	if (unlikely(uncompressed) && zram->bdev)
+		zram_kick_writeback(zram, HZ);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
 	zram_stat_inc(&zram->stats.pages_stored);
+	if (entry && !new_object) {
+		zram_stat_inc(&zram->stats.pages_dup);
+		zram_stat64_add(zram, &zram->stats.dup_data_size, clen);
+		return 0;
+	}
+	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+	if (unlikely(uncompressed))
+		zram_stat_inc(&zram->stats.pages_expand);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
 	return 0;
 
+out_put:
+	zram_stream_put(zram, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 out:
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
@@ -461,15 +965,15 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
+	if (rw == READ)
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
+	else if (is_partial_io(bvec)) {
+		/* two writers to parts of the same page must not interleave */
+		mutex_lock(&zram->partial_lock);
+		ret = zram_bvec_write(zram, bvec, index, offset);
+		mutex_unlock(&zram->partial_lock);
+	} else
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
 
 	return ret;
 }
@@ -576,41 +1080,277 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return 0;
 }
 
+/*
+ * Copies the page of table entry @index into @page and marks the entry
+ * ZRAM_UNDER_WB if it should be written back: if it is incompressible,
+ * or has not been accessed for wb_idle_age seconds.
+ */
+static bool zram_wb_prepare(struct zram *zram, struct zram_stream *zstrm,
+			    u32 index, struct page *page, u16 now)
+{
+	bool ret = false;
+	unsigned char *mem, *cmem;
+
+	zram_lock_slot(zram, index);
+	if (zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+	    !zram->table[index].entry)
+		goto out;
+
+	mem = kmap_atomic(page, KM_USER0);
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		ret = true;
+	} else if (zram->wb_idle_age &&
+		   (u16)(now - zram->table[index].ac_time) << ZRAM_AGE_SHIFT >=
+		   zram->wb_idle_age) {
+		ret = !zram_decompress_page(zram, zstrm, mem,
+					    zram->table[index].entry);
+	}
+	kunmap_atomic(mem, KM_USER0);
+
+	if (ret)
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+out:
+	zram_unlock_slot(zram, index);
+	return ret;
+}
+
+/*
+ * Writes the @nr pages prepared in zram->wb_pages to consecutive blocks
+ * of the backing device, and replaces the table entries in @index that
+ * were not overwritten meanwhile. Returns 0, or an error if not all
+ * could be written, with the rest left in memory.
+ */
+static int zram_wb_flush(struct zram *zram, u32 *index, int nr)
+{
+	int i, len = nr, done = 0;
+	unsigned long blk = 0;
+
+	down_write(&zram->wb_sem);
+	spin_lock(&zram->wb_bitmap_lock);
+	while (len) {
+		blk = bitmap_find_next_zero_area(zram->wb_bitmap,
+					zram->nr_blocks, 0, len, 0);
+		if (blk < zram->nr_blocks) {
+			bitmap_set(zram->wb_bitmap, blk, len);
+			break;
+		}
+		len >>= 1;
+	}
+	spin_unlock(&zram->wb_bitmap_lock);
+	up_write(&zram->wb_sem);
+
+	if (len) {
+		done = zram_bdev_rw(zram, WRITE, zram->wb_pages, len, blk);
+		if (done < 0)
+			done = 0;
+		spin_lock(&zram->wb_bitmap_lock);
+		bitmap_clear(zram->wb_bitmap, blk + done, len - done);
+		spin_unlock(&zram->wb_bitmap_lock);
+	}
+
+	for (i = 0; i < nr; i++) {
+		zram_lock_slot(zram, index[i]);
+		if (i < done &&
+		    zram_test_flag(zram, index[i], ZRAM_UNDER_WB)) {
+			zram_free_page(zram, index[i]);
+			zram_set_flag(zram, index[i], ZRAM_WB);
+			zram->table[index[i]].element = blk + i;
+			zram_stat_inc(&zram->stats.pages_stored);
+			zram_stat_inc(&zram->stats.pages_wb);
+			zram_stat64_add(zram, &zram->stats.wb_bytes,
+					PAGE_SIZE);
+		} else {
+			zram_clear_flag(zram, index[i], ZRAM_UNDER_WB);
+			if (i < done) {
+				spin_lock(&zram->wb_bitmap_lock);
+				clear_bit(blk + i, zram->wb_bitmap);
+				spin_unlock(&zram->wb_bitmap_lock);
+			}
+		}
+		zram_unlock_slot(zram, index[i]);
+	}
+
+	if (!len)
+		return -ENOSPC;
+	return done < nr ? -EIO : 0;
+}
+
+/*
+ * Writes incompressible and idle pages to the backing device, in batches
+ * of ZRAM_WB_BATCH. Called with init_lock held on an initialized device
+ * that has one.
+ */
+void zram_writeback(struct zram *zram)
+{
+	u32 index[ZRAM_WB_BATCH];
+	u32 i, nr_pages = zram->disksize >> PAGE_SHIFT;
+	u16 now = zram_age_now();
+	struct zram_stream *zstrm;
+	int nr = 0;
+
+	zstrm = zram_stream_get(zram);
+	for (i = 0; i < nr_pages; i++) {
+		if (!zram_wb_prepare(zram, zstrm, i, zram->wb_pages[nr], now))
+			continue;
+
+		index[nr++] = i;
+		if (nr < ZRAM_WB_BATCH)
+			continue;
+
+		/* don't keep a stream from writers while waiting on I/O */
+		zram_stream_put(zram, zstrm);
+		if (zram_wb_flush(zram, index, nr))
+			return;
+		nr = 0;
+		cond_resched();
+		zstrm = zram_stream_get(zram);
+	}
+	zram_stream_put(zram, zstrm);
+
+	if (nr)
+		zram_wb_flush(zram, index, nr);
+}
+
+static void zram_wb_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(to_delayed_work(work), struct zram,
+					 wb_work);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done && zram->bdev) {
+		zram_writeback(zram);
+		if (zram->wb_idle_age)
+			zram_kick_writeback(zram, zram->wb_idle_age * HZ);
+	}
+	mutex_unlock(&zram->init_lock);
+}
+
+void zram_kick_writeback(struct zram *zram, unsigned long delay)
+{
+	queue_delayed_work(zram_wb_wq, &zram->wb_work, delay);
+}
+
+static void zram_release_backing_dev(struct zram *zram)
+{
+	int i;
+
+	if (!zram->bdev)
+		return;
+
+	cancel_delayed_work_sync(&zram->wb_work);
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+	zram->backing_dev[0] = '\0';
+	vfree(zram->wb_bitmap);
+	zram->wb_bitmap = NULL;
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		if (zram->wb_pages[i])
+			__free_page(zram->wb_pages[i]);
+		zram->wb_pages[i] = NULL;
+	}
+}
+
+/*
+ * Sets the block device at @path as backing device, or none if @path is
+ * empty or "none". Only while the device is not initialized.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int i, ret = 0;
+	struct block_device *bdev;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	zram_release_backing_dev(zram);
+	if (!*path || !strcmp(path, "none"))
+		goto out;
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE |
+				  FMODE_EXCL, zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out;
+	}
+	zram->bdev = bdev;
+
+	zram->nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (!zram->nr_blocks || bdev->bd_disk == zram->disk) {
+		ret = -EINVAL;
+		goto fail;
+	}
+
+	zram->wb_bitmap = vzalloc(BITS_TO_LONGS(zram->nr_blocks) *
+				  sizeof(unsigned long));
+	if (!zram->wb_bitmap) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		zram->wb_pages[i] = alloc_page(GFP_KERNEL);
+		if (!zram->wb_pages[i]) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	strlcpy(zram->backing_dev, path, sizeof(zram->backing_dev));
+	pr_info("Using %s as backing device: %lu pages\n", path,
+		zram->nr_blocks);
+	goto out;
+
+fail:
+	zram_release_backing_dev(zram);
+out:
+	mutex_unlock(&zram->init_lock);
+	return ret;
+}
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
+	/* the writeback work takes init_lock itself */
+	cancel_delayed_work_sync(&zram->wb_work);
+
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_free_streams(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
+		if (zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB) ||
+		    !zram->table[index].entry)
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page(zram->table[index].page);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zram_entry_put(zram, zram->table[index].entry);
 	}
+	zram->dedup_tree = RB_ROOT;
+	if (zram->wb_bitmap)
+		memset(zram->wb_bitmap, 0, BITS_TO_LONGS(zram->nr_blocks) *
+		       sizeof(unsigned long));
 
 	vfree(zram->table);
 	zram->table = NULL;
+	vfree(zram->slot_lock);
+	zram->slot_lock = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -634,23 +1374,18 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_alloc_streams(zram, num_possible_cpus());
+	if (ret) {
+		/* No table yet, so no table entries to free on cleanup */
+		zram->disksize = 0;
 		goto fail;
 	}
 
 	num_pages = zram->disksize >> PAGE_SHIFT;
 	zram->table = vzalloc(num_pages * sizeof(*zram->table));
-	if (!zram->table) {
+	zram->slot_lock = vzalloc(BITS_TO_LONGS(num_pages) *
+				  sizeof(unsigned long));
+	if (!zram->table || !zram->slot_lock) {
 		pr_err("Error allocating zram address table\n");
 		/* To prevent accessing table entries during cleanup */
 		zram->disksize = 0;
@@ -663,7 +1398,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -671,6 +1406,8 @@ int zram_init_device(struct zram *zram)
 	}
 
 	zram->init_done = 1;
+	if (zram->bdev && zram->wb_idle_age)
+		zram_kick_writeback(zram, zram->wb_idle_age * HZ);
 	mutex_unlock(&zram->init_lock);
 
 	pr_debug("Initialization done!\n");
@@ -689,7 +1426,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_slot(zram, index);
 	zram_free_page(zram, index);
+	zram_unlock_slot(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -702,8 +1441,18 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
+	mutex_init(&zram->partial_lock);
 	mutex_init(&zram->init_lock);
+	INIT_LIST_HEAD(&zram->idle_streams);
+	spin_lock_init(&zram->stream_lock);
+	init_waitqueue_head(&zram->stream_wait);
+	zram->dedup_tree = RB_ROOT;
+	spin_lock_init(&zram->dedup_lock);
+	spin_lock_init(&zram->wb_bitmap_lock);
+	init_rwsem(&zram->wb_sem);
+	INIT_DELAYED_WORK(&zram->wb_work, zram_wb_work);
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 	spin_lock_init(&zram->stat64_lock);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
@@ -764,6 +1513,8 @@ out:
 
 static void destroy_device(struct zram *zram)
 {
+	zram_release_backing_dev(zram);
+
 	sysfs_remove_group(&disk_to_dev(zram->disk)->kobj,
 			&zram_disk_attr_group);
 
@@ -787,11 +1538,23 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_entry_cache = KMEM_CACHE(zram_entry, 0);
+	if (!zram_entry_cache) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	zram_wb_wq = alloc_workqueue("zram_wb", WQ_MEM_RECLAIM, 1);
+	if (!zram_wb_wq) {
+		ret = -ENOMEM;
+		goto destroy_cache;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	if (!num_devices) {
@@ -821,6 +1584,10 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_wq:
+	destroy_workqueue(zram_wb_wq);
+destroy_cache:
+	kmem_cache_destroy(zram_entry_cache);
 out:
 	return ret;
 }
@@ -841,6 +1608,8 @@ static void __exit zram_exit(void)
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(devices);
+	destroy_workqueue(zram_wb_wq);
+	kmem_cache_destroy(zram_entry_cache);
 	pr_debug("Cleanup done!\n");
 }
 
@@ -17,8 +17,13 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/crypto.h>
+#include <linux/rbtree.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
 
-#include "xvmalloc.h"
+#include "../zsmalloc/zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,23 +31,14 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Crypto API compression algorithm used unless another one is set */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -51,8 +47,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -66,27 +62,76 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
+/* pages written back to the backing device per bio */
+#define ZRAM_WB_BATCH		32
+
+/*
+ * Page ages are 16 bit counts of 16 second ticks, to fit the padding of
+ * struct table. They wrap after about 12 days, so wb_idle_age is kept
+ * below half that for writeback to see every idle page before it wraps.
+ */
+#define ZRAM_AGE_SHIFT		4
+#define ZRAM_MAX_IDLE_AGE	((1 << 15) << ZRAM_AGE_SHIFT)
+
+/* compressed data can be larger than a page */
+#define ZRAM_STREAM_BUFFER_ORDER	1
+#define ZRAM_STREAM_BUFFER_SIZE		(PAGE_SIZE << ZRAM_STREAM_BUFFER_ORDER)
+
 /* Flags for zram pages (table[page_no].flags) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is one word repeated, kept in table[page_no].element */
+	ZRAM_SAME,
+
+	/* Page is on the backing device, at block table[page_no].element */
+	ZRAM_WB,
+
+	/* Page is being written back; cleared if it is overwritten */
+	ZRAM_UNDER_WB,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * A compressed object, shared by all table entries with the same contents
+ * while dedup is enabled. Indexed by checksum in zram->dedup_tree.
+ */
+struct zram_entry {
+	struct rb_node rb_node;
+	u32 checksum;		/* of the uncompressed page */
+	u32 refcount;		/* protected by zram->dedup_lock */
+	unsigned long handle;	/* zsmalloc handle */
+	unsigned int len;	/* compressed size */
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		struct zram_entry *entry;
+		struct page *page;	/* if ZRAM_UNCOMPRESSED */
+		unsigned long element;	/* if ZRAM_SAME or ZRAM_WB */
+	};
+	u16 ac_time;	/* last read or write, see zram_age_now() */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
 
+/*
+ * A compression stream: a transform of the device's compressor and an
+ * output buffer. A device keeps one per possible cpu, so that writers
+ * compress in parallel even on cpus hotplugged in after init, and a per-cpu set that reads decompress with, so
+ * that they never wait for writers.
+ */
+struct zram_stream {
+	struct crypto_comp *tfm;
+	void *buffer;		/* ZRAM_STREAM_BUFFER_SIZE bytes */
+	struct list_head list;	/* on zram->idle_streams */
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -95,20 +140,37 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 num_compress;	/* pages run through the compressor */
+	u64 compr_time;		/* ns spent compressing them */
+	u64 num_decompress;	/* pages run through the decompressor */
+	u64 decompr_time;	/* ns spent decompressing them */
+	u64 dup_data_size;	/* compressed bytes not stored again */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of same filled pages, incl. zero */
+	atomic_t pages_dup;	/* no. of pages sharing a stored object */
+	atomic_t pages_wb;	/* no. of pages on the backing device */
+	u64 wb_bytes;		/* written back, in total */
+	u64 num_wb_reads;	/* pages read back from the backing device */
+	u64 wb_read_time;	/* ns spent reading them */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct list_head idle_streams;	/* of struct zram_stream */
+	spinlock_t stream_lock;	/* protect idle_streams */
+	wait_queue_head_t stream_wait;	/* for a stream to become idle */
+	struct zram_stream __percpu *read_streams; /* used preempt disabled */
 	struct table *table;
+	unsigned long *slot_lock; /* one bit lock per table entry */
+	struct rb_root dedup_tree;	/* of struct zram_entry */
+	spinlock_t dedup_lock;	/* protect dedup_tree and refcounts */
+	bool use_dedup;		/* fixed while initialized */
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	struct mutex partial_lock; /* serialize read-modify-write of
+				    * partial pages */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -119,6 +181,27 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* crypto API name of the compressor; fixed while initialized */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+
+	/*
+	 * Optional backing device for incompressible and idle pages. Set
+	 * only while not initialized.
+	 */
+	struct block_device *bdev;
+	char backing_dev[64];		/* its path */
+	unsigned long nr_blocks;	/* of PAGE_SIZE on bdev */
+	unsigned long *wb_bitmap;	/* blocks in use */
+	spinlock_t wb_bitmap_lock;
+	/*
+	 * Held for read across reads from bdev, and for write while
+	 * allocating blocks, so that a block freed by an overwrite is not
+	 * reused while still being read.
+	 */
+	struct rw_semaphore wb_sem;
+	struct page *wb_pages[ZRAM_WB_BATCH];
+	struct delayed_work wb_work;
+	unsigned int wb_idle_age;	/* seconds; 0 = huge pages only */
 
 	struct zram_stats stats;
 };
@@ -131,5 +214,8 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_writeback(struct zram *zram);
+extern void zram_kick_writeback(struct zram *zram, unsigned long delay);
 
 #endif
@@ -0,0 +1,775 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Objects are grouped by size into classes ZS_SIZE_CLASS_DELTA bytes
+ * apart.  A class packs its objects back to back into "zspages" of one to
+ * ZS_MAX_PAGES_PER_ZSPAGE order-0 pages, as many as waste the least space
+ * for its size, so objects may straddle a page boundary.  No block
+ * headers or free space ever mix between classes: the only per-object
+ * overhead is one word in front of it, the back-pointer to its handle.
+ *
+ * A handle is a small slab object recording where its object lives.  That
+ * indirection lets zs_compact() move objects out of sparsely used zspages
+ * into fuller ones of the same class and give whole pages back.  A handle
+ * is pinned while its object is mapped or being freed, and compaction
+ * leaves pinned objects alone.
+ */
+
+#ifdef CONFIG_ZSMALLOC_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zsmalloc.h"
+
+#define ZS_HANDLE_SIZE		sizeof(unsigned long)
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_OBJ_SIZE		PAGE_SIZE	/* back-pointer included */
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES		((ZS_MAX_OBJ_SIZE - ZS_MIN_ALLOC_SIZE) / \
+					ZS_SIZE_CLASS_DELTA + 1)
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* end of a zspage's free object list */
+#define ZS_NO_FREE		(~0U >> 1)
+
+/*
+ * The first word of an object is the back-pointer to its handle, tagged
+ * with OBJ_ALLOCATED_TAG, or if the object is free, the index of the next
+ * free one shifted past the tag.
+ */
+#define OBJ_ALLOCATED_TAG	1UL
+
+/* in zs_handle->pin */
+#define HANDLE_PIN_BIT		0
+
+enum zs_fullness {
+	ZS_ALMOST_FULL,		/* at least 3/4 of the objects in use */
+	ZS_ALMOST_EMPTY,
+	ZS_FULL,
+	ZS_NR_FULLNESS,
+	ZS_EMPTY = ZS_NR_FULLNESS,	/* about to be freed */
+	ZS_ISOLATED,		/* being emptied by compaction */
+};
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;	/* on class->fullness_list[fullness] */
+	struct size_class *class;
+	unsigned int inuse;	/* objects allocated */
+	unsigned int freeidx;	/* first free object or ZS_NO_FREE */
+	enum zs_fullness fullness;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+struct zs_handle {
+	unsigned long pin;
+	struct zspage *zspage;
+	unsigned int idx;	/* of the object in zspage */
+};
+
+struct size_class {
+	spinlock_t lock;
+	unsigned int size;	/* of objects, back-pointer included */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+	struct list_head fullness_list[ZS_NR_FULLNESS];
+
+	/* protected by lock; read racily for stats */
+	unsigned long nr_zspages;
+	unsigned long nr_fullness[ZS_NR_FULLNESS];
+	unsigned long objs_inuse;
+	unsigned long pages_compacted;
+};
+
+struct zs_pool {
+	char name[32];
+	atomic_long_t pages_allocated;
+	struct dentry *stats_dentry;
+	struct size_class classes[ZS_SIZE_CLASSES];
+};
+
+/*
+ * Objects straddling two pages are copied here by zs_map_object() and
+ * back by zs_unmap_object().
+ */
+struct zs_map_area {
+	char *buf;		/* ZS_MAX_OBJ_SIZE bytes */
+	char *vaddr;		/* kmap of a non straddling object */
+};
+
+static DEFINE_PER_CPU(struct zs_map_area, zs_map_areas);
+
+static struct kmem_cache *zs_handle_cachep;
+static struct kmem_cache *zs_zspage_cachep;
+static struct dentry *zs_debugfs_root;
+
+static int get_size_class_index(size_t size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Number of pages per zspage that leaves the smallest fraction of it
+ * unused for objects of class_size.
+ */
+static unsigned int get_pages_per_zspage(unsigned int class_size)
+{
+	unsigned int i, best = 1, best_used = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int waste = zspage_size % class_size;
+		unsigned int used = (zspage_size - waste) * 100 / zspage_size;
+
+		if (used > best_used) {
+			best_used = used;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static void obj_location(struct size_class *class, unsigned int idx,
+			 unsigned int *pg, unsigned int *off)
+{
+	unsigned long offset = (unsigned long)idx * class->size;
+
+	*pg = offset >> PAGE_SHIFT;
+	*off = offset & ~PAGE_MASK;
+}
+
+/* Reads or replaces the first word of object idx; returns the old one */
+static unsigned long obj_head(struct zspage *zspage, unsigned int idx,
+			      bool set, unsigned long val)
+{
+	unsigned int pg, off;
+	unsigned long *head, old;
+	void *vaddr;
+
+	obj_location(zspage->class, idx, &pg, &off);
+	vaddr = kmap_atomic(zspage->pages[pg], KM_USER0);
+	head = vaddr + off;
+	old = *head;
+	if (set)
+		*head = val;
+	kunmap_atomic(vaddr, KM_USER0);
+
+	return old;
+}
+
+static enum zs_fullness get_fullness(struct size_class *class,
+				     struct zspage *zspage)
+{
+	if (zspage->inuse == 0)
+		return ZS_EMPTY;
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+	if (zspage->inuse * 4 >= class->objs_per_zspage * 3)
+		return ZS_ALMOST_FULL;
+	return ZS_ALMOST_EMPTY;
+}
+
+static void insert_zspage(struct size_class *class, struct zspage *zspage,
+			  enum zs_fullness fullness)
+{
+	zspage->fullness = fullness;
+	if (fullness >= ZS_NR_FULLNESS)
+		return;
+	list_add(&zspage->list, &class->fullness_list[fullness]);
+	class->nr_fullness[fullness]++;
+}
+
+static void remove_zspage(struct size_class *class, struct zspage *zspage)
+{
+	if (zspage->fullness >= ZS_NR_FULLNESS)
+		return;
+	list_del_init(&zspage->list);
+	class->nr_fullness[zspage->fullness]--;
+}
+
+/* Moves zspage to the list matching its use, unless being compacted */
+static void fix_fullness(struct size_class *class, struct zspage *zspage)
+{
+	enum zs_fullness fullness;
+
+	if (zspage->fullness == ZS_ISOLATED)
+		return;
+	fullness = get_fullness(class, zspage);
+	if (fullness == zspage->fullness)
+		return;
+	remove_zspage(class, zspage);
+	insert_zspage(class, zspage, fullness);
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	unsigned int i, nr_pages = zspage->class->pages_per_zspage;
+
+	for (i = 0; i < nr_pages; i++)
+		if (zspage->pages[i])
+			__free_page(zspage->pages[i]);
+	atomic_long_sub(nr_pages, &pool->pages_allocated);
+	kmem_cache_free(zs_zspage_cachep, zspage);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+				   struct size_class *class, gfp_t flags)
+{
+	unsigned int i, idx, pg, off, cur_pg = ~0U;
+	struct zspage *zspage;
+	void *vaddr = NULL;
+
+	zspage = kmem_cache_zalloc(zs_zspage_cachep, flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+	zspage->class = class;
+	INIT_LIST_HEAD(&zspage->list);
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i]) {
+			free_zspage(pool, zspage);
+			return NULL;
+		}
+	}
+
+	/* link all objects into the free list */
+	for (idx = 0; idx < class->objs_per_zspage; idx++) {
+		obj_location(class, idx, &pg, &off);
+		if (pg != cur_pg) {
+			if (vaddr)
+				kunmap_atomic(vaddr, KM_USER0);
+			vaddr = kmap_atomic(zspage->pages[pg], KM_USER0);
+			cur_pg = pg;
+		}
+		*(unsigned long *)(vaddr + off) =
+			(idx + 1 < class->objs_per_zspage ?
+			 idx + 1 : ZS_NO_FREE) << 1;
+	}
+	kunmap_atomic(vaddr, KM_USER0);
+	zspage->freeidx = 0;
+	zspage->fullness = ZS_EMPTY;
+
+	return zspage;
+}
+
+/* Called with class->lock held, on a zspage with a free object */
+static void obj_malloc(struct size_class *class, struct zspage *zspage,
+		       struct zs_handle *handle)
+{
+	unsigned int idx = zspage->freeidx;
+	unsigned long next;
+
+	BUG_ON(idx == ZS_NO_FREE);
+	next = obj_head(zspage, idx, true,
+			(unsigned long)handle | OBJ_ALLOCATED_TAG);
+	zspage->freeidx = next >> 1;
+	zspage->inuse++;
+	class->objs_inuse++;
+	handle->zspage = zspage;
+	handle->idx = idx;
+	fix_fullness(class, zspage);
+}
+
+/* Called with class->lock held */
+static void obj_free(struct size_class *class, struct zspage *zspage,
+		     unsigned int idx)
+{
+	obj_head(zspage, idx, true, (unsigned long)zspage->freeidx << 1);
+	zspage->freeidx = idx;
+	zspage->inuse--;
+	class->objs_inuse--;
+	fix_fullness(class, zspage);
+}
+
+/* Copies an object, back-pointer included, between two zspages */
+static void obj_copy(struct size_class *class, struct zspage *dst,
+		     unsigned int didx, struct zspage *src, unsigned int sidx)
+{
+	unsigned long doff = (unsigned long)didx * class->size;
+	unsigned long soff = (unsigned long)sidx * class->size;
+	unsigned int len = class->size;
+
+	while (len) {
+		unsigned int d = doff & ~PAGE_MASK, s = soff & ~PAGE_MASK;
+		unsigned int n = min3(len, (unsigned int)PAGE_SIZE - d,
+				      (unsigned int)PAGE_SIZE - s);
+		void *dv, *sv;
+
+		dv = kmap_atomic(dst->pages[doff >> PAGE_SHIFT], KM_USER0);
+		sv = kmap_atomic(src->pages[soff >> PAGE_SHIFT], KM_USER1);
+		memcpy(dv + d, sv + s, n);
+		kunmap_atomic(sv, KM_USER1);
+		kunmap_atomic(dv, KM_USER0);
+
+		doff += n;
+		soff += n;
+		len -= n;
+	}
+}
+
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	int i;
+
+	for (i = ZS_ALMOST_FULL; i <= ZS_ALMOST_EMPTY; i++)
+		if (!list_empty(&class->fullness_list[i]))
+			return list_first_entry(&class->fullness_list[i],
+						struct zspage, list);
+	return NULL;
+}
+
+static void pin_handle(struct zs_handle *handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, &handle->pin);
+}
+
+static void unpin_handle(struct zs_handle *handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, &handle->pin);
+}
+
+/**
+ * zs_malloc - allocate an object from a pool
+ * @pool: pool to allocate from
+ * @size: object size, at most ZS_MAX_ALLOC_SIZE
+ * @flags: for the pages of new zspages
+ *
+ * Returns a handle to the object, to be passed to zs_map_object() to
+ * access it, or 0 on failure.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	struct zs_handle *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kmem_cache_zalloc(zs_handle_cachep, flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	class = &pool->classes[get_size_class_index(size + ZS_HANDLE_SIZE)];
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class, flags);
+		if (unlikely(!zspage)) {
+			kmem_cache_free(zs_handle_cachep, handle);
+			return 0;
+		}
+		spin_lock(&class->lock);
+		class->nr_zspages++;
+	}
+	obj_malloc(class, zspage, handle);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zspage *zspage;
+	bool empty;
+
+	if (unlikely(!handle))
+		return;
+
+	pin_handle(handle);
+	zspage = handle->zspage;
+	class = zspage->class;
+	spin_lock(&class->lock);
+	obj_free(class, zspage, handle->idx);
+	empty = zspage->fullness == ZS_EMPTY;
+	if (empty)
+		class->nr_zspages--;
+	spin_unlock(&class->lock);
+	unpin_handle(handle);
+
+	kmem_cache_free(zs_handle_cachep, handle);
+	if (empty)
+		free_zspage(pool, zspage);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get a pointer to an object
+ * @pool: pool it was allocated from
+ * @handle: handle returned by zs_malloc()
+ *
+ * The object stays where it is until zs_unmap_object(), with preemption
+ * disabled; only one object can be mapped at a time per cpu.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zs_map_area *area;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned int pg, off, first;
+	void *vaddr;
+
+	pin_handle(handle);
+	zspage = handle->zspage;
+	class = zspage->class;
+	obj_location(class, handle->idx, &pg, &off);
+
+	area = &__get_cpu_var(zs_map_areas);
+	if (off + class->size <= PAGE_SIZE) {
+		area->vaddr = kmap_atomic(zspage->pages[pg], KM_USER0);
+		return area->vaddr + off + ZS_HANDLE_SIZE;
+	}
+
+	/* straddles two pages: work on a copy */
+	area->vaddr = NULL;
+	first = PAGE_SIZE - off;
+	vaddr = kmap_atomic(zspage->pages[pg], KM_USER0);
+	memcpy(area->buf, vaddr + off, first);
+	kunmap_atomic(vaddr, KM_USER0);
+	vaddr = kmap_atomic(zspage->pages[pg + 1], KM_USER0);
+	memcpy(area->buf + first, vaddr, class->size - first);
+	kunmap_atomic(vaddr, KM_USER0);
+
+	return area->buf + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zs_map_area *area;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned int pg, off, first;
+	void *vaddr;
+
+	area = &__get_cpu_var(zs_map_areas);
+	if (area->vaddr) {
+		kunmap_atomic(area->vaddr, KM_USER0);
+		goto out;
+	}
+
+	zspage = handle->zspage;
+	class = zspage->class;
+	obj_location(class, handle->idx, &pg, &off);
+	first = PAGE_SIZE - off;
+	vaddr = kmap_atomic(zspage->pages[pg], KM_USER0);
+	memcpy(vaddr + off, area->buf, first);
+	kunmap_atomic(vaddr, KM_USER0);
+	vaddr = kmap_atomic(zspage->pages[pg + 1], KM_USER0);
+	memcpy(vaddr, area->buf + first, class->size - first);
+	kunmap_atomic(vaddr, KM_USER0);
+out:
+	unpin_handle(handle);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Moves all objects of the least used zspages of a class into others
+ * with room, and frees the emptied zspages.  Stops at the first pinned
+ * object, or when the other zspages could not take all objects of the
+ * next one.
+ */
+static unsigned long compact_class(struct zs_pool *pool,
+				   struct size_class *class)
+{
+	unsigned long freed = 0;
+	struct zspage *src, *dst;
+	unsigned int idx;
+
+	spin_lock(&class->lock);
+	for (;;) {
+		unsigned long nr_free;
+		struct list_head *list;
+
+		list = &class->fullness_list[ZS_ALMOST_EMPTY];
+		if (list_empty(list))
+			break;
+		/* the least used one; new objects go to the list head */
+		src = NULL;
+		list_for_each_entry(dst, list, list)
+			if (!src || dst->inuse < src->inuse)
+				src = dst;
+
+		nr_free = class->nr_zspages * class->objs_per_zspage -
+			class->objs_inuse;
+		if (nr_free - (class->objs_per_zspage - src->inuse) <
+		    src->inuse)
+			break;
+
+		remove_zspage(class, src);
+		src->fullness = ZS_ISOLATED;
+
+		for (idx = 0; src->inuse && idx < class->objs_per_zspage;
+		     idx++) {
+			struct zs_handle *handle;
+			unsigned long head = obj_head(src, idx, false, 0);
+
+			if (!(head & OBJ_ALLOCATED_TAG))
+				continue;
+			handle = (struct zs_handle *)(head & ~OBJ_ALLOCATED_TAG);
+			if (!bit_spin_trylock(HANDLE_PIN_BIT, &handle->pin))
+				break;
+
+			dst = find_get_zspage(class);
+			BUG_ON(!dst);
+			obj_malloc(class, dst, handle);
+			obj_copy(class, dst, handle->idx, src, idx);
+			obj_free(class, src, idx);
+			unpin_handle(handle);
+		}
+
+		src->fullness = ZS_NR_FULLNESS;	/* on no list */
+		if (src->inuse) {
+			/* ran into a pinned object */
+			insert_zspage(class, src, get_fullness(class, src));
+			break;
+		}
+
+		class->nr_zspages--;
+		class->pages_compacted += class->pages_per_zspage;
+		freed += class->pages_per_zspage;
+		spin_unlock(&class->lock);
+		free_zspage(pool, src);
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - compact all size classes of a pool
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed.  May sleep.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		freed += compact_class(pool, &pool->classes[i]);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+#ifdef CONFIG_DEBUG_FS
+/* per size class occupancy, for classes that ever had a zspage */
+static int zs_stats_show(struct seq_file *s, void *v)
+{
+	struct zs_pool *pool = s->private;
+	unsigned long zspages, inuse;
+	int i;
+
+	seq_printf(s, " %5s %5s %6s %10s %10s %10s %10s %10s %10s\n",
+		   "size", "pages", "objs", "almost_ful", "almost_emp",
+		   "full", "objs_used", "objs_total", "compacted");
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		spin_lock(&class->lock);
+		zspages = class->nr_zspages;
+		inuse = class->objs_inuse;
+		if (zspages || class->pages_compacted)
+			seq_printf(s, " %5u %5u %6u %10lu %10lu %10lu "
+				   "%10lu %10lu %10lu\n",
+				   class->size, class->pages_per_zspage,
+				   class->objs_per_zspage,
+				   class->nr_fullness[ZS_ALMOST_FULL],
+				   class->nr_fullness[ZS_ALMOST_EMPTY],
+				   class->nr_fullness[ZS_FULL], inuse,
+				   zspages * class->objs_per_zspage,
+				   class->pages_compacted);
+		spin_unlock(&class->lock);
+	}
+
+	return 0;
+}
+
+static int zs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_show, inode->i_private);
+}
+
+static const struct file_operations zs_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = zs_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void zs_pool_stats_create(struct zs_pool *pool)
+{
+	if (!zs_debugfs_root)
+		return;
+	pool->stats_dentry = debugfs_create_file(pool->name, S_IRUGO,
+						 zs_debugfs_root, pool,
+						 &zs_stats_fops);
+}
+
+static void zs_pool_stats_destroy(struct zs_pool *pool)
+{
+	debugfs_remove(pool->stats_dentry);
+}
+#else
+static void zs_pool_stats_create(struct zs_pool *pool)
+{
+}
+
+static void zs_pool_stats_destroy(struct zs_pool *pool)
+{
+}
+#endif
+
+/**
+ * zs_create_pool - create a pool of objects
+ * @name: names the pool's statistics in debugfs
+ */
+struct zs_pool *zs_create_pool(const char *name)
+{
+	struct zs_pool *pool;
+	int i, j;
+
+	pool = vzalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	strlcpy(pool->name, name, sizeof(pool->name));
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		spin_lock_init(&class->lock);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					 PAGE_SIZE / class->size;
+		for (j = 0; j < ZS_NR_FULLNESS; j++)
+			INIT_LIST_HEAD(&class->fullness_list[j]);
+	}
+	atomic_long_set(&pool->pages_allocated, 0);
+	zs_pool_stats_create(pool);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+/* All objects must have been freed */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, j;
+
+	zs_pool_stats_destroy(pool);
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		for (j = 0; j < ZS_NR_FULLNESS; j++)
+			if (!list_empty(&pool->classes[i].fullness_list[j]))
+				pr_info("zsmalloc: %s: freeing non-empty class "
+					"%u\n", pool->name,
+					pool->classes[i].size);
+	vfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+static void zs_free_map_areas(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(zs_map_areas, cpu).buf);
+		per_cpu(zs_map_areas, cpu).buf = NULL;
+	}
+}
+
+static int __init zs_init(void)
+{
+	int cpu;
+
+	/* objects of the largest class take up whole pages */
+	BUILD_BUG_ON(ZS_MIN_ALLOC_SIZE + (ZS_SIZE_CLASSES - 1) *
+		     ZS_SIZE_CLASS_DELTA != ZS_MAX_OBJ_SIZE);
+
+	for_each_possible_cpu(cpu) {
+		per_cpu(zs_map_areas, cpu).buf =
+			kmalloc(ZS_MAX_OBJ_SIZE, GFP_KERNEL);
+		if (!per_cpu(zs_map_areas, cpu).buf)
+			goto fail;
+	}
+
+	zs_handle_cachep = kmem_cache_create("zs_handle",
+				sizeof(struct zs_handle), 0, 0, NULL);
+	zs_zspage_cachep = kmem_cache_create("zs_zspage",
+				sizeof(struct zspage), 0, 0, NULL);
+	if (!zs_handle_cachep || !zs_zspage_cachep)
+		goto fail;
+
+#ifdef CONFIG_DEBUG_FS
+	zs_debugfs_root = debugfs_create_dir("zsmalloc", NULL);
+#endif
+	return 0;
+
+fail:
+	if (zs_handle_cachep)
+		kmem_cache_destroy(zs_handle_cachep);
+	if (zs_zspage_cachep)
+		kmem_cache_destroy(zs_zspage_cachep);
+	zs_free_map_areas();
+	return -ENOMEM;
+}
+
+static void __exit zs_exit(void)
+{
+	debugfs_remove(zs_debugfs_root);
+	kmem_cache_destroy(zs_handle_cachep);
+	kmem_cache_destroy(zs_zspage_cachep);
+	zs_free_map_areas();
+}
+
+module_init(zs_init);
+module_exit(zs_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("Allocator for compressed pages");
@@ -39,6 +39,9 @@
 #define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Ages beyond this many block allocations all score the same for cost-benefit GC */
+#define YAFFS_GC_MAX_AGE 0xffff
+
 #include "yaffs_ecc.h"
 
 /* Forward declarations */
@@ -46,6 +49,9 @@
 static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 			     const u8 * buffer, int n_bytes, int use_reserve);
 
+static void yaffs_skip_rest_of_chunk_block(struct yaffs_dev *dev,
+					   int nand_chunk);
+
 
 
 /* Function to calculate chunk and offset */
@@ -142,10 +148,16 @@ static int yaffs_init_tmp_buffers(struct yaffs_dev *dev)
 	return buf ? YAFFS_OK : YAFFS_FAIL;
 }
 
+/*
+ * Lookups and readpage only share the meta lock, so the temp buffers are
+ * handed out under dev->rd_lock.
+ */
 u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev, int line_no)
 {
 	int i, j;
 
+	spin_lock(&dev->rd_lock);
+
 	dev->temp_in_use++;
 	if (dev->temp_in_use > dev->max_temp)
 		dev->max_temp = dev->temp_in_use;
@@ -160,6 +172,7 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev, int line_no)
 					    dev->temp_buffer[j].line;
 			}
 
+			spin_unlock(&dev->rd_lock);
 			return dev->temp_buffer[i].buffer;
 		}
 	}
@@ -176,6 +189,8 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev, int line_no)
 	 */
 
 	dev->unmanaged_buffer_allocs++;
+	spin_unlock(&dev->rd_lock);
+
 	return kmalloc(dev->data_bytes_per_chunk, GFP_NOFS);
 
 }
@@ -184,22 +199,29 @@ void yaffs_release_temp_buffer(struct yaffs_dev *dev, u8 * buffer, int line_no)
 {
 	int i;
 
+	spin_lock(&dev->rd_lock);
+
 	dev->temp_in_use--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->temp_buffer[i].buffer == buffer) {
 			dev->temp_buffer[i].line = 0;
+			spin_unlock(&dev->rd_lock);
 			return;
 		}
 	}
 
+	if (buffer)
+		dev->unmanaged_buffer_deallocs++;
+
+	spin_unlock(&dev->rd_lock);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		yaffs_trace(YAFFS_TRACE_BUFFERS,
 		  "Releasing unmanaged temp buffer in line %d",
 		   line_no);
 		kfree(buffer);
-		dev->unmanaged_buffer_deallocs++;
 	}
 
 }
@@ -252,6 +274,7 @@ static void yaffs_handle_chunk_update(struct yaffs_dev *dev, int nand_chunk,
 	tags = tags;
 }
 
+/* Readers that only share the meta lock call this under dev->rd_lock */
 void yaffs_handle_chunk_error(struct yaffs_dev *dev,
 			      struct yaffs_block_info *bi)
 {
@@ -285,7 +308,7 @@ static void yaffs_handle_chunk_wr_error(struct yaffs_dev *dev, int nand_chunk,
 
 	/* Delete the chunk */
 	yaffs_chunk_del(dev, nand_chunk, 1, __LINE__);
-	yaffs_skip_rest_of_block(dev);
+	yaffs_skip_rest_of_chunk_block(dev, nand_chunk);
 }
 
 /*
@@ -440,16 +463,64 @@ static int yaffs_find_alloc_block(struct yaffs_dev *dev)
 	return -1;
 }
 
+/*
+ * yaffs2 scanning takes the copy of a chunk in the block with the highest
+ * sequence number, so a chunk must never be written to a block older than
+ * one holding an earlier copy of it.  With one allocation block that holds
+ * by itself.  With a separate block for GC copies (param.gc_stream) neither
+ * allocation block need be the newest, so:
+ *
+ * - normal writes only go to the newest block.
+ * - GC copies only go to a block newer than the block being collected,
+ *   which holds the latest copy of everything it has live.
+ *
+ * An allocation block that doesn't qualify is closed off as if it were full
+ * and a new one, with the next sequence number, is started.
+ */
 static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
-			     struct yaffs_block_info **block_ptr)
+			     int gc_copy, struct yaffs_block_info **block_ptr)
 {
 	int ret_val;
 	struct yaffs_block_info *bi;
+	int *alloc_block = &dev->alloc_block;
+	u32 *alloc_page = &dev->alloc_page;
+	unsigned min_seq = dev->seq_number;
+
+	if (gc_copy && dev->param.gc_stream && dev->gc_block > 0) {
+		bi = yaffs_get_block_info(dev, dev->gc_block);
+		min_seq = bi->seq_number + 1;
+
+		if (dev->gc_alloc_block > 0 &&
+		    yaffs_get_block_info(dev, dev->gc_alloc_block)->seq_number <
+		    min_seq) {
+			yaffs_skip_rest_of_gc_block(dev);
+			dev->n_alloc_closes++;
+		}
+
+		/* Only start a new GC block while there are erased blocks to
+		 * spare; short of them, GC copies share the normal block.
+		 */
+		if (dev->gc_alloc_block > 0 ||
+		    dev->n_erased_blocks > dev->param.n_reserved_blocks +
+		    yaffs_calc_checkpt_blocks_required(dev) + 1) {
+			alloc_block = &dev->gc_alloc_block;
+			alloc_page = &dev->gc_alloc_page;
+		} else {
+			min_seq = dev->seq_number;
+		}
+	}
 
-	if (dev->alloc_block < 0) {
+	if (dev->param.is_yaffs2 && alloc_block == &dev->alloc_block &&
+	    dev->alloc_block > 0 &&
+	    yaffs_get_block_info(dev, dev->alloc_block)->seq_number < min_seq) {
+		yaffs_skip_rest_of_block(dev);
+		dev->n_alloc_closes++;
+	}
+
+	if (*alloc_block < 0) {
 		/* Get next block to allocate off */
-		dev->alloc_block = yaffs_find_alloc_block(dev);
-		dev->alloc_page = 0;
+		*alloc_block = yaffs_find_alloc_block(dev);
+		*alloc_page = 0;
 	}
 
 	if (!use_reserver && !yaffs_check_alloc_available(dev, 1)) {
@@ -458,26 +529,26 @@ static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 	}
 
 	if (dev->n_erased_blocks < dev->param.n_reserved_blocks
-	    && dev->alloc_page == 0)
+	    && *alloc_page == 0)
 		yaffs_trace(YAFFS_TRACE_ALLOCATE, "Allocating reserve");
 
 	/* Next page please.... */
-	if (dev->alloc_block >= 0) {
-		bi = yaffs_get_block_info(dev, dev->alloc_block);
+	if (*alloc_block >= 0) {
+		bi = yaffs_get_block_info(dev, *alloc_block);
 
-		ret_val = (dev->alloc_block * dev->param.chunks_per_block) +
-		    dev->alloc_page;
+		ret_val = (*alloc_block * dev->param.chunks_per_block) +
+		    *alloc_page;
 		bi->pages_in_use++;
-		yaffs_set_chunk_bit(dev, dev->alloc_block, dev->alloc_page);
+		yaffs_set_chunk_bit(dev, *alloc_block, *alloc_page);
 
-		dev->alloc_page++;
+		(*alloc_page)++;
 
 		dev->n_free_chunks--;
 
 		/* If the block is full set the state to full */
-		if (dev->alloc_page >= dev->param.chunks_per_block) {
+		if (*alloc_page >= dev->param.chunks_per_block) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
-			dev->alloc_block = -1;
+			*alloc_block = -1;
 		}
 
 		if (block_ptr)
@@ -500,6 +571,9 @@ static int yaffs_get_erased_chunks(struct yaffs_dev *dev)
 	if (dev->alloc_block > 0)
 		n += (dev->param.chunks_per_block - dev->alloc_page);
 
+	if (dev->gc_alloc_block > 0)
+		n += (dev->param.chunks_per_block - dev->gc_alloc_page);
+
 	return n;
 
 }
@@ -520,9 +594,33 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 	}
 }
 
+/* The same for the block GC copies are allocated off. */
+void yaffs_skip_rest_of_gc_block(struct yaffs_dev *dev)
+{
+	if (dev->gc_alloc_block > 0) {
+		struct yaffs_block_info *bi =
+		    yaffs_get_block_info(dev, dev->gc_alloc_block);
+		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
+			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			dev->gc_alloc_block = -1;
+		}
+	}
+}
+
+/* Skips the rest of whichever allocation block nand_chunk came from. */
+static void yaffs_skip_rest_of_chunk_block(struct yaffs_dev *dev,
+					   int nand_chunk)
+{
+	if (nand_chunk / dev->param.chunks_per_block == dev->gc_alloc_block)
+		yaffs_skip_rest_of_gc_block(dev);
+	else
+		yaffs_skip_rest_of_block(dev);
+}
+
 static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 				 const u8 * data,
-				 struct yaffs_ext_tags *tags, int use_reserver)
+				 struct yaffs_ext_tags *tags, int use_reserver,
+				 int gc_copy)
 {
 	int attempts = 0;
 	int write_ok = 0;
@@ -534,7 +632,7 @@ static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 		struct yaffs_block_info *bi = 0;
 		int erased_ok = 0;
 
-		chunk = yaffs_alloc_chunk(dev, use_reserver, &bi);
+		chunk = yaffs_alloc_chunk(dev, use_reserver, gc_copy, &bi);
 		if (chunk < 0) {
 			/* no space */
 			break;
@@ -581,7 +679,7 @@ static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 				 * skip rest of block and
 				 * try another chunk */
 				yaffs_chunk_del(dev, chunk, 1, __LINE__);
-				yaffs_skip_rest_of_block(dev);
+				yaffs_skip_rest_of_chunk_block(dev, chunk);
 				continue;
 			}
 		}
@@ -1394,20 +1492,73 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cache chunks are hashed by (object, chunk) for lookup, kept on an lru
+ *   list (or the free list when unused) for replacement and on their
+ *   object's list for flushing, so none of these need to search the whole
+ *   cache and a device can have hundreds of cache chunks.
+ *
+ *   yaffs_file_rd_cached() reads from the cache without the meta lock, so
+ *   the hash, the lru list, and the object, chunk_id and data of a hashed
+ *   cache chunk are changed under dev->cache_lock.  Only holders of the
+ *   meta lock change anything but the lru list, so they can look at the
+ *   rest without taking cache_lock.  A chunk's data is filled in before it
+ *   is hashed.
+ */
+
+static inline u32 yaffs_cache_hash(struct yaffs_dev *dev,
+				   const struct yaffs_obj *obj, int chunk_id)
+{
+	/* Consecutive chunks of a file land in consecutive buckets */
+	return (obj->obj_id * 0x9e3779b1 + chunk_id) & dev->cache_hash_mask;
+}
+
+/* Put a free cache chunk, with its data already read in, into use for this
+ * object's chunk
  */
+static void yaffs_cache_attach(struct yaffs_dev *dev, struct yaffs_cache *cache,
+			       struct yaffs_obj *obj, int chunk_id)
+{
+	cache->dirty = 0;
+	cache->locked = 0;
+	list_add_tail(&cache->obj_link, &obj->cache_chunks);
+
+	spin_lock(&dev->cache_lock);
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	list_add(&cache->hash_link,
+		 &dev->cache_hash[yaffs_cache_hash(dev, obj, chunk_id)]);
+	list_move_tail(&cache->lru_link, &dev->cache_lru);
+	spin_unlock(&dev->cache_lock);
+}
+
+/* The cache chunk has been written out, or its data is no longer wanted */
+static void yaffs_cache_release(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	if (cache->dirty)
+		dev->n_dirty_caches--;
+	cache->dirty = 0;
+	list_del_init(&cache->obj_link);
+
+	spin_lock(&dev->cache_lock);
+	cache->object = NULL;
+	list_del_init(&cache->hash_link);
+	list_move(&cache->lru_link, &dev->cache_free);
+	spin_unlock(&dev->cache_lock);
+}
+
+static void yaffs_cache_clean(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	if (cache->dirty)
+		dev->n_dirty_caches--;
+	cache->dirty = 0;
+}
 
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
-	struct yaffs_dev *dev = obj->my_dev;
-	int i;
 	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
-		if (cache->object == obj && cache->dirty)
+	list_for_each_entry(cache, &obj->cache_chunks, obj_link) {
+		if (cache->dirty)
 			return 1;
 	}
 
@@ -1417,27 +1568,19 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
 	struct yaffs_cache *cache;
+	struct yaffs_cache *c;
 	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	if (n_caches > 0) {
+	if (dev->param.n_caches > 0) {
 		do {
 			cache = NULL;
 
 			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < n_caches; i++) {
-				if (dev->cache[i].object == obj &&
-				    dev->cache[i].dirty) {
-					if (!cache
-					    || dev->cache[i].chunk_id <
-					    lowest) {
-						cache = &dev->cache[i];
-						lowest = cache->chunk_id;
-					}
-				}
+			list_for_each_entry(c, &obj->cache_chunks, obj_link) {
+				if (c->dirty &&
+				    (!cache || c->chunk_id < cache->chunk_id))
+					cache = c;
 			}
 
 			if (cache && !cache->locked) {
@@ -1448,8 +1591,8 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 						      cache->chunk_id,
 						      cache->data,
 						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
+				dev->cache_chunk_writes++;
+				yaffs_cache_release(dev, cache);
 			}
 
 		} while (cache && chunk_written > 0);
@@ -1471,18 +1614,22 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
+	struct yaffs_cache *cache;
 
 	/* Find a dirty object in the cache and flush it...
 	 * until there are no further dirty objects.
 	 */
 	do {
 		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-
+		if (dev->n_dirty_caches > 0) {
+			spin_lock(&dev->cache_lock);
+			list_for_each_entry(cache, &dev->cache_lru, lru_link) {
+				if (cache->dirty) {
+					obj = cache->object;
+					break;
+				}
+			}
+			spin_unlock(&dev->cache_lock);
 		}
 		if (obj)
 			yaffs_flush_file_cache(obj);
@@ -1493,92 +1640,77 @@ void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 
 /* Grab us a cache chunk for use.
  * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Then take the least recently used one, and if it is dirty flush its
+ * object, which writes out and frees all of that object's dirty chunks.
  */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
+static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
-	int i;
+	struct yaffs_cache *cache = NULL;
+	struct yaffs_cache *c;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
+	if (dev->param.n_caches < 1)
+		return NULL;
+
+	if (list_empty(&dev->cache_free)) {
+		/* With locking we can't assume we can use the head of the lru */
+		spin_lock(&dev->cache_lock);
+		list_for_each_entry(c, &dev->cache_lru, lru_link) {
+			if (!c->locked) {
+				cache = c;
+				break;
+			}
+		}
+		spin_unlock(&dev->cache_lock);
+		if (!cache)
+			return NULL;
+
+		if (cache->dirty) {
+			dev->cache_lru_flushes++;
+			yaffs_flush_file_cache(cache->object);
+		} else {
+			yaffs_cache_release(dev, cache);
 		}
 	}
 
-	return NULL;
+	if (list_empty(&dev->cache_free))
+		return NULL;
+
+	return list_first_entry(&dev->cache_free, struct yaffs_cache, lru_link);
 }
 
-static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
+/* Find a cached chunk, with dev->cache_lock held */
+static struct yaffs_cache *__yaffs_find_chunk_cache(const struct yaffs_obj *obj,
+						    int chunk_id)
 {
+	struct yaffs_dev *dev = obj->my_dev;
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
+	struct list_head *bucket;
 
 	if (dev->param.n_caches > 0) {
-		/* Try find a non-dirty one... */
-
-		cache = yaffs_grab_chunk_worker(dev);
-
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
-
-			/* With locking we can't assume we can use entry zero */
-
-			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
-				}
-			}
+		bucket = &dev->cache_hash[yaffs_cache_hash(dev, obj, chunk_id)];
+		list_for_each_entry(cache, bucket, hash_link) {
+			if (cache->object == obj &&
+			    cache->chunk_id == chunk_id) {
+				dev->cache_hits++;
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_flush_file_cache(the_obj);
-				cache = yaffs_grab_chunk_worker(dev);
+				return cache;
 			}
-
 		}
-		return cache;
-	} else {
-		return NULL;
-        }
+	}
+	return NULL;
 }
 
-/* Find a cached chunk */
 static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
-				dev->cache_hits++;
+	struct yaffs_cache *cache;
 
-				return &dev->cache[i];
-			}
-		}
-	}
-	return NULL;
+	spin_lock(&dev->cache_lock);
+	cache = __yaffs_find_chunk_cache(obj, chunk_id);
+	spin_unlock(&dev->cache_lock);
+
+	return cache;
 }
 
 /* Mark the chunk for the least recently used algorithym */
@@ -1587,21 +1719,16 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 {
 
 	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
-
-		dev->cache_last_use++;
-
-		cache->last_use = dev->cache_last_use;
+		spin_lock(&dev->cache_lock);
+		list_move_tail(&cache->lru_link, &dev->cache_lru);
+		spin_unlock(&dev->cache_lock);
 
-		if (is_write)
+		if (is_write) {
+			if (!cache->dirty)
+				dev->n_dirty_caches++;
 			cache->dirty = 1;
+			dev->cache_writes++;
+		}
 	}
 }
 
@@ -1616,7 +1743,7 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 		    yaffs_find_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_release(object->my_dev, cache);
 	}
 }
 
@@ -1625,16 +1752,12 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
  */
 static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 {
-	int i;
 	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache;
+	struct yaffs_cache *next;
 
-	if (dev->param.n_caches > 0) {
-		/* Invalidate it. */
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
-		}
-	}
+	list_for_each_entry_safe(cache, next, &in->cache_chunks, obj_link)
+		yaffs_cache_release(dev, cache);
 }
 
 static void yaffs_unhash_obj(struct yaffs_obj *obj)
@@ -1857,6 +1980,7 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 		INIT_LIST_HEAD(&(obj->hard_links));
 		INIT_LIST_HEAD(&(obj->hash_link));
 		INIT_LIST_HEAD(&obj->siblings);
+		INIT_LIST_HEAD(&obj->cache_chunks);
 
 		/* Now make the directory sane */
 		if (dev->root_dir) {
@@ -2306,6 +2430,7 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	dev->chunk_bits = NULL;
 
 	dev->alloc_block = -1;	/* force it to get a new one */
+	dev->gc_alloc_block = -1;
 
 	/* If the first allocation strategy fails, thry the alternate one */
 	dev->block_info =
@@ -2631,13 +2756,13 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 									  (u8 *)
 									  oh,
 									  &tags,
-									  1);
+									  1, 1);
 					} else {
 						new_chunk =
 						    yaffs_write_new_chunk(dev,
 									  buffer,
 									  &tags,
-									  1);
+									  1, 1);
                                         }
 
 					if (new_chunk < 0) {
@@ -2715,6 +2840,61 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	return ret_val;
 }
 
+/*
+ * yaffs_find_cost_benefit_block() looks through all the full blocks with at
+ * most threshold live chunks and returns the one that gives back the most
+ * free space for the copying it costs, weighted by how long ago the block
+ * was written:
+ *
+ *	age * free chunks / (chunks per block + live chunks)
+ *
+ * The block is read whole and its live chunks are written back, hence the
+ * cost.  Data that has not been touched for a long time is unlikely to be
+ * deleted soon, so it is worth collecting an old block that is only a bit
+ * dirty and keeping its data together, rather than collecting the block
+ * that is dirtiest right now and will be dirtier still if left alone.
+ * Returns 0 if there is no candidate, else sets gc_pages_in_use.
+ */
+static unsigned yaffs_find_cost_benefit_block(struct yaffs_dev *dev,
+					      int threshold)
+{
+	struct yaffs_block_info *bi = dev->block_info;
+	int cpb = dev->param.chunks_per_block;
+	unsigned best = 0;
+	u32 best_benefit = 0;
+	u32 best_cost = 1;
+	u32 age, benefit, cost;
+	int pages_used;
+	int i;
+
+	for (i = dev->internal_start_block; i <= dev->internal_end_block;
+	     i++, bi++) {
+		if (bi->block_state != YAFFS_BLOCK_STATE_FULL)
+			continue;
+
+		pages_used = bi->pages_in_use - bi->soft_del_pages;
+		if (pages_used >= cpb || pages_used > threshold ||
+		    !yaffs_block_ok_for_gc(dev, bi))
+			continue;
+
+		age = dev->seq_number - bi->seq_number;
+		if (age > YAFFS_GC_MAX_AGE)
+			age = YAFFS_GC_MAX_AGE;
+		benefit = (age + 1) * (cpb - pages_used);
+		cost = cpb + pages_used;
+
+		if (!best ||
+		    (u64) benefit * best_cost > (u64) best_benefit * cost) {
+			best = i;
+			best_benefit = benefit;
+			best_cost = cost;
+			dev->gc_pages_in_use = pages_used;
+		}
+	}
+
+	return best;
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
  * for garbage collection.
@@ -2798,6 +2978,12 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				iterations = 100;
 		}
 
+		if (dev->param.gc_policy == YAFFS_GC_POLICY_COST_BENEFIT) {
+			dev->gc_dirtiest = yaffs_find_cost_benefit_block(dev,
+								threshold);
+			iterations = 0;
+		}
+
 		for (i = 0;
 		     i < iterations &&
 		     (dev->gc_dirtiest < 1 ||
@@ -3117,9 +3303,10 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 	}
 
 	new_chunk_id =
-	    yaffs_write_new_chunk(dev, buffer, &new_tags, use_reserve);
+	    yaffs_write_new_chunk(dev, buffer, &new_tags, use_reserve, 0);
 
 	if (new_chunk_id > 0) {
+		dev->n_data_writes++;
 		yaffs_put_chunk_in_file(in, inode_chunk, new_chunk_id, 0);
 
 		if (prev_chunk_id > 0)
@@ -3256,6 +3443,10 @@ int yaffs_list_xattrib(struct yaffs_obj *obj, char *buffer, int size)
 	return yaffs_do_xattrib_fetch(obj, NULL, buffer, size);
 }
 
+/*
+ * Lookups only share the meta lock, so loading is serialised by
+ * dev->lazy_lock and lazy_loaded is only cleared once the details are in.
+ */
 static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 {
 	u8 *chunk_data;
@@ -3270,8 +3461,13 @@ static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 
 	dev = in->my_dev;
 
+	if (!in->lazy_loaded) {
+		smp_rmb();	/* Pairs with the smp_wmb() below */
+		return;
+	}
+
+	mutex_lock(&dev->lazy_lock);
 	if (in->lazy_loaded && in->hdr_chunk > 0) {
-		in->lazy_loaded = 0;
 		chunk_data = yaffs_get_temp_buffer(dev, __LINE__);
 
 		result =
@@ -3291,7 +3487,11 @@ static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 		}
 
 		yaffs_release_temp_buffer(dev, chunk_data, __LINE__);
+
+		smp_wmb();
+		in->lazy_loaded = 0;
 	}
+	mutex_unlock(&dev->lazy_lock);
 }
 
 static void yaffs_load_name_from_oh(struct yaffs_dev *dev, YCHAR * name,
@@ -3493,9 +3693,10 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR * name, int force,
 		/* Create new chunk in NAND */
 		new_chunk_id =
 		    yaffs_write_new_chunk(dev, buffer, &new_tags,
-					  (prev_chunk_id > 0) ? 1 : 0);
+					  (prev_chunk_id > 0) ? 1 : 0, 0);
 
 		if (new_chunk_id >= 0) {
+			dev->n_hdr_writes++;
 
 			in->hdr_chunk = new_chunk_id;
 
@@ -3581,13 +3782,11 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 				if (!cache) {
 					cache =
 					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 					cache->n_bytes = 0;
+					yaffs_cache_attach(dev, cache, in,
+							   chunk);
 				}
 
 				yaffs_use_cache(dev, cache, 0);
@@ -3627,6 +3826,104 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 	return n_done;
 }
 
+/*
+ * Reads a whole chunk of a file if it is in the short op cache, without
+ * the meta lock: everything it looks at is only changed under
+ * dev->cache_lock.  The caller keeps the object alive.  Returns 1 if the
+ * chunk was read, 0 if it is not cached.
+ */
+int yaffs_file_rd_cached(struct yaffs_obj *in, u8 * buffer, loff_t offset)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache;
+	int chunk;
+	u32 start;
+
+	if (dev->param.n_caches < 1)
+		return 0;
+
+	yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+	if (start)
+		return 0;
+	chunk++;
+
+	spin_lock(&dev->cache_lock);
+	cache = __yaffs_find_chunk_cache(in, chunk);
+	if (cache) {
+		list_move_tail(&cache->lru_link, &dev->cache_lru);
+		memcpy(buffer, cache->data, dev->data_bytes_per_chunk);
+	}
+	spin_unlock(&dev->cache_lock);
+
+	return cache ? 1 : 0;
+}
+
+/*
+ * Reading a whole chunk of a file without holding the meta lock across the
+ * read from flash.  yaffs_file_rd_chunk_begin() is called with the meta
+ * lock held shared.  If the chunk is cached, a hole or has to be read with
+ * the lock held, it fills in the buffer and returns 0.  Otherwise it
+ * returns the nand chunk to read, which the caller does with
+ * yaffs_rd_chunk_tags_nand_raw() after dropping the lock, and then calls
+ * yaffs_file_rd_chunk_end() with the lock held shared again.  A chunk in
+ * use is only written again after its block has been erased, so if
+ * nothing has been erased in the meantime the data read is what the chunk
+ * held when it was looked up.  If something was, yaffs_file_rd_chunk_end()
+ * fails and the read has to be done again.  Returns -1 if the offset is
+ * not at the start of a chunk or the chunk can only be read exclusively.
+ */
+int yaffs_file_rd_chunk_begin(struct yaffs_obj *in, u8 * buffer,
+			      loff_t offset, u32 * erase_seq)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	int chunk;
+	u32 start;
+	int nand_chunk;
+
+	if (dev->param.inband_tags)
+		return -1;
+
+	if (yaffs_file_rd_cached(in, buffer, offset))
+		return 0;
+
+	yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+	if (start)
+		return -1;
+	chunk++;
+
+	nand_chunk = yaffs_find_chunk_in_file(in, chunk, NULL);
+	if (nand_chunk < 0) {
+		/* A hole */
+		memset(buffer, 0, dev->data_bytes_per_chunk);
+		return 0;
+	}
+
+	*erase_seq = dev->erase_seq;
+	return nand_chunk;
+}
+
+int yaffs_file_rd_chunk_end(struct yaffs_obj *in, int nand_chunk,
+			    u32 erase_seq, const struct yaffs_ext_tags *tags)
+{
+	struct yaffs_dev *dev = in->my_dev;
+
+	int retval = YAFFS_OK;
+
+	spin_lock(&dev->rd_lock);
+	dev->n_page_reads++;
+	if (erase_seq != dev->erase_seq)
+		retval = YAFFS_FAIL;
+	else if (tags->ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+		yaffs_handle_chunk_error(dev,
+					 yaffs_get_block_info(dev,
+							      nand_chunk /
+							      dev->param.
+							      chunks_per_block));
+	spin_unlock(&dev->rd_lock);
+
+	return retval;
+}
+
 int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 		     int n_bytes, int write_trhrough)
 {
@@ -3707,12 +4004,10 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
+					yaffs_cache_attach(dev, cache, in,
+							   chunk);
 				} else if (cache &&
 					   !cache->dirty &&
 					   !yaffs_check_alloc_available(dev,
@@ -3727,8 +4022,10 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 					yaffs_use_cache(dev, cache, 1);
 					cache->locked = 1;
 
+					spin_lock(&dev->cache_lock);
 					memcpy(&cache->data[start], buffer,
 					       n_copy);
+					spin_unlock(&dev->cache_lock);
 
 					cache->locked = 0;
 					cache->n_bytes = n_writeback;
@@ -3740,7 +4037,8 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						dev->cache_chunk_writes++;
+						yaffs_cache_clean(dev, cache);
 					}
 
 				} else {
@@ -4930,6 +5228,9 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->n_erased_blocks = 0;
 	dev->gc_disable = 0;
 	dev->has_pending_prioritised_gc = 1;	/* Assume the worst for now, will get fixed on first GC */
+	spin_lock_init(&dev->cache_lock);
+	spin_lock_init(&dev->rd_lock);
+	mutex_init(&dev->lazy_lock);
 	INIT_LIST_HEAD(&dev->dirty_dirs);
 	dev->oldest_dirty_seq = 0;
 	dev->oldest_dirty_block = 0;
@@ -4939,38 +5240,61 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		init_failed = 1;
 
 	dev->cache = NULL;
+	dev->cache_hash = NULL;
 	dev->gc_cleanup_list = NULL;
+	INIT_LIST_HEAD(&dev->cache_lru);
+	INIT_LIST_HEAD(&dev->cache_free);
+	dev->n_dirty_caches = 0;
 
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
+		int n_buckets;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
 
+		/* A power of two buckets, at least one per cache chunk */
+		for (n_buckets = 1; n_buckets < dev->param.n_caches;)
+			n_buckets <<= 1;
+		dev->cache_hash =
+		    kmalloc(n_buckets * sizeof(struct list_head), GFP_NOFS);
+		dev->cache_hash_mask = n_buckets - 1;
+
 		buf = (u8 *) dev->cache;
 
 		if (dev->cache)
 			memset(dev->cache, 0, cache_bytes);
 
+		if (dev->cache_hash) {
+			for (i = 0; i < n_buckets; i++)
+				INIT_LIST_HEAD(&dev->cache_hash[i]);
+		} else {
+			buf = NULL;
+		}
+
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			INIT_LIST_HEAD(&dev->cache[i].obj_link);
+			list_add_tail(&dev->cache[i].lru_link,
+				      &dev->cache_free);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
+	dev->cache_writes = 0;
+	dev->cache_chunk_writes = 0;
+	dev->cache_lru_flushes = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -5012,6 +5336,8 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 				dev->n_free_chunks = 0;
 				dev->alloc_block = -1;
 				dev->alloc_page = -1;
+				dev->gc_alloc_block = -1;
+				dev->gc_alloc_page = -1;
 				dev->n_deleted_files = 0;
 				dev->n_unlinked_files = 0;
 				dev->n_bg_deletions = 0;
@@ -5087,6 +5413,8 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 			kfree(dev->cache);
 			dev->cache = NULL;
 		}
+		kfree(dev->cache_hash);
+		dev->cache_hash = NULL;
 
 		kfree(dev->gc_cleanup_list);
 
@@ -5132,21 +5460,14 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 	/* This is what we report to the outside world */
 
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
 	/* Now count the number of dirty chunks in the cache and subtract those */
 
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
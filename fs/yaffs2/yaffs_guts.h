@@ -83,10 +83,14 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	1024
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Garbage collection victim selection, see yaffs_find_gc_block() */
+#define YAFFS_GC_POLICY_GREEDY		0	/* Fewest live chunks in the search window */
+#define YAFFS_GC_POLICY_COST_BENEFIT	1	/* Best age x free space / copy cost */
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -110,11 +114,13 @@
 struct yaffs_cache {
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
 	u8 *data;
+	struct list_head hash_link;	/* In the (object, chunk) hash bucket */
+	struct list_head lru_link;	/* On the device lru list, or free list if unused */
+	struct list_head obj_link;	/* On the object's list of cached chunks */
 };
 
 /* Tags structures in RAM
@@ -408,6 +414,8 @@ struct yaffs_obj {
 
 	struct list_head hard_links;	/* all the equivalent hard linked objects */
 
+	struct list_head cache_chunks;	/* short op cache entries holding this object's data */
+
 	/* directory structure stuff */
 	/* also used for linking up the free list */
 	struct yaffs_obj *parent;
@@ -506,8 +514,8 @@ struct yaffs_param {
 	/* reserved blocks on NOR and RAM. */
 
 	int n_caches;		/* If <= 0, then short op caching is disabled, else
-				 * the number of short op caches (don't use too many).
-				 * 10 to 20 is a good bet.
+				 * the number of short op caches. Lookups are hashed,
+				 * so up to YAFFS_MAX_SHORT_OP_CACHES is fine.
 				 */
 	int use_nand_ecc;	/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int no_tags_ecc;	/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */
@@ -518,6 +526,16 @@ struct yaffs_param {
 
 	int refresh_period;	/* How often we should check to do a block refresh */
 
+	int n_scan_threads;	/* Threads reading tags ahead of a yaffs2 scan, 0 for none.
+				 * read_chunk_tags_fn and query_block_fn must be safe
+				 * to call concurrently if this is set.
+				 */
+
+	int gc_policy;		/* How GC picks its victim, YAFFS_GC_POLICY_xxx */
+	int gc_stream;		/* yaffs2: copy GC'd chunks into their own block,
+				 * away from freshly written ones.
+				 */
+
 	/* Checkpoint control. Can be set before or after initialisation */
 	u8 skip_checkpt_rd;
 	u8 skip_checkpt_wr;
@@ -642,8 +660,11 @@ struct yaffs_dev {
 				 */
 
 	int n_erased_blocks;
+	u32 erase_seq;		/* Bumped before every erase, see yaffs_file_rd_chunk_begin() */
 	int alloc_block;	/* Current block being allocated off */
 	u32 alloc_page;
+	int gc_alloc_block;	/* Block GC copies are allocated off, see param.gc_stream */
+	u32 gc_alloc_page;
 	int alloc_block_finder;	/* Used to search for next allocation block */
 
 	/* Object and Tnode memory management */
@@ -685,7 +706,12 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head *cache_hash;	/* Buckets of caches hashed by object and chunk */
+	u32 cache_hash_mask;
+	struct list_head cache_lru;	/* Caches in use, least recently used first */
+	struct list_head cache_free;	/* Unused caches */
+	int n_dirty_caches;
+	spinlock_t cache_lock;	/* Cache hash, lru and hashed data, see yaffs_file_rd_cached() */
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -702,6 +728,10 @@ struct yaffs_dev {
 	int unmanaged_buffer_allocs;
 	int unmanaged_buffer_deallocs;
 
+	/* Taken by readers that only share the meta lock, see yaffs_rd_chunk_tags_nand() */
+	spinlock_t rd_lock;	/* Temp buffers, read accounting and ecc strikes */
+	struct mutex lazy_lock;	/* Loading the details of lazy loaded objects */
+
 	/* yaffs2 runtime stuff */
 	unsigned seq_number;	/* Sequence number of currently allocating block */
 	unsigned oldest_dirty_seq;
@@ -734,6 +764,12 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_writes;	/* Short writes that went into the cache */
+	u32 cache_chunk_writes;	/* Chunks written out of the cache */
+	u32 cache_lru_flushes;	/* Files flushed to make room in the cache */
+	u32 n_data_writes;	/* File data chunks written, not counting GC copies */
+	u32 n_hdr_writes;	/* Object headers written, not counting GC copies */
+	u32 n_alloc_closes;	/* Allocation blocks closed early to keep sequence order */
 
 };
 
@@ -801,6 +837,11 @@ int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 /* File operations */
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 		  int n_bytes);
+int yaffs_file_rd_cached(struct yaffs_obj *obj, u8 * buffer, loff_t offset);
+int yaffs_file_rd_chunk_begin(struct yaffs_obj *obj, u8 * buffer,
+			      loff_t offset, u32 * erase_seq);
+int yaffs_file_rd_chunk_end(struct yaffs_obj *obj, int nand_chunk,
+			    u32 erase_seq, const struct yaffs_ext_tags *tags);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
@@ -901,6 +942,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 		     int n_bytes, int write_trhrough);
 void yaffs_resize_file_down(struct yaffs_obj *obj, loff_t new_size);
 void yaffs_skip_rest_of_block(struct yaffs_dev *dev);
+void yaffs_skip_rest_of_gc_block(struct yaffs_dev *dev);
 
 int yaffs_count_free_chunks(struct yaffs_dev *dev);
 
@@ -24,7 +24,11 @@ struct yaffs_linux_context {
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	/* Objects, directories, tnodes, allocation and gc.  Shared by
+	 * lookups and readpage, held exclusively by everything that changes
+	 * them.  Cached reads don't take it, see yaffs_file_rd_cached().
+	 */
+	struct rw_semaphore meta_lock;
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
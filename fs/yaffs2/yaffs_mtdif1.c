@@ -180,12 +180,16 @@ int nandmtd1_read_chunk_tags(struct yaffs_dev *dev,
 	case -EUCLEAN:
 		/* MTD's ECC fixed the data */
 		eccres = YAFFS_ECC_RESULT_FIXED;
+		spin_lock(&dev->rd_lock);
 		dev->n_ecc_fixed++;
+		spin_unlock(&dev->rd_lock);
 		break;
 
 	case -EBADMSG:
 		/* MTD's ECC could not fix the data */
+		spin_lock(&dev->rd_lock);
 		dev->n_ecc_unfixed++;
+		spin_unlock(&dev->rd_lock);
 		/* fall into... */
 	default:
 		rettags(etags, YAFFS_ECC_RESULT_UNFIXED, 0);
@@ -219,13 +223,17 @@ int nandmtd1_read_chunk_tags(struct yaffs_dev *dev,
 		break;
 	case 1:
 		/* recovered tags-ECC error */
+		spin_lock(&dev->rd_lock);
 		dev->n_tags_ecc_fixed++;
+		spin_unlock(&dev->rd_lock);
 		if (eccres == YAFFS_ECC_RESULT_NO_ERROR)
 			eccres = YAFFS_ECC_RESULT_FIXED;
 		break;
 	default:
 		/* unrecovered tags-ECC error */
+		spin_lock(&dev->rd_lock);
 		dev->n_tags_ecc_unfixed++;
+		spin_unlock(&dev->rd_lock);
 		return rettags(etags, YAFFS_ECC_RESULT_UNFIXED, YAFFS_FAIL);
 	}
 
@@ -17,28 +17,39 @@
 
 #include "yaffs_getblockinfo.h"
 
+/* Just the flash read of yaffs_rd_chunk_tags_nand(), without the accounting
+ * and error handling, for reads done without the meta lock.  See
+ * yaffs_file_rd_chunk_begin().
+ */
+int yaffs_rd_chunk_tags_nand_raw(struct yaffs_dev *dev, int nand_chunk,
+				 u8 * buffer, struct yaffs_ext_tags *tags)
+{
+	int realigned_chunk = nand_chunk - dev->chunk_offset;
+
+	if (dev->param.read_chunk_tags_fn)
+		return dev->param.read_chunk_tags_fn(dev, realigned_chunk,
+						     buffer, tags);
+	return yaffs_tags_compat_rd(dev, realigned_chunk, buffer, tags);
+}
+
+/* Lookups, readpage and the scan threads read at the same time, so the
+ * accounting is done under dev->rd_lock.
+ */
 int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 			     u8 * buffer, struct yaffs_ext_tags *tags)
 {
 	int result;
 	struct yaffs_ext_tags local_tags;
 
-	int realigned_chunk = nand_chunk - dev->chunk_offset;
-
-	dev->n_page_reads++;
-
 	/* If there are no tags provided, use local tags to get prioritised gc working */
 	if (!tags)
 		tags = &local_tags;
 
-	if (dev->param.read_chunk_tags_fn)
-		result =
-		    dev->param.read_chunk_tags_fn(dev, realigned_chunk, buffer,
-						  tags);
-	else
-		result = yaffs_tags_compat_rd(dev,
-					      realigned_chunk, buffer, tags);
-	if (tags && tags->ecc_result > YAFFS_ECC_RESULT_NO_ERROR) {
+	result = yaffs_rd_chunk_tags_nand_raw(dev, nand_chunk, buffer, tags);
+
+	spin_lock(&dev->rd_lock);
+	dev->n_page_reads++;
+	if (tags->ecc_result > YAFFS_ECC_RESULT_NO_ERROR) {
 
 		struct yaffs_block_info *bi;
 		bi = yaffs_get_block_info(dev,
@@ -46,6 +57,7 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 					  dev->param.chunks_per_block);
 		yaffs_handle_chunk_error(dev, bi);
 	}
+	spin_unlock(&dev->rd_lock);
 
 	return result;
 }
@@ -113,6 +125,7 @@ int yaffs_erase_block(struct yaffs_dev *dev, int flash_block)
 	flash_block -= dev->block_offset;
 
 	dev->n_erasures++;
+	dev->erase_seq++;
 
 	result = dev->param.erase_fn(dev, flash_block);
 
@@ -116,10 +116,12 @@ static void yaffs_get_tags_from_spare(struct yaffs_dev *dev,
 	tu->as_bytes[7] = spare_ptr->tb7;
 
 	result = yaffs_check_tags_ecc(tags_ptr);
+	spin_lock(&dev->rd_lock);
 	if (result > 0)
 		dev->n_tags_ecc_fixed++;
 	else if (result < 0)
 		dev->n_tags_ecc_unfixed++;
+	spin_unlock(&dev->rd_lock);
 }
 
 static void yaffs_spare_init(struct yaffs_spare *spare)
@@ -178,24 +180,32 @@ static int yaffs_rd_chunk_nand(struct yaffs_dev *dev,
 				yaffs_trace(YAFFS_TRACE_ERROR,
 					"**>>yaffs ecc error fix performed on chunk %d:0",
 					nand_chunk);
+				spin_lock(&dev->rd_lock);
 				dev->n_ecc_fixed++;
+				spin_unlock(&dev->rd_lock);
 			} else if (ecc_result1 < 0) {
 				yaffs_trace(YAFFS_TRACE_ERROR,
 					"**>>yaffs ecc error unfixed on chunk %d:0",
 					nand_chunk);
+				spin_lock(&dev->rd_lock);
 				dev->n_ecc_unfixed++;
+				spin_unlock(&dev->rd_lock);
 			}
 
 			if (ecc_result2 > 0) {
 				yaffs_trace(YAFFS_TRACE_ERROR,
 					"**>>yaffs ecc error fix performed on chunk %d:1",
 					nand_chunk);
+				spin_lock(&dev->rd_lock);
 				dev->n_ecc_fixed++;
+				spin_unlock(&dev->rd_lock);
 			} else if (ecc_result2 < 0) {
 				yaffs_trace(YAFFS_TRACE_ERROR,
 					"**>>yaffs ecc error unfixed on chunk %d:1",
 					nand_chunk);
+				spin_lock(&dev->rd_lock);
 				dev->n_ecc_unfixed++;
+				spin_unlock(&dev->rd_lock);
 			}
 
 			if (ecc_result1 || ecc_result2) {
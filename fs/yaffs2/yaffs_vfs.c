@@ -90,12 +90,14 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 #include "yaffs_mtdif.h"
 #include "yaffs_mtdif1.h"
 #include "yaffs_mtdif2.h"
+#include "yaffs_nand.h"
 
 unsigned int yaffs_trace_mask = YAFFS_TRACE_BAD_BLOCKS | YAFFS_TRACE_ALWAYS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_scan_threads;	/* Off unless set, see yaffs2_scan_backwards() */
 
 /* Module Parameters */
 module_param(yaffs_trace_mask, uint, 0644);
@@ -103,6 +105,7 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_scan_threads, uint, 0644);
 
 
 #define yaffs_inode_to_obj_lv(iptr) ((iptr)->i_private)
@@ -120,17 +123,36 @@ static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 	return yaffs_gc_control;
 }
 
-static void yaffs_gross_lock(struct yaffs_dev *dev)
+/*
+ * Anything that changes objects, directories, tnodes, block allocation or
+ * gc state takes the meta lock exclusively.  Lookups, statfs and readpage
+ * only look and share it: the temp buffers, read accounting and lazy
+ * loading they use have their own locks in yaffs_guts.c.
+ */
+static void yaffs_meta_lock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	down_write(&(yaffs_dev_to_lc(dev)->meta_lock));
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
-static void yaffs_gross_unlock(struct yaffs_dev *dev)
+static void yaffs_meta_unlock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	up_write(&(yaffs_dev_to_lc(dev)->meta_lock));
+}
+
+static void yaffs_meta_lock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking shared %p", current);
+	down_read(&(yaffs_dev_to_lc(dev)->meta_lock));
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked shared %p", current);
+}
+
+static void yaffs_meta_unlock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking shared %p", current);
+	up_read(&(yaffs_dev_to_lc(dev)->meta_lock));
 }
 
 static void yaffs_fill_inode_from_obj(struct inode *inode,
@@ -155,13 +177,13 @@ static struct inode *yaffs_iget(struct super_block *sb, unsigned long ino)
 	 * need to lock again.
 	 */
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	obj = yaffs_find_by_number(dev, inode->i_ino);
 
 	yaffs_fill_inode_from_obj(inode, obj);
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	unlock_new_inode(inode);
 	return inode;
@@ -196,7 +218,7 @@ struct inode *yaffs_get_inode(struct super_block *sb, int mode, int dev,
 
 	/* NB Side effect: iget calls back to yaffs_read_inode(). */
 	/* iget also increments the inode's i_count */
-	/* NB You can't be holding gross_lock or deadlock will happen! */
+	/* NB You can't be holding the meta lock or deadlock will happen! */
 
 	return inode;
 }
@@ -235,7 +257,7 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 
 	dev = parent->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	switch (mode & S_IFMT) {
 	default:
@@ -261,8 +283,8 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 		break;
 	}
 
-	/* Can not call yaffs_get_inode() with gross lock held */
-	yaffs_gross_unlock(dev);
+	/* Can not call yaffs_get_inode() with the meta lock held */
+	yaffs_meta_unlock(dev);
 
 	if (obj) {
 		inode = yaffs_get_inode(dir->i_sb, mode, rdev, obj);
@@ -305,7 +327,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 	obj = yaffs_inode_to_obj(inode);
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	if (!S_ISDIR(inode->i_mode))	/* Don't link directories */
 		link =
@@ -322,7 +344,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 			atomic_read(&old_dentry->d_inode->i_count));
 	}
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	if (link) {
 		update_dir_time(dir);
@@ -344,10 +366,10 @@ static int yaffs_symlink(struct inode *dir, struct dentry *dentry,
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_symlink");
 
 	dev = yaffs_inode_to_obj(dir)->my_dev;
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 	obj = yaffs_create_symlink(yaffs_inode_to_obj(dir), dentry->d_name.name,
 				   S_IFLNK | S_IRWXUGO, uid, gid, symname);
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	if (obj) {
 		struct inode *inode;
@@ -373,7 +395,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry,
 	struct yaffs_dev *dev = yaffs_inode_to_obj(dir)->my_dev;
 
 	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock_shared(dev);
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_lookup for %d:%s",
@@ -383,9 +405,9 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry,
 
 	obj = yaffs_get_equivalent_obj(obj);	/* in case it was a hardlink */
 
-	/* Can't hold gross lock when calling yaffs_get_inode() */
+	/* Can't hold the meta lock when calling yaffs_get_inode() */
 	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock_shared(dev);
 
 	if (obj) {
 		yaffs_trace(YAFFS_TRACE_OS,
@@ -423,19 +445,19 @@ static int yaffs_unlink(struct inode *dir, struct dentry *dentry)
 	obj = yaffs_inode_to_obj(dir);
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	ret_val = yaffs_unlinker(obj, dentry->d_name.name);
 
 	if (ret_val == YAFFS_OK) {
 		dentry->d_inode->i_nlink--;
 		dir->i_version++;
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 		mark_inode_dirty(dentry->d_inode);
 		update_dir_time(dir);
 		return 0;
 	}
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 	return -ENOTEMPTY;
 }
 
@@ -451,9 +473,9 @@ static int yaffs_sync_object(struct file *file, loff_t start, loff_t end, int da
 	dev = obj->my_dev;
 
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_SYNC, "yaffs_sync_object");
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 	yaffs_flush_file(obj, 1, datasync);
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 	return 0;
 }
 /*
@@ -471,7 +493,7 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_rename");
 	dev = yaffs_inode_to_obj(old_dir)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	/* Check if the target is an existing directory that is not empty. */
 	target = yaffs_find_by_name(yaffs_inode_to_obj(new_dir),
@@ -492,7 +514,7 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 					   yaffs_inode_to_obj(new_dir),
 					   new_dentry->d_name.name);
 	}
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	if (ret_val == YAFFS_OK) {
 		if (target) {
@@ -541,14 +563,14 @@ static int yaffs_setattr(struct dentry *dentry, struct iattr *attr)
 					   (int)(attr->ia_size),
 					   (int)(attr->ia_size));
 		}
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		result = yaffs_set_attribs(yaffs_inode_to_obj(inode), attr);
 		if (result == YAFFS_OK) {
 			error = 0;
 		} else {
 			error = -EPERM;
 		}
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 
 	}
 
@@ -571,13 +593,13 @@ static int yaffs_setxattr(struct dentry *dentry, const char *name,
 	if (error == 0) {
 		int result;
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		result = yaffs_set_xattrib(obj, name, value, size, flags);
 		if (result == YAFFS_OK)
 			error = 0;
 		else if (result < 0)
 			error = result;
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_setxattr done returning %d", error);
@@ -599,9 +621,9 @@ static ssize_t yaffs_getxattr(struct dentry * dentry, const char *name, void *bu
 
 	if (error == 0) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		error = yaffs_get_xattrib(obj, name, buff, size);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_getxattr done returning %d", error);
@@ -622,13 +644,13 @@ static int yaffs_removexattr(struct dentry *dentry, const char *name)
 	if (error == 0) {
 		int result;
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		result = yaffs_remove_xattrib(obj, name);
 		if (result == YAFFS_OK)
 			error = 0;
 		else if (result < 0)
 			error = result;
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS,
@@ -649,9 +671,9 @@ static ssize_t yaffs_listxattr(struct dentry * dentry, char *buff, size_t size)
 
 	if (error == 0) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		error = yaffs_list_xattrib(obj, buff, size);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS,
@@ -809,7 +831,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_dentry_to_obj(f->f_dentry);
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	yaffs_dev_to_lc(dev)->readdir_process = current;
 
@@ -828,12 +850,12 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry . ino %d",
 			(int)inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_meta_lock(dev);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -841,14 +863,14 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry .. ino %d",
 			(int)f->f_dentry->d_parent->d_inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 		if (filldir(dirent, "..", 2, offset,
 			    f->f_dentry->d_parent->d_inode->i_ino,
 			    DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_meta_lock(dev);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -875,17 +897,17 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 				"yaffs_readdir: %s inode %d",
 				name, yaffs_get_obj_inode(l));
 
-			yaffs_gross_unlock(dev);
+			yaffs_meta_unlock(dev);
 
 			if (filldir(dirent,
 				    name,
 				    strlen(name),
 				    offset, this_inode, this_type) < 0) {
-				yaffs_gross_lock(dev);
+				yaffs_meta_lock(dev);
 				goto out;
 			}
 
-			yaffs_gross_lock(dev);
+			yaffs_meta_lock(dev);
 
 			offset++;
 			f->f_pos++;
@@ -896,7 +918,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 out:
 	yaffs_search_end(sc);
 	yaffs_dev_to_lc(dev)->readdir_process = NULL;
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	return ret_val;
 }
@@ -920,11 +942,11 @@ static int yaffs_file_flush(struct file *file, fl_owner_t id)
 	  	"yaffs_file_flush object %d (%s)",
 		obj->obj_id, obj->dirty ? "dirty" : "clean");
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	yaffs_flush_file(obj, 1, 0);
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	return 0;
 }
@@ -1020,11 +1042,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user * buffer,
 
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock_shared(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock_shared(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -1040,10 +1062,10 @@ static void *yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	void *ret;
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock_shared(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock_shared(dev);
 
 	if (!alias) {
 		ret = ERR_PTR(-ENOMEM);
@@ -1102,15 +1124,15 @@ static void yaffs_evict_inode(struct inode *inode)
 
 	if (deleteme && obj) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		yaffs_del_obj(obj);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 	}
 	if (obj) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		yaffs_unstitch_obj(inode, obj);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 	}
 
 }
@@ -1124,6 +1146,62 @@ static void yaffs_touch_super(struct yaffs_dev *dev)
 		sb->s_dirt = 1;
 }
 
+/*
+ * Reads a page a chunk at a time.  Chunks in the short op cache are copied
+ * without the meta lock, the others are looked up and accounted for with
+ * it shared and read from flash without it, so page reads run alongside
+ * each other and only wait for writes and gc to look chunks up.  Returns
+ * -EAGAIN if the page has to be read the usual way instead.
+ */
+#define YAFFS_RD_CHUNK_TRIES 3
+static int yaffs_readpage_chunks(struct yaffs_obj *obj, u8 *pg_buf,
+				 loff_t offset)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_ext_tags tags;
+	u32 erase_seq = 0;
+	int nand_chunk;
+	int ok;
+	int tries;
+	int n;
+
+	if (!dev->param.is_yaffs2 || dev->param.inband_tags ||
+	    PAGE_CACHE_SIZE % dev->data_bytes_per_chunk)
+		return -EAGAIN;
+
+	for (n = 0; n < PAGE_CACHE_SIZE; n += dev->data_bytes_per_chunk) {
+		if (yaffs_file_rd_cached(obj, pg_buf + n, offset + n))
+			continue;
+
+		for (tries = 0; tries < YAFFS_RD_CHUNK_TRIES; tries++) {
+			yaffs_meta_lock_shared(dev);
+			nand_chunk = yaffs_file_rd_chunk_begin(obj, pg_buf + n,
+							       offset + n,
+							       &erase_seq);
+			yaffs_meta_unlock_shared(dev);
+			if (nand_chunk < 0)
+				return -EAGAIN;
+			if (nand_chunk == 0)
+				break;
+
+			yaffs_rd_chunk_tags_nand_raw(dev, nand_chunk,
+						     pg_buf + n, &tags);
+
+			yaffs_meta_lock_shared(dev);
+			ok = yaffs_file_rd_chunk_end(obj, nand_chunk,
+						     erase_seq, &tags);
+			yaffs_meta_unlock_shared(dev);
+			if (ok == YAFFS_OK)
+				break;
+		}
+		/* gc keeps erasing blocks under us, read it locked */
+		if (tries == YAFFS_RD_CHUNK_TRIES)
+			return -EAGAIN;
+	}
+
+	return 0;
+}
+
 static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 {
 	/* Lifted from jffs2 */
@@ -1148,12 +1226,18 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	ret = yaffs_readpage_chunks(obj, pg_buf,
+				    (loff_t)pg->index << PAGE_CACHE_SHIFT);
+
+	if (ret == -EAGAIN) {
+		yaffs_meta_lock(dev);
 
-	ret = yaffs_file_rd(obj, pg_buf,
-			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
+		ret = yaffs_file_rd(obj, pg_buf,
+				    pg->index << PAGE_CACHE_SHIFT,
+				    PAGE_CACHE_SIZE);
 
-	yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -1243,7 +1327,7 @@ static int yaffs_writepage(struct page *page, struct writeback_control *wbc)
 
 	obj = yaffs_inode_to_obj(inode);
 	dev = obj->my_dev;
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_writepage at %08x, size %08x",
@@ -1261,7 +1345,7 @@ static int yaffs_writepage(struct page *page, struct writeback_control *wbc)
 		"writepag1: obj = %05x, ino = %05x",
 		(int)obj->variant.file_variant.file_size, (int)inode->i_size);
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	kunmap(page);
 	set_page_writeback(page);
@@ -1290,11 +1374,11 @@ static ssize_t yaffs_hold_space(struct file *f)
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock_shared(dev);
 
 	n_free_chunks = yaffs_get_n_free_chunks(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock_shared(dev);
 
 	return (n_free_chunks > 20) ? 1 : 0;
 }
@@ -1308,9 +1392,9 @@ static void yaffs_release_space(struct file *f)
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock_shared(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock_shared(dev);
 }
 
 static int yaffs_write_begin(struct file *filp, struct address_space *mapping,
@@ -1380,7 +1464,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	inode = f->f_dentry->d_inode;
 
@@ -1418,7 +1502,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 		}
 
 	}
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 	return (n_written == 0) && (n > 0) ? -ENOSPC : n_written;
 }
 
@@ -1461,7 +1545,7 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_statfs");
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock_shared(dev);
 
 	buf->f_type = YAFFS_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
@@ -1513,7 +1597,7 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_ffree = 0;
 	buf->f_bavail = buf->f_bfree;
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock_shared(dev);
 	return 0;
 }
 
@@ -1582,7 +1666,7 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 		request_checkpoint ? "checkpoint requested" : "no checkpoint",
 		oneshot_checkpoint ? " one-shot" : "");
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 	do_checkpoint = ((request_checkpoint && !gc_urgent) ||
 			 oneshot_checkpoint) && !dev->is_checkpointed;
 
@@ -1592,7 +1676,7 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 		if (oneshot_checkpoint)
 			yaffs_auto_checkpoint &= ~4;
 	}
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	return 0;
 }
@@ -1640,7 +1724,7 @@ static int yaffs_bg_thread_fn(void *data)
 		if (try_to_freeze())
 			continue;
 
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 
 		now = jiffies;
 
@@ -1667,7 +1751,7 @@ static int yaffs_bg_thread_fn(void *data)
 				next_gc = next_dir_update;
                         }
 		}
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
 			expires = next_gc;
@@ -1757,12 +1841,16 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int n_caches;
+	int n_caches_overridden;
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
 	int lazy_loading_overridden;
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
+	int gc_policy;
+	int gc_stream;
 };
 
 #define MAX_OPT_LEN 30
@@ -1812,6 +1900,26 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->empty_lost_and_found_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "cache=", 6)) {
+			char *end;
+
+			options->n_caches = simple_strtol(cur_opt + 6, &end, 0);
+			options->n_caches_overridden = 1;
+			if (*end || options->n_caches < 0 ||
+			    options->n_caches > YAFFS_MAX_SHORT_OP_CACHES) {
+				printk(KERN_INFO
+				       "yaffs: cache must be 0 to %d chunks\n",
+				       YAFFS_MAX_SHORT_OP_CACHES);
+				error = 1;
+			}
+		} else if (!strcmp(cur_opt, "gc=greedy")) {
+			options->gc_policy = YAFFS_GC_POLICY_GREEDY;
+		} else if (!strcmp(cur_opt, "gc=cost-benefit")) {
+			options->gc_policy = YAFFS_GC_POLICY_COST_BENEFIT;
+		} else if (!strcmp(cur_opt, "gc-stream-on")) {
+			options->gc_stream = 1;
+		} else if (!strcmp(cur_opt, "gc-stream-off")) {
+			options->gc_stream = 0;
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -1965,7 +2073,7 @@ static void yaffs_put_super(struct super_block *sb)
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_BACKGROUND,
 		"yaffs background thread shut down");
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	yaffs_flush_super(sb, 1);
 
@@ -1974,7 +2082,7 @@ static void yaffs_put_super(struct super_block *sb)
 
 	yaffs_deinitialise(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 	mutex_lock(&yaffs_context_lock);
 	list_del_init(&(yaffs_dev_to_lc(dev)->context_list));
 	mutex_unlock(&yaffs_context_lock);
@@ -2215,6 +2323,8 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
 	param->n_caches = (options.no_cache) ? 0 : 10;
+	if (!options.no_cache && options.n_caches_overridden)
+		param->n_caches = options.n_caches;
 	param->inband_tags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2296,6 +2406,17 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->skip_checkpt_rd = options.skip_checkpoint_read;
 	param->skip_checkpt_wr = options.skip_checkpoint_write;
 
+	param->gc_policy = options.gc_policy;
+	/* The ordering a separate GC block has to keep is by sequence number */
+	param->gc_stream = (yaffs_version == 2) ? options.gc_stream : 0;
+
+	/* Inband tags are read through the temporary buffers, which the
+	 * scan threads can't share.
+	 */
+	if (yaffs_version == 2 && !options.inband_tags)
+		param->n_scan_threads = min_t(int, yaffs_scan_threads,
+					      num_online_cpus());
+
 	mutex_lock(&yaffs_context_lock);
 	/* Get a mount id */
 	found = 0;
@@ -2319,9 +2440,9 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->meta_lock));
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	err = yaffs_guts_initialise(dev);
 
@@ -2336,7 +2457,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		param->defered_dir_update = 0;
 
 	/* Release lock before yaffs_get_inode() */
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	/* Create root inode */
 	if (err == YAFFS_OK)
@@ -2435,7 +2556,13 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 			param->disable_lazy_load);
 	buf += sprintf(buf, "refresh_period........ %d\n",
 			param->refresh_period);
+	buf += sprintf(buf, "n_scan_threads........ %d\n",
+			param->n_scan_threads);
 	buf += sprintf(buf, "n_caches.............. %d\n", param->n_caches);
+	buf += sprintf(buf, "gc_policy............. %s\n",
+			param->gc_policy == YAFFS_GC_POLICY_COST_BENEFIT ?
+			"cost-benefit" : "greedy");
+	buf += sprintf(buf, "gc_stream............. %d\n", param->gc_stream);
 	buf += sprintf(buf, "n_reserved_blocks..... %d\n",
 			param->n_reserved_blocks);
 	buf += sprintf(buf, "always_check_erased... %d\n",
@@ -2446,6 +2573,15 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 
 static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 {
+	/* Chunks written to flash per chunk written for the user */
+	u32 user_writes = dev->n_data_writes + dev->n_hdr_writes;
+	u64 wa_x100 = 100;
+
+	if (user_writes) {
+		wa_x100 = (u64) (user_writes + dev->n_gc_copies) * 100;
+		do_div(wa_x100, user_writes);
+	}
+
 	buf +=
 	    sprintf(buf, "data_bytes_per_chunk.. %d\n",
 		    dev->data_bytes_per_chunk);
@@ -2464,6 +2600,12 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_page_reads.......... %u\n", dev->n_page_reads);
 	buf += sprintf(buf, "n_erasures............ %u\n", dev->n_erasures);
 	buf += sprintf(buf, "n_gc_copies........... %u\n", dev->n_gc_copies);
+	buf += sprintf(buf, "n_data_writes......... %u\n", dev->n_data_writes);
+	buf += sprintf(buf, "n_hdr_writes.......... %u\n", dev->n_hdr_writes);
+	buf += sprintf(buf, "write_amplification... %u.%02u\n",
+		       (u32) wa_x100 / 100, (u32) wa_x100 % 100);
+	buf +=
+	    sprintf(buf, "n_alloc_closes........ %u\n", dev->n_alloc_closes);
 	buf += sprintf(buf, "all_gcs............... %u\n", dev->all_gcs);
 	buf +=
 	    sprintf(buf, "passive_gc_count...... %u\n", dev->passive_gc_count);
@@ -2484,6 +2626,14 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	    sprintf(buf, "n_tags_ecc_unfixed.... %u\n",
 		    dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits............ %u\n", dev->cache_hits);
+	buf += sprintf(buf, "cache_writes.......... %u\n", dev->cache_writes);
+	buf +=
+	    sprintf(buf, "cache_chunk_writes.... %u\n",
+		    dev->cache_chunk_writes);
+	buf +=
+	    sprintf(buf, "cache_lru_flushes..... %u\n",
+		    dev->cache_lru_flushes);
+	buf += sprintf(buf, "n_dirty_caches........ %d\n", dev->n_dirty_caches);
 	buf +=
 	    sprintf(buf, "n_deleted_files....... %u\n", dev->n_deleted_files);
 	buf +=
@@ -215,7 +215,9 @@ int yaffs_calc_checkpt_blocks_required(struct yaffs_dev *dev)
 		return 0;
 
 	if (!dev->checkpoint_blocks_required && yaffs2_checkpt_required(dev)) {
-		/* Not a valid value so recalculate */
+		/* Not a valid value so recalculate.  statfs does this with
+		 * the meta lock shared, but all of them get the same value.
+		 */
 		int n_bytes = 0;
 		int n_blocks;
 		int dev_blocks =
@@ -317,6 +319,11 @@ static int yaffs2_wr_checkpt_dev(struct yaffs_dev *dev)
 
 	int ok;
 
+	/* Only the normal allocation block is checkpointed, so close off
+	 * the one GC copies were going to.
+	 */
+	yaffs_skip_rest_of_gc_block(dev);
+
 	/* Write device runtime values */
 	yaffs2_dev_to_checkpt_dev(&cp, dev);
 	cp.struct_type = sizeof(cp);
@@ -954,6 +961,273 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 		return aseq - bseq;
 }
 
+/*
+ * Parallel tag reading for the scan.
+ *
+ * Without a checkpoint, mounting has to read the tags of every chunk in
+ * use.  With dev->param.n_scan_threads set, that reading is done by a set
+ * of threads: first each queries the state of its own range of blocks,
+ * then, once the blocks have been sorted, they read the tags of whole
+ * blocks in the order the scan will replay them, up to YAFFS_SCAN_WINDOW
+ * blocks ahead of it.  The replay itself stays on the mounting thread.
+ */
+
+#define YAFFS_SCAN_WINDOW 32
+
+struct yaffs_scan_ctl;
+
+struct yaffs_scan_thread {
+	struct yaffs_scan_ctl *ctl;
+	struct task_struct *task;
+	int first_block;
+	int last_block;
+};
+
+struct yaffs_scan_ctl {
+	struct yaffs_dev *dev;
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	int n_threads;
+	int n_started;
+	struct yaffs_scan_thread *threads;
+	int n_querying;		/* Threads still querying their blocks */
+	int replaying;		/* The block index is sorted, read its blocks */
+	int stop;
+	struct yaffs_block_index *block_index;
+	int next;		/* Next block index entry to read, counting down */
+	int replay_iter;	/* Entry being replayed, later ones are done */
+	struct yaffs_ext_tags *tags;	/* Tags of YAFFS_SCAN_WINDOW blocks */
+	int slot_iter[YAFFS_SCAN_WINDOW];	/* Entry whose tags each slot holds */
+};
+
+static void yaffs2_scan_query_block(struct yaffs_dev *dev, int blk)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	enum yaffs_block_state state;
+	u32 seq_number;
+
+	yaffs_clear_chunk_bits(dev, blk);
+	bi->pages_in_use = 0;
+	bi->soft_del_pages = 0;
+
+	yaffs_query_init_block_state(dev, blk, &state, &seq_number);
+
+	bi->block_state = state;
+	bi->seq_number = seq_number;
+
+	if (bi->seq_number == YAFFS_SEQUENCE_CHECKPOINT_DATA)
+		bi->block_state = YAFFS_BLOCK_STATE_CHECKPOINT;
+	if (bi->seq_number == YAFFS_SEQUENCE_BAD_BLOCK)
+		bi->block_state = YAFFS_BLOCK_STATE_DEAD;
+}
+
+static struct yaffs_ext_tags *yaffs2_scan_slot(struct yaffs_scan_ctl *ctl,
+					       int iter)
+{
+	return &ctl->tags[(iter % YAFFS_SCAN_WINDOW) *
+			  ctl->dev->param.chunks_per_block];
+}
+
+static void yaffs2_scan_read_block(struct yaffs_scan_ctl *ctl, int iter)
+{
+	struct yaffs_dev *dev = ctl->dev;
+	struct yaffs_ext_tags *tags = yaffs2_scan_slot(ctl, iter);
+	int first = ctl->block_index[iter].block * dev->param.chunks_per_block;
+	int c;
+
+	for (c = 0; c < dev->param.chunks_per_block; c++)
+		yaffs_rd_chunk_tags_nand(dev, first + c, NULL, &tags[c]);
+
+	spin_lock(&ctl->lock);
+	ctl->slot_iter[iter % YAFFS_SCAN_WINDOW] = iter;
+	spin_unlock(&ctl->lock);
+	wake_up(&ctl->wait);
+}
+
+/* Take the next block to read, if it is within the window */
+static int yaffs2_scan_claim(struct yaffs_scan_ctl *ctl, int *iter)
+{
+	int claimed = 1;
+
+	spin_lock(&ctl->lock);
+	if (ctl->stop || ctl->next < 0)
+		*iter = -1;
+	else if (ctl->next > ctl->replay_iter - YAFFS_SCAN_WINDOW)
+		*iter = ctl->next--;
+	else
+		claimed = 0;
+	spin_unlock(&ctl->lock);
+
+	return claimed;
+}
+
+static int yaffs2_scan_ready(struct yaffs_scan_ctl *ctl, int iter)
+{
+	int ready;
+
+	spin_lock(&ctl->lock);
+	ready = (ctl->slot_iter[iter % YAFFS_SCAN_WINDOW] == iter);
+	spin_unlock(&ctl->lock);
+
+	return ready;
+}
+
+static int yaffs2_scan_thread_fn(void *data)
+{
+	struct yaffs_scan_thread *st = data;
+	struct yaffs_scan_ctl *ctl = st->ctl;
+	int blk;
+	int iter;
+
+	for (blk = st->first_block; blk <= st->last_block; blk++)
+		yaffs2_scan_query_block(ctl->dev, blk);
+
+	spin_lock(&ctl->lock);
+	ctl->n_querying--;
+	spin_unlock(&ctl->lock);
+	wake_up(&ctl->wait);
+
+	wait_event_interruptible(ctl->wait, ctl->replaying || ctl->stop);
+
+	while (1) {
+		iter = -1;
+		wait_event_interruptible(ctl->wait,
+					 yaffs2_scan_claim(ctl, &iter));
+		if (iter < 0)
+			break;
+		yaffs2_scan_read_block(ctl, iter);
+	}
+
+	/* ctl goes away once we are stopped, so wait for that */
+	wait_event_interruptible(ctl->wait, kthread_should_stop());
+	return 0;
+}
+
+/* Start the scan threads and have them query the state of every block.
+ * Returns NULL if the blocks have to be queried and read without them.
+ */
+static struct yaffs_scan_ctl *yaffs2_scan_start(struct yaffs_dev *dev)
+{
+	struct yaffs_scan_ctl *ctl;
+	struct yaffs_scan_thread *st;
+	int n_threads = dev->param.n_scan_threads;
+	int blk;
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int i;
+
+	if (n_threads < 1)
+		return NULL;
+	if (n_threads > n_blocks)
+		n_threads = n_blocks;
+
+	ctl = kzalloc(sizeof(struct yaffs_scan_ctl), GFP_NOFS);
+	if (!ctl)
+		return NULL;
+	ctl->threads = kcalloc(n_threads, sizeof(struct yaffs_scan_thread),
+			       GFP_NOFS);
+	ctl->tags = vmalloc(YAFFS_SCAN_WINDOW * dev->param.chunks_per_block *
+			    sizeof(struct yaffs_ext_tags));
+	if (!ctl->threads || !ctl->tags) {
+		kfree(ctl->threads);
+		vfree(ctl->tags);
+		kfree(ctl);
+		return NULL;
+	}
+
+	ctl->dev = dev;
+	spin_lock_init(&ctl->lock);
+	init_waitqueue_head(&ctl->wait);
+	ctl->n_threads = n_threads;
+	ctl->n_querying = n_threads;
+	ctl->next = -1;
+	for (i = 0; i < YAFFS_SCAN_WINDOW; i++)
+		ctl->slot_iter[i] = -1;
+
+	for (i = 0; i < n_threads; i++) {
+		st = &ctl->threads[i];
+		st->ctl = ctl;
+		st->first_block = dev->internal_start_block +
+		    i * n_blocks / n_threads;
+		st->last_block = dev->internal_start_block +
+		    (i + 1) * n_blocks / n_threads - 1;
+		st->task = kthread_run(yaffs2_scan_thread_fn, st,
+				       "yaffs-scan/%d", i);
+		if (IS_ERR(st->task)) {
+			/* Do its blocks ourselves */
+			st->task = NULL;
+			for (blk = st->first_block; blk <= st->last_block;
+			     blk++)
+				yaffs2_scan_query_block(dev, blk);
+			spin_lock(&ctl->lock);
+			ctl->n_querying--;
+			spin_unlock(&ctl->lock);
+		} else {
+			ctl->n_started++;
+		}
+	}
+
+	wait_event(ctl->wait, !ctl->n_querying);
+
+	yaffs_trace(YAFFS_TRACE_SCAN, "%d scan threads queried %d blocks",
+		ctl->n_started, n_blocks);
+
+	return ctl;
+}
+
+/* The block index is sorted, start reading the blocks to replay */
+static void yaffs2_scan_replay(struct yaffs_scan_ctl *ctl,
+			       struct yaffs_block_index *block_index,
+			       int n_to_scan)
+{
+	spin_lock(&ctl->lock);
+	ctl->block_index = block_index;
+	ctl->next = n_to_scan - 1;
+	ctl->replay_iter = n_to_scan - 1;
+	ctl->replaying = 1;
+	spin_unlock(&ctl->lock);
+	wake_up_all(&ctl->wait);
+}
+
+/* Get the tags of a block to replay */
+static struct yaffs_ext_tags *yaffs2_scan_block_tags(struct yaffs_scan_ctl *ctl,
+						     int iter)
+{
+	if (!ctl->n_started)
+		yaffs2_scan_read_block(ctl, iter);
+	else
+		wait_event(ctl->wait, yaffs2_scan_ready(ctl, iter));
+
+	return yaffs2_scan_slot(ctl, iter);
+}
+
+/* The block's tags have been replayed, its slot can be reused */
+static void yaffs2_scan_block_done(struct yaffs_scan_ctl *ctl, int iter)
+{
+	spin_lock(&ctl->lock);
+	ctl->replay_iter = iter - 1;
+	spin_unlock(&ctl->lock);
+	wake_up_all(&ctl->wait);
+}
+
+static void yaffs2_scan_stop(struct yaffs_scan_ctl *ctl)
+{
+	int i;
+
+	spin_lock(&ctl->lock);
+	ctl->stop = 1;
+	spin_unlock(&ctl->lock);
+	wake_up_all(&ctl->wait);
+
+	for (i = 0; i < ctl->n_threads; i++) {
+		if (ctl->threads[i].task)
+			kthread_stop(ctl->threads[i].task);
+	}
+
+	kfree(ctl->threads);
+	vfree(ctl->tags);
+	kfree(ctl);
+}
+
 int yaffs2_scan_backwards(struct yaffs_dev *dev)
 {
 	struct yaffs_ext_tags tags;
@@ -986,6 +1260,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
+	struct yaffs_scan_ctl *ctl;
+	struct yaffs_ext_tags *block_tags;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
@@ -1014,22 +1290,16 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	chunk_data = yaffs_get_temp_buffer(dev, __LINE__);
 
 	/* Scan all the blocks to determine their state */
+	ctl = yaffs2_scan_start(dev);
+
 	bi = dev->block_info;
 	for (blk = dev->internal_start_block; blk <= dev->internal_end_block;
 	     blk++) {
-		yaffs_clear_chunk_bits(dev, blk);
-		bi->pages_in_use = 0;
-		bi->soft_del_pages = 0;
-
-		yaffs_query_init_block_state(dev, blk, &state, &seq_number);
-
-		bi->block_state = state;
-		bi->seq_number = seq_number;
+		if (!ctl)
+			yaffs2_scan_query_block(dev, blk);
 
-		if (bi->seq_number == YAFFS_SEQUENCE_CHECKPOINT_DATA)
-			bi->block_state = state = YAFFS_BLOCK_STATE_CHECKPOINT;
-		if (bi->seq_number == YAFFS_SEQUENCE_BAD_BLOCK)
-			bi->block_state = state = YAFFS_BLOCK_STATE_DEAD;
+		state = bi->block_state;
+		seq_number = bi->seq_number;
 
 		yaffs_trace(YAFFS_TRACE_SCAN_DEBUG,
 			"Block scanning block %d state %d seq %d",
@@ -1081,6 +1351,9 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_trace(YAFFS_TRACE_SCAN, "...done");
 
+	if (ctl)
+		yaffs2_scan_replay(ctl, block_index, n_to_scan);
+
 	/* Now scan the blocks looking at the data. */
 	start_iter = 0;
 	end_iter = n_to_scan - 1;
@@ -1102,6 +1375,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		deleted = 0;
 
+		block_tags = ctl ? yaffs2_scan_block_tags(ctl, block_iter) : NULL;
+
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
 		for (c = dev->param.chunks_per_block - 1;
@@ -1114,8 +1389,11 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 			chunk = blk * dev->param.chunks_per_block + c;
 
-			result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
-							  &tags);
+			if (block_tags)
+				tags = block_tags[c];
+			else
+				result = yaffs_rd_chunk_tags_nand(dev, chunk,
+								  NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -1571,8 +1849,14 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 			yaffs_block_became_dirty(dev, blk);
 		}
 
+		if (ctl)
+			yaffs2_scan_block_done(ctl, block_iter);
+
 	}
 
+	if (ctl)
+		yaffs2_scan_stop(ctl);
+
 	yaffs_skip_rest_of_block(dev);
 
 	if (alt_block_index)
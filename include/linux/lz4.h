@@ -0,0 +1,42 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Public Kernel Interface
+ *
+ *  Compressor and decompressor for the LZ4 block format: a byte-oriented
+ *  LZ77 coding without entropy stage, trading some ratio against LZO for
+ *  considerably faster decompression.
+ *
+ *  The format is described at http://code.google.com/p/lz4/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define LZ4_HASH_LOG		12
+#define LZ4_MEM_COMPRESS	((1 << LZ4_HASH_LOG) * sizeof(u32))
+
+#define lz4_compressbound(x)	((x) + ((x) / 255) + 16)
+
+/*
+ * This requires 'wrkmem' of size LZ4_MEM_COMPRESS.  *dst_len holds the size
+ * of dst on entry and the compressed size on return.
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+		 unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/* safe decompression with overrun testing */
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len);
+
+/*
+ * Return values (< 0 = Error)
+ */
+#define LZ4_E_OK		0
+#define LZ4_E_ERROR		(-1)
+#define LZ4_E_INPUT_OVERRUN	(-4)
+#define LZ4_E_OUTPUT_OVERRUN	(-5)
+#define LZ4_E_LOOKBEHIND_OVERRUN (-6)
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef _XT_QTAGUID_MATCH_H
 #define _XT_QTAGUID_MATCH_H
 
+#include <linux/if.h>
+#include <linux/types.h>
+
 /* For now we just replace the xt_owner.
  * FIXME: make iptables aware of qtaguid. */
 #include <linux/netfilter/xt_owner.h>
@@ -10,4 +13,63 @@
 #define XT_QTAGUID_SOCKET XT_OWNER_SOCKET
 #define xt_qtaguid_match_info xt_owner_match_info
 
+/*
+ * Binary stats, read from /proc/net/xt_qtaguid/stats_bin.
+ *
+ * A read at offset 0 takes a snapshot, which the following reads return
+ * the rest of: a struct xt_qtaguid_stats_hdr and then nr_records records
+ * of record_size bytes, each starting with a struct xt_qtaguid_stats_rec.
+ * Only the tags whose counters changed since the previous snapshot taken
+ * on the same open file are in it. If XT_QTAGUID_STATS_FULL is set, the
+ * snapshot has every tag the reader may see, and the ones missing from it
+ * were deleted. The first snapshot of an open file is always full.
+ * The counters are totals, not deltas.
+ *
+ * A reader that opens the file for each snapshot can write the header of
+ * its previous snapshot to the file before reading it: the snapshot then
+ * only has what changed since that one, as if the file had stayed open.
+ */
+#define XT_QTAGUID_STATS_MAGIC   0x53555451  /* "QTUS" */
+#define XT_QTAGUID_STATS_VERSION 1
+
+#define XT_QTAGUID_STATS_FULL    (1 << 0)
+
+#define XT_QTAGUID_COUNTER_SETS  2
+
+enum {
+	XT_QTAGUID_TX,
+	XT_QTAGUID_RX,
+	XT_QTAGUID_DIRECTIONS
+};
+
+enum {
+	XT_QTAGUID_TCP,
+	XT_QTAGUID_UDP,
+	XT_QTAGUID_PROTO_OTHER,
+	XT_QTAGUID_PROTOS
+};
+
+struct xt_qtaguid_stats_hdr {
+	__u32 magic;
+	__u16 version;
+	__u16 flags;
+	__u32 gen;  /* bumped by every snapshot taken */
+	__u32 nr_records;
+	__u32 record_size;
+	__u32 deletes;  /* tag deletes seen, for the reader to write back */
+};
+
+struct xt_qtaguid_stats_bpc {
+	__u64 bytes;
+	__u64 packets;
+};
+
+struct xt_qtaguid_stats_rec {
+	char ifname[IFNAMSIZ];
+	__u64 tag;  /* acct_tag in the upper 32 bits, uid in the lower */
+	struct xt_qtaguid_stats_bpc
+		bpc[XT_QTAGUID_COUNTER_SETS][XT_QTAGUID_DIRECTIONS]
+		   [XT_QTAGUID_PROTOS];
+};
+
 #endif /* _XT_QTAGUID_MATCH_H */
@@ -0,0 +1,130 @@
+/*
+ *  LZ4 compressor
+ *
+ *  Single pass, greedy matching against a hash table of the last position
+ *  each four byte prefix was seen at.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+#include <linux/lz4.h>
+#include "lz4defs.h"
+
+static inline u32 lz4_hash(const unsigned char *p)
+{
+	return (get_unaligned((const u32 *)p) * 2654435761U) >>
+		(32 - LZ4_HASH_LOG);
+}
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		 unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	u32 *table = wrkmem;
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - LZ4_MFLIMIT;
+	const unsigned char * const matchlimit = iend - LZ4_LAST_LITERALS;
+	unsigned char *op = dst;
+	unsigned char * const oend = dst + *dst_len;
+	unsigned char *token;
+	size_t len;
+
+	if (src_len < LZ4_MFLIMIT + 1)
+		goto last_literals;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+
+	while (ip < mflimit) {
+		const unsigned char *ref;
+		u32 h = lz4_hash(ip);
+
+		ref = src + table[h];
+		table[h] = ip - src;
+		if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE ||
+		    get_unaligned((const u32 *)ref) !=
+		    get_unaligned((const u32 *)ip)) {
+			ip += 1 + ((ip - anchor) >> LZ4_SKIP_TRIGGER);
+			continue;
+		}
+
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* token, literals, offset and the last literals must fit */
+		len = ip - anchor;
+		if (unlikely(op + 1 + len + len / 255 + 2 + 1 +
+			     LZ4_LAST_LITERALS > oend))
+			return LZ4_E_OUTPUT_OVERRUN;
+
+		token = op++;
+		if (len >= LZ4_RUN_MASK) {
+			*token = LZ4_RUN_MASK << LZ4_ML_BITS;
+			op = lz4_put_length(op, len - LZ4_RUN_MASK);
+		} else
+			*token = len << LZ4_ML_BITS;
+		memcpy(op, anchor, len);
+		op += len;
+
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		ip += LZ4_MIN_MATCH;
+		ref += LZ4_MIN_MATCH;
+		anchor = ip;
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+
+		len = ip - anchor;
+		if (unlikely(op + len / 255 + 1 + LZ4_LAST_LITERALS > oend))
+			return LZ4_E_OUTPUT_OVERRUN;
+		if (len >= LZ4_ML_MASK) {
+			*token |= LZ4_ML_MASK;
+			op = lz4_put_length(op, len - LZ4_ML_MASK);
+		} else
+			*token |= len;
+
+		anchor = ip;
+		if (ip < mflimit)
+			table[lz4_hash(ip - 2)] = ip - 2 - src;
+	}
+
+last_literals:
+	len = iend - anchor;
+	if (unlikely(op + 1 + len + (len + 255 - LZ4_RUN_MASK) / 255 > oend))
+		return LZ4_E_OUTPUT_OVERRUN;
+	if (len >= LZ4_RUN_MASK) {
+		*op++ = LZ4_RUN_MASK << LZ4_ML_BITS;
+		op = lz4_put_length(op, len - LZ4_RUN_MASK);
+	} else
+		*op++ = len << LZ4_ML_BITS;
+	memcpy(op, anchor, len);
+	op += len;
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
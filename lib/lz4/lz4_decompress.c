@@ -0,0 +1,109 @@
+/*
+ *  LZ4 decompressor
+ *
+ *  Every length read from the input is checked against the space left in
+ *  both buffers, so corrupted or hostile input cannot overrun them.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#ifndef STATIC
+#include <linux/module.h>
+#include <linux/kernel.h>
+#endif
+
+#include <linux/string.h>
+#include <asm/unaligned.h>
+#include <linux/lz4.h>
+#include "lz4defs.h"
+
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len)
+{
+	const unsigned char *ip = src;
+	const unsigned char * const iend = src + src_len;
+	unsigned char *op = dst;
+	unsigned char * const oend = dst + *dst_len;
+	const unsigned char *ref;
+	unsigned int token, s;
+	size_t len, offset;
+	int ret = LZ4_E_OK;
+
+	for (;;) {
+		if (unlikely(ip >= iend))
+			goto input_overrun;
+		token = *ip++;
+
+		len = token >> LZ4_ML_BITS;
+		if (len == LZ4_RUN_MASK) {
+			do {
+				if (unlikely(ip >= iend))
+					goto input_overrun;
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+		if (unlikely(len > (size_t)(iend - ip)))
+			goto input_overrun;
+		if (unlikely(len > (size_t)(oend - op)))
+			goto output_overrun;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* the last sequence has no match part */
+		if (ip == iend)
+			break;
+
+		if (unlikely(iend - ip < 2))
+			goto input_overrun;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(offset == 0 || offset > (size_t)(op - dst))) {
+			ret = LZ4_E_LOOKBEHIND_OVERRUN;
+			goto out;
+		}
+		ref = op - offset;
+
+		len = token & LZ4_ML_MASK;
+		if (len == LZ4_ML_MASK) {
+			do {
+				if (unlikely(ip >= iend))
+					goto input_overrun;
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+		len += LZ4_MIN_MATCH;
+		if (unlikely(len > (size_t)(oend - op)))
+			goto output_overrun;
+
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* overlapping: repeats the last offset bytes */
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+	goto out;
+
+input_overrun:
+	ret = LZ4_E_INPUT_OVERRUN;
+	goto out;
+output_overrun:
+	ret = LZ4_E_OUTPUT_OVERRUN;
+out:
+	*dst_len = op - dst;
+	return ret;
+}
+#ifndef STATIC
+EXPORT_SYMBOL_GPL(lz4_decompress_safe);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
+
+#endif
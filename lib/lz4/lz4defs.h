@@ -0,0 +1,27 @@
+/*
+ *  LZ4 block format definitions shared by the compressor and decompressor
+ *
+ *  A block is a series of sequences.  Each starts with a token byte whose
+ *  high nibble is the literal run length and low nibble the match length
+ *  minus LZ4_MIN_MATCH; a nibble of 15 is continued by bytes added to it
+ *  until one is not 255.  The literals follow, then a two byte little
+ *  endian match offset.  The last sequence has literals only.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define LZ4_MIN_MATCH		4
+#define LZ4_RUN_MASK		15
+#define LZ4_ML_MASK		15
+#define LZ4_ML_BITS		4
+#define LZ4_MAX_DISTANCE	65535
+
+/* the last match must start this far from the end of the input... */
+#define LZ4_MFLIMIT		12
+/* ...and the last bytes of it are always literals */
+#define LZ4_LAST_LITERALS	5
+
+/* skip ahead faster the longer no match has been found */
+#define LZ4_SKIP_TRIGGER	6
@@ -27,6 +27,8 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 
@@ -34,10 +36,24 @@
 #define ASHMEM_NAME_PREFIX_LEN (sizeof(ASHMEM_NAME_PREFIX) - 1)
 #define ASHMEM_FULL_NAME_LEN (ASHMEM_NAME_LEN + ASHMEM_NAME_PREFIX_LEN)
 
+/*
+ * ashmem_lru - one shard of the LRU list of unpinned ranges
+ * Lifecycle: From ashmem_init() on
+ * Locking: Protected by its `lock', which nests inside ashmem_area.mutex
+ *
+ * An area puts its ranges on the shard of the cpu that opened it, so apps
+ * pinning and unpinning at the same time rarely share a lock.
+ */
+struct ashmem_lru {
+	spinlock_t lock;
+	struct list_head list;		/* ranges, least recently unpinned first */
+	unsigned long count;		/* pages on 'list' */
+} ____cacheline_aligned_in_smp;
+
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
@@ -46,12 +62,15 @@ struct ashmem_area {
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	struct mutex mutex;		/* protects all of the above */
+	struct ashmem_lru *lru;		/* shard our ranges go on */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's mutex, and while on the LRU also by the
+ * shard's lock
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -62,18 +81,24 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
-static LIST_HEAD(ashmem_lru_list);
-
-/* Count of pages on our LRU list, protected by ashmem_mutex */
-static unsigned long lru_count;
-
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * The LRU shards, one per possible cpu.
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: ashmem_area.mutex -> i_mutex -> i_alloc_sem
+ *                ashmem_area.mutex -> ashmem_lru.lock
+ * The shrinker goes the other way round and only trylocks areas.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static struct ashmem_lru *ashmem_lru;
+static unsigned int ashmem_lru_nr;
+
+/* Count of pages on all LRU shards */
+static atomic_long_t lru_count = ATOMIC_LONG_INIT(0);
+
+/* shard the next shrinker pass starts with */
+static atomic_t ashmem_lru_cursor = ATOMIC_INIT(0);
+
+/* ranges the shrinker purges per trip through a shard's lock */
+#define ASHMEM_SHRINK_BATCH	16
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -104,14 +129,30 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
-	list_add_tail(&range->lru, &ashmem_lru_list);
-	lru_count += range_size(range);
+	struct ashmem_lru *lru = range->asma->lru;
+
+	spin_lock(&lru->lock);
+	list_add_tail(&range->lru, &lru->list);
+	lru->count += range_size(range);
+	spin_unlock(&lru->lock);
+	atomic_long_add(range_size(range), &lru_count);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+/* Caller must hold lru->lock. */
+static inline void __lru_del(struct ashmem_lru *lru, struct ashmem_range *range)
 {
 	list_del(&range->lru);
-	lru_count -= range_size(range);
+	lru->count -= range_size(range);
+	atomic_long_sub(range_size(range), &lru_count);
+}
+
+static inline void lru_del(struct ashmem_range *range)
+{
+	struct ashmem_lru *lru = range->asma->lru;
+
+	spin_lock(&lru->lock);
+	__lru_del(lru, range);
+	spin_unlock(&lru->lock);
 }
 
 /*
@@ -123,7 +164,7 @@ static inline void lru_del(struct ashmem_range *range)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
@@ -159,18 +200,25 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold the range's asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
 {
+	struct ashmem_lru *lru = range->asma->lru;
 	size_t pre = range_size(range);
 
-	range->pgstart = start;
-	range->pgend = end;
-
-	if (range_on_lru(range))
-		lru_count -= pre - range_size(range);
+	if (range_on_lru(range)) {
+		spin_lock(&lru->lock);
+		range->pgstart = start;
+		range->pgend = end;
+		lru->count -= pre - range_size(range);
+		spin_unlock(&lru->lock);
+		atomic_long_sub(pre - range_size(range), &lru_count);
+	} else {
+		range->pgstart = start;
+		range->pgend = end;
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -189,6 +237,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	INIT_LIST_HEAD(&asma->unpinned_list);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
+	mutex_init(&asma->mutex);
+	asma->lru = &ashmem_lru[raw_smp_processor_id() % ashmem_lru_nr];
 	file->private_data = asma;
 
 	return 0;
@@ -199,10 +249,10 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -217,7 +267,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -238,7 +288,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -247,7 +297,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -268,7 +318,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -285,7 +335,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -328,7 +378,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -344,36 +394,69 @@ out:
  * proceed without risk of deadlock (due to gfp_mask).
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * chunks of ashmem regions LRU-wise until we hit 'nr_to_scan' pages freed.
+ * The shards are visited round-robin.  From each we take a batch of ranges
+ * whose areas we can lock without waiting, and purge the batch once the
+ * shard's lock is dropped; the area locks keep pin from racing the purge.
  */
 static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *batch[ASHMEM_SHRINK_BATCH];
+	struct ashmem_area *locked[ASHMEM_SHRINK_BATCH];
+	long nr_to_scan = sc->nr_to_scan;
+	unsigned int shard, idle = 0;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS))
 		return -1;
 	if (!sc->nr_to_scan)
-		return lru_count;
+		return atomic_long_read(&lru_count);
+
+	shard = atomic_inc_return(&ashmem_lru_cursor);
+	while (nr_to_scan > 0 && idle < ashmem_lru_nr) {
+		struct ashmem_lru *lru = &ashmem_lru[shard++ % ashmem_lru_nr];
+		struct ashmem_range *range, *next;
+		int nr = 0, nr_locked = 0, i;
+
+		spin_lock(&lru->lock);
+		list_for_each_entry_safe(range, next, &lru->list, lru) {
+			struct ashmem_area *asma = range->asma;
+
+			for (i = 0; i < nr_locked; i++)
+				if (locked[i] == asma)
+					break;
+			if (i == nr_locked) {
+				/* busy areas are in use, leave them be */
+				if (!mutex_trylock(&asma->mutex))
+					continue;
+				locked[nr_locked++] = asma;
+			}
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+			__lru_del(lru, range);
+			range->purged = ASHMEM_WAS_PURGED;
+			batch[nr++] = range;
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+			nr_to_scan -= range_size(range);
+			if (nr == ASHMEM_SHRINK_BATCH || nr_to_scan <= 0)
+				break;
+		}
+		spin_unlock(&lru->lock);
 
-		sc->nr_to_scan -= range_size(range);
-		if (sc->nr_to_scan <= 0)
-			break;
+		for (i = 0; i < nr; i++) {
+			struct inode *inode;
+			loff_t start = batch[i]->pgstart * PAGE_SIZE;
+			loff_t end = (batch[i]->pgend + 1) * PAGE_SIZE - 1;
+
+			inode = batch[i]->asma->file->f_dentry->d_inode;
+			vmtruncate_range(inode, start, end);
+		}
+		for (i = 0; i < nr_locked; i++)
+			mutex_unlock(&locked[i]->mutex);
+
+		idle = nr ? 0 : idle + 1;
 	}
-	mutex_unlock(&ashmem_mutex);
 
-	return lru_count;
+	return atomic_long_read(&lru_count);
 }
 
 static struct shrinker ashmem_shrinker = {
@@ -385,7 +468,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -400,7 +483,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -408,7 +491,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -422,7 +505,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -431,7 +514,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -448,7 +531,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -457,7 +540,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -523,7 +606,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -558,7 +641,7 @@ restart:
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -607,7 +690,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -621,7 +704,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -640,10 +723,12 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case ASHMEM_SET_SIZE:
 		ret = -EINVAL;
+		mutex_lock(&asma->mutex);
 		if (!asma->file) {
 			ret = 0;
 			asma->size = (size_t) arg;
 		}
+		mutex_unlock(&asma->mutex);
 		break;
 	case ASHMEM_GET_SIZE:
 		ret = asma->size;
@@ -695,8 +780,20 @@ static struct miscdevice ashmem_misc = {
 
 static int __init ashmem_init(void)
 {
+	unsigned int i;
 	int ret;
 
+	ashmem_lru_nr = nr_cpu_ids;
+	ashmem_lru = kcalloc(ashmem_lru_nr, sizeof(*ashmem_lru), GFP_KERNEL);
+	if (unlikely(!ashmem_lru)) {
+		printk(KERN_ERR "ashmem: failed to allocate lru lists\n");
+		return -ENOMEM;
+	}
+	for (i = 0; i < ashmem_lru_nr; i++) {
+		spin_lock_init(&ashmem_lru[i].lock);
+		INIT_LIST_HEAD(&ashmem_lru[i].list);
+	}
+
 	ashmem_area_cachep = kmem_cache_create("ashmem_area_cache",
 					  sizeof(struct ashmem_area),
 					  0, 0, NULL);
@@ -738,6 +835,7 @@ static void __exit ashmem_exit(void)
 
 	kmem_cache_destroy(ashmem_range_cachep);
 	kmem_cache_destroy(ashmem_area_cachep);
+	kfree(ashmem_lru);
 
 	printk(KERN_INFO "ashmem: unloaded\n");
 }
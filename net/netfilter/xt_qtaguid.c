@@ -15,11 +15,14 @@
 #define DEBUG
 
 #include <linux/file.h>
+#include <linux/hash.h>
 #include <linux/inetdevice.h>
 #include <linux/module.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_qtaguid.h>
+#include <linux/rculist.h>
 #include <linux/skbuff.h>
+#include <linux/vmalloc.h>
 #include <linux/workqueue.h>
 #include <net/addrconf.h>
 #include <net/sock.h>
@@ -48,6 +51,8 @@ static struct proc_dir_entry *xt_qtaguid_stats_file;
 static unsigned int proc_stats_perms = S_IRUGO;
 module_param_named(stats_perms, proc_stats_perms, uint, S_IRUGO | S_IWUSR);
 
+static struct proc_dir_entry *xt_qtaguid_stats_bin_file;
+
 static struct proc_dir_entry *xt_qtaguid_ctrl_file;
 #ifdef CONFIG_ANDROID_PARANOID_NETWORK
 static unsigned int proc_ctrl_perms = S_IRUGO | S_IWUGO;
@@ -124,6 +129,12 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  * Notice how sock_tag_list_lock is held sometimes when uid_tag_data_tree_lock
  * is acquired.
  *
+ * The packet path takes none of them to find its counters: the sock_tags,
+ * tag_stats and tag_counter_sets are also kept in hashes that it walks under
+ * rcu_read_lock(). The trees stay for the control path and the procfs
+ * output. An entry is added to and removed from both under the list lock,
+ * and freed after a grace period.
+ *
  * Call tree with all lock holders as of 2011-09-25:
  *
  * iface_stat_all_proc_read()
@@ -146,6 +157,11 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  *   iface_stat_list_lock
  *     struct iface_stat->tag_stat_list_lock
  *
+ * qtaguid_stats_bin_read()
+ *   rcu_read_lock()
+ *     (iface_stat_list)
+ *     (struct iface_stat->tag_stat_hash)
+ *
  * qtudev_open()
  *   uid_tag_data_tree_lock
  *
@@ -178,15 +194,15 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  * qtaguid_mt()
  *   account_for_uid()
  *     if_tag_stat_update()
- *       get_sock_stat()
- *         sock_tag_list_lock
- *       struct iface_stat->tag_stat_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *       rcu_read_lock()
+ *         get_sock_stat()
+ *           (sock_tag_hash)
+ *         (struct iface_stat->tag_stat_hash)
+ *         struct iface_stat->tag_stat_list_lock
+ *           (only to create a missing tag_stat)
  *         tag_stat_update()
  *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *             (tag_counter_set_hash)
  *
  *
  * qtaguid_ctrl_parse()
@@ -195,6 +211,8 @@ static struct proc_dir_entry *iface_stat_all_procfile;
  *     tag_counter_set_list_lock
  *     iface_stat_list_lock
  *       struct iface_stat->tag_stat_list_lock
+ *     synchronize_rcu()
+ *     sock_tag_list_lock
  *     uid_tag_data_tree_lock
  *   ctrl_cmd_counter_set()
  *     tag_counter_set_list_lock
@@ -215,9 +233,13 @@ static LIST_HEAD(iface_stat_list);
 static DEFINE_SPINLOCK(iface_stat_list_lock);
 
 static struct rb_root sock_tag_tree = RB_ROOT;
+#define SOCK_TAG_HASH_BITS 8
+static struct hlist_head sock_tag_hash[1 << SOCK_TAG_HASH_BITS];
 static DEFINE_SPINLOCK(sock_tag_list_lock);
 
 static struct rb_root tag_counter_set_tree = RB_ROOT;
+#define TAG_COUNTER_SET_HASH_BITS 6
+static struct hlist_head tag_counter_set_hash[1 << TAG_COUNTER_SET_HASH_BITS];
 static DEFINE_SPINLOCK(tag_counter_set_list_lock);
 
 static struct rb_root uid_tag_data_tree = RB_ROOT;
@@ -227,6 +249,13 @@ static struct rb_root proc_qtu_data_tree = RB_ROOT;
 /* No proc_qtu_data_tree_lock; use uid_tag_data_tree_lock */
 
 static struct qtaguid_event_counts qtu_events;
+
+/*
+ * Bumped by each stats_bin snapshot. The packet path stamps the per cpu
+ * counters it updates with it, so a reader can tell what changed since its
+ * last snapshot.
+ */
+static atomic_t qtu_stats_gen = ATOMIC_INIT(1);
 /*----------------------------------------------*/
 static bool can_manipulate_uids(void)
 {
@@ -408,6 +437,38 @@ static void sock_tag_tree_insert(struct sock_tag *data, struct rb_root *root)
 	rb_insert_color(&data->sock_node, root);
 }
 
+static struct hlist_head *sock_tag_bucket(const struct sock *sk)
+{
+	return &sock_tag_hash[hash_ptr(sk, SOCK_TAG_HASH_BITS)];
+}
+
+/* Caller must hold sock_tag_list_lock */
+static void sock_tag_link(struct sock_tag *st_entry)
+{
+	sock_tag_tree_insert(st_entry, &sock_tag_tree);
+	hlist_add_head_rcu(&st_entry->hash_node, sock_tag_bucket(st_entry->sk));
+}
+
+/* Caller must hold sock_tag_list_lock */
+static void sock_tag_unlink(struct sock_tag *st_entry)
+{
+	rb_erase(&st_entry->sock_node, &sock_tag_tree);
+	hlist_del_rcu(&st_entry->hash_node);
+}
+
+/* Reads the tag without sock_tag_list_lock. */
+static tag_t sock_tag_read_tag(struct sock_tag *st_entry)
+{
+	unsigned int seq;
+	tag_t tag;
+
+	do {
+		seq = read_seqcount_begin(&st_entry->tag_seq);
+		tag = st_entry->tag;
+	} while (read_seqcount_retry(&st_entry->tag_seq, seq));
+	return tag;
+}
+
 static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 {
 	struct rb_node *node;
@@ -424,7 +485,8 @@ static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 			 get_uid_from_tag(st_entry->tag));
 		rb_erase(&st_entry->sock_node, st_to_free_tree);
 		sockfd_put(st_entry->socket);
-		kfree(st_entry);
+		/* The packet path might still be looking at it */
+		kfree_rcu(st_entry, rcu);
 	}
 }
 
@@ -735,27 +797,37 @@ static int read_proc_bool(char *page, char **start, off_t off,
 	return len;
 }
 
+static struct hlist_head *tag_counter_set_bucket(tag_t tag)
+{
+	return &tag_counter_set_hash[hash_64(tag, TAG_COUNTER_SET_HASH_BITS)];
+}
+
+/* Caller must be in an rcu read side critical section */
 static int get_active_counter_set(tag_t tag)
 {
 	int active_set = 0;
 	struct tag_counter_set *tcs;
+	struct hlist_node *node;
 
 	MT_DEBUG("qtaguid: get_active_counter_set(tag=0x%llx)"
 		 " (uid=%u)\n",
 		 tag, get_uid_from_tag(tag));
 	/* For now we only handle UID tags for active sets */
 	tag = get_utag_from_tag(tag);
-	spin_lock_bh(&tag_counter_set_list_lock);
-	tcs = tag_counter_set_tree_search(&tag_counter_set_tree, tag);
-	if (tcs)
-		active_set = tcs->active_set;
-	spin_unlock_bh(&tag_counter_set_list_lock);
+	hlist_for_each_entry_rcu(tcs, node, tag_counter_set_bucket(tag),
+				 hash_node) {
+		if (tcs->tn.tag == tag) {
+			active_set = ACCESS_ONCE(tcs->active_set);
+			break;
+		}
+	}
 	return active_set;
 }
 
 /*
  * Find the entry for tracking the specified interface.
- * Caller must hold iface_stat_list_lock
+ * Caller must hold iface_stat_list_lock, or be in an rcu read side critical
+ * section: entries are only ever added.
  */
 static struct iface_stat *get_iface_entry(const char *ifname)
 {
@@ -768,7 +840,7 @@ static struct iface_stat *get_iface_entry(const char *ifname)
 	}
 
 	/* Iterate over interfaces */
-	list_for_each_entry(iface_entry, &iface_stat_list, list) {
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
 		if (!strcmp(ifname, iface_entry->ifname))
 			goto done;
 	}
@@ -941,7 +1013,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 	isw->iface_entry = new_iface;
 	INIT_WORK(&isw->iface_work, iface_create_proc_worker);
 	schedule_work(&isw->iface_work);
-	list_add(&new_iface->list, &iface_stat_list);
+	list_add_rcu(&new_iface->list, &iface_stat_list);
 	return new_iface;
 }
 
@@ -1131,16 +1203,20 @@ static struct sock_tag *get_sock_stat_nl(const struct sock *sk)
 	return sock_tag_tree_search(&sock_tag_tree, sk);
 }
 
+/* Caller must be in an rcu read side critical section */
 static struct sock_tag *get_sock_stat(const struct sock *sk)
 {
 	struct sock_tag *sock_tag_entry;
+	struct hlist_node *node;
 	MT_DEBUG("qtaguid: get_sock_stat(sk=%p)\n", sk);
 	if (!sk)
 		return NULL;
-	spin_lock_bh(&sock_tag_list_lock);
-	sock_tag_entry = get_sock_stat_nl(sk);
-	spin_unlock_bh(&sock_tag_list_lock);
-	return sock_tag_entry;
+	hlist_for_each_entry_rcu(sock_tag_entry, node, sock_tag_bucket(sk),
+				 hash_node) {
+		if (sock_tag_entry->sk == sk)
+			return sock_tag_entry;
+	}
+	return NULL;
 }
 
 static void
@@ -1216,6 +1292,18 @@ static void iface_stat_update(struct net_device *net_dev, bool stash_only)
 	spin_unlock_bh(&iface_stat_list_lock);
 }
 
+static void tag_stat_cpu_update(struct tag_stat *tag_entry, int set,
+				enum ifs_tx_rx direction, int proto, int bytes)
+{
+	/* The match runs with bh disabled, so this cpu is ours. */
+	struct tag_stat_cpu *tsc = &tag_entry->cpu[smp_processor_id()];
+
+	u64_stats_update_begin(&tsc->syncp);
+	data_counters_update(&tsc->counters, set, direction, proto, bytes);
+	tsc->gen = atomic_read(&qtu_stats_gen);
+	u64_stats_update_end(&tsc->syncp);
+}
+
 static void tag_stat_update(struct tag_stat *tag_entry,
 			enum ifs_tx_rx direction, int proto, int bytes)
 {
@@ -1225,11 +1313,31 @@ static void tag_stat_update(struct tag_stat *tag_entry,
 		 "dir=%d proto=%d bytes=%d)\n",
 		 tag_entry->tn.tag, get_uid_from_tag(tag_entry->tn.tag),
 		 active_set, direction, proto, bytes);
-	data_counters_update(&tag_entry->counters, active_set, direction,
-			     proto, bytes);
-	if (tag_entry->parent_counters)
-		data_counters_update(tag_entry->parent_counters, active_set,
-				     direction, proto, bytes);
+	tag_stat_cpu_update(tag_entry, active_set, direction, proto, bytes);
+	if (tag_entry->parent)
+		tag_stat_cpu_update(tag_entry->parent, active_set,
+				    direction, proto, bytes);
+}
+
+static struct hlist_head *tag_stat_bucket(struct iface_stat *iface_entry,
+					  tag_t tag)
+{
+	return &iface_entry->tag_stat_hash[hash_64(tag, TAG_STAT_HASH_BITS)];
+}
+
+/* Caller must be in an rcu read side critical section */
+static struct tag_stat *tag_stat_hash_search(struct iface_stat *iface_entry,
+					     tag_t tag)
+{
+	struct tag_stat *ts_entry;
+	struct hlist_node *node;
+
+	hlist_for_each_entry_rcu(ts_entry, node,
+				 tag_stat_bucket(iface_entry, tag), hash_node) {
+		if (ts_entry->tn.tag == tag)
+			return ts_entry;
+	}
+	return NULL;
 }
 
 /*
@@ -1238,44 +1346,87 @@ static void tag_stat_update(struct tag_stat *tag_entry,
  * iface_entry->tag_stat_list_lock should be held.
  */
 static struct tag_stat *create_if_tag_stat(struct iface_stat *iface_entry,
-					   tag_t tag)
+					   tag_t tag, struct tag_stat *parent)
 {
 	struct tag_stat *new_tag_stat_entry = NULL;
 	IF_DEBUG("qtaguid: iface_stat: %s(): ife=%p tag=0x%llx"
 		 " (uid=%u)\n", __func__,
 		 iface_entry, tag, get_uid_from_tag(tag));
-	new_tag_stat_entry = kzalloc(sizeof(*new_tag_stat_entry), GFP_ATOMIC);
+	/*
+	 * alloc_percpu() can sleep, and this runs for a packet. So the per
+	 * cpu counters come with the entry, one cacheline aligned slot per
+	 * possible cpu.
+	 */
+	new_tag_stat_entry = kzalloc(sizeof(*new_tag_stat_entry) +
+				     nr_cpu_ids * sizeof(struct tag_stat_cpu),
+				     GFP_ATOMIC);
 	if (!new_tag_stat_entry) {
 		pr_err("qtaguid: iface_stat: tag stat alloc failed\n");
 		goto done;
 	}
 	new_tag_stat_entry->tn.tag = tag;
+	new_tag_stat_entry->iface_entry = iface_entry;
+	new_tag_stat_entry->parent = parent;
 	tag_stat_tree_insert(new_tag_stat_entry, &iface_entry->tag_stat_tree);
+	hlist_add_head_rcu(&new_tag_stat_entry->hash_node,
+			   tag_stat_bucket(iface_entry, tag));
 done:
 	return new_tag_stat_entry;
 }
 
+/*
+ * Find the entry for the {acct_tag,uid_tag} within the interface, creating
+ * it and its {0,uid_tag} parent if needed.
+ * iface_entry->tag_stat_list_lock should be held.
+ */
+static struct tag_stat *get_if_tag_stat_nl(struct iface_stat *iface_entry,
+					   tag_t tag)
+{
+	struct tag_stat *tag_stat_entry;
+	struct tag_stat *uid_tag_stat;
+	tag_t uid_tag = get_utag_from_tag(tag);
+
+	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
+					      tag);
+	if (tag_stat_entry)
+		return tag_stat_entry;
+
+	/* Loop over tag list under this interface for {0,uid_tag} */
+	uid_tag_stat = tag_stat_tree_search(&iface_entry->tag_stat_tree,
+					    uid_tag);
+	if (!uid_tag_stat) {
+		/* Here: the base uid_tag did not exist */
+		/*
+		 * No parent counters. So
+		 *  - No {0, uid_tag} stats and no {acc_tag, uid_tag} stats.
+		 */
+		uid_tag_stat = create_if_tag_stat(iface_entry, uid_tag, NULL);
+		if (!uid_tag_stat)
+			return NULL;
+	}
+	if (!get_atag_from_tag(tag))
+		return uid_tag_stat;
+	return create_if_tag_stat(iface_entry, tag, uid_tag_stat);
+}
+
 static void if_tag_stat_update(const char *ifname, uid_t uid,
 			       const struct sock *sk, enum ifs_tx_rx direction,
 			       int proto, int bytes)
 {
 	struct tag_stat *tag_stat_entry;
-	tag_t tag, acct_tag;
-	tag_t uid_tag;
-	struct data_counters *uid_tag_counters;
+	tag_t tag;
 	struct sock_tag *sock_tag_entry;
 	struct iface_stat *iface_entry;
-	struct tag_stat *new_tag_stat;
 	MT_DEBUG("qtaguid: if_tag_stat_update(ifname=%s "
 		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
 		 ifname, uid, sk, direction, proto, bytes);
 
-
+	rcu_read_lock();
 	iface_entry = get_iface_entry(ifname);
 	if (!iface_entry) {
 		pr_err("qtaguid: iface_stat: stat_update() %s not found\n",
 		       ifname);
-		return;
+		goto unlock;
 	}
 	/* It is ok to process data when an iface_entry is inactive */
 
@@ -1288,53 +1439,40 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	 */
 	sock_tag_entry = get_sock_stat(sk);
 	if (sock_tag_entry) {
-		tag = sock_tag_entry->tag;
-		acct_tag = get_atag_from_tag(tag);
-		uid_tag = get_utag_from_tag(tag);
+		tag = sock_tag_read_tag(sock_tag_entry);
+		/* Most packets of a socket go out the same iface */
+		tag_stat_entry = rcu_dereference(sock_tag_entry->cached_ts);
+		if (tag_stat_entry &&
+		    tag_stat_entry->iface_entry == iface_entry &&
+		    tag_stat_entry->tn.tag == tag &&
+		    !tag_stat_entry->deleted) {
+			tag_stat_update(tag_stat_entry, direction, proto,
+					bytes);
+			goto unlock;
+		}
 	} else {
-		acct_tag = make_atag_from_value(0);
-		tag = combine_atag_with_uid(acct_tag, uid);
-		uid_tag = make_tag_from_uid(uid);
+		tag = combine_atag_with_uid(make_atag_from_value(0), uid);
 	}
 	MT_DEBUG("qtaguid: iface_stat: stat_update(): "
 		 " looking for tag=0x%llx (uid=%u) in ife=%p\n",
 		 tag, get_uid_from_tag(tag), iface_entry);
-	/* Loop over tag list under this interface for {acct_tag,uid_tag} */
-	spin_lock_bh(&iface_entry->tag_stat_list_lock);
-
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      tag);
-	if (tag_stat_entry) {
-		/*
-		 * Updating the {acct_tag, uid_tag} entry handles both stats:
-		 * {0, uid_tag} will also get updated.
-		 */
-		tag_stat_update(tag_stat_entry, direction, proto, bytes);
-		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
-		return;
-	}
-
-	/* Loop over tag list under this interface for {0,uid_tag} */
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      uid_tag);
+	tag_stat_entry = tag_stat_hash_search(iface_entry, tag);
 	if (!tag_stat_entry) {
-		/* Here: the base uid_tag did not exist */
-		/*
-		 * No parent counters. So
-		 *  - No {0, uid_tag} stats and no {acc_tag, uid_tag} stats.
-		 */
-		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag);
-		uid_tag_counters = &new_tag_stat->counters;
-	} else {
-		uid_tag_counters = &tag_stat_entry->counters;
-	}
-
-	if (acct_tag) {
-		new_tag_stat = create_if_tag_stat(iface_entry, tag);
-		new_tag_stat->parent_counters = uid_tag_counters;
+		spin_lock_bh(&iface_entry->tag_stat_list_lock);
+		tag_stat_entry = get_if_tag_stat_nl(iface_entry, tag);
+		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+		if (!tag_stat_entry)
+			goto unlock;
 	}
-	tag_stat_update(new_tag_stat, direction, proto, bytes);
-	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+	if (sock_tag_entry)
+		rcu_assign_pointer(sock_tag_entry->cached_ts, tag_stat_entry);
+	/*
+	 * Updating the {acct_tag, uid_tag} entry handles both stats:
+	 * {0, uid_tag} will also get updated.
+	 */
+	tag_stat_update(tag_stat_entry, direction, proto, bytes);
+unlock:
+	rcu_read_unlock();
 }
 
 static int iface_netdev_event_handler(struct notifier_block *nb,
@@ -1866,7 +2004,8 @@ static int ctrl_cmd_delete(const char *input)
 	struct rb_node *node;
 	struct sock_tag *st_entry;
 	struct rb_root st_to_free_tree = RB_ROOT;
-	struct tag_stat *ts_entry;
+	struct tag_stat *ts_entry, *ts_next;
+	LIST_HEAD(ts_to_free_list);
 	struct tag_counter_set *tcs_entry;
 	struct tag_ref *tr_entry;
 	struct uid_tag_data *utd_entry;
@@ -1913,7 +2052,7 @@ static int ctrl_cmd_delete(const char *input)
 			 input, st_entry->tag, entry_uid);
 
 		if (!acct_tag || st_entry->tag == tag) {
-			rb_erase(&st_entry->sock_node, &sock_tag_tree);
+			sock_tag_unlink(st_entry);
 			/* Can't sockfd_put() within spinlock, do it later. */
 			sock_tag_tree_insert(st_entry, &st_to_free_tree);
 			tr_entry = lookup_tag_ref(st_entry->tag, NULL);
@@ -1946,7 +2085,8 @@ static int ctrl_cmd_delete(const char *input)
 			 get_uid_from_tag(tcs_entry->tn.tag),
 			 tcs_entry->active_set);
 		rb_erase(&tcs_entry->tn.node, &tag_counter_set_tree);
-		kfree(tcs_entry);
+		hlist_del_rcu(&tcs_entry->hash_node);
+		kfree_rcu(tcs_entry, rcu);
 	}
 	spin_unlock_bh(&tag_counter_set_list_lock);
 
@@ -1977,13 +2117,39 @@ static int ctrl_cmd_delete(const char *input)
 					 entry_uid);
 				rb_erase(&ts_entry->tn.node,
 					 &iface_entry->tag_stat_tree);
-				kfree(ts_entry);
+				hlist_del_rcu(&ts_entry->hash_node);
+				ts_entry->deleted = true;
+				list_add(&ts_entry->free_list,
+					 &ts_to_free_list);
 			}
 		}
 		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
 	}
 	spin_unlock_bh(&iface_stat_list_lock);
 
+	if (!list_empty(&ts_to_free_list)) {
+		/*
+		 * Sockets cache the tag_stat they were last billed to.
+		 * Once the packet path is done with the lookups that could
+		 * still find the deleted entries, drop them from the caches.
+		 * A packet may still be using a cached one, so the free waits
+		 * for another grace period.
+		 */
+		synchronize_rcu();
+		spin_lock_bh(&sock_tag_list_lock);
+		for (node = rb_first(&sock_tag_tree); node;
+		     node = rb_next(node)) {
+			st_entry = rb_entry(node, struct sock_tag, sock_node);
+			ts_entry = st_entry->cached_ts;
+			if (ts_entry && ts_entry->deleted)
+				rcu_assign_pointer(st_entry->cached_ts, NULL);
+		}
+		spin_unlock_bh(&sock_tag_list_lock);
+		list_for_each_entry_safe(ts_entry, ts_next, &ts_to_free_list,
+					 free_list)
+			kfree_rcu(ts_entry, rcu);
+	}
+
 	/* Cleanup the uid_tag_data */
 	spin_lock_bh(&uid_tag_data_tree_lock);
 	node = rb_first(&uid_tag_data_tree);
@@ -2059,7 +2225,10 @@ static int ctrl_cmd_counter_set(const char *input)
 			goto err;
 		}
 		tcs->tn.tag = tag;
+		tcs->active_set = counter_set;
 		tag_counter_set_tree_insert(tcs, &tag_counter_set_tree);
+		hlist_add_head_rcu(&tcs->hash_node,
+				   tag_counter_set_bucket(tag));
 		CT_DEBUG("qtaguid: ctrl_counterset(%s): added tcs tag=0x%llx "
 			 "(uid=%u) set=%d\n",
 			 input, tag, get_uid_from_tag(tag), counter_set);
@@ -2158,7 +2327,9 @@ static int ctrl_cmd_tag(const char *input)
 		BUG_ON(IS_ERR_OR_NULL(prev_tag_ref_entry));
 		BUG_ON(prev_tag_ref_entry->num_sock_tags <= 0);
 		prev_tag_ref_entry->num_sock_tags--;
+		write_seqcount_begin(&sock_tag_entry->tag_seq);
 		sock_tag_entry->tag = full_tag;
+		write_seqcount_end(&sock_tag_entry->tag_seq);
 	} else {
 		CT_DEBUG("qtaguid: ctrl_tag(%s): newtag for sk=%p\n",
 			 input, el_socket->sk);
@@ -2177,6 +2348,7 @@ static int ctrl_cmd_tag(const char *input)
 		sock_tag_entry->pid = current->tgid;
 		sock_tag_entry->tag = combine_atag_with_uid(acct_tag,
 							    uid);
+		seqcount_init(&sock_tag_entry->tag_seq);
 		spin_lock_bh(&uid_tag_data_tree_lock);
 		pqd_entry = proc_qtu_data_tree_search(
 			&proc_qtu_data_tree, current->tgid);
@@ -2197,7 +2369,7 @@ static int ctrl_cmd_tag(const char *input)
 				 &pqd_entry->sock_tag_list);
 		spin_unlock_bh(&uid_tag_data_tree_lock);
 
-		sock_tag_tree_insert(sock_tag_entry, &sock_tag_tree);
+		sock_tag_link(sock_tag_entry);
 		atomic64_inc(&qtu_events.sockets_tagged);
 	}
 	spin_unlock_bh(&sock_tag_list_lock);
@@ -2261,7 +2433,7 @@ static int ctrl_cmd_untag(const char *input)
 	 * The socket already belongs to the current process
 	 * so it can do whatever it wants to it.
 	 */
-	rb_erase(&sock_tag_entry->sock_node, &sock_tag_tree);
+	sock_tag_unlink(sock_tag_entry);
 
 	tag_ref_entry = lookup_tag_ref(sock_tag_entry->tag, &utd_entry);
 	BUG_ON(!tag_ref_entry);
@@ -2298,7 +2470,7 @@ static int ctrl_cmd_untag(const char *input)
 		 atomic_long_read(&el_socket->file->f_count) - 1);
 	sockfd_put(el_socket);
 
-	kfree(sock_tag_entry);
+	kfree_rcu(sock_tag_entry, rcu);
 	atomic64_inc(&qtu_events.sockets_untagged);
 
 	return 0;
@@ -2374,6 +2546,8 @@ struct proc_print_info {
 	char **num_items_returned;
 	struct iface_stat *iface_entry;
 	struct tag_stat *ts_entry;
+	/* The ts_entry per cpu counters, added up */
+	struct data_counters counters;
 	int item_index;
 	int items_to_skip;
 	int char_count;
@@ -2412,7 +2586,7 @@ static int pp_stats_line(struct proc_print_info *ppi, int cnt_set)
 		}
 		if (ppi->item_index++ < ppi->items_to_skip)
 			return 0;
-		cnts = &ppi->ts_entry->counters;
+		cnts = &ppi->counters;
 		len = snprintf(
 			ppi->outp, ppi->char_count,
 			"%d %s 0x%llx %u %u "
@@ -2453,6 +2627,8 @@ static bool pp_sets(struct proc_print_info *ppi)
 {
 	int len;
 	int counter_set;
+
+	tag_stat_read_counters(ppi->ts_entry, &ppi->counters);
 	for (counter_set = 0; counter_set < IFS_MAX_COUNTER_SETS;
 	     counter_set++) {
 		len = pp_stats_line(ppi, counter_set);
@@ -2539,6 +2715,235 @@ static int qtaguid_stats_proc_read(char *page, char **num_items_returned,
 	return ppi.outp - page;
 }
 
+/* Is any of the per cpu counters stamped with gen or a later one? */
+static bool tag_stat_changed_since(struct tag_stat *ts, u32 gen)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if ((s32)(ACCESS_ONCE(ts->cpu[cpu].gen) - gen) >= 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Fills buf with the records of the tag_stats the current process may read,
+ * all of them if full, or else those updated since the since gen.
+ * Returns the number of records, or -ENOSPC if more than max_records.
+ */
+static int stats_bin_fill(struct xt_qtaguid_stats_rec *recs, int max_records,
+			  bool full, u32 since)
+{
+	struct iface_stat *iface_entry;
+	struct tag_stat *ts_entry;
+	struct hlist_node *node;
+	struct xt_qtaguid_stats_rec *rec;
+	int nr = 0, bucket;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
+		for (bucket = 0; bucket < 1 << TAG_STAT_HASH_BITS; bucket++) {
+			hlist_for_each_entry_rcu(
+				ts_entry, node,
+				&iface_entry->tag_stat_hash[bucket],
+				hash_node) {
+				if (ts_entry->deleted)
+					continue;
+				if (!full &&
+				    !tag_stat_changed_since(ts_entry, since))
+					continue;
+				if (!can_read_other_uid_stats(
+					    get_uid_from_tag(ts_entry->tn.tag)))
+					continue;
+				if (nr == max_records) {
+					rcu_read_unlock();
+					return -ENOSPC;
+				}
+				rec = &recs[nr++];
+				memset(rec->ifname, 0, sizeof(rec->ifname));
+				strlcpy(rec->ifname, iface_entry->ifname,
+					sizeof(rec->ifname));
+				rec->tag = ts_entry->tn.tag;
+				tag_stat_read_counters(
+					ts_entry, (struct data_counters *)rec->bpc);
+			}
+		}
+	}
+	rcu_read_unlock();
+	return nr;
+}
+
+/* Counts all the tag_stats, to size the snapshot buffer */
+static int stats_bin_count(void)
+{
+	struct iface_stat *iface_entry;
+	struct tag_stat *ts_entry;
+	struct hlist_node *node;
+	int nr = 0, bucket;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
+		for (bucket = 0; bucket < 1 << TAG_STAT_HASH_BITS; bucket++)
+			hlist_for_each_entry_rcu(
+				ts_entry, node,
+				&iface_entry->tag_stat_hash[bucket], hash_node)
+				nr++;
+	}
+	rcu_read_unlock();
+	return nr;
+}
+
+static int stats_bin_snapshot(struct stats_bin_reader *reader)
+{
+	struct xt_qtaguid_stats_hdr *hdr;
+	u64 delete_cmds;
+	bool full;
+	u32 gen;
+	int max_records, nr;
+
+	BUILD_BUG_ON(sizeof(((struct xt_qtaguid_stats_rec *)0)->bpc) !=
+		     sizeof(struct data_counters));
+
+	vfree(reader->buf);
+	reader->buf = NULL;
+	reader->len = 0;
+
+	/*
+	 * A delete drops tag_stats, which only a full snapshot shows.
+	 * Reading the count before the walk means a delete racing with it
+	 * makes the next snapshot full too.
+	 */
+	delete_cmds = atomic64_read(&qtu_events.delete_cmds);
+	full = reader->full || (u32)delete_cmds != reader->delete_cmds;
+	/*
+	 * Updates stamped with the gen from before the bump might land after
+	 * the walk went by; the next snapshot, which starts from that gen,
+	 * gets them.
+	 */
+	gen = atomic_inc_return(&qtu_stats_gen);
+
+	max_records = stats_bin_count() + 16;
+	for (;;) {
+		hdr = vmalloc(sizeof(*hdr) +
+			      max_records * sizeof(struct xt_qtaguid_stats_rec));
+		if (!hdr)
+			return -ENOMEM;
+		nr = stats_bin_fill((struct xt_qtaguid_stats_rec *)(hdr + 1),
+				    max_records, full, reader->since_gen);
+		if (nr >= 0)
+			break;
+		/* Tags were added while walking, go again with more room */
+		vfree(hdr);
+		max_records *= 2;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = XT_QTAGUID_STATS_MAGIC;
+	hdr->version = XT_QTAGUID_STATS_VERSION;
+	hdr->flags = full ? XT_QTAGUID_STATS_FULL : 0;
+	hdr->gen = gen;
+	hdr->nr_records = nr;
+	hdr->record_size = sizeof(struct xt_qtaguid_stats_rec);
+	hdr->deletes = delete_cmds;
+
+	reader->buf = hdr;
+	reader->len = sizeof(*hdr) + nr * sizeof(struct xt_qtaguid_stats_rec);
+	reader->since_gen = gen - 1;
+	reader->full = false;
+	reader->delete_cmds = delete_cmds;
+	CT_DEBUG("qtaguid: %s(): gen=%u full=%d records=%d\n", __func__,
+		 gen, full, nr);
+	return 0;
+}
+
+/*
+ * Binary stats reader: see include/linux/netfilter/xt_qtaguid.h.
+ * It walks the tag_stat hashes under rcu, so unlike the text stats it does
+ * not hold off the packet path, and it only returns what changed since the
+ * previous snapshot of the same reader.
+ */
+static ssize_t qtaguid_stats_bin_read(struct file *file, char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct stats_bin_reader *reader = file->private_data;
+	ssize_t res;
+
+	if (unlikely(module_passive))
+		return 0;
+
+	mutex_lock(&reader->lock);
+	if (*ppos == 0) {
+		res = stats_bin_snapshot(reader);
+		if (res)
+			goto out;
+	}
+	res = simple_read_from_buffer(buf, count, ppos, reader->buf,
+				      reader->len);
+out:
+	mutex_unlock(&reader->lock);
+	return res;
+}
+
+/*
+ * Takes back the header of an earlier snapshot, so that the next snapshot
+ * only has what changed since that one. For readers that reopen the file
+ * for every snapshot.
+ */
+static ssize_t qtaguid_stats_bin_write(struct file *file,
+				       const char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	struct stats_bin_reader *reader = file->private_data;
+	struct xt_qtaguid_stats_hdr hdr;
+
+	if (count != sizeof(hdr))
+		return -EINVAL;
+	if (copy_from_user(&hdr, buf, sizeof(hdr)))
+		return -EFAULT;
+	if (hdr.magic != XT_QTAGUID_STATS_MAGIC ||
+	    hdr.version != XT_QTAGUID_STATS_VERSION)
+		return -EINVAL;
+
+	mutex_lock(&reader->lock);
+	reader->since_gen = hdr.gen - 1;
+	reader->delete_cmds = hdr.deletes;
+	reader->full = false;
+	mutex_unlock(&reader->lock);
+	return count;
+}
+
+static int qtaguid_stats_bin_open(struct inode *inode, struct file *file)
+{
+	struct stats_bin_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	mutex_init(&reader->lock);
+	reader->full = true;
+	file->private_data = reader;
+	return 0;
+}
+
+static int qtaguid_stats_bin_release(struct inode *inode, struct file *file)
+{
+	struct stats_bin_reader *reader = file->private_data;
+
+	vfree(reader->buf);
+	kfree(reader);
+	return 0;
+}
+
+static const struct file_operations qtaguid_stats_bin_fops = {
+	.owner = THIS_MODULE,
+	.open = qtaguid_stats_bin_open,
+	.read = qtaguid_stats_bin_read,
+	.write = qtaguid_stats_bin_write,
+	.llseek = default_llseek,
+	.release = qtaguid_stats_bin_release,
+};
+
 /*------------------------------------------*/
 static int qtudev_open(struct inode *inode, struct file *file)
 {
@@ -2656,7 +3061,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 		tr->num_sock_tags--;
 		free_tag_ref_from_utd_entry(tr, utd_entry);
 
-		rb_erase(&st_entry->sock_node, &sock_tag_tree);
+		sock_tag_unlink(st_entry);
 		list_del(&st_entry->list);
 		/* Can't sockfd_put() within spinlock, do it later. */
 		sock_tag_tree_insert(st_entry, &st_to_free_tree);
@@ -2736,8 +3141,23 @@ static int __init qtaguid_proc_register(struct proc_dir_entry **res_procdir)
 	 * TODO: add support counter hacking
 	 * xt_qtaguid_stats_file->write_proc = qtaguid_stats_proc_write;
 	 */
+
+	/* Writes only set up the writer's own snapshots */
+	xt_qtaguid_stats_bin_file = proc_create("stats_bin",
+						proc_stats_perms |
+						(proc_stats_perms & S_IRUGO) >> 1,
+						*res_procdir,
+						&qtaguid_stats_bin_fops);
+	if (!xt_qtaguid_stats_bin_file) {
+		pr_err("qtaguid: failed to create xt_qtaguid/stats_bin "
+			"file\n");
+		ret = -ENOMEM;
+		goto no_stats_bin_entry;
+	}
 	return 0;
 
+no_stats_bin_entry:
+	remove_proc_entry("stats", *res_procdir);
 no_stats_entry:
 	remove_proc_entry("ctrl", *res_procdir);
 no_ctrl_entry:
@@ -11,8 +11,14 @@
 #define __XT_QTAGUID_INTERNAL_H__
 
 #include <linux/types.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
 #include <linux/spinlock_types.h>
+#include <linux/string.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/workqueue.h>
 
 /* Iface handling */
@@ -156,6 +162,10 @@ static inline tag_t make_atag_from_value(uint32_t value)
  */
 #define IFS_MAX_COUNTER_SETS 2
 
+/*
+ * The binary stats copy data_counters out as is: keep these in the order of
+ * the XT_QTAGUID_* ones in linux/netfilter/xt_qtaguid.h.
+ */
 enum ifs_tx_rx {
 	IFS_TX,
 	IFS_RX,
@@ -185,16 +195,66 @@ struct tag_node {
 	tag_t tag;
 };
 
+/*
+ * The counters are bumped for every matched packet, so each cpu gets its own
+ * copy and the readers of the stats add them up.
+ */
+struct tag_stat_cpu {
+	struct data_counters counters;
+	/* qtu_stats_gen as of the last update, for the stats_bin readers */
+	u32 gen;
+	struct u64_stats_sync syncp;
+} ____cacheline_aligned_in_smp;
+
 struct tag_stat {
 	struct tag_node tn;
-	struct data_counters counters;
+	struct hlist_node hash_node;  /* in iface_stat.tag_stat_hash */
+	struct iface_stat *iface_entry;
 	/*
 	 * If this tag is acct_tag based, we need to count against the
 	 * matching parent uid_tag.
 	 */
-	struct data_counters *parent_counters;
+	struct tag_stat *parent;
+	/*
+	 * Set once a delete has unlinked the entry, so that the sock_tags
+	 * still caching it can be found before it is freed.
+	 */
+	bool deleted;
+	struct list_head free_list;
+	struct rcu_head rcu;
+	struct tag_stat_cpu cpu[0];  /* nr_cpu_ids of them */
 };
 
+/* Adds up the per cpu counters of the tag_stat into dc. */
+static inline void tag_stat_read_counters(struct tag_stat *ts,
+					  struct data_counters *dc)
+{
+	struct data_counters snap;
+	struct tag_stat_cpu *tsc;
+	unsigned int start;
+	int cpu, set, dir, proto;
+
+	memset(dc, 0, sizeof(*dc));
+	for_each_possible_cpu(cpu) {
+		tsc = &ts->cpu[cpu];
+		do {
+			start = u64_stats_fetch_begin(&tsc->syncp);
+			snap = tsc->counters;
+		} while (u64_stats_fetch_retry(&tsc->syncp, start));
+		for (set = 0; set < IFS_MAX_COUNTER_SETS; set++)
+			for (dir = 0; dir < IFS_MAX_DIRECTIONS; dir++)
+				for (proto = 0; proto < IFS_MAX_PROTOS;
+				     proto++) {
+					dc->bpc[set][dir][proto].bytes +=
+						snap.bpc[set][dir][proto].bytes;
+					dc->bpc[set][dir][proto].packets +=
+						snap.bpc[set][dir][proto].packets;
+				}
+	}
+}
+
+#define TAG_STAT_HASH_BITS 6
+
 struct iface_stat {
 	struct list_head list;  /* in iface_stat_list */
 	char *ifname;
@@ -218,6 +278,8 @@ struct iface_stat {
 	struct proc_dir_entry *proc_ptr;
 
 	struct rb_root tag_stat_tree;
+	/* Same entries as the tree, for lookups on the packet path */
+	struct hlist_head tag_stat_hash[1 << TAG_STAT_HASH_BITS];
 	spinlock_t tag_stat_list_lock;
 };
 
@@ -235,6 +297,7 @@ struct iface_stat_work {
  */
 struct sock_tag {
 	struct rb_node sock_node;
+	struct hlist_node hash_node;  /* in sock_tag_hash */
 	struct sock *sk;  /* Only used as a number, never dereferenced */
 	/* The socket is needed for sockfd_put() */
 	struct socket *socket;
@@ -243,6 +306,27 @@ struct sock_tag {
 	pid_t pid;
 
 	tag_t tag;
+	/* Retagging changes the tag while the packet path reads it */
+	seqcount_t tag_seq;
+	/*
+	 * The tag_stat the last packet was billed to. Only used while it is
+	 * for the same iface and tag.
+	 */
+	struct tag_stat *cached_ts;
+	struct rcu_head rcu;
+};
+
+/* Per open file state of the binary stats reader. */
+struct stats_bin_reader {
+	struct mutex lock;
+	/* The next snapshot has the tag_stats updated since this gen */
+	u32 since_gen;
+	/* Set until the first snapshot, and whenever a delete went by */
+	bool full;
+	u32 delete_cmds;  /* qtu_events.delete_cmds at the last snapshot */
+	/* The snapshot being read, vmalloc()ed */
+	void *buf;
+	size_t len;
 };
 
 struct qtaguid_event_counts {
@@ -278,7 +362,9 @@ struct qtaguid_event_counts {
 /* Track the set active_set for the given tag. */
 struct tag_counter_set {
 	struct tag_node tn;
+	struct hlist_node hash_node;  /* in tag_counter_set_hash */
 	int active_set;
+	struct rcu_head rcu;
 };
 
 /*----------------------------------------------*/
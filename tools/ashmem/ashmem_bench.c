@@ -0,0 +1,232 @@
+/*
+ * ashmem_bench.c -- ashmem pin/unpin throughput under concurrent shrinking
+ *
+ * Starts N threads that each create their own ashmem region, map it and
+ * then unpin and re-pin it a few pages at a time as fast as they can, the
+ * way cursor windows and gralloc buffers are cycled.  Pages found purged
+ * on pin are written again.  With -p another thread keeps calling
+ * ASHMEM_PURGE_ALL_CACHES, which runs the ashmem shrinker (this needs
+ * CAP_SYS_ADMIN).  For every thread count given on the command line it
+ * prints the pin/unpin pairs per second and how often the shrinker ran,
+ * so that kernels with different ashmem locking can be compared.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o ashmem_bench ashmem_bench.c -lpthread */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <linux/types.h>
+
+#include "../../include/linux/ashmem.h"
+
+#define MAX_THREADS	64
+
+static const char *dev = "/dev/ashmem";
+static int duration = 5;
+static size_t region_size = 1024 * 1024;
+static size_t chunk_pages = 4;
+static int purge;
+
+static volatile int stop;
+static long page_size;
+
+struct worker {
+	pthread_t thread;
+	unsigned long pairs;
+	unsigned long purged;
+	int failed;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct ashmem_pin pin;
+	size_t chunk = chunk_pages * page_size, off = 0;
+	char *mem;
+	int fd, ret;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		w->failed = 1;
+		return NULL;
+	}
+	if (ioctl(fd, ASHMEM_SET_SIZE, region_size) < 0) {
+		perror("ASHMEM_SET_SIZE");
+		w->failed = 1;
+		goto out;
+	}
+	mem = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		w->failed = 1;
+		goto out;
+	}
+	memset(mem, 1, region_size);
+
+	while (!stop) {
+		pin.offset = off;
+		pin.len = chunk;
+		if (ioctl(fd, ASHMEM_UNPIN, &pin) < 0) {
+			perror("ASHMEM_UNPIN");
+			w->failed = 1;
+			break;
+		}
+		ret = ioctl(fd, ASHMEM_PIN, &pin);
+		if (ret < 0) {
+			perror("ASHMEM_PIN");
+			w->failed = 1;
+			break;
+		}
+		if (ret == ASHMEM_WAS_PURGED) {
+			memset(mem + off, 1, chunk);
+			w->purged++;
+		}
+		w->pairs++;
+		off += chunk;
+		if (off + chunk > region_size)
+			off = 0;
+	}
+	munmap(mem, region_size);
+out:
+	close(fd);
+	return NULL;
+}
+
+static void *purge_thread(void *arg)
+{
+	unsigned long *count = arg;
+	int fd;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0)
+		die(dev);
+	while (!stop) {
+		if (ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0)
+			die("ASHMEM_PURGE_ALL_CACHES");
+		(*count)++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static int run_threads(int nthreads)
+{
+	struct worker workers[MAX_THREADS];
+	struct timeval start, end;
+	unsigned long pairs = 0, purged = 0, purges = 0;
+	pthread_t purger;
+	int i, failed = 0;
+	double secs;
+
+	memset(workers, 0, sizeof(workers));
+	stop = 0;
+	if (purge && pthread_create(&purger, NULL, purge_thread, &purges))
+		die("pthread_create");
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&workers[i].thread, NULL, worker_thread,
+				   &workers[i]))
+			die("pthread_create");
+	sleep(duration);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		pairs += workers[i].pairs;
+		purged += workers[i].purged;
+		failed |= workers[i].failed;
+	}
+	gettimeofday(&end, NULL);
+	if (purge)
+		pthread_join(purger, NULL);
+	secs = end.tv_sec - start.tv_sec +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+
+	printf("%7d %12lu %12.0f %10lu %10.0f%s\n", nthreads, pairs,
+	       secs ? pairs / secs : 0.0, purged,
+	       secs ? purges / secs : 0.0, failed ? "  (failed)" : "");
+	fflush(stdout);
+	return failed;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-D device] [-d seconds] [-s region_kb] "
+		"[-c chunk_pages] [-p] [threads...]\n"
+		"Default thread counts are 1 2 4 8 16.\n"
+		"-p runs the shrinker continuously from another thread.\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const int default_threads[] = { 1, 2, 4, 8, 16 };
+	int opt, i, ret = 0;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	while ((opt = getopt(argc, argv, "D:d:s:c:ph")) != -1) {
+		switch (opt) {
+		case 'D':
+			dev = optarg;
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 's':
+			region_size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'c':
+			chunk_pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			purge = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	region_size &= ~(page_size - 1);
+	if (duration <= 0 || !chunk_pages ||
+	    region_size < chunk_pages * page_size)
+		usage(argv[0]);
+
+	printf("%zu KB regions, %zu page chunks%s, %d s per run\n",
+	       region_size / 1024, chunk_pages,
+	       purge ? ", shrinking" : "", duration);
+	printf("threads    pin+unpin  pin+unpin/s     purged   shrinks/s\n");
+	fflush(stdout);
+	if (optind == argc) {
+		for (i = 0; i < sizeof(default_threads) / sizeof(int); i++)
+			ret |= run_threads(default_threads[i]);
+	} else {
+		for (i = optind; i < argc; i++) {
+			int n = atoi(argv[i]);
+
+			if (n < 1 || n > MAX_THREADS)
+				usage(argv[0]);
+			ret |= run_threads(n);
+		}
+	}
+	return ret;
+}
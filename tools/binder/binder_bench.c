@@ -0,0 +1,504 @@
+/*
+ * binder_bench.c -- binder round-trip transaction stress test
+ *
+ * Forks a server that registers itself as the binder context manager and
+ * a client process whose threads issue synchronous transactions to handle
+ * 0 as fast as they can.  For every thread count given on the command
+ * line it prints the number of round trips per second, so that runs on
+ * kernels with different binder locking can be compared.
+ *
+ * With -z the payload is sent as a BINDER_TYPE_PTR buffer with
+ * BC_TRANSACTION_SG and TF_ZERO_COPY, so the driver can map it into the
+ * server rather than copy it.  -S runs one thread at payload sizes from
+ * 4 KiB to 1 MiB and prints the throughput of both ways side by side.
+ * The payload lives in a shared mapping since anonymous pages are
+ * always copied.
+ *
+ * The context manager can only be claimed once, so servicemanager (or
+ * whatever else owns it) must not be running.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o binder_bench binder_bench.c -lpthread */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(4 * 1024 * 1024)
+#define MAX_THREADS	64
+
+static const char *dev = "/dev/binder";
+static int duration = 5;
+static size_t payload_size;
+static int zero_copy;
+
+static volatile int stop;
+static int binder_fd;
+
+struct client {
+	pthread_t thread;
+	unsigned long count;
+	int failed;
+};
+
+struct result {
+	unsigned long total;
+	double secs;
+	int failed;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int binder_open_map(void)
+{
+	void *map;
+
+	binder_fd = open(dev, O_RDWR);
+	if (binder_fd < 0)
+		die(dev);
+	map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, binder_fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap");
+	return 0;
+}
+
+static int binder_write_read(void *wbuf, size_t wsize,
+			     void *rbuf, size_t rsize, size_t *rconsumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wsize;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = rsize;
+	do {
+		ret = ioctl(binder_fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (rconsumed)
+		*rconsumed = bwr.read_consumed;
+	return ret;
+}
+
+static int binder_write(void *wbuf, size_t wsize)
+{
+	return binder_write_read(wbuf, wsize, NULL, 0, NULL);
+}
+
+/* command followed by its payload, as the driver expects it */
+struct txn_cmd {
+	uint32_t cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+struct txn_sg_cmd {
+	uint32_t cmd;
+	struct binder_transaction_data_sg tr;
+} __attribute__((packed));
+
+struct free_and_reply {
+	uint32_t free_cmd;
+	void *buffer;
+	uint32_t reply_cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+/*
+ * Handle everything in a read buffer.  Returns the number of BR_REPLYs
+ * seen, or -1 on a failed transaction.
+ */
+static int handle_returns(uint8_t *ptr, size_t size, int server)
+{
+	uint8_t *end = ptr + size;
+	int replies = 0;
+
+	while (ptr < end) {
+		uint32_t cmd = *(uint32_t *)ptr;
+
+		ptr += sizeof(uint32_t);
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_TRANSACTION_COMPLETE:
+		case BR_SPAWN_LOOPER:
+			break;
+		case BR_INCREFS:
+		case BR_ACQUIRE: {
+			struct {
+				uint32_t cmd;
+				void *ptr;
+				void *cookie;
+			} __attribute__((packed)) done;
+
+			done.cmd = cmd == BR_INCREFS ?
+				BC_INCREFS_DONE : BC_ACQUIRE_DONE;
+			done.ptr = ((void **)ptr)[0];
+			done.cookie = ((void **)ptr)[1];
+			binder_write(&done, sizeof(done));
+			ptr += 2 * sizeof(void *);
+			break;
+		}
+		case BR_RELEASE:
+		case BR_DECREFS:
+			ptr += 2 * sizeof(void *);
+			break;
+		case BR_TRANSACTION: {
+			struct binder_transaction_data *tr = (void *)ptr;
+			struct free_and_reply fr;
+
+			ptr += sizeof(*tr);
+			if (!server)
+				break;
+			memset(&fr, 0, sizeof(fr));
+			fr.free_cmd = BC_FREE_BUFFER;
+			fr.buffer = (void *)tr->data.ptr.buffer;
+			fr.reply_cmd = BC_REPLY;
+			binder_write(&fr, sizeof(fr));
+			break;
+		}
+		case BR_REPLY: {
+			struct binder_transaction_data *tr = (void *)ptr;
+			struct {
+				uint32_t cmd;
+				void *buffer;
+			} __attribute__((packed)) fb;
+
+			ptr += sizeof(*tr);
+			fb.cmd = BC_FREE_BUFFER;
+			fb.buffer = (void *)tr->data.ptr.buffer;
+			binder_write(&fb, sizeof(fb));
+			replies++;
+			break;
+		}
+		case BR_DEAD_BINDER:
+		case BR_CLEAR_DEATH_NOTIFICATION_DONE:
+			ptr += sizeof(void *);
+			break;
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+		case BR_ERROR:
+			return -1;
+		default:
+			fprintf(stderr, "binder_bench: unexpected return %x\n",
+				cmd);
+			return -1;
+		}
+	}
+	return replies;
+}
+
+static void *server_loop(void *arg)
+{
+	uint32_t cmd = BC_ENTER_LOOPER;
+	uint32_t rbuf[64];
+	size_t consumed;
+
+	(void)arg;
+	binder_write(&cmd, sizeof(cmd));
+	for (;;) {
+		if (binder_write_read(NULL, 0, rbuf, sizeof(rbuf), &consumed))
+			die("server BINDER_WRITE_READ");
+		handle_returns((uint8_t *)rbuf, consumed, 1);
+	}
+	return NULL;
+}
+
+static void run_server(int nthreads, int ready_fd)
+{
+	pthread_t thread;
+	int i;
+
+	binder_open_map();
+	/* -z needs the server to accept mapped pages */
+	if (ioctl(binder_fd, BINDER_SET_CONTEXT_MGR,
+		  FLAT_BINDER_FLAG_ACCEPTS_ZERO_COPY) < 0)
+		die("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&thread, NULL, server_loop, NULL))
+			die("pthread_create");
+	if (write(ready_fd, "r", 1) != 1)
+		die("write");
+	close(ready_fd);
+	server_loop(NULL);
+}
+
+static void *client_loop(void *arg)
+{
+	struct client *c = arg;
+	struct txn_cmd txn;
+	struct txn_sg_cmd sg_txn;
+	struct binder_buffer_object obj;
+	size_t offsets[1] = { 0 };
+	size_t map_size, consumed;
+	uint32_t rbuf[64];
+	void *payload, *wbuf;
+	size_t wsize;
+	int ret;
+
+	/* shared memory, so that zero-copy can map it */
+	map_size = payload_size ? payload_size : 1;
+	payload = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (payload == MAP_FAILED)
+		die("mmap payload");
+	memset(payload, 0x5a, map_size);
+
+	memset(&txn, 0, sizeof(txn));
+	txn.cmd = BC_TRANSACTION;
+	txn.tr.target.handle = 0;
+	txn.tr.data_size = payload_size;
+	txn.tr.data.ptr.buffer = payload;
+
+	memset(&obj, 0, sizeof(obj));
+	obj.type = BINDER_TYPE_PTR;
+	obj.buffer = payload;
+	obj.length = payload_size;
+	memset(&sg_txn, 0, sizeof(sg_txn));
+	sg_txn.cmd = BC_TRANSACTION_SG;
+	sg_txn.tr.transaction_data.target.handle = 0;
+	sg_txn.tr.transaction_data.flags = TF_ZERO_COPY;
+	sg_txn.tr.transaction_data.data_size = sizeof(obj);
+	sg_txn.tr.transaction_data.offsets_size = sizeof(offsets);
+	sg_txn.tr.transaction_data.data.ptr.buffer = &obj;
+	sg_txn.tr.transaction_data.data.ptr.offsets = offsets;
+	/* room to page align the buffer in the server's binder area */
+	sg_txn.tr.buffers_size = payload_size + getpagesize();
+
+	if (zero_copy) {
+		wbuf = &sg_txn;
+		wsize = sizeof(sg_txn);
+	} else {
+		wbuf = &txn;
+		wsize = sizeof(txn);
+	}
+
+	while (!stop) {
+		/* the driver rewrites the object in its own copy only */
+		if (binder_write_read(wbuf, wsize, rbuf, sizeof(rbuf),
+				      &consumed))
+			die("client BINDER_WRITE_READ");
+		ret = handle_returns((uint8_t *)rbuf, consumed, 0);
+		/* wait for the reply if it was not in the first read */
+		while (ret == 0) {
+			if (binder_write_read(NULL, 0, rbuf, sizeof(rbuf),
+					      &consumed))
+				die("client BINDER_WRITE_READ");
+			ret = handle_returns((uint8_t *)rbuf, consumed, 0);
+		}
+		if (ret < 0) {
+			c->failed = 1;
+			break;
+		}
+		c->count++;
+	}
+	munmap(payload, map_size);
+	return NULL;
+}
+
+static void run_client(int nthreads, int result_fd)
+{
+	struct client clients[MAX_THREADS];
+	struct timeval start, end;
+	struct result r;
+	uint32_t acquire[2] = { BC_ACQUIRE, 0 };
+	int i;
+
+	binder_open_map();
+	/* a ref on handle 0 is needed before transactions can use it */
+	if (binder_write(acquire, sizeof(acquire)))
+		die("BC_ACQUIRE");
+
+	memset(clients, 0, sizeof(clients));
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&clients[i].thread, NULL, client_loop,
+				   &clients[i]))
+			die("pthread_create");
+	sleep(duration);
+	stop = 1;
+	memset(&r, 0, sizeof(r));
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(clients[i].thread, NULL);
+		r.total += clients[i].count;
+		r.failed |= clients[i].failed;
+	}
+	gettimeofday(&end, NULL);
+	r.secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+
+	if (write(result_fd, &r, sizeof(r)) != sizeof(r))
+		die("write");
+	exit(r.failed);
+}
+
+static int run_one(int nthreads, struct result *r)
+{
+	pid_t server, client;
+	int pipefd[2];
+	char c;
+	int status;
+
+	if (pipe(pipefd))
+		die("pipe");
+	server = fork();
+	if (server < 0)
+		die("fork");
+	if (server == 0) {
+		close(pipefd[0]);
+		run_server(nthreads, pipefd[1]);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], &c, 1) != 1) {
+		fprintf(stderr, "binder_bench: server failed to start\n");
+		waitpid(server, NULL, 0);
+		return 1;
+	}
+	close(pipefd[0]);
+
+	if (pipe(pipefd))
+		die("pipe");
+	client = fork();
+	if (client < 0)
+		die("fork");
+	if (client == 0) {
+		close(pipefd[0]);
+		run_client(nthreads, pipefd[1]);
+	}
+	close(pipefd[1]);
+	memset(r, 0, sizeof(*r));
+	if (read(pipefd[0], r, sizeof(*r)) != sizeof(*r))
+		r->failed = 1;
+	close(pipefd[0]);
+	waitpid(client, &status, 0);
+
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+	return r->failed || !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+static double mb_per_sec(struct result *r)
+{
+	return r->secs ? r->total * (double)payload_size / r->secs /
+		(1024 * 1024) : 0.0;
+}
+
+static int run_threads(int nthreads)
+{
+	struct result r;
+	int ret;
+
+	ret = run_one(nthreads, &r);
+	printf("%7d %12lu %14.0f %12.2f %10.1f%s\n", nthreads, r.total,
+	       r.secs ? r.total / r.secs : 0.0,
+	       r.total ? r.secs * 1000000.0 * nthreads / r.total : 0.0,
+	       mb_per_sec(&r), r.failed ? "  (transactions failed)" : "");
+	fflush(stdout);
+	return ret;
+}
+
+/* one thread, copy against zero-copy at growing payload sizes */
+static int run_sweep(void)
+{
+	struct result copy, zc;
+	int ret = 0;
+
+	printf("%d s per run\n", duration);
+	printf("  payload    copy(MB/s)  zero-copy(MB/s)\n");
+	fflush(stdout);
+	for (payload_size = 4096; payload_size <= MAP_SIZE / 4;
+	     payload_size *= 4) {
+		zero_copy = 0;
+		ret |= run_one(1, &copy);
+		zero_copy = 1;
+		ret |= run_one(1, &zc);
+		printf("%9zu %13.1f %16.1f%s\n", payload_size,
+		       mb_per_sec(&copy), mb_per_sec(&zc),
+		       copy.failed || zc.failed ?
+		       "  (transactions failed)" : "");
+		fflush(stdout);
+	}
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-D device] [-d seconds] [-s payload_bytes] [-z] "
+		"[threads...]\n"
+		"       %s [-D device] [-d seconds] -S\n"
+		"Default thread counts are 1 2 4 8 16.\n"
+		"-z sends the payload zero-copy, -S compares copy and "
+		"zero-copy\nthroughput across payload sizes.\n", prog, prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const int default_threads[] = { 1, 2, 4, 8, 16 };
+	int opt, i, sweep = 0, ret = 0;
+
+	while ((opt = getopt(argc, argv, "D:d:s:zSh")) != -1) {
+		switch (opt) {
+		case 'D':
+			dev = optarg;
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 's':
+			payload_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'z':
+			zero_copy = 1;
+			break;
+		case 'S':
+			sweep = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (duration <= 0 || payload_size > MAP_SIZE / 4)
+		usage(argv[0]);
+	if (sweep)
+		return run_sweep();
+
+	printf("payload %zu bytes%s, %d s per run\n", payload_size,
+	       zero_copy ? " zero-copy" : "", duration);
+	printf("threads   round-trips  round-trips/s  latency(us)       MB/s\n");
+	fflush(stdout);
+	if (optind == argc) {
+		for (i = 0; i < sizeof(default_threads) / sizeof(int); i++)
+			ret |= run_threads(default_threads[i]);
+	} else {
+		for (i = optind; i < argc; i++) {
+			int n = atoi(argv[i]);
+
+			if (n < 1 || n > MAX_THREADS)
+				usage(argv[0]);
+			ret |= run_threads(n);
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,413 @@
+/*
+ * binder_rt.c -- binder call latency from a realtime thread under load
+ *
+ * A cyclictest style harness: a SCHED_FIFO thread wakes up every
+ * interval and makes a synchronous binder call to a SCHED_NORMAL server
+ * that registers itself as the context manager and spins for a while
+ * before replying.  Meanwhile one busy loop per cpu keeps every cpu
+ * loaded with SCHED_NORMAL work.  Without priority inheritance the
+ * server thread competes with the busy loops and the worst case call
+ * latency grows with the load; with it the server runs at the caller's
+ * priority until it replies.
+ *
+ * The server reports the policy it ran the call with, so the output
+ * also shows how many calls were served with an rt policy.
+ *
+ * Needs CAP_SYS_NICE for SCHED_FIFO, and servicemanager must not be
+ * running.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o binder_rt binder_rt.c -lpthread -lrt */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define HIST_BUCKETS	24
+#define MAX_LOAD	64
+
+static const char *dev = "/dev/binder";
+static int rt_prio = 80;
+static long interval_us = 1000;
+static long loops = 10000;
+static long work_us = 50;
+static int load_procs = -1;
+
+static int binder_fd;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void binder_open_map(void)
+{
+	binder_fd = open(dev, O_RDWR);
+	if (binder_fd < 0)
+		die(dev);
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, binder_fd, 0) ==
+	    MAP_FAILED)
+		die("mmap");
+}
+
+static int binder_write_read(void *wbuf, size_t wsize,
+			     void *rbuf, size_t rsize, size_t *rconsumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wsize;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = rsize;
+	do {
+		ret = ioctl(binder_fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (rconsumed)
+		*rconsumed = bwr.read_consumed;
+	return ret;
+}
+
+static int binder_write(void *wbuf, size_t wsize)
+{
+	return binder_write_read(wbuf, wsize, NULL, 0, NULL);
+}
+
+struct txn_cmd {
+	uint32_t cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+struct free_and_reply {
+	uint32_t free_cmd;
+	void *buffer;
+	uint32_t reply_cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+struct free_cmd {
+	uint32_t cmd;
+	void *buffer;
+} __attribute__((packed));
+
+/*
+ * Walk a read buffer, answering transactions as the server does.
+ * Returns -1 on errors, 0 if no reply has arrived yet, and otherwise
+ * the policy the server reported plus one.
+ */
+static int handle_returns(uint8_t *ptr, size_t size)
+{
+	uint8_t *end = ptr + size;
+	int ret = 0;
+
+	while (ptr < end) {
+		uint32_t cmd = *(uint32_t *)ptr;
+
+		ptr += sizeof(uint32_t);
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_TRANSACTION_COMPLETE:
+		case BR_SPAWN_LOOPER:
+			break;
+		case BR_INCREFS:
+		case BR_ACQUIRE: {
+			struct {
+				uint32_t cmd;
+				void *ptr;
+				void *cookie;
+			} __attribute__((packed)) done;
+
+			done.cmd = cmd == BR_INCREFS ?
+				BC_INCREFS_DONE : BC_ACQUIRE_DONE;
+			done.ptr = ((void **)ptr)[0];
+			done.cookie = ((void **)ptr)[1];
+			binder_write(&done, sizeof(done));
+			ptr += 2 * sizeof(void *);
+			break;
+		}
+		case BR_RELEASE:
+		case BR_DECREFS:
+			ptr += 2 * sizeof(void *);
+			break;
+		case BR_TRANSACTION: {
+			struct binder_transaction_data *tr = (void *)ptr;
+			struct free_and_reply fr;
+			uint64_t until = now_ns() + work_us * 1000;
+			int policy = sched_getscheduler(0);
+
+			ptr += sizeof(*tr);
+			/* the work the caller is waiting for */
+			while (now_ns() < until)
+				;
+			memset(&fr, 0, sizeof(fr));
+			fr.free_cmd = BC_FREE_BUFFER;
+			fr.buffer = (void *)tr->data.ptr.buffer;
+			fr.reply_cmd = BC_REPLY;
+			fr.tr.data_size = sizeof(policy);
+			fr.tr.data.ptr.buffer = &policy;
+			binder_write(&fr, sizeof(fr));
+			break;
+		}
+		case BR_REPLY: {
+			struct binder_transaction_data *tr = (void *)ptr;
+			struct free_cmd fb;
+
+			ptr += sizeof(*tr);
+			ret = tr->data_size == sizeof(int) ?
+				*(int *)tr->data.ptr.buffer + 1 : 1;
+			fb.cmd = BC_FREE_BUFFER;
+			fb.buffer = (void *)tr->data.ptr.buffer;
+			binder_write(&fb, sizeof(fb));
+			break;
+		}
+		case BR_DEAD_BINDER:
+		case BR_CLEAR_DEATH_NOTIFICATION_DONE:
+			ptr += sizeof(void *);
+			break;
+		default:
+			fprintf(stderr, "binder_rt: unexpected return %x\n",
+				cmd);
+			return -1;
+		}
+	}
+	return ret;
+}
+
+static void *server_loop(void *arg)
+{
+	uint32_t cmd = BC_ENTER_LOOPER;
+	uint32_t rbuf[64];
+	size_t consumed;
+
+	(void)arg;
+	binder_write(&cmd, sizeof(cmd));
+	for (;;) {
+		if (binder_write_read(NULL, 0, rbuf, sizeof(rbuf), &consumed))
+			die("server BINDER_WRITE_READ");
+		handle_returns((uint8_t *)rbuf, consumed);
+	}
+	return NULL;
+}
+
+static pid_t start_server(void)
+{
+	pthread_t thread;
+	int pipefd[2];
+	pid_t pid;
+	char c;
+
+	if (pipe(pipefd))
+		die("pipe");
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		close(pipefd[0]);
+		binder_open_map();
+		if (ioctl(binder_fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+			die("BINDER_SET_CONTEXT_MGR (is servicemanager "
+			    "running?)");
+		if (pthread_create(&thread, NULL, server_loop, NULL))
+			die("pthread_create");
+		if (write(pipefd[1], "r", 1) != 1)
+			die("write");
+		close(pipefd[1]);
+		server_loop(NULL);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], &c, 1) != 1) {
+		fprintf(stderr, "binder_rt: server failed to start\n");
+		exit(1);
+	}
+	close(pipefd[0]);
+	return pid;
+}
+
+static pid_t start_load(void)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		die("fork");
+	if (pid == 0)
+		for (;;)
+			;
+	return pid;
+}
+
+static void run_client(void)
+{
+	uint32_t acquire[2] = { BC_ACQUIRE, 0 };
+	unsigned long hist[HIST_BUCKETS];
+	uint64_t min = ~0ULL, max = 0, sum = 0;
+	struct sched_param param;
+	struct txn_cmd txn;
+	struct timespec next;
+	uint32_t rbuf[64];
+	size_t consumed;
+	long i, rt_served = 0;
+	int b, ret;
+
+	binder_open_map();
+	if (binder_write(acquire, sizeof(acquire)))
+		die("BC_ACQUIRE");
+	param.sched_priority = rt_prio;
+	if (sched_setscheduler(0, SCHED_FIFO, &param))
+		die("sched_setscheduler");
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		perror("mlockall");
+
+	memset(hist, 0, sizeof(hist));
+	memset(&txn, 0, sizeof(txn));
+	txn.cmd = BC_TRANSACTION;
+	txn.tr.target.handle = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < loops; i++) {
+		uint64_t start, lat;
+
+		next.tv_nsec += interval_us * 1000;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		start = now_ns();
+		if (binder_write_read(&txn, sizeof(txn), rbuf, sizeof(rbuf),
+				      &consumed))
+			die("client BINDER_WRITE_READ");
+		ret = handle_returns((uint8_t *)rbuf, consumed);
+		while (ret == 0) {
+			if (binder_write_read(NULL, 0, rbuf, sizeof(rbuf),
+					      &consumed))
+				die("client BINDER_WRITE_READ");
+			ret = handle_returns((uint8_t *)rbuf, consumed);
+		}
+		if (ret < 0) {
+			fprintf(stderr, "binder_rt: transaction failed\n");
+			exit(1);
+		}
+		if (ret - 1 == SCHED_FIFO || ret - 1 == SCHED_RR)
+			rt_served++;
+
+		lat = (now_ns() - start) / 1000;
+		if (lat < min)
+			min = lat;
+		if (lat > max)
+			max = lat;
+		sum += lat;
+		for (b = 0; b < HIST_BUCKETS - 1 && lat >= (1ULL << b); b++)
+			;
+		hist[b]++;
+	}
+
+	printf("calls %ld, served with rt policy %ld\n", loops, rt_served);
+	printf("latency (us): min %llu avg %llu max %llu\n",
+	       (unsigned long long)min, (unsigned long long)(sum / loops),
+	       (unsigned long long)max);
+	for (b = 0; b < HIST_BUCKETS; b++)
+		if (hist[b])
+			printf("  < %8lu us: %lu\n", 1UL << b, hist[b]);
+	exit(0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-D device] [-p rt_prio] [-i interval_us] "
+		"[-l loops]\n"
+		"          [-w server_work_us] [-b load_procs]\n"
+		"Defaults: -p 80 -i 1000 -l 10000 -w 50, one busy loop "
+		"per cpu.\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	pid_t server, client, load[MAX_LOAD];
+	int opt, i, status;
+
+	while ((opt = getopt(argc, argv, "D:p:i:l:w:b:h")) != -1) {
+		switch (opt) {
+		case 'D':
+			dev = optarg;
+			break;
+		case 'p':
+			rt_prio = atoi(optarg);
+			break;
+		case 'i':
+			interval_us = atol(optarg);
+			break;
+		case 'l':
+			loops = atol(optarg);
+			break;
+		case 'w':
+			work_us = atol(optarg);
+			break;
+		case 'b':
+			load_procs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (load_procs < 0)
+		load_procs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (rt_prio < 1 || rt_prio > 99 || interval_us <= 0 || loops <= 0 ||
+	    work_us < 0 || load_procs > MAX_LOAD)
+		usage(argv[0]);
+
+	printf("rt prio %d, interval %ld us, %ld calls, server work %ld us, "
+	       "%d busy loops\n", rt_prio, interval_us, loops, work_us,
+	       load_procs);
+	fflush(stdout);
+
+	server = start_server();
+	for (i = 0; i < load_procs; i++)
+		load[i] = start_load();
+
+	client = fork();
+	if (client < 0)
+		die("fork");
+	if (client == 0)
+		run_client();
+	waitpid(client, &status, 0);
+
+	for (i = 0; i < load_procs; i++) {
+		kill(load[i], SIGKILL);
+		waitpid(load[i], NULL, 0);
+	}
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
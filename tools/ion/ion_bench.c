@@ -0,0 +1,202 @@
+/*
+ * ion_bench.c -- ion allocation and free latency
+ *
+ * Allocates and frees a buffer of the given size from the given heap
+ * through /dev/ion as fast as it can, the way a camera or graphics
+ * pipeline reallocates its buffers every frame, and prints the latency
+ * distribution of the allocations and of the frees.  With -t each buffer
+ * is also mapped and written to before it is freed, as a real user would,
+ * and the time to do that is reported too.
+ *
+ * Heap ids are board specific; -H selects the one to allocate from.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o ion_bench ion_bench.c -lrt */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* from include/linux/ion.h */
+struct ion_handle;
+
+struct ion_allocation_data {
+	size_t len;
+	size_t align;
+	unsigned int flags;
+	struct ion_handle *handle;
+};
+
+struct ion_fd_data {
+	struct ion_handle *handle;
+	int fd;
+};
+
+struct ion_handle_data {
+	struct ion_handle *handle;
+};
+
+#define ION_IOC_MAGIC		'I'
+#define ION_IOC_ALLOC		_IOWR(ION_IOC_MAGIC, 0, \
+				      struct ion_allocation_data)
+#define ION_IOC_FREE		_IOWR(ION_IOC_MAGIC, 1, struct ion_handle_data)
+#define ION_IOC_MAP		_IOWR(ION_IOC_MAGIC, 2, struct ion_fd_data)
+
+static const char *dev = "/dev/ion";
+static size_t size = 8 << 20;
+static int iterations = 1000;
+static int heap_id;
+static int touch;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s size KiB] [-n iterations] [-H heap id] [-t]\n",
+		prog);
+	exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, unsigned long long *ns, int n)
+{
+	unsigned long long sum = 0;
+	int i;
+
+	qsort(ns, n, sizeof(*ns), cmp_ull);
+	for (i = 0; i < n; i++)
+		sum += ns[i];
+	printf("%-6s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", what,
+	       sum / 1e3 / n, ns[0] / 1e3, ns[n / 2] / 1e3,
+	       ns[n * 9 / 10] / 1e3, ns[n * 99 / 100] / 1e3,
+	       ns[n - 1] / 1e3);
+}
+
+/* maps the buffer and writes every page of it, as its user would */
+static void touch_buffer(int fd, struct ion_handle *handle)
+{
+	struct ion_fd_data map = { .handle = handle };
+	char *p;
+	size_t i;
+
+	if (ioctl(fd, ION_IOC_MAP, &map) < 0) {
+		perror("ION_IOC_MAP");
+		exit(1);
+	}
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map.fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	for (i = 0; i < size; i += 4096)
+		p[i] = i;
+	munmap(p, size);
+	close(map.fd);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long *alloc_ns, *free_ns, *touch_ns, t;
+	struct ion_allocation_data alloc;
+	struct ion_handle_data hdata;
+	int opt, fd, i;
+
+	while ((opt = getopt(argc, argv, "s:n:H:t")) != -1) {
+		switch (opt) {
+		case 's':
+			size = strtoul(optarg, NULL, 0) << 10;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'H':
+			heap_id = atoi(optarg);
+			break;
+		case 't':
+			touch = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!size || iterations <= 0 || heap_id < 0 || heap_id > 31)
+		usage(argv[0]);
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+	alloc_ns = calloc(iterations, sizeof(*alloc_ns));
+	free_ns = calloc(iterations, sizeof(*free_ns));
+	touch_ns = calloc(iterations, sizeof(*touch_ns));
+	if (!alloc_ns || !free_ns || !touch_ns) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < iterations; i++) {
+		memset(&alloc, 0, sizeof(alloc));
+		alloc.len = size;
+		alloc.align = 4096;
+		alloc.flags = 1 << heap_id;
+		t = now_ns();
+		if (ioctl(fd, ION_IOC_ALLOC, &alloc) < 0 || !alloc.handle) {
+			fprintf(stderr, "allocation %d of %zu bytes failed\n",
+				i, size);
+			return 1;
+		}
+		alloc_ns[i] = now_ns() - t;
+		if (touch) {
+			t = now_ns();
+			touch_buffer(fd, alloc.handle);
+			touch_ns[i] = now_ns() - t;
+		}
+		hdata.handle = alloc.handle;
+		t = now_ns();
+		if (ioctl(fd, ION_IOC_FREE, &hdata) < 0) {
+			perror("ION_IOC_FREE");
+			return 1;
+		}
+		free_ns[i] = now_ns() - t;
+	}
+
+	printf("%d x %zu KiB from heap %d, latency in us\n", iterations,
+	       size >> 10, heap_id);
+	printf("%-6s %9s %9s %9s %9s %9s %9s\n", "", "mean", "min", "p50",
+	       "p90", "p99", "max");
+	report("alloc", alloc_ns, iterations);
+	report("free", free_ns, iterations);
+	if (touch)
+		report("touch", touch_ns, iterations);
+
+	close(fd);
+	free(alloc_ns);
+	free(free_ns);
+	free(touch_ns);
+	return 0;
+}
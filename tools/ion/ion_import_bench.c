@@ -0,0 +1,292 @@
+/*
+ * ion_import_bench.c -- ion import and free with many clients and handles
+ *
+ * The parent allocates a set of buffers and shares each of them as an fd,
+ * the way gralloc hands buffers between processes.  Then a number of
+ * child processes, each its own ion client, import every buffer once and
+ * hold on to the handles, as a compositor holding hundreds of buffers
+ * does.  While holding them they repeatedly import a random buffer again
+ * (which finds the handle they already have) and free that reference,
+ * and allocate and free a small buffer of their own, for the given time.
+ * It prints how many of each the clients did and their latency.
+ *
+ * Heap ids are board specific; -H selects the one to allocate from.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o ion_import_bench ion_import_bench.c -lrt */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* from include/linux/ion.h */
+struct ion_handle;
+
+struct ion_allocation_data {
+	size_t len;
+	size_t align;
+	unsigned int flags;
+	struct ion_handle *handle;
+};
+
+struct ion_fd_data {
+	struct ion_handle *handle;
+	int fd;
+};
+
+struct ion_handle_data {
+	struct ion_handle *handle;
+};
+
+#define ION_IOC_MAGIC		'I'
+#define ION_IOC_ALLOC		_IOWR(ION_IOC_MAGIC, 0, \
+				      struct ion_allocation_data)
+#define ION_IOC_FREE		_IOWR(ION_IOC_MAGIC, 1, struct ion_handle_data)
+#define ION_IOC_SHARE		_IOWR(ION_IOC_MAGIC, 4, struct ion_fd_data)
+#define ION_IOC_IMPORT		_IOWR(ION_IOC_MAGIC, 5, int)
+
+#define MAX_CLIENTS	64
+
+static const char *dev = "/dev/ion";
+static int nr_buffers = 256;
+static int nr_clients = 4;
+static int seconds = 5;
+static int heap_id;
+
+/* results, in a shared mapping so that the children can fill them in */
+struct op_stats {
+	unsigned long count;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+};
+
+struct client_stats {
+	struct op_stats import;
+	struct op_stats free;
+	struct op_stats alloc;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-b buffers] [-c clients] [-n seconds] "
+		"[-H heap id]\n", prog);
+	exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void account(struct op_stats *st, unsigned long long ns)
+{
+	st->count++;
+	st->total_ns += ns;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+}
+
+static struct ion_handle *ion_alloc(int fd, size_t len)
+{
+	struct ion_allocation_data data = {
+		.len = len,
+		.align = 4096,
+		.flags = 1 << heap_id,
+	};
+
+	if (ioctl(fd, ION_IOC_ALLOC, &data) < 0 || !data.handle) {
+		fprintf(stderr, "allocation of %zu bytes failed\n", len);
+		exit(1);
+	}
+	return data.handle;
+}
+
+static void ion_free(int fd, struct ion_handle *handle)
+{
+	struct ion_handle_data data = { .handle = handle };
+
+	if (ioctl(fd, ION_IOC_FREE, &data) < 0) {
+		perror("ION_IOC_FREE");
+		exit(1);
+	}
+}
+
+static struct ion_handle *ion_import(int fd, int share_fd)
+{
+	struct ion_fd_data data = { .fd = share_fd };
+
+	if (ioctl(fd, ION_IOC_IMPORT, &data) < 0 || !data.handle) {
+		fprintf(stderr, "import of fd %d failed\n", share_fd);
+		exit(1);
+	}
+	return data.handle;
+}
+
+static void run_client(int id, int *share_fds, struct client_stats *st)
+{
+	struct ion_handle **handles, *handle;
+	unsigned long long t, end;
+	unsigned int seed = id;
+	int fd, i;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	handles = calloc(nr_buffers, sizeof(*handles));
+	if (!handles) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < nr_buffers; i++)
+		handles[i] = ion_import(fd, share_fds[i]);
+
+	end = now_ns() + seconds * 1000000000ULL;
+	while (now_ns() < end) {
+		i = rand_r(&seed) % nr_buffers;
+		t = now_ns();
+		handle = ion_import(fd, share_fds[i]);
+		account(&st->import, now_ns() - t);
+		t = now_ns();
+		ion_free(fd, handle);
+		account(&st->free, now_ns() - t);
+
+		t = now_ns();
+		handle = ion_alloc(fd, 4096);
+		ion_free(fd, handle);
+		account(&st->alloc, now_ns() - t);
+	}
+
+	for (i = 0; i < nr_buffers; i++)
+		ion_free(fd, handles[i]);
+	free(handles);
+	close(fd);
+}
+
+/* sums up the op_stats at offset off in every client's stats */
+static void report(const char *what, struct client_stats *stats, size_t off)
+{
+	unsigned long count = 0;
+	unsigned long long total = 0, max = 0;
+	struct op_stats *st;
+	int i;
+
+	for (i = 0; i < nr_clients; i++) {
+		st = (struct op_stats *)((char *)&stats[i] + off);
+		count += st->count;
+		total += st->total_ns;
+		if (st->max_ns > max)
+			max = st->max_ns;
+	}
+	printf("%-10s %10lu %10.0f %9.2f %9.1f\n", what, count,
+	       count / (double)seconds, count ? total / 1e3 / count : 0.0,
+	       max / 1e3);
+}
+
+int main(int argc, char **argv)
+{
+	struct client_stats *stats;
+	struct ion_handle *handle;
+	struct ion_fd_data share;
+	int *share_fds;
+	int opt, fd, i, status, failed = 0;
+
+	while ((opt = getopt(argc, argv, "b:c:n:H:")) != -1) {
+		switch (opt) {
+		case 'b':
+			nr_buffers = atoi(optarg);
+			break;
+		case 'c':
+			nr_clients = atoi(optarg);
+			break;
+		case 'n':
+			seconds = atoi(optarg);
+			break;
+		case 'H':
+			heap_id = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_buffers <= 0 || nr_clients <= 0 || nr_clients > MAX_CLIENTS ||
+	    seconds <= 0 || heap_id < 0 || heap_id > 31)
+		usage(argv[0]);
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+	share_fds = calloc(nr_buffers, sizeof(*share_fds));
+	stats = mmap(NULL, nr_clients * sizeof(*stats), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (!share_fds || stats == MAP_FAILED) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	memset(stats, 0, nr_clients * sizeof(*stats));
+
+	for (i = 0; i < nr_buffers; i++) {
+		handle = ion_alloc(fd, 64 * 1024);
+		share.handle = handle;
+		if (ioctl(fd, ION_IOC_SHARE, &share) < 0) {
+			perror("ION_IOC_SHARE");
+			return 1;
+		}
+		share_fds[i] = share.fd;
+		/* the shared fd keeps the buffer alive */
+		ion_free(fd, handle);
+	}
+
+	for (i = 0; i < nr_clients; i++) {
+		switch (fork()) {
+		case -1:
+			perror("fork");
+			return 1;
+		case 0:
+			close(fd);
+			run_client(i, share_fds, &stats[i]);
+			_exit(0);
+		}
+	}
+	for (i = 0; i < nr_clients; i++) {
+		if (wait(&status) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))
+			failed = 1;
+	}
+	if (failed) {
+		fprintf(stderr, "a client failed\n");
+		return 1;
+	}
+
+	printf("%d clients holding %d buffers each, %d s\n", nr_clients,
+	       nr_buffers, seconds);
+	printf("%-10s %10s %10s %9s %9s\n", "", "ops", "ops/s", "mean us",
+	       "max us");
+	report("import", stats, offsetof(struct client_stats, import));
+	report("free", stats, offsetof(struct client_stats, free));
+	report("alloc+free", stats, offsetof(struct client_stats, alloc));
+
+	for (i = 0; i < nr_buffers; i++)
+		close(share_fds[i]);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * logger_bench.c -- multi-writer throughput test for the Android logger
+ *
+ * Starts N threads that each write entries to a log device as fast as
+ * they can, framed the way liblog frames them (priority byte, tag and
+ * message, each NUL terminated, in one writev()).  For every thread
+ * count given on the command line it prints the entries and megabytes
+ * written per second, so that kernels with different write paths can be
+ * compared.
+ *
+ * With -r a reader thread drains the log meanwhile and the read() calls it
+ * needed per second are printed too.  -b makes it read in batches with
+ * LOGGER_SET_BATCH_READ, -w and -t set a LOGGER_SET_WAKEUP watermark of
+ * that many bytes and milliseconds.  Without -r nothing reads the log and
+ * old entries are simply overwritten.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o logger_bench logger_bench.c -lpthread */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define MAX_THREADS	64
+
+static const char *dev = "/dev/log/main";
+static const char *tag = "logger_bench";
+static int duration = 5;
+static size_t msg_size = 64;
+static int reader, batch;
+static struct logger_wakeup wakeup;
+
+static volatile int stop;
+
+struct writer {
+	pthread_t thread;
+	unsigned long count;
+	unsigned long bytes;
+	int failed;
+};
+
+struct log_reader {
+	pthread_t thread;
+	unsigned long reads;
+	unsigned long entries;
+	int failed;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = arg;
+	unsigned char prio = 4;		/* ANDROID_LOG_INFO */
+	struct iovec vec[3];
+	char *msg;
+	ssize_t len;
+	int fd;
+
+	fd = open(dev, O_WRONLY);
+	if (fd < 0) {
+		perror(dev);
+		w->failed = 1;
+		return NULL;
+	}
+	msg = malloc(msg_size + 1);
+	if (!msg)
+		die("malloc");
+	memset(msg, 'x', msg_size);
+	msg[msg_size] = '\0';
+
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = (void *)tag;
+	vec[1].iov_len = strlen(tag) + 1;
+	vec[2].iov_base = msg;
+	vec[2].iov_len = msg_size + 1;
+
+	while (!stop) {
+		len = writev(fd, vec, 3);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("writev");
+			w->failed = 1;
+			break;
+		}
+		w->count++;
+		w->bytes += len;
+	}
+	free(msg);
+	close(fd);
+	return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct log_reader *r = arg;
+	size_t size = batch ? 64 * 1024 : LOGGER_ENTRY_MAX_LEN;
+	char *buf;
+	ssize_t len, off;
+	int fd;
+
+	fd = open(dev, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(dev);
+		r->failed = 1;
+		return NULL;
+	}
+	if (ioctl(fd, LOGGER_SET_BATCH_READ, batch) ||
+	    ioctl(fd, LOGGER_SET_WAKEUP, &wakeup)) {
+		perror("ioctl");
+		r->failed = 1;
+		close(fd);
+		return NULL;
+	}
+	buf = malloc(size);
+	if (!buf)
+		die("malloc");
+	/* skip what is already in the log */
+	while (read(fd, buf, size) > 0)
+		;
+
+	/* blocking from here on, so the watermark applies */
+	fcntl(fd, F_SETFL, 0);
+	while (!stop) {
+		len = read(fd, buf, size);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			r->failed = 1;
+			break;
+		}
+		r->reads++;
+		for (off = 0; off < len; r->entries++)
+			off += sizeof(struct logger_entry) +
+				((struct logger_entry *)(buf + off))->len;
+	}
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static int run_threads(int nthreads)
+{
+	struct writer writers[MAX_THREADS];
+	struct log_reader r;
+	struct timeval start, end;
+	unsigned long total = 0, bytes = 0;
+	int i, failed = 0;
+	double secs;
+
+	memset(writers, 0, sizeof(writers));
+	memset(&r, 0, sizeof(r));
+	stop = 0;
+	if (reader && pthread_create(&r.thread, NULL, reader_thread, &r))
+		die("pthread_create");
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&writers[i].thread, NULL, writer_thread,
+				   &writers[i]))
+			die("pthread_create");
+	sleep(duration);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(writers[i].thread, NULL);
+		total += writers[i].count;
+		bytes += writers[i].bytes;
+		failed |= writers[i].failed;
+	}
+	gettimeofday(&end, NULL);
+	secs = end.tv_sec - start.tv_sec +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+	if (reader) {
+		/* one last entry, so that a blocked reader sees 'stop' */
+		int fd = open(dev, O_WRONLY);
+
+		if (fd >= 0) {
+			if (write(fd, "\4logger_bench\0stop", 19) < 0)
+				perror("write");
+			close(fd);
+		}
+		pthread_join(r.thread, NULL);
+		failed |= r.failed;
+	}
+
+	printf("%7d %12lu %12.0f %10.2f", nthreads, total,
+	       secs ? total / secs : 0.0,
+	       secs ? bytes / secs / (1024 * 1024) : 0.0);
+	if (reader)
+		printf(" %10.0f %13.1f", secs ? r.reads / secs : 0.0,
+		       r.reads ? (double)r.entries / r.reads : 0.0);
+	printf("%s\n", failed ? "  (failed)" : "");
+	fflush(stdout);
+	return failed;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-D device] [-d seconds] [-s message_bytes] "
+		"[-r [-b] [-w bytes] [-t msecs]] [threads...]\n"
+		"Default thread counts are 1 2 4 8 16.\n"
+		"-r drains the log with a reader thread, -b makes it read in "
+		"batches,\n-w and -t set its wake-up watermark.\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const int default_threads[] = { 1, 2, 4, 8, 16 };
+	int opt, i, ret = 0;
+
+	while ((opt = getopt(argc, argv, "D:d:s:rbw:t:h")) != -1) {
+		switch (opt) {
+		case 'D':
+			dev = optarg;
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 's':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			reader = 1;
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		case 'w':
+			wakeup.bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			wakeup.msecs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (duration <= 0 || msg_size == 0 ||
+	    msg_size + strlen(tag) + 3 > LOGGER_ENTRY_MAX_PAYLOAD)
+		usage(argv[0]);
+	/* the reader has to wake up for the final entry of each run */
+	if (wakeup.bytes && !wakeup.msecs)
+		wakeup.msecs = 1000;
+
+	printf("%s, message %zu bytes, %d s per run\n", dev, msg_size,
+	       duration);
+	printf("threads      entries    entries/s       MB/s%s\n",
+	       reader ? "    reads/s  entries/read" : "");
+	fflush(stdout);
+	if (optind == argc) {
+		for (i = 0; i < sizeof(default_threads) / sizeof(int); i++)
+			ret |= run_threads(default_threads[i]);
+	} else {
+		for (i = optind; i < argc; i++) {
+			int n = atoi(argv[i]);
+
+			if (n < 1 || n > MAX_THREADS)
+				usage(argv[0]);
+			ret |= run_threads(n);
+		}
+	}
+	return ret;
+}
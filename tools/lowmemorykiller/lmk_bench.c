@@ -0,0 +1,220 @@
+/*
+ * lmk_bench.c -- lowmemorykiller shrinker cost under memory pressure
+ *
+ * Forks a number of idle processes at an oom_adj that is not killable at
+ * the pressure level reached, the way most of a phone's processes are,
+ * and one process at OOM_DISABLE that keeps touching a large anonymous
+ * allocation so that reclaim, and with it the lowmemorykiller shrinker,
+ * runs continuously.  Afterwards it prints the CPU time kswapd used and,
+ * where the kernel has it, the shrinker's own statistics, so that
+ * kernels can be compared.
+ *
+ * Needs root for the negative oom_adj.  Pick -m so that free memory ends
+ * up between the lowmemorykiller minfree levels, or the idle processes
+ * get killed too (which shows up as kills).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o lmk_bench lmk_bench.c */
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATS	"/sys/module/lowmemorykiller/parameters/stats"
+
+static int nprocs = 1000;
+static int idle_adj;
+static size_t hog_mb = 256;
+static int duration = 10;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void set_oom_adj(int adj)
+{
+	FILE *f = fopen("/proc/self/oom_adj", "w");
+
+	if (!f || fprintf(f, "%d\n", adj) < 0 || fclose(f))
+		die("/proc/self/oom_adj");
+}
+
+static void idle_child(void)
+{
+	char *page;
+
+	set_oom_adj(idle_adj);
+	page = malloc(4096);
+	if (page)
+		memset(page, 1, 4096);
+	for (;;)
+		pause();
+}
+
+static void hog_child(void)
+{
+	size_t size = hog_mb << 20, off;
+	char *mem;
+
+	set_oom_adj(-17);
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		die("mmap");
+	for (;;)
+		for (off = 0; off < size; off += 4096)
+			mem[off]++;
+}
+
+/* utime + stime of all kswapd threads, in clock ticks */
+static unsigned long long kswapd_ticks(void)
+{
+	unsigned long long total = 0, utime, stime;
+	struct dirent *d;
+	char path[300], buf[512], *p;
+	DIR *dir;
+	FILE *f;
+
+	dir = opendir("/proc");
+	if (!dir)
+		die("/proc");
+	while ((d = readdir(dir))) {
+		snprintf(path, sizeof(path), "/proc/%s/stat", d->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fgets(buf, sizeof(buf), f) && strstr(buf, "(kswapd")) {
+			/* fields 14 and 15, after the ")" ending comm */
+			p = strrchr(buf, ')');
+			if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u "
+					"%*u %*u %*u %*u %llu %llu",
+					&utime, &stime) == 2)
+				total += utime + stime;
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	return total;
+}
+
+struct lmk_stats {
+	long calls, scans, kills;
+	long long time_ns;
+};
+
+static int read_stats(struct lmk_stats *s)
+{
+	FILE *f = fopen(STATS, "r");
+	int n;
+
+	if (!f)
+		return 0;
+	n = fscanf(f, "calls %ld scans %ld kills %ld time_ns %lld",
+		   &s->calls, &s->scans, &s->kills, &s->time_ns);
+	fclose(f);
+	return n == 4;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n idle_procs] [-a idle_oom_adj] [-m hog_mb] "
+		"[-d seconds]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct lmk_stats before, after;
+	unsigned long long ticks;
+	pid_t *pids, hog;
+	int opt, i, have_stats, killed = 0, status;
+
+	while ((opt = getopt(argc, argv, "n:a:m:d:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nprocs = atoi(optarg);
+			break;
+		case 'a':
+			idle_adj = atoi(optarg);
+			break;
+		case 'm':
+			hog_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nprocs < 0 || duration <= 0 || !hog_mb)
+		usage(argv[0]);
+
+	pids = calloc(nprocs, sizeof(*pids));
+	if (!pids)
+		die("calloc");
+	for (i = 0; i < nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0)
+			die("fork");
+		if (pids[i] == 0)
+			idle_child();
+	}
+	/* let them settle before measuring */
+	sleep(1);
+
+	have_stats = read_stats(&before);
+	ticks = kswapd_ticks();
+	hog = fork();
+	if (hog < 0)
+		die("fork");
+	if (hog == 0)
+		hog_child();
+	sleep(duration);
+	kill(hog, SIGKILL);
+	waitpid(hog, NULL, 0);
+	ticks = kswapd_ticks() - ticks;
+	have_stats = have_stats && read_stats(&after);
+
+	for (i = 0; i < nprocs; i++) {
+		if (waitpid(pids[i], &status, WNOHANG) == pids[i])
+			killed++;
+		else
+			kill(pids[i], SIGKILL);
+	}
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+
+	printf("%d idle processes at oom_adj %d, %zu MB hog, %d s\n",
+	       nprocs, idle_adj, hog_mb, duration);
+	printf("kswapd cpu      %8.1f ms\n",
+	       ticks * 1000.0 / sysconf(_SC_CLK_TCK));
+	printf("idle killed     %8d\n", killed);
+	if (have_stats) {
+		long calls = after.calls - before.calls;
+		long long ns = after.time_ns - before.time_ns;
+
+		printf("shrinker calls  %8ld\n", calls);
+		printf("index scans     %8ld\n", after.scans - before.scans);
+		printf("kills           %8ld\n", after.kills - before.kills);
+		printf("shrinker time   %8.1f ms (%.0f ns/call)\n", ns / 1e6,
+		       calls ? (double)ns / calls : 0.0);
+	} else
+		printf("no %s, shrinker statistics unavailable\n", STATS);
+	return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * lmk_events.c -- print lowmemorykiller pressure events as they come
+ *
+ * Reads struct lowmem_event records from /dev/lowmemorykiller and prints
+ * one line for each, with the time it arrived.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o lmk_events lmk_events.c */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "lowmemorykiller.h"
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/lowmemorykiller";
+	struct lowmem_event event;
+	struct timeval tv;
+	ssize_t len;
+	int fd;
+
+	fd = open(dev, O_RDONLY);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+	for (;;) {
+		len = read(fd, &event, sizeof(event));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len != sizeof(event)) {
+			perror("read");
+			return 1;
+		}
+		gettimeofday(&tv, NULL);
+		printf("%ld.%06ld seq %u level %u adj %d%s free %u file %u\n",
+		       (long)tv.tv_sec, (long)tv.tv_usec, event.seq,
+		       event.level, event.adj,
+		       event.killing ? " killing" : "",
+		       event.free_pages, event.file_pages);
+		fflush(stdout);
+	}
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# qtaguid_bench.sh - loopback packet rate with and without qtaguid accounting
+#
+# usage: qtaguid_bench.sh [max threads] [seconds]
+#
+# Runs qtaguid_udp_bench with 1, 2, 4, ... threads up to the given number,
+# first with no rules, then with an owner match on lo in the OUTPUT and
+# INPUT chains so that xt_qtaguid accounts every datagram, and last with
+# the sending sockets tagged as well.  The drop in packet rate between the
+# runs is the cost of the accounting; how it changes with the number of
+# threads shows how well it scales.  The stats lines of the test are
+# deleted afterwards.
+
+MAX_THREADS=${1:-4}
+SECS=${2:-5}
+TAG=42
+UDP_BENCH=$(dirname $0)/qtaguid_udp_bench
+
+if [ ! -x $UDP_BENCH ]; then
+	echo "$UDP_BENCH not found; run make first" >&2
+	exit 1
+fi
+if [ ! -w /proc/net/xt_qtaguid/ctrl ]; then
+	echo "xt_qtaguid is not available" >&2
+	exit 1
+fi
+
+cleanup()
+{
+	iptables -D OUTPUT -o lo -m owner --socket-exists -j ACCEPT 2>/dev/null
+	iptables -D INPUT -i lo -m owner --socket-exists -j ACCEPT 2>/dev/null
+	echo "d 0 $(id -u)" > /proc/net/xt_qtaguid/ctrl 2>/dev/null
+}
+trap cleanup EXIT
+
+run()
+{
+	t=1
+	while [ $t -le $MAX_THREADS ]; do
+		$UDP_BENCH -t $t -n $SECS "$@" | tail -n 1 | \
+			sed "s/^udp lo/$t threads/" || exit 1
+		t=$((t * 2))
+	done
+}
+
+header()
+{
+	echo "$1"
+	printf "%-10s %12s %12s %12s %12s %8s\n" "" "packets" "pps" \
+	       "min thread" "max thread" "errors"
+}
+
+header "no rules"
+run
+echo
+
+iptables -A OUTPUT -o lo -m owner --socket-exists -j ACCEPT || exit 1
+iptables -A INPUT -i lo -m owner --socket-exists -j ACCEPT || exit 1
+
+header "qtaguid, untagged sockets"
+run
+echo
+
+header "qtaguid, tagged sockets"
+run -T $TAG
@@ -0,0 +1,243 @@
+/*
+ * qtaguid_stats_bench.c -- cost of polling the xt_qtaguid stats
+ *
+ * Reads /proc/net/xt_qtaguid/stats the way a stats collector polls it, then
+ * does the same number of polls of the binary, incremental
+ * /proc/net/xt_qtaguid/stats_bin through one open file, or with -r by
+ * reopening it for each poll and writing back the previous header.  It
+ * prints for each the time and system cpu time per poll, and how much each
+ * poll returned.
+ * Run it next to some traffic (e.g. qtaguid_udp_bench) so that the binary
+ * polls have changes to return.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o qtaguid_stats_bench qtaguid_stats_bench.c -lrt */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/* from include/linux/netfilter/xt_qtaguid.h */
+#define XT_QTAGUID_STATS_MAGIC	0x53555451
+#define XT_QTAGUID_STATS_FULL	(1 << 0)
+
+struct xt_qtaguid_stats_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint32_t gen;
+	uint32_t nr_records;
+	uint32_t record_size;
+	uint32_t deletes;
+};
+
+#define BUF_SIZE	(4 << 20)
+
+static const char *text_stats = "/proc/net/xt_qtaguid/stats";
+static const char *bin_stats = "/proc/net/xt_qtaguid/stats_bin";
+static int nr_polls = 100;
+static int interval_ms = 100;
+static int reopen;
+static char *buf;
+static struct xt_qtaguid_stats_hdr prev_hdr;
+
+struct poll_stats {
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+	unsigned long long sys_us;
+	unsigned long long bytes;
+	unsigned long long items;
+	int full;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n polls] [-i interval ms] [-r]\n", prog);
+	exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long sys_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+}
+
+/* reads from offset 0 to the end, returns the length */
+static size_t read_all(int fd)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while ((n = pread(fd, buf + len, BUF_SIZE - len, len)) > 0) {
+		len += n;
+		if (len == BUF_SIZE) {
+			fprintf(stderr, "stats larger than %d bytes\n",
+				BUF_SIZE);
+			exit(1);
+		}
+	}
+	if (n < 0) {
+		perror("read");
+		exit(1);
+	}
+	return len;
+}
+
+static size_t count_lines(size_t len)
+{
+	size_t i, lines = 0;
+
+	for (i = 0; i < len; i++)
+		if (buf[i] == '\n')
+			lines++;
+	/* not the header line */
+	return lines ? lines - 1 : 0;
+}
+
+static void poll_text(struct poll_stats *st)
+{
+	unsigned long long t, ns;
+	size_t len;
+	int fd;
+
+	t = now_ns();
+	fd = open(text_stats, O_RDONLY);
+	if (fd < 0) {
+		perror(text_stats);
+		exit(1);
+	}
+	len = read_all(fd);
+	close(fd);
+	ns = now_ns() - t;
+
+	st->total_ns += ns;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+	st->bytes += len;
+	st->items += count_lines(len);
+}
+
+static void poll_bin(int fd, struct poll_stats *st)
+{
+	struct xt_qtaguid_stats_hdr *hdr = (struct xt_qtaguid_stats_hdr *)buf;
+	unsigned long long t, ns;
+	size_t len;
+
+	t = now_ns();
+	if (reopen) {
+		fd = open(bin_stats, O_RDWR);
+		if (fd < 0) {
+			perror(bin_stats);
+			exit(1);
+		}
+		if (prev_hdr.magic &&
+		    write(fd, &prev_hdr, sizeof(prev_hdr)) != sizeof(prev_hdr)) {
+			perror("write");
+			exit(1);
+		}
+	}
+	len = read_all(fd);
+	if (reopen)
+		close(fd);
+	ns = now_ns() - t;
+	if (len < sizeof(*hdr) || hdr->magic != XT_QTAGUID_STATS_MAGIC) {
+		fprintf(stderr, "bad binary stats\n");
+		exit(1);
+	}
+	prev_hdr = *hdr;
+
+	st->total_ns += ns;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+	st->bytes += len;
+	st->items += hdr->nr_records;
+	if (hdr->flags & XT_QTAGUID_STATS_FULL)
+		st->full++;
+}
+
+static void report(const char *what, struct poll_stats *st)
+{
+	printf("%-8s %9.1f %9.1f %9.1f %10.0f %10.1f %5d\n", what,
+	       st->total_ns / 1e3 / nr_polls, st->max_ns / 1e3,
+	       st->sys_us / (double)nr_polls, st->bytes / (double)nr_polls,
+	       st->items / (double)nr_polls, st->full);
+}
+
+int main(int argc, char **argv)
+{
+	struct poll_stats text, bin;
+	unsigned long long s;
+	int opt, fd, i;
+
+	while ((opt = getopt(argc, argv, "n:i:r")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_polls = atoi(optarg);
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'r':
+			reopen = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_polls <= 0 || interval_ms < 0)
+		usage(argv[0]);
+
+	buf = malloc(BUF_SIZE);
+	if (!buf) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	memset(&text, 0, sizeof(text));
+	memset(&bin, 0, sizeof(bin));
+
+	for (i = 0; i < nr_polls; i++) {
+		s = sys_us();
+		poll_text(&text);
+		text.sys_us += sys_us() - s;
+		usleep(interval_ms * 1000);
+	}
+
+	fd = open(bin_stats, O_RDONLY);
+	if (fd < 0) {
+		perror(bin_stats);
+		return 1;
+	}
+	for (i = 0; i < nr_polls; i++) {
+		s = sys_us();
+		poll_bin(fd, &bin);
+		bin.sys_us += sys_us() - s;
+		usleep(interval_ms * 1000);
+	}
+	close(fd);
+
+	printf("%d polls, %d ms apart\n", nr_polls, interval_ms);
+	printf("%-8s %9s %9s %9s %10s %10s %5s\n", "", "mean us", "max us",
+	       "sys us", "bytes", "entries", "full");
+	report("text", &text);
+	report("binary", &bin);
+	return 0;
+}
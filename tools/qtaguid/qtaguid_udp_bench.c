@@ -0,0 +1,192 @@
+/*
+ * qtaguid_udp_bench.c -- loopback udp packet rate through xt_qtaguid
+ *
+ * Each thread has its own pair of udp sockets on 127.0.0.1 and sends a
+ * datagram from one to the other and reads it back, as fast as it can, for
+ * the given time.  With an owner match in the OUTPUT and INPUT chains every
+ * datagram is accounted twice by xt_qtaguid, so the packet rate shows what
+ * the accounting costs and how it scales with the number of cpus sending.
+ *
+ * With -T the sending sockets are tagged through /proc/net/xt_qtaguid/ctrl,
+ * so the socket tag lookup and the acct_tag stats are exercised as well.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o qtaguid_udp_bench qtaguid_udp_bench.c -lpthread -lrt */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS	64
+
+static const char *ctrl = "/proc/net/xt_qtaguid/ctrl";
+static const char *dev = "/dev/xt_qtaguid";
+static int nr_threads = 4;
+static int seconds = 5;
+static int size = 64;
+static unsigned int acct_tag;
+
+struct thread_stats {
+	unsigned long packets;
+	unsigned long errors;
+};
+
+static struct thread_stats stats[MAX_THREADS];
+static unsigned long long end_ns;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t threads] [-n seconds] [-s size] [-T acct tag]\n",
+		prog);
+	exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void tag_socket(int fd)
+{
+	char cmd[64];
+	int cfd, len;
+
+	/* the acct_tag is the upper 32 bits of the tag */
+	len = snprintf(cmd, sizeof(cmd), "t %d %llu", fd,
+		       (unsigned long long)acct_tag << 32);
+	cfd = open(ctrl, O_WRONLY);
+	if (cfd < 0) {
+		perror(ctrl);
+		exit(1);
+	}
+	if (write(cfd, cmd, len) != len) {
+		perror("tag");
+		exit(1);
+	}
+	close(cfd);
+}
+
+static void *run_thread(void *arg)
+{
+	struct thread_stats *st = arg;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	char *buf;
+	int rfd, sfd, i;
+
+	buf = calloc(1, size);
+	rfd = socket(AF_INET, SOCK_DGRAM, 0);
+	sfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (!buf || rfd < 0 || sfd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(rfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    getsockname(rfd, (struct sockaddr *)&addr, &addrlen) < 0 ||
+	    connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("loopback");
+		exit(1);
+	}
+	if (acct_tag)
+		tag_socket(sfd);
+
+	while (now_ns() < end_ns) {
+		/* check the time every so many packets, not for each */
+		for (i = 0; i < 64; i++) {
+			if (send(sfd, buf, size, 0) != size ||
+			    recv(rfd, buf, size, 0) != size) {
+				st->errors++;
+				continue;
+			}
+			st->packets++;
+		}
+	}
+
+	close(sfd);
+	close(rfd);
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[MAX_THREADS];
+	unsigned long packets = 0, errors = 0, min = ~0UL, max = 0;
+	int opt, i, qfd = -1;
+
+	while ((opt = getopt(argc, argv, "t:n:s:T:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			seconds = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'T':
+			acct_tag = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_threads <= 0 || nr_threads > MAX_THREADS || seconds <= 0 ||
+	    size <= 0 || size > 65507)
+		usage(argv[0]);
+
+	/* xt_qtaguid wants tagging processes to have its device open */
+	if (acct_tag) {
+		qfd = open(dev, O_RDONLY);
+		if (qfd < 0)
+			fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+	}
+
+	end_ns = now_ns() + seconds * 1000000000ULL;
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, run_thread, &stats[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+		packets += stats[i].packets;
+		errors += stats[i].errors;
+		if (stats[i].packets < min)
+			min = stats[i].packets;
+		if (stats[i].packets > max)
+			max = stats[i].packets;
+	}
+
+	printf("%d threads, %d byte datagrams, acct_tag %u, %d s\n",
+	       nr_threads, size, acct_tag, seconds);
+	printf("%-10s %12s %12s %12s %12s %8s\n", "", "packets", "pps",
+	       "min thread", "max thread", "errors");
+	printf("%-10s %12lu %12.0f %12lu %12lu %8lu\n", "udp lo", packets,
+	       packets / (double)seconds, min, max, errors);
+
+	if (qfd >= 0)
+		close(qfd);
+	return 0;
+}
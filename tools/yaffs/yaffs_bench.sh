@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# yaffs_bench.sh - small random write throughput on nandsim by cache size
+#
+# usage: yaffs_bench.sh [cache sizes...]
+#
+# For each short op cache size, loads nandsim as a 128 MiB NAND with 2 KiB
+# pages, mounts it as yaffs2 with -o cache=<size>, runs yaffs_randwrite on
+# it and prints the result with the cache's write-coalescing counters from
+# /proc/yaffs: short writes taken by the cache, chunks it wrote out, and
+# how often it had to flush a file to make room.  nandsim is reloaded for
+# every size so that each run starts from erased flash.  RANDWRITE_ARGS
+# are passed to yaffs_randwrite, e.g. RANDWRITE_ARGS="-r 256 -f 0".
+
+SIZES=${*:-"10 64 256 1024"}
+MNT=${TMPDIR:-/tmp}/yaffs_bench.$$
+RANDWRITE=$(dirname $0)/yaffs_randwrite
+NANDSIM="first_id_byte=0x20 second_id_byte=0xf1 third_id_byte=0x00 fourth_id_byte=0x15"
+
+if [ ! -x $RANDWRITE ]; then
+	echo "$RANDWRITE not found; run make first" >&2
+	exit 1
+fi
+
+cleanup()
+{
+	umount $MNT 2>/dev/null
+	rmdir $MNT 2>/dev/null
+	rmmod nandsim 2>/dev/null
+}
+trap cleanup EXIT
+
+yaffs_stat()
+{
+	sed -n "s/^$1\.* *//p" /proc/yaffs | head -n 1
+}
+
+mkdir -p $MNT || exit 1
+modprobe mtdblock 2>/dev/null
+
+for n in $SIZES; do
+	rmmod nandsim 2>/dev/null
+	modprobe nandsim $NANDSIM || exit 1
+	mtd=$(grep '"NAND simulator' /proc/mtd | cut -d: -f1 | sed 's/mtd//')
+	if [ -z "$mtd" ]; then
+		echo "nandsim did not register an mtd device" >&2
+		exit 1
+	fi
+	mount -t yaffs2 -o cache=$n /dev/mtdblock$mtd $MNT || exit 1
+
+	printf "cache=%-5s " $n
+	$RANDWRITE $RANDWRITE_ARGS $MNT/file || exit 1
+	echo "    cache_writes $(yaffs_stat cache_writes)" \
+	     "cache_chunk_writes $(yaffs_stat cache_chunk_writes)" \
+	     "cache_lru_flushes $(yaffs_stat cache_lru_flushes)" \
+	     "n_page_writes $(yaffs_stat n_page_writes)"
+
+	umount $MNT || exit 1
+done
@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# yaffs_gc_bench.sh - write amplification on nandsim by GC policy
+#
+# usage: yaffs_gc_bench.sh [mount options...]
+#
+# For each set of mount options (by default greedy GC, cost-benefit GC,
+# and cost-benefit GC with GC copies in their own allocation block), loads
+# nandsim as a 128 MiB NAND with 2 KiB pages, mounts it as yaffs2, fills
+# it with COLD MiB (default 64) of data that is never written again, and
+# then runs yaffs_randwrite on a HOT KiB (default 40960) file, whose
+# writes go to its first HOT_PERCENT (default 20) percent, for SECS
+# seconds (default 60).  It prints the writes per second and, from the
+# /proc/yaffs counters taken before and after the random writes, the
+# chunks written for the user, the chunks GC copied, the write
+# amplification and the erasures of that phase alone.  nandsim is
+# reloaded for every set so that each run starts from erased flash.
+
+POLICIES=${*:-"gc=greedy gc=cost-benefit gc=cost-benefit,gc-stream-on"}
+COLD=${COLD:-64}
+HOT=${HOT:-40960}
+HOT_PERCENT=${HOT_PERCENT:-20}
+SECS=${SECS:-60}
+MNT=${TMPDIR:-/tmp}/yaffs_gc_bench.$$
+RANDWRITE=$(dirname $0)/yaffs_randwrite
+NANDSIM="first_id_byte=0x20 second_id_byte=0xf1 third_id_byte=0x00 fourth_id_byte=0x15"
+
+if [ ! -x $RANDWRITE ]; then
+	echo "$RANDWRITE not found; run make first" >&2
+	exit 1
+fi
+
+cleanup()
+{
+	umount $MNT 2>/dev/null
+	rmdir $MNT 2>/dev/null
+	rmmod nandsim 2>/dev/null
+}
+trap cleanup EXIT
+
+yaffs_stat()
+{
+	sed -n "s/^$1\.* *//p" /proc/yaffs | head -n 1
+}
+
+mkdir -p $MNT || exit 1
+modprobe mtdblock 2>/dev/null
+
+for opts in $POLICIES; do
+	rmmod nandsim 2>/dev/null
+	modprobe nandsim $NANDSIM || exit 1
+	mtd=$(grep '"NAND simulator' /proc/mtd | cut -d: -f1 | sed 's/mtd//')
+	if [ -z "$mtd" ]; then
+		echo "nandsim did not register an mtd device" >&2
+		exit 1
+	fi
+	mount -t yaffs2 -o $opts /dev/mtdblock$mtd $MNT || exit 1
+
+	dd if=/dev/urandom of=$MNT/cold bs=1M count=$COLD 2>/dev/null || exit 1
+	sync
+	data0=$(yaffs_stat n_data_writes)
+	hdr0=$(yaffs_stat n_hdr_writes)
+	gc0=$(yaffs_stat n_gc_copies)
+	erase0=$(yaffs_stat n_erasures)
+
+	echo "$opts"
+	$RANDWRITE -s $HOT -r 2048 -h $HOT_PERCENT -n $SECS $MNT/hot || exit 1
+	sync
+
+	user=$(($(yaffs_stat n_data_writes) - data0 + \
+		$(yaffs_stat n_hdr_writes) - hdr0))
+	gc=$(($(yaffs_stat n_gc_copies) - gc0))
+	erase=$(($(yaffs_stat n_erasures) - erase0))
+	wa=$(((user + gc) * 100 / (user > 0 ? user : 1)))
+	printf "    user %d gc_copies %d write_amplification %d.%02d" \
+	       $user $gc $((wa / 100)) $((wa % 100))
+	echo " erasures $erase n_alloc_closes $(yaffs_stat n_alloc_closes)"
+
+	umount $MNT || exit 1
+done
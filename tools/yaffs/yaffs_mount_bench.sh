@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# yaffs_mount_bench.sh - yaffs2 mount time on nandsim by partition size
+#
+# usage: [THREADS=<n>] yaffs_mount_bench.sh [sizes in MiB...]
+#
+# For each size (128, 256, 512 or 1024 MiB of 2 KiB page NAND), loads
+# nandsim, fills half of it with a mix of large and small files, and then
+# times mounting it: from a checkpoint, without the checkpoint (as after
+# an unclean shutdown) with the scan done on the mounting thread, and
+# without the checkpoint with THREADS scan threads (default 4) reading
+# the tags ahead of it.
+
+SIZES=${*:-"128 256 512 1024"}
+THREADS=${THREADS:-4}
+MNT=${TMPDIR:-/tmp}/yaffs_mount_bench.$$
+PARAM=/sys/module/yaffs/parameters/yaffs_scan_threads
+
+if [ ! -w $PARAM ]; then
+	echo "$PARAM not found; is yaffs2 loaded?" >&2
+	exit 1
+fi
+OLD_THREADS=$(cat $PARAM)
+
+cleanup()
+{
+	umount $MNT 2>/dev/null
+	rmdir $MNT 2>/dev/null
+	rmmod nandsim 2>/dev/null
+	echo $OLD_THREADS > $PARAM
+}
+trap cleanup EXIT
+
+now_ns()
+{
+	date +%s%N
+}
+
+# nandsim device id for each size, all 2 KiB pages and 128 KiB blocks
+id_byte()
+{
+	case $1 in
+	128)	echo 0xf1 ;;
+	256)	echo 0xda ;;
+	512)	echo 0xdc ;;
+	1024)	echo 0xd3 ;;
+	*)	echo "unsupported size $1" >&2; exit 1 ;;
+	esac
+}
+
+timed_mount()
+{
+	start=$(now_ns)
+	mount -t yaffs2 ${1:+-o $1} /dev/mtdblock$mtd $MNT || exit 1
+	end=$(now_ns)
+	echo $(((end - start) / 1000000))
+}
+
+fill()
+{
+	mb=$(($1 / 2))
+	# half of it in 1 MiB files, half in 8 KiB files
+	i=0
+	while [ $i -lt $((mb / 2)) ]; do
+		dd if=/dev/urandom of=$MNT/big$i bs=1M count=1 2>/dev/null
+		i=$((i + 1))
+	done
+	mkdir -p $MNT/small
+	i=0
+	while [ $i -lt $((mb * 64)) ]; do
+		dd if=/dev/urandom of=$MNT/small/$i bs=8k count=1 2>/dev/null
+		i=$((i + 1))
+	done
+	sync
+}
+
+mkdir -p $MNT || exit 1
+modprobe mtdblock 2>/dev/null
+
+printf "%8s %12s %12s %12s\n" "MiB" "checkpt ms" "scan ms" \
+	"$THREADS thr ms"
+for size in $SIZES; do
+	id=$(id_byte $size) || exit 1
+	rmmod nandsim 2>/dev/null
+	modprobe nandsim first_id_byte=0x20 second_id_byte=$id \
+		third_id_byte=0x00 fourth_id_byte=0x15 || exit 1
+	mtd=$(grep '"NAND simulator' /proc/mtd | cut -d: -f1 | sed 's/mtd//')
+	if [ -z "$mtd" ]; then
+		echo "nandsim did not register an mtd device" >&2
+		exit 1
+	fi
+
+	mount -t yaffs2 /dev/mtdblock$mtd $MNT || exit 1
+	fill $size
+	umount $MNT || exit 1
+
+	checkpt=$(timed_mount)
+	umount $MNT
+	echo 0 > $PARAM
+	scan=$(timed_mount no-checkpoint-read)
+	umount $MNT
+	echo $THREADS > $PARAM
+	threaded=$(timed_mount no-checkpoint-read)
+	umount $MNT
+
+	printf "%8d %12d %12d %12d\n" $size $checkpt $scan $threaded
+done
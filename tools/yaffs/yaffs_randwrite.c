@@ -0,0 +1,145 @@
+/*
+ * yaffs_randwrite.c -- small random write throughput of a file
+ *
+ * Creates a file of the given size, then overwrites records of the given
+ * size at random record-aligned offsets within it for the given time,
+ * the way a database or settings store updates its file, and calls fsync
+ * every so many writes.  It prints the writes per second and the write
+ * bandwidth.  Records smaller than a NAND chunk go through the yaffs short
+ * op cache, so this shows how well that cache coalesces writes.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o yaffs_randwrite yaffs_randwrite.c -lrt */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static size_t file_size = 4 << 20;
+static size_t record = 512;
+static int seconds = 10;
+static int sync_every = 64;
+static int hot_percent = 100;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s file size KiB] [-r record bytes] [-n seconds]\n"
+		"       [-f writes per fsync, 0 for none] [-h hot percent] file\n",
+		prog);
+	exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long start, end, elapsed;
+	unsigned long writes = 0, nr_records, hot_records;
+	unsigned int seed = 1;
+	char *buf;
+	off_t off;
+	size_t done;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "s:r:n:f:h:")) != -1) {
+		switch (opt) {
+		case 's':
+			file_size = strtoul(optarg, NULL, 0) << 10;
+			break;
+		case 'r':
+			record = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			seconds = atoi(optarg);
+			break;
+		case 'f':
+			sync_every = atoi(optarg);
+			break;
+		case 'h':
+			hot_percent = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || !record || file_size < record ||
+	    seconds <= 0 || sync_every < 0 || hot_percent <= 0 ||
+	    hot_percent > 100)
+		usage(argv[0]);
+
+	buf = malloc(record > 65536 ? record : 65536);
+	if (!buf) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	memset(buf, 0x5a, record > 65536 ? record : 65536);
+
+	fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	for (done = 0; done < file_size; done += 65536) {
+		size_t n = file_size - done < 65536 ? file_size - done : 65536;
+
+		if (write(fd, buf, n) != (ssize_t)n) {
+			perror("write");
+			return 1;
+		}
+	}
+	if (fsync(fd) < 0) {
+		perror("fsync");
+		return 1;
+	}
+
+	/* the writes go to the first hot_percent of the file */
+	nr_records = file_size / record;
+	hot_records = nr_records * hot_percent / 100;
+	if (!hot_records)
+		hot_records = 1;
+
+	start = now_ns();
+	end = start + seconds * 1000000000ULL;
+	while (now_ns() < end) {
+		off = (off_t)(rand_r(&seed) % hot_records) * record;
+		memset(buf, writes & 0xff, record);
+		if (pwrite(fd, buf, record, off) != (ssize_t)record) {
+			perror("pwrite");
+			return 1;
+		}
+		writes++;
+		if (sync_every && writes % sync_every == 0 && fsync(fd) < 0) {
+			perror("fsync");
+			return 1;
+		}
+	}
+	if (fsync(fd) < 0) {
+		perror("fsync");
+		return 1;
+	}
+	elapsed = now_ns() - start;
+
+	printf("%lu writes of %zu bytes in %.2f s: %.0f writes/s, %.1f KiB/s\n",
+	       writes, record, elapsed / 1e9, writes * 1e9 / elapsed,
+	       writes * record * 1e9 / 1024 / elapsed);
+
+	close(fd);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# yaffs_rw_bench.sh - read latency on nandsim with and without writers
+#
+# usage: yaffs_rw_bench.sh [readers] [writers] [seconds]
+#
+# Loads nandsim as a 128 MiB NAND with 2 KiB pages, mounts it as yaffs2
+# and runs yaffs_rw_latency on it twice: once with the readers alone and
+# once with the writers next to them, so that the read latency percentiles
+# of the second run show how much writes and the garbage collection they
+# cause hold up reads.  nandsim is reloaded for each run so that both start
+# from erased flash.  The garbage collection counters from /proc/yaffs are
+# printed after each run.
+
+READERS=${1:-4}
+WRITERS=${2:-2}
+SECS=${3:-10}
+MNT=${TMPDIR:-/tmp}/yaffs_rw_bench.$$
+RW_LATENCY=$(dirname $0)/yaffs_rw_latency
+NANDSIM="first_id_byte=0x20 second_id_byte=0xf1 third_id_byte=0x00 fourth_id_byte=0x15"
+
+if [ ! -x $RW_LATENCY ]; then
+	echo "$RW_LATENCY not found; run make first" >&2
+	exit 1
+fi
+
+cleanup()
+{
+	umount $MNT 2>/dev/null
+	rmdir $MNT 2>/dev/null
+	rmmod nandsim 2>/dev/null
+}
+trap cleanup EXIT
+
+yaffs_stat()
+{
+	sed -n "s/^$1\.* *//p" /proc/yaffs | head -n 1
+}
+
+mkdir -p $MNT || exit 1
+modprobe mtdblock 2>/dev/null
+
+for w in 0 $WRITERS; do
+	rmmod nandsim 2>/dev/null
+	modprobe nandsim $NANDSIM || exit 1
+	mtd=$(grep '"NAND simulator' /proc/mtd | cut -d: -f1 | sed 's/mtd//')
+	if [ -z "$mtd" ]; then
+		echo "nandsim did not register an mtd device" >&2
+		exit 1
+	fi
+	mount -t yaffs2 /dev/mtdblock$mtd $MNT || exit 1
+
+	$RW_LATENCY -r $READERS -w $w -n $SECS $MNT || exit 1
+	echo "    n_gc_copies $(yaffs_stat n_gc_copies)" \
+	     "all_gcs $(yaffs_stat all_gcs)" \
+	     "n_page_reads $(yaffs_stat n_page_reads)"
+	echo
+
+	umount $MNT || exit 1
+done
@@ -0,0 +1,266 @@
+/*
+ * yaffs_rw_latency.c -- read latency next to writers on one file system
+ *
+ * Creates a file to read from and one file per writer, then runs reader
+ * threads that read random pages of the first file and writer threads
+ * that overwrite random pages of their own file and fsync, for the given
+ * time.  Each read first drops the page from the page cache, so that it
+ * is read from the file system every time.  It prints the latency
+ * percentiles of the reads and of the writes; what to look at is how much
+ * the writers, and the garbage collection they cause, hold up the reads.
+ *
+ * Run it on a yaffs2 mount of nandsim, e.g.
+ *	modprobe nandsim first_id_byte=0x20 second_id_byte=0xf1 \
+ *		third_id_byte=0x00 fourth_id_byte=0x15
+ *	mount -t yaffs2 /dev/mtdblock0 /mnt
+ *	yaffs_rw_latency -r 4 -w 2 /mnt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o yaffs_rw_latency yaffs_rw_latency.c -lpthread -lrt */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGE_SZ		4096
+#define MAX_THREADS	64
+#define MAX_SAMPLES	(1 << 20)
+
+static const char *dir;
+static size_t file_size = 16 << 20;
+static int nr_readers = 4;
+static int nr_writers = 2;
+static int seconds = 10;
+static int sync_every = 16;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int fd;
+	unsigned long long *ns;
+	unsigned long n;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s file size KiB] [-r readers] [-w writers]\n"
+		"       [-n seconds] [-f writes per fsync] dir\n", prog);
+	exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int create_file(const char *name)
+{
+	char path[4096], buf[65536];
+	size_t done;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	memset(buf, 0xa5, sizeof(buf));
+	for (done = 0; done < file_size; done += sizeof(buf)) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			perror("write");
+			exit(1);
+		}
+	}
+	if (fsync(fd) < 0) {
+		perror("fsync");
+		exit(1);
+	}
+	return fd;
+}
+
+static void record(struct worker *w, unsigned long long ns)
+{
+	if (w->n < MAX_SAMPLES)
+		w->ns[w->n++] = ns;
+}
+
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int seed = w->id;
+	unsigned long long t;
+	char buf[PAGE_SZ];
+	off_t off;
+
+	while (!stop) {
+		off = (off_t)(rand_r(&seed) % (file_size / PAGE_SZ)) * PAGE_SZ;
+		posix_fadvise(w->fd, off, PAGE_SZ, POSIX_FADV_DONTNEED);
+		t = now_ns();
+		if (pread(w->fd, buf, PAGE_SZ, off) != PAGE_SZ) {
+			perror("pread");
+			exit(1);
+		}
+		record(w, now_ns() - t);
+	}
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int seed = w->id + 1000;
+	unsigned long long t;
+	unsigned long writes = 0;
+	char buf[PAGE_SZ];
+	off_t off;
+
+	while (!stop) {
+		off = (off_t)(rand_r(&seed) % (file_size / PAGE_SZ)) * PAGE_SZ;
+		memset(buf, writes, sizeof(buf));
+		t = now_ns();
+		if (pwrite(w->fd, buf, PAGE_SZ, off) != PAGE_SZ) {
+			perror("pwrite");
+			exit(1);
+		}
+		if (++writes % sync_every == 0 && fsync(w->fd) < 0) {
+			perror("fsync");
+			exit(1);
+		}
+		record(w, now_ns() - t);
+	}
+	return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* merges the samples of the workers and prints their percentiles */
+static void report(const char *what, struct worker *w, int nr)
+{
+	unsigned long long *ns, sum = 0;
+	unsigned long n = 0, i;
+	int j;
+
+	for (j = 0; j < nr; j++)
+		n += w[j].n;
+	if (!n)
+		return;
+	ns = malloc(n * sizeof(*ns));
+	if (!ns) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (n = 0, j = 0; j < nr; j++) {
+		memcpy(ns + n, w[j].ns, w[j].n * sizeof(*ns));
+		n += w[j].n;
+	}
+	qsort(ns, n, sizeof(*ns), cmp_ull);
+	for (i = 0; i < n; i++)
+		sum += ns[i];
+	printf("%-6s %8lu %8.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", what, n,
+	       n / (double)seconds, sum / 1e3 / n, ns[n / 2] / 1e3,
+	       ns[n * 9 / 10] / 1e3, ns[n * 99 / 100] / 1e3,
+	       ns[n - 1] / 1e3);
+	free(ns);
+}
+
+int main(int argc, char **argv)
+{
+	struct worker readers[MAX_THREADS], writers[MAX_THREADS];
+	char name[32];
+	int opt, read_fd, i;
+
+	while ((opt = getopt(argc, argv, "s:r:w:n:f:")) != -1) {
+		switch (opt) {
+		case 's':
+			file_size = strtoul(optarg, NULL, 0) << 10;
+			break;
+		case 'r':
+			nr_readers = atoi(optarg);
+			break;
+		case 'w':
+			nr_writers = atoi(optarg);
+			break;
+		case 'n':
+			seconds = atoi(optarg);
+			break;
+		case 'f':
+			sync_every = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || file_size < PAGE_SZ || nr_readers < 0 ||
+	    nr_readers > MAX_THREADS || nr_writers < 0 ||
+	    nr_writers > MAX_THREADS || seconds <= 0 || sync_every <= 0)
+		usage(argv[0]);
+	dir = argv[optind];
+
+	read_fd = create_file("read");
+	for (i = 0; i < nr_readers; i++) {
+		readers[i].id = i;
+		readers[i].fd = read_fd;
+		readers[i].n = 0;
+		readers[i].ns = malloc(MAX_SAMPLES * sizeof(*readers[i].ns));
+		if (!readers[i].ns) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < nr_writers; i++) {
+		snprintf(name, sizeof(name), "write%d", i);
+		writers[i].id = i;
+		writers[i].fd = create_file(name);
+		writers[i].n = 0;
+		writers[i].ns = malloc(MAX_SAMPLES * sizeof(*writers[i].ns));
+		if (!writers[i].ns) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < nr_readers; i++)
+		pthread_create(&readers[i].thread, NULL, reader, &readers[i]);
+	for (i = 0; i < nr_writers; i++)
+		pthread_create(&writers[i].thread, NULL, writer, &writers[i]);
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nr_readers; i++)
+		pthread_join(readers[i].thread, NULL);
+	for (i = 0; i < nr_writers; i++)
+		pthread_join(writers[i].thread, NULL);
+
+	printf("%d readers, %d writers, %zu KiB files, %d s, latency in us\n",
+	       nr_readers, nr_writers, file_size >> 10, seconds);
+	printf("%-6s %8s %8s %9s %9s %9s %9s %9s\n", "", "ops", "ops/s",
+	       "mean", "p50", "p90", "p99", "max");
+	report("read", readers, nr_readers);
+	report("write", writers, nr_writers);
+
+	for (i = 0; i < nr_writers; i++)
+		close(writers[i].fd);
+	close(read_fd);
+	return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * zcache_stress.c -- drive cleancache puts and gets from many threads
+ *
+ * Each thread writes a file of its own in the given directory, which
+ * must be on a filesystem that uses cleancache (ext3, ext4, btrfs, ...),
+ * then for the given time repeatedly drops the file from the page cache
+ * with posix_fadvise(POSIX_FADV_DONTNEED), which puts its clean pages
+ * to cleancache, and reads it back, which gets them, checking every page
+ * read.  Now and then a page is rewritten, so that flushes are mixed in.
+ *
+ * At the end it prints the cleancache and zcache counters that changed,
+ * and how often each zbud shard lock was taken and found contended.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o zcache_stress zcache_stress.c -lpthread */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define PAGE_SZ		4096
+#define MAX_SHARDS	64
+
+static const char *dir = ".";
+static int nr_threads = 8;
+static unsigned long file_mb = 16;
+static int seconds = 30;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	int id;
+	unsigned long passes;
+	unsigned long pages_read;
+	unsigned long pages_written;
+	unsigned long bad_pages;
+};
+
+static const char *counters[] = {
+	"cleancache/puts",
+	"cleancache/succ_gets",
+	"cleancache/failed_gets",
+	"cleancache/flushes",
+	"zcache/zbud_curr_raw_pages",
+	"zcache/evicted_raw_pages",
+	"zcache/evicted_unbuddied_pages",
+	"zcache/evicted_buddied_pages",
+	"zcache/failed_eph_puts",
+	"zcache/put_to_flush",
+	"zcache/aborted_shrink",
+};
+#define NR_COUNTERS	(sizeof(counters) / sizeof(counters[0]))
+
+struct shard_stats {
+	int nr;
+	unsigned long acquired[MAX_SHARDS];
+	unsigned long contended[MAX_SHARDS];
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d directory] [-t threads] [-s file size MB]\n"
+		"          [-n seconds]\n", prog);
+	exit(1);
+}
+
+static long long read_counter(const char *name)
+{
+	char path[128], buf[32];
+	int fd;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "/sys/kernel/mm/%s", name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	return strtoll(buf, NULL, 10);
+}
+
+static void read_shard_stats(struct shard_stats *st)
+{
+	FILE *f = fopen("/sys/kernel/mm/zcache/zbud_shard_stats", "r");
+	unsigned long buddied, unbuddied;
+	int n;
+
+	st->nr = 0;
+	if (f == NULL)
+		return;
+	while (st->nr < MAX_SHARDS &&
+	       fscanf(f, "%d: buddied %lu unbuddied %lu acquired %lu "
+		      "contended %lu\n", &n, &buddied, &unbuddied,
+		      &st->acquired[st->nr], &st->contended[st->nr]) == 5)
+		st->nr++;
+	fclose(f);
+}
+
+/*
+ * Fills a page with its owner, index and generation, then with bytes that
+ * compress to a size depending on those, so that pages of many sizes end
+ * up in zcache and both buddied and unbuddied zbud pages get used.
+ */
+static void fill_page(unsigned char *page, int id, unsigned long index,
+		      unsigned long gen)
+{
+	unsigned long *hdr = (unsigned long *)page;
+	unsigned int i, random = (index * 37 + gen * 11) % (PAGE_SZ / 2);
+	unsigned int seed = index ^ (gen << 16) ^ id;
+
+	hdr[0] = id;
+	hdr[1] = index;
+	hdr[2] = gen;
+	for (i = 3 * sizeof(*hdr); i < random; i++)
+		page[i] = rand_r(&seed);
+	for (; i < PAGE_SZ; i++)
+		page[i] = i & 0x1f;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long nr_pages = (file_mb << 20) / PAGE_SZ, i, index;
+	unsigned long *gen;
+	unsigned char *page, *expect;
+	unsigned int seed = w->id;
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/zcache_stress.%d", dir, w->id);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	unlink(path);
+	page = malloc(PAGE_SZ);
+	expect = malloc(PAGE_SZ);
+	gen = calloc(nr_pages, sizeof(*gen));
+	if (page == NULL || expect == NULL || gen == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < nr_pages; i++) {
+		fill_page(page, w->id, i, 0);
+		if (pwrite(fd, page, PAGE_SZ, (off_t)i * PAGE_SZ) != PAGE_SZ) {
+			perror("pwrite");
+			exit(1);
+		}
+	}
+
+	while (!stop) {
+		/* only clean pages are put, so write back the dirty ones */
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		for (i = 0; i < nr_pages && !stop; i++) {
+			if (pread(fd, page, PAGE_SZ,
+				  (off_t)i * PAGE_SZ) != PAGE_SZ) {
+				perror("pread");
+				exit(1);
+			}
+			fill_page(expect, w->id, i, gen[i]);
+			if (memcmp(page, expect, PAGE_SZ))
+				w->bad_pages++;
+			w->pages_read++;
+		}
+		/* rewrite a few pages, which flushes their old copies */
+		for (i = 0; i < nr_pages / 64 && !stop; i++) {
+			index = rand_r(&seed) % nr_pages;
+			fill_page(page, w->id, index, ++gen[index]);
+			if (pwrite(fd, page, PAGE_SZ,
+				   (off_t)index * PAGE_SZ) != PAGE_SZ) {
+				perror("pwrite");
+				exit(1);
+			}
+			w->pages_written++;
+		}
+		w->passes++;
+	}
+
+	close(fd);
+	free(gen);
+	free(expect);
+	free(page);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	long long before[NR_COUNTERS], after;
+	struct shard_stats sbefore, safter;
+	unsigned long acquired, contended, reads = 0, writes = 0, bad = 0;
+	struct timeval start, end;
+	struct worker *workers;
+	double secs;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "d:t:s:n:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 's':
+			file_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_threads <= 0 || !file_mb)
+		usage(argv[0]);
+	if (read_counter("zcache/zbud_curr_raw_pages") < 0)
+		fprintf(stderr, "warning: zcache does not seem to be enabled\n");
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (workers == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < (int)NR_COUNTERS; i++)
+		before[i] = read_counter(counters[i]);
+	read_shard_stats(&sbefore);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, worker_fn,
+				   &workers[i])) {
+			fprintf(stderr, "can't create thread %d\n", i);
+			return 1;
+		}
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		reads += workers[i].pages_read;
+		writes += workers[i].pages_written;
+		bad += workers[i].bad_pages;
+	}
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) +
+	       (end.tv_usec - start.tv_usec) / 1e6;
+
+	printf("%d threads, %.1f s: %lu pages read (%.0f/s), %lu rewritten, "
+	       "%lu bad\n", nr_threads, secs, reads, reads / secs, writes,
+	       bad);
+	for (i = 0; i < (int)NR_COUNTERS; i++) {
+		after = read_counter(counters[i]);
+		if (before[i] < 0 || after < 0)
+			continue;
+		printf("%-32s %12lld (%+lld)\n", counters[i], after,
+		       after - before[i]);
+	}
+
+	read_shard_stats(&safter);
+	if (safter.nr == sbefore.nr && safter.nr) {
+		printf("%5s %14s %14s %8s\n", "shard", "acquired",
+		       "contended", "%");
+		for (i = 0; i < safter.nr; i++) {
+			acquired = safter.acquired[i] - sbefore.acquired[i];
+			contended = safter.contended[i] - sbefore.contended[i];
+			printf("%5d %14lu %14lu %7.2f%%\n", i, acquired,
+			       contended, acquired ?
+			       100.0 * contended / acquired : 0.0);
+		}
+	}
+
+	free(workers);
+	return bad ? 2 : 0;
+}
@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# zram_bench.sh - parallel write/read throughput of a zram device
+#
+# usage: [COMP=<algorithm>] zram_bench.sh [device] [disksize in MB] [writers...]
+#
+# Resets the device, then for each writer count runs that many concurrent
+# O_DIRECT dd writers to disjoint parts of the disk, followed by as many
+# readers, and reports the aggregate MB/s.  The data written compresses to
+# roughly a quarter of its size, like typical anonymous memory.  COMP
+# selects the compressor, e.g. COMP=lz4; the default is the device's.
+
+DEV=${1:-zram0}
+SIZE_MB=${2:-256}
+shift 2 2>/dev/null
+WRITERS=${*:-"1 2 4 8"}
+
+SYS=/sys/block/$DEV
+BLK=/dev/$DEV
+TMP=${TMPDIR:-/tmp}/zram_bench.$$
+BS=4096
+
+if [ ! -d $SYS ]; then
+	echo "$SYS not found; is the zram module loaded?" >&2
+	exit 1
+fi
+
+trap 'rm -f $TMP.data' EXIT
+
+echo 1 > $SYS/reset || exit 1
+if [ -n "$COMP" ]; then
+	echo $COMP > $SYS/comp_algorithm || exit 1
+fi
+echo $((SIZE_MB << 20)) > $SYS/disksize || exit 1
+
+now_ns()
+{
+	date +%s%N
+}
+
+per_page()
+{
+	n=$(cat $SYS/$1)
+	[ "$n" -gt 0 ] && echo "$3: $(($(cat $SYS/$2) / n)) ns/page"
+}
+
+# One MB of data with four symbols out of 256: compressible but not zero.
+head -c 1048576 /dev/urandom | \
+	tr '\000-\377' '[a*64][b*64][c*64][d*64]' > $TMP.data
+
+run()
+{
+	op=$1
+	n=$2
+	chunk=$((SIZE_MB / n))
+	count=$((chunk * 256))
+
+	start=$(now_ns)
+	i=0
+	while [ $i -lt $n ]; do
+		if [ $op = write ]; then
+			for j in $(seq $chunk); do cat $TMP.data; done | \
+				dd of=$BLK bs=$BS count=$count \
+				   seek=$((i * count)) oflag=direct \
+				   iflag=fullblock 2>/dev/null &
+		else
+			dd if=$BLK of=/dev/null bs=$BS count=$count \
+			   skip=$((i * count)) iflag=direct 2>/dev/null &
+		fi
+		i=$((i + 1))
+	done
+	wait
+	end=$(now_ns)
+
+	mbs=$((chunk * n * 1000000000 / (end - start)))
+	printf "%-6s %2d streams: %6d MB/s\n" $op $n $mbs
+}
+
+for n in $WRITERS; do
+	run write $n
+	run read $n
+done
+
+echo "comp_algorithm: $(cat $SYS/comp_algorithm)"
+echo "mem_used_total: $(cat $SYS/mem_used_total)"
+echo "compr_data_size: $(cat $SYS/compr_data_size)"
+per_page num_compress compr_time_ns compress
+per_page num_decompress decompr_time_ns decompress
+echo 1 > $SYS/reset
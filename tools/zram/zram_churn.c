@@ -0,0 +1,212 @@
+/*
+ * zram_churn.c -- memory overhead of a zram device under churn
+ *
+ * Fills a zram device with pages of mixed compressibility, then keeps
+ * overwriting random pages of it with new data of a random compressed
+ * size, like swap does over the life of a system.  Every interval it
+ * prints the size of the data stored, its compressed size and the memory
+ * the device actually uses for it, so that the allocator's overhead and
+ * fragmentation can be followed over time.  With -c it writes the
+ * device's "compact" attribute after every interval and also prints the
+ * memory used afterwards.
+ *
+ * The device is reset and sized first, so it must not be in use.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)gcc -Wall -O2 -o zram_churn zram_churn.c */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define PAGE_SZ		4096
+
+static const char *dev = "zram0";
+static unsigned long disk_mb = 64;
+static unsigned long writes_per_interval = 16384;
+static int intervals = 20;
+static int compact;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-s disksize MB] [-n intervals]\n"
+		"          [-w writes per interval] [-c]\n", prog);
+	exit(1);
+}
+
+static int sys_write(const char *attr, const char *val)
+{
+	char path[128];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s", dev, attr);
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || write(fd, val, strlen(val)) < 0) {
+		perror(path);
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static unsigned long long sys_read(const char *attr)
+{
+	char path[128], buf[32];
+	int fd;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s", dev, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	return strtoull(buf, NULL, 10);
+}
+
+/*
+ * Fills a page with random bytes for its first @random bytes and a
+ * repeating pattern for the rest, so that it compresses to roughly
+ * @random bytes.
+ */
+static void fill_page(unsigned char *page, unsigned int random)
+{
+	unsigned int i;
+
+	for (i = 0; i < random; i++)
+		page[i] = rand();
+	for (; i < PAGE_SZ; i++)
+		page[i] = i & 0x0f;
+}
+
+/* skewed towards well compressible pages, as anonymous memory is */
+static unsigned int pick_size(void)
+{
+	unsigned int r = rand() % 100;
+
+	if (r < 50)
+		return rand() % (PAGE_SZ / 4);
+	if (r < 90)
+		return PAGE_SZ / 4 + rand() % (PAGE_SZ / 2);
+	return PAGE_SZ;
+}
+
+static void write_page(int fd, unsigned char *page, unsigned long index)
+{
+	fill_page(page, pick_size());
+	if (pwrite(fd, page, PAGE_SZ, (off_t)index * PAGE_SZ) != PAGE_SZ) {
+		perror("pwrite");
+		exit(1);
+	}
+}
+
+static void report(int interval, double secs)
+{
+	unsigned long long orig = sys_read("orig_data_size");
+	unsigned long long compr = sys_read("compr_data_size");
+	unsigned long long used = sys_read("mem_used_total");
+
+	printf("%4d %8.1f %10llu %10llu %10llu %7.1f%%", interval, secs,
+	       orig >> 10, compr >> 10, used >> 10,
+	       compr ? 100.0 * ((double)used - compr) / compr : 0.0);
+	if (compact) {
+		sys_write("compact", "1");
+		used = sys_read("mem_used_total");
+		printf(" %10llu %7.1f%%", used >> 10,
+		       compr ? 100.0 * ((double)used - compr) / compr : 0.0);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long i, nr_pages;
+	struct timeval start, now;
+	unsigned char *page;
+	char path[64], val[32];
+	int opt, fd, n;
+
+	while ((opt = getopt(argc, argv, "d:s:n:w:c")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 's':
+			disk_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			intervals = atoi(optarg);
+			break;
+		case 'w':
+			writes_per_interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			compact = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!disk_mb)
+		usage(argv[0]);
+
+	if (sys_write("reset", "1"))
+		return 1;
+	snprintf(val, sizeof(val), "%lu", disk_mb << 20);
+	if (sys_write("disksize", val))
+		return 1;
+
+	snprintf(path, sizeof(path), "/dev/%s", dev);
+	fd = open(path, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	if (posix_memalign((void **)&page, PAGE_SZ, PAGE_SZ)) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	srand(1);
+	gettimeofday(&start, NULL);
+	nr_pages = (disk_mb << 20) / PAGE_SZ;
+	for (i = 0; i < nr_pages; i++)
+		write_page(fd, page, i);
+
+	printf("%4s %8s %10s %10s %10s %8s", "int", "secs", "orig_kB",
+	       "compr_kB", "used_kB", "overhead");
+	if (compact)
+		printf(" %10s %8s", "compacted", "overhead");
+	printf("\n");
+
+	for (n = 0; n <= intervals; n++) {
+		if (n) {
+			for (i = 0; i < writes_per_interval; i++)
+				write_page(fd, page, rand() % nr_pages);
+		}
+		gettimeofday(&now, NULL);
+		report(n, (now.tv_sec - start.tv_sec) +
+		       (now.tv_usec - start.tv_usec) / 1e6);
+	}
+
+	close(fd);
+	free(page);
+	return 0;
+}